@@ -1260,6 +1260,16 @@ typedef struct xen_sysctl_cpuinfo xc_cpuinfo_t;
 int xc_getcpuinfo(xc_interface *xch, int max_cpus,
                   xc_cpuinfo_t *info, int *nr_cpus); 
 
+/*
+ * Get the scheduling statistics of a pCPU, as XEN_SYSCTL_SCHED_HIST_NR
+ * histograms indexed by XEN_SYSCTL_SCHED_HIST_*.  On input, *nr_hists is
+ * the number of entries in hist; on output, the number written (or, if
+ * hist is NULL, the number available).
+ */
+typedef struct xen_sysctl_sched_hist xc_sched_hist_t;
+int xc_sched_stats(xc_interface *xch, unsigned int cpu, uint32_t flags,
+                   xc_sched_hist_t *hist, unsigned int *nr_hists);
+
 int xc_domain_setmaxmem(xc_interface *xch,
                         uint32_t domid,
                         uint64_t max_memkb);
@@ -2342,6 +2352,16 @@ void xc_compression_free_context(xc_interface *xch, comp_ctx *ctx);
 int xc_compression_add_page(xc_interface *xch, comp_ctx *ctx, char *page,
 			    unsigned long pfn, int israw);
 
+/**
+ * Drop any cached copy of a page, for when the receiver's copy of it has
+ * been updated by other means.  The next time the page is added, it is
+ * sent in full.
+ *
+ * returns 0 on success, or -2 if the pfn is out of bounds.
+ */
+int xc_compression_invalidate_page(xc_interface *xch, comp_ctx *ctx,
+				   unsigned long pfn);
+
 /**
  * Delta compress pages in the compression buffer and inserts the
  * compressed data into the supplied compression buffer compbuf, whose
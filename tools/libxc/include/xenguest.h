@@ -29,6 +29,42 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+/*
+ * Send zero and duplicate pages as PAGE_ELIDED records.  Older restorers
+ * reject such streams.
+ */
+#define XCFLAGS_ELIDE_PAGES            (1 << 5)
+/*
+ * During live migration, cap the domain's vcpus through the scheduler while
+ * it dirties memory faster than it can be sent.  See
+ * save_callbacks.max_downtime_ms.
+ */
+#define XCFLAGS_AUTO_CONVERGE          (1 << 6)
+/*
+ * Send the pages still dirty once the domain is suspended after the rest of
+ * its state, letting the restorer resume the guest and demand page them.
+ * HVM only, and needs a back channel (recv_fd) for the restorer's requests,
+ * and postcopy_transition callbacks on both sides to hand over the device
+ * model state.
+ */
+#define XCFLAGS_POSTCOPY               (1 << 7)
+/*
+ * Send normal pages which have been sent before as PAGE_DELTA records,
+ * against a cache of recently sent pages.  Applies to plain live migration
+ * as well as to checkpointed streams.  Older restorers reject such streams.
+ */
+#define XCFLAGS_PAGE_DELTA             (1 << 8)
+
+/*
+ * Number of threads to map and normalise guest pages with during save, or to
+ * copy page data into the guest with during restore.  The stream is written
+ * and read by the calling thread in order regardless.  0 (the default) keeps
+ * everything on the calling thread.
+ */
+#define XCFLAGS_WORKERS_SHIFT   16
+#define XCFLAGS_WORKERS_MASK    (0xffU << XCFLAGS_WORKERS_SHIFT)
+#define XCFLAGS_WORKERS(n)      (((n) << XCFLAGS_WORKERS_SHIFT) & \
+                                 XCFLAGS_WORKERS_MASK)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -53,6 +89,27 @@ struct precopy_stats
  */
 typedef int (*precopy_policy_t)(struct precopy_stats, void *);
 
+/*
+ * For save's iteration_stats(), describing one pass over the guest's memory.
+ * With XCFLAGS_WORKERS, map_ns and copy_ns are summed over the workers, and
+ * may exceed elapsed_ns.
+ */
+struct save_iteration_stats
+{
+    unsigned int iteration;
+    unsigned int suspended;   /* Sent with the domain suspended. */
+    uint64_t pages_sent;
+    uint64_t bytes_written;   /* Octets of stream, including other records. */
+    uint64_t dirty_count;     /* Pages dirtied meanwhile, to be sent next. */
+    uint64_t map_ns;          /* Looking up and mapping guest pages. */
+    uint64_t copy_ns;         /* Normalising and eliding them. */
+    uint64_t write_ns;        /* Encoding and writing records. */
+    uint64_t elapsed_ns;
+    uint64_t send_rate;       /* Pages per second. */
+    uint64_t dirty_rate;      /* Pages per second, 0 if suspended. */
+    uint64_t downtime_ms;     /* Projected time to send dirty_count pages. */
+};
+
 /* callbacks provided by xc_domain_save */
 struct save_callbacks {
     /* Called after expiration of checkpoint interval,
@@ -111,6 +168,32 @@ struct save_callbacks {
     /* Enable qemu-dm logging dirty pages to xen */
     int (*switch_qemu_logdirty)(uint32_t domid, unsigned enable, void *data); /* HVM only */
 
+    /*
+     * With XCFLAGS_AUTO_CONVERGE and no precopy_policy, precopy ends once
+     * the remaining dirty pages are projected to be sent within this many
+     * milliseconds.  0 selects a default of 300ms.
+     */
+    unsigned int max_downtime_ms;
+
+    /*
+     * Called, if non-NULL, after each pass over the guest's memory with
+     * statistics about it.  Informational only.
+     */
+    void (*iteration_stats)(const struct save_iteration_stats *stats,
+                            void *data);
+
+    /*
+     * With XCFLAGS_POSTCOPY, called once everything but the outstanding
+     * pages has been sent, right after the POSTCOPY_TRANSITION record.
+     * Writes the device model state to io_fd, for the restorer's
+     * postcopy_transition() to read.  Returns 1 on success.
+     *
+     * From this call on, the restorer may resume the guest.  Should
+     * xc_domain_save() fail afterwards, the domain is left suspended, and
+     * must be destroyed rather than resumed.
+     */
+    int (*postcopy_transition)(void *data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -172,6 +255,26 @@ struct restore_callbacks {
     void (*restore_results)(xen_pfn_t store_gfn, xen_pfn_t console_gfn,
                             void *data);
 
+    /*
+     * Post-copy, called upon the POSTCOPY_TRANSITION record once the
+     * outstanding pages have been paged out, after restore_results().
+     * Reads the device model state written by the saver's
+     * postcopy_transition() from io_fd, and loads it without resuming the
+     * guest.  Paging requests are serviced meanwhile.  Returns 1 on success.
+     */
+    int (*postcopy_transition)(void *data);
+
+    /*
+     * Post-copy, called once postcopy_transition() has returned and the
+     * pages which could not be paged out have arrived.  Resumes the guest
+     * and the device model.  Returns 1 on success.
+     *
+     * Should the stream fail after this, the guest's outstanding memory is
+     * lost: xc_domain_restore() pauses the domain and fails, and it must be
+     * destroyed.
+     */
+    int (*postcopy_resume)(void *data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -188,6 +291,7 @@ struct restore_callbacks {
  * @parm store_mfn returned with the mfn of the store page
  * @parm hvm non-zero if this is a HVM restore
  * @parm pae non-zero if this HVM domain has PAE support enabled
+ * @parm flags XCFLAGS_xxx; only XCFLAGS_WORKERS() is meaningful on restore
  * @parm stream_type non-zero if the far end of the stream is using checkpointing
  * @parm callbacks non-NULL to receive a callback to restore toolstack
  *       specific data
@@ -198,7 +302,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       uint32_t store_domid, unsigned int console_evtchn,
                       unsigned long *console_mfn, uint32_t console_domid,
                       unsigned int hvm, unsigned int pae,
-                      xc_migration_stream_t stream_type,
+                      uint32_t flags, xc_migration_stream_t stream_type,
                       struct restore_callbacks *callbacks, int send_back_fd);
 
 /**
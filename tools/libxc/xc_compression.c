@@ -285,7 +285,7 @@ void invalidate_cache_page(comp_ctx *ctx, xen_pfn_t pfn)
 int xc_compression_add_page(xc_interface *xch, comp_ctx *ctx,
                             char *page, xen_pfn_t pfn, int israw)
 {
-    if (pfn > ctx->dom_pfnlist_size)
+    if (pfn >= ctx->dom_pfnlist_size)
     {
         ERROR("Invalid pfn passed into "
               "xc_compression_add_page %" PRIpfn "\n", pfn);
@@ -307,6 +307,20 @@ int xc_compression_add_page(xc_interface *xch, comp_ctx *ctx,
     return 0;
 }
 
+int xc_compression_invalidate_page(xc_interface *xch, comp_ctx *ctx,
+                                   xen_pfn_t pfn)
+{
+    if (pfn >= ctx->dom_pfnlist_size)
+    {
+        ERROR("Invalid pfn passed into "
+              "xc_compression_invalidate_page %" PRIpfn "\n", pfn);
+        return -2;
+    }
+
+    invalidate_cache_page(ctx, pfn);
+    return 0;
+}
+
 int xc_compression_compress_pages(xc_interface *xch, comp_ctx *ctx,
                                   char *compbuf, unsigned long compbuf_size,
                                   unsigned long *compbuf_len)
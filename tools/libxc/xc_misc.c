@@ -538,6 +538,34 @@ int xc_getcpuinfo(xc_interface *xch, int max_cpus,
     return rc;
 }
 
+int xc_sched_stats(xc_interface *xch, unsigned int cpu, uint32_t flags,
+                   xc_sched_hist_t *hist, unsigned int *nr_hists)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(hist, *nr_hists * sizeof(*hist),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, hist) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_sched_stats;
+    sysctl.u.sched_stats.cpu = cpu;
+    sysctl.u.sched_stats.flags = flags;
+    sysctl.u.sched_stats.nr_hists = *nr_hists;
+    sysctl.u.sched_stats.pad = 0;
+    set_xen_guest_handle(sysctl.u.sched_stats.hist, hist);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, hist);
+
+    if ( !rc )
+        *nr_hists = sysctl.u.sched_stats.nr_hists;
+
+    return rc;
+}
+
 int xc_livepatch_upload(xc_interface *xch,
                         char *name,
                         unsigned char *payload,
@@ -38,6 +38,11 @@ static const char *mandatory_rec_types[] =
     [REC_TYPE_VERIFY]                       = "Verify",
     [REC_TYPE_CHECKPOINT]                   = "Checkpoint",
     [REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST]    = "Checkpoint dirty pfn list",
+    [REC_TYPE_PAGE_ELIDED]                  = "Page elided",
+    [REC_TYPE_PAGE_DELTA]                   = "Page delta",
+    [REC_TYPE_POSTCOPY_BEGIN]               = "Post-copy begin",
+    [REC_TYPE_POSTCOPY_TRANSITION]          = "Post-copy transition",
+    [REC_TYPE_POSTCOPY_PFN_REQUEST]         = "Post-copy pfn request",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -52,43 +57,18 @@ const char *rec_type_to_str(uint32_t type)
     return "Reserved";
 }
 
-int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
-                       void *buf, size_t sz)
+bool page_is_zero(const void *page)
 {
-    static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+    const uint64_t *p = page;
+    unsigned int i;
 
-    xc_interface *xch = ctx->xch;
-    typeof(rec->length) combined_length = rec->length + sz;
-    size_t record_length = ROUNDUP(combined_length, REC_ALIGN_ORDER);
-    struct iovec parts[] =
-    {
-        { &rec->type,       sizeof(rec->type) },
-        { &combined_length, sizeof(combined_length) },
-        { rec->data,        rec->length },
-        { buf,              sz },
-        { (void*)zeroes,    record_length - combined_length },
-    };
-
-    if ( record_length > REC_LENGTH_MAX )
-    {
-        ERROR("Record (0x%08x, %s) length %#zx exceeds max (%#x)", rec->type,
-              rec_type_to_str(rec->type), record_length, REC_LENGTH_MAX);
-        return -1;
-    }
-
-    if ( rec->length )
-        assert(rec->data);
-    if ( sz )
-        assert(buf);
-
-    if ( writev_exact(ctx->fd, parts, ARRAY_SIZE(parts)) )
-        goto err;
-
-    return 0;
+    /* OR a cacheline at a time, which the compiler can vectorise. */
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 8 )
+        if ( p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+             p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7] )
+            return false;
 
- err:
-    PERROR("Unable to write record to stream");
-    return -1;
+    return true;
 }
 
 int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec)
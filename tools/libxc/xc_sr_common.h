@@ -198,6 +198,25 @@ struct xc_sr_context
             /* Further debugging information in the stream. */
             bool debug;
 
+            /* Send zero and duplicate pages as PAGE_ELIDED records. */
+            bool elide_pages;
+
+            /* Send pages already sent once as PAGE_DELTA records. */
+            bool compress;
+
+            /* Throttle the guest if precopy is not converging. */
+            bool auto_converge;
+
+            /* Send the final dirty pages after the guest has resumed. */
+            bool postcopy;
+            unsigned long nr_postcopy_pfns;
+            /* POSTCOPY_TRANSITION sent: the domain may run on the far side. */
+            bool postcopy_transitioned;
+
+            /* Statistics for the iteration being sent, and its start time. */
+            struct save_iteration_stats iter_stats;
+            uint64_t iter_start;
+
             unsigned long p2m_size;
 
             struct precopy_stats stats;
@@ -207,6 +226,40 @@ struct xc_sr_context
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /*
+             * Log-dirty ring mode, where Xen returns the dirtied GFNs
+             * themselves rather than a bitmap of the whole guest.  The
+             * harvested GFNs are listed in gfns (and set in the dirty
+             * bitmap, to weed out duplicates), and sent from there if
+             * pending.
+             */
+            struct
+            {
+                bool enabled, pending;
+                xen_pfn_t *gfns;
+                unsigned long nr_gfns, max_gfns;
+                xc_hypercall_buffer_t hbuf;
+            } dirty_ring;
+
+            /* Parallel page sender, if nr_workers is non-zero. */
+            unsigned int nr_workers;
+            struct xc_sr_save_pipeline *pipeline;
+
+            /* Page delta compression, if compress. */
+            comp_ctx *compress_ctx;
+            char *compress_buf;
+            bool send_deltas;
+
+            /* Rates measured during precopy, and auto-converge state. */
+            struct
+            {
+                uint64_t send_rate, dirty_rate; /* Pages per second. */
+                unsigned int max_downtime_ms;
+                uint32_t sched_id;  /* 0 if not throttling. */
+                uint16_t orig_cap;
+                unsigned int throttle; /* Percent of vcpu time withheld. */
+            } converge;
         } save;
 
         struct /* Restore data. */
@@ -258,6 +311,13 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Parallel page data application, if nr_workers is non-zero. */
+            unsigned int nr_workers;
+            struct xc_sr_restore_pool *pool;
+
+            /* Pages still to be received after the guest is resumed. */
+            struct xc_sr_restore_postcopy *postcopy;
         } restore;
     };
 
@@ -348,6 +408,9 @@ struct xc_sr_record
     void *data;
 };
 
+/* Is a page of data entirely zero? */
+bool page_is_zero(const void *page);
+
 /*
  * Writes a split record to the stream, applying correct padding where
  * appropriate.  It is common when sending records containing blobs from Xen
@@ -357,6 +420,9 @@ struct xc_sr_record
  * Records with a non-zero length must provide a valid data field; records
  * with a 0 length shall have their data field ignored.
  *
+ * Only the saving side writes records to the stream, so this lives in
+ * xc_sr_save.c, and accounts for the record in the iteration's statistics.
+ *
  * Returns 0 on success and non0 on failure.
  */
 int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
@@ -1,6 +1,11 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
 
 #include "xc_sr_common.h"
 
@@ -162,249 +167,1878 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
         }
     }
 
-    if ( nr_pfns )
+    if ( nr_pfns )
+    {
+        rc = xc_domain_populate_physmap_exact(
+            xch, ctx->domid, nr_pfns, 0, 0, mfns);
+        if ( rc )
+        {
+            PERROR("Failed to populate physmap");
+            goto err;
+        }
+
+        for ( i = 0; i < nr_pfns; ++i )
+        {
+            if ( mfns[i] == INVALID_MFN )
+            {
+                ERROR("Populate physmap failed for pfn %u", i);
+                rc = -1;
+                goto err;
+            }
+
+            ctx->restore.ops.set_gfn(ctx, pfns[i], mfns[i]);
+        }
+    }
+
+    rc = 0;
+
+ err:
+    free(pfns);
+    free(mfns);
+
+    return rc;
+}
+
+/*
+ * Parallel page data application.
+ *
+ * With ctx->restore.nr_workers non-zero, the stream reading thread only
+ * validates PAGE_DATA records and populates the physmap for them (which
+ * updates shared restore state), then hands the record to a bounded queue.
+ * Worker threads map the target frames and copy the data in.
+ *
+ * Records carrying a pfn which is still queued are only queued after the
+ * queue has drained, so later data for a pfn always wins.  The queue is also
+ * drained ahead of every other record, so the rest of the restore logic
+ * always sees all preceding page data applied.
+ */
+#define RESTORE_JOBS_PER_WORKER 4
+
+struct xc_sr_restore_job
+{
+    unsigned count, nr_pages;
+    xen_pfn_t *pfns, *mfns;
+    uint32_t *types;
+    void *page_data;
+    /* Record buffer page_data points into. */
+    void *rec_data;
+};
+
+struct xc_sr_restore_pool
+{
+    /*
+     * Protects the queue, and serialises shared restore state (physmap
+     * population and localisation) between the reader and the workers.
+     */
+    pthread_mutex_t lock;
+    /* Signalled when a job is queued, or on shutdown. */
+    pthread_cond_t work_cond;
+    /* Signalled when a job completes. */
+    pthread_cond_t done_cond;
+
+    pthread_t *threads;
+    unsigned nr_threads;
+
+    struct xc_sr_restore_job *jobs;
+    unsigned nr_jobs, head, nr_queued, nr_busy;
+
+    /* Pfns of queued and in-progress jobs. */
+    unsigned long *pending_pfns;
+    xen_pfn_t max_pending_pfn;
+
+    /* First error reported by a worker. */
+    int rc, err;
+    bool stop;
+};
+
+/*
+ * Given a list of pfns and their types, populate and record their types, and
+ * collect the gfns of the subset which carry page data into 'mfns'.
+ */
+static int prepare_page_data(struct xc_sr_context *ctx, unsigned count,
+                             xen_pfn_t *pfns, uint32_t *types,
+                             xen_pfn_t *mfns, unsigned *nr_pages)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+    int rc;
+
+    *nr_pages = 0;
+
+    rc = populate_pfns(ctx, count, pfns, types);
+    if ( rc )
+    {
+        ERROR("Failed to populate pfns for batch of %u pages", count);
+        return rc;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
+
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_NOTAB:
+
+        case XEN_DOMCTL_PFINFO_L1TAB:
+        case XEN_DOMCTL_PFINFO_L1TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+        case XEN_DOMCTL_PFINFO_L2TAB:
+        case XEN_DOMCTL_PFINFO_L2TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+        case XEN_DOMCTL_PFINFO_L3TAB:
+        case XEN_DOMCTL_PFINFO_L3TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+        case XEN_DOMCTL_PFINFO_L4TAB:
+        case XEN_DOMCTL_PFINFO_L4TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+            mfns[(*nr_pages)++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Map the gfns collected by prepare_page_data() and copy the data into the
+ * guest.  May be called from a page data worker, in which case localising
+ * pagetables is serialised against the reader under the pool lock.
+ */
+static int apply_page_data(struct xc_sr_context *ctx, unsigned count,
+                           const xen_pfn_t *pfns, const uint32_t *types,
+                           const xen_pfn_t *mfns, unsigned nr_pages,
+                           void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pool *pool = ctx->restore.pool;
+    int *map_errs = NULL;
+    int rc = -1;
+    void *mapping = NULL, *guest_page = NULL;
+    unsigned i,    /* i indexes the pfns from the record. */
+        j;         /* j indexes the subset of pfns we decide to map. */
+
+    /* Nothing to do? */
+    if ( nr_pages == 0 )
+        return 0;
+
+    map_errs = malloc(nr_pages * sizeof(*map_errs));
+    if ( !map_errs )
+    {
+        ERROR("Failed to allocate %zu bytes to process page data",
+              nr_pages * sizeof(*map_errs));
+        goto err;
+    }
+
+    mapping = guest_page = xenforeignmemory_map(xch->fmem,
+        ctx->domid, PROT_READ | PROT_WRITE,
+        nr_pages, mfns, map_errs);
+    if ( !mapping )
+    {
+        PERROR("Unable to map %u mfns for %u pages of data",
+               nr_pages, count);
+        goto err;
+    }
+
+    for ( i = 0, j = 0; i < count; ++i )
+    {
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_XTAB:
+        case XEN_DOMCTL_PFINFO_BROKEN:
+        case XEN_DOMCTL_PFINFO_XALLOC:
+            /* No page data to deal with. */
+            continue;
+        }
+
+        if ( map_errs[j] )
+        {
+            rc = -1;
+            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn", type %#"PRIx32") failed with %d",
+                  pfns[i], mfns[j], types[i], map_errs[j]);
+            goto err;
+        }
+
+        /* Undo page normalisation done by the saver. */
+        if ( pool && types[i] != XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            pthread_mutex_lock(&pool->lock);
+            rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        else
+            rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        if ( rc )
+        {
+            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            goto err;
+        }
+
+        if ( ctx->restore.verify )
+        {
+            /* Verify mode - compare incoming data to what we already have. */
+            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
+                ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
+                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+        }
+        else
+        {
+            /* Regular mode - copy incoming data into place. */
+            memcpy(guest_page, page_data, PAGE_SIZE);
+        }
+
+        ++j;
+        guest_page += PAGE_SIZE;
+        page_data += PAGE_SIZE;
+    }
+
+    rc = 0;
+
+ err:
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+
+    free(map_errs);
+
+    return rc;
+}
+
+/*
+ * Given a list of pfns, their types, and a block of page data from the
+ * stream, populate and record their types, map the relevant subset and copy
+ * the data into the guest.
+ */
+static int process_page_data(struct xc_sr_context *ctx, unsigned count,
+                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
+    unsigned nr_pages;
+    int rc;
+
+    if ( !mfns )
+    {
+        ERROR("Failed to allocate %zu bytes to process page data",
+              count * sizeof(*mfns));
+        return -1;
+    }
+
+    rc = prepare_page_data(ctx, count, pfns, types, mfns, &nr_pages);
+    if ( !rc )
+        rc = apply_page_data(ctx, count, pfns, types, mfns, nr_pages,
+                             page_data);
+
+    free(mfns);
+
+    return rc;
+}
+
+static void free_restore_job(struct xc_sr_restore_job *job)
+{
+    free(job->rec_data);
+    free(job->types);
+    free(job->mfns);
+    free(job->pfns);
+    memset(job, 0, sizeof(*job));
+}
+
+static void *restore_worker(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    struct xc_sr_restore_pool *pool = ctx->restore.pool;
+    struct xc_sr_restore_job job;
+    unsigned i;
+    int rc;
+
+    for ( ; ; )
+    {
+        pthread_mutex_lock(&pool->lock);
+        while ( !pool->stop && pool->nr_queued == 0 )
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+
+        if ( pool->stop )
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        job = pool->jobs[pool->head];
+        memset(&pool->jobs[pool->head], 0, sizeof(job));
+        pool->head = (pool->head + 1) % pool->nr_jobs;
+        pool->nr_queued--;
+        pool->nr_busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        rc = apply_page_data(ctx, job.count, job.pfns, job.types, job.mfns,
+                             job.nr_pages, job.page_data);
+
+        pthread_mutex_lock(&pool->lock);
+        if ( rc && !pool->rc )
+        {
+            pool->rc = rc;
+            pool->err = errno;
+        }
+        for ( i = 0; i < job.count; ++i )
+            clear_bit(job.pfns[i], pool->pending_pfns);
+        pool->nr_busy--;
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        free_restore_job(&job);
+    }
+
+    return NULL;
+}
+
+/*
+ * Wait for all queued page data to be applied.  Returns the first error
+ * encountered by a worker, if any.
+ */
+static int drain_page_data(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_pool *pool = ctx->restore.pool;
+    int rc;
+
+    if ( !pool )
+        return 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while ( pool->nr_queued || pool->nr_busy )
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    rc = pool->rc;
+    if ( rc )
+        errno = pool->err;
+    pthread_mutex_unlock(&pool->lock);
+
+    return rc;
+}
+
+/* Grow pending_pfns to cover 'pfn'.  Must hold the pool lock. */
+static int pool_track_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pool *pool = ctx->restore.pool;
+    xen_pfn_t new_max = pool->max_pending_pfn;
+    size_t old_sz, new_sz;
+    unsigned long *p;
+
+    if ( pfn <= pool->max_pending_pfn )
+        return 0;
+
+    while ( new_max < pfn )
+        new_max = (new_max << 1) | 1;
+
+    old_sz = bitmap_size(pool->max_pending_pfn + 1);
+    new_sz = bitmap_size(new_max + 1);
+    p = realloc(pool->pending_pfns, new_sz);
+    if ( !p )
+    {
+        ERROR("Failed to realloc pending pfn bitmap");
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset((uint8_t *)p + old_sz, 0x00, new_sz - old_sz);
+
+    pool->pending_pfns    = p;
+    pool->max_pending_pfn = new_max;
+
+    return 0;
+}
+
+/*
+ * Populate the pfns of a validated PAGE_DATA record and queue the copy of
+ * its data to the workers.  Takes ownership of 'pfns', 'types' and the
+ * record data.
+ */
+static int queue_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec,
+                           unsigned count, xen_pfn_t *pfns, uint32_t *types,
+                           void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pool *pool = ctx->restore.pool;
+    struct xc_sr_restore_job *job;
+    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
+    bool overlap = false;
+    unsigned i, nr_pages;
+    int rc = -1;
+
+    if ( !mfns )
+    {
+        ERROR("Failed to allocate %zu bytes to process page data",
+              count * sizeof(*mfns));
+        goto out;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    rc = prepare_page_data(ctx, count, pfns, types, mfns, &nr_pages);
+    for ( i = 0; !rc && i < count; ++i )
+    {
+        rc = pool_track_pfn(ctx, pfns[i]);
+        if ( !rc && test_bit(pfns[i], pool->pending_pfns) )
+            overlap = true;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if ( rc || nr_pages == 0 )
+        goto out;
+
+    if ( overlap )
+    {
+        rc = drain_page_data(ctx);
+        if ( rc )
+            goto out;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while ( pool->nr_queued == pool->nr_jobs && !pool->rc )
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+
+    rc = pool->rc;
+    if ( rc )
+    {
+        errno = pool->err;
+        pthread_mutex_unlock(&pool->lock);
+        goto out;
+    }
+
+    for ( i = 0; i < count; ++i )
+        set_bit(pfns[i], pool->pending_pfns);
+
+    job = &pool->jobs[(pool->head + pool->nr_queued) % pool->nr_jobs];
+    job->count = count;
+    job->nr_pages = nr_pages;
+    job->pfns = pfns;
+    job->types = types;
+    job->mfns = mfns;
+    job->page_data = page_data;
+    job->rec_data = rec->data;
+    rec->data = NULL;
+
+    pool->nr_queued++;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+
+ out:
+    free(mfns);
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+static void destroy_restore_pool(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_pool *pool = ctx->restore.pool;
+    unsigned i;
+
+    if ( !pool )
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for ( i = 0; i < pool->nr_threads; ++i )
+        pthread_join(pool->threads[i], NULL);
+
+    for ( i = 0; i < pool->nr_jobs; ++i )
+        free_restore_job(&pool->jobs[i]);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool->pending_pfns);
+    free(pool->jobs);
+    free(pool->threads);
+    free(pool);
+    ctx->restore.pool = NULL;
+}
+
+static int create_restore_pool(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pool *pool;
+    unsigned i;
+    int rc;
+
+    pool = calloc(1, sizeof(*pool));
+    if ( !pool )
+        goto enomem;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    ctx->restore.pool = pool;
+
+    pool->nr_jobs = RESTORE_JOBS_PER_WORKER * ctx->restore.nr_workers;
+    pool->jobs = calloc(pool->nr_jobs, sizeof(*pool->jobs));
+    pool->threads = calloc(ctx->restore.nr_workers, sizeof(*pool->threads));
+    pool->max_pending_pfn = ctx->restore.max_populated_pfn;
+    pool->pending_pfns = bitmap_alloc(pool->max_pending_pfn + 1);
+    if ( !pool->jobs || !pool->threads || !pool->pending_pfns )
+        goto enomem;
+
+    for ( i = 0; i < ctx->restore.nr_workers; ++i )
+    {
+        rc = pthread_create(&pool->threads[i], NULL, restore_worker, ctx);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to create page data thread %u", i);
+            return -1;
+        }
+        pool->nr_threads++;
+    }
+
+    DPRINTF("Using %u page data threads", pool->nr_threads);
+
+    return 0;
+
+ enomem:
+    ERROR("Unable to allocate memory for %u page data threads",
+          ctx->restore.nr_workers);
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * Workers localising pagetables may grow the guest's pfn space, so check
+ * against it under the pool lock.
+ */
+static bool page_data_pfn_is_valid(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    struct xc_sr_restore_pool *pool = ctx->restore.pool;
+    bool valid;
+
+    if ( !pool )
+        return ctx->restore.ops.pfn_is_valid(ctx, pfn);
+
+    pthread_mutex_lock(&pool->lock);
+    valid = ctx->restore.ops.pfn_is_valid(ctx, pfn);
+    pthread_mutex_unlock(&pool->lock);
+
+    return valid;
+}
+
+/*
+ * Post-copy.
+ *
+ * POSTCOPY_BEGIN records list the pages which will only be sent once the
+ * guest is running.  Upon POSTCOPY_TRANSITION, those pages are paged out
+ * with mem_paging, and the toolstack loads the device model state which
+ * follows in the stream.  The guest is then resumed.  Accesses to the pages
+ * paged out are reported on the paging ring, and the pages asked for on the
+ * back channel, until they arrive in PAGE_DATA records and are paged in.
+ *
+ * The ring is serviced by a pager thread, as the main thread may be blocked
+ * reading the stream or in a callback for arbitrarily long.  pc->lock
+ * serialises the two over the tracking state and the ring.
+ *
+ * Pages which can't be paged out (typically because they are mapped by the
+ * toolstack) are requested up front, and the guest only resumed once they
+ * have been received.
+ *
+ * Once the guest has been resumed, its outstanding memory only exists on
+ * the saving side.  Should the stream fail, the domain is paused, and the
+ * restore fails for the toolstack to destroy it.
+ */
+struct xc_sr_restore_postcopy
+{
+    /* Tracking bitmaps, covering pfns up to max_pfn. */
+    xen_pfn_t max_pfn;
+    unsigned long *outstanding;   /* Listed, not received yet. */
+    unsigned long *evicted;       /* Paged out. */
+    unsigned long *requested;     /* Asked for on the back channel. */
+
+    unsigned long nr_outstanding;
+    unsigned long nr_busy;        /* Outstanding, but not paged out. */
+
+    bool transitioned;
+    bool resumed;
+    bool paging;
+
+    xenevtchn_handle *xce;
+    xenevtchn_port_or_error_t port;
+    void *ring_page;
+    vm_event_back_ring_t back_ring;
+
+    /* Paging requests waiting for their page. */
+    vm_event_request_t *waiters;
+    unsigned int nr_waiters, max_waiters;
+
+    /* Page aligned bounce buffer for xc_mem_paging_load(). */
+    void *page;
+
+    /* Pager thread, stopped by writing to stop_pipe. */
+    pthread_mutex_t lock;
+    pthread_t pager;
+    bool pager_running;
+    bool pager_failed;
+    int stop_pipe[2];
+};
+
+static bool postcopy_transitioned(const struct xc_sr_context *ctx)
+{
+    return ctx->restore.postcopy && ctx->restore.postcopy->transitioned;
+}
+
+static bool postcopy_is_outstanding(const struct xc_sr_restore_postcopy *pc,
+                                    xen_pfn_t pfn)
+{
+    return pfn <= pc->max_pfn && test_bit(pfn, pc->outstanding);
+}
+
+/*
+ * Expand the tracking bitmaps to cover pfn, in the same way as
+ * pfn_set_populated().
+ */
+static int postcopy_track_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    unsigned long **maps[] = { &pc->outstanding, &pc->evicted,
+                               &pc->requested };
+    xen_pfn_t new_max;
+    size_t old_sz, new_sz;
+    unsigned int i;
+    unsigned long *p;
+
+    if ( pc->outstanding && pfn <= pc->max_pfn )
+        return 0;
+
+    new_max = pfn;
+    new_max |= new_max >> 1;
+    new_max |= new_max >> 2;
+    new_max |= new_max >> 4;
+    new_max |= new_max >> 8;
+    new_max |= new_max >> 16;
+#ifdef __x86_64__
+    new_max |= new_max >> 32;
+#endif
+
+    old_sz = pc->outstanding ? bitmap_size(pc->max_pfn + 1) : 0;
+    new_sz = bitmap_size(new_max + 1);
+
+    for ( i = 0; i < ARRAY_SIZE(maps); ++i )
+    {
+        p = realloc(*maps[i], new_sz);
+        if ( !p )
+        {
+            ERROR("Failed to realloc post-copy bitmap");
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memset((uint8_t *)p + old_sz, 0x00, new_sz - old_sz);
+        *maps[i] = p;
+    }
+
+    pc->max_pfn = new_max;
+
+    return 0;
+}
+
+/*
+ * Ask the sender for pages on the back channel.
+ */
+static int postcopy_request_pfns(struct xc_sr_context *ctx,
+                                 uint64_t *pfns, unsigned int count)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_POSTCOPY_PFN_REQUEST,
+        .length = count * sizeof(*pfns),
+    };
+    struct iovec iov[] =
+    {
+        { .iov_base = &rec.type,   .iov_len = sizeof(rec.type) },
+        { .iov_base = &rec.length, .iov_len = sizeof(rec.length) },
+        { .iov_base = pfns,        .iov_len = rec.length },
+    };
+
+    if ( count == 0 )
+        return 0;
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to write post-copy pfn request to back channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void postcopy_put_response(struct xc_sr_restore_postcopy *pc,
+                                  const vm_event_request_t *req)
+{
+    vm_event_back_ring_t *back_ring = &pc->back_ring;
+    vm_event_response_t rsp =
+    {
+        .version = VM_EVENT_INTERFACE_VERSION,
+        .vcpu_id = req->vcpu_id,
+        .flags = req->flags,
+        .reason = VM_EVENT_REASON_MEM_PAGING,
+        .u.mem_paging.gfn = req->u.mem_paging.gfn,
+        .u.mem_paging.flags = req->u.mem_paging.flags,
+    };
+
+    memcpy(RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt),
+           &rsp, sizeof(rsp));
+    back_ring->rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(back_ring);
+}
+
+static int postcopy_notify(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+
+    if ( xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Respond to the paging requests waiting for pfn, which has been paged in
+ * or dropped.  Called with pc->lock held.
+ */
+static int postcopy_wake(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    unsigned int i = 0, woken = 0;
+
+    while ( i < pc->nr_waiters )
+    {
+        if ( pc->waiters[i].u.mem_paging.gfn != pfn )
+        {
+            ++i;
+            continue;
+        }
+
+        postcopy_put_response(pc, &pc->waiters[i]);
+        pc->waiters[i] = pc->waiters[--pc->nr_waiters];
+        ++woken;
+    }
+
+    return woken ? postcopy_notify(ctx) : 0;
+}
+
+/*
+ * Handle the requests on the paging ring, without blocking.  Called with
+ * pc->lock held, or with the pager stopped.
+ */
+static int postcopy_service(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    vm_event_back_ring_t *back_ring = &pc->back_ring;
+    struct pollfd pfd = { .fd = xenevtchn_fd(pc->xce), .events = POLLIN };
+    vm_event_request_t req, *w;
+    uint64_t pfns[64];
+    unsigned int nr_pfns = 0, responded = 0;
+    xenevtchn_port_or_error_t port;
+    xen_pfn_t gfn;
+    int rc;
+
+    if ( poll(&pfd, 1, 0) > 0 )
+    {
+        port = xenevtchn_pending(pc->xce);
+        if ( port < 0 || xenevtchn_unmask(pc->xce, port) )
+        {
+            PERROR("Failed to handle paging event channel");
+            return -1;
+        }
+    }
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION )
+        {
+            ERROR("Paging request version %#x, expected %#x",
+                  req.version, VM_EVENT_INTERFACE_VERSION);
+            return -1;
+        }
+
+        gfn = req.u.mem_paging.gfn;
+
+        if ( !postcopy_is_outstanding(pc, gfn) )
+        {
+            /* Already paged in, or never paged out. */
+            postcopy_put_response(pc, &req);
+            ++responded;
+            continue;
+        }
+
+        if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+        {
+            /* The guest freed the page.  Ignore it when it arrives. */
+            clear_bit(gfn, pc->outstanding);
+            clear_bit(gfn, pc->evicted);
+            pc->nr_outstanding--;
+            postcopy_put_response(pc, &req);
+            ++responded;
+            continue;
+        }
+
+        if ( pc->nr_waiters == pc->max_waiters )
+        {
+            unsigned int new_max = pc->max_waiters ? pc->max_waiters * 2 : 64;
+
+            w = realloc(pc->waiters, new_max * sizeof(*w));
+            if ( !w )
+            {
+                ERROR("Unable to allocate memory for paging requests");
+                return -1;
+            }
+
+            pc->waiters = w;
+            pc->max_waiters = new_max;
+        }
+        pc->waiters[pc->nr_waiters++] = req;
+
+        if ( !test_and_set_bit(gfn, pc->requested) )
+        {
+            pfns[nr_pfns++] = gfn;
+
+            if ( nr_pfns == ARRAY_SIZE(pfns) )
+            {
+                rc = postcopy_request_pfns(ctx, pfns, nr_pfns);
+                if ( rc )
+                    return rc;
+                nr_pfns = 0;
+            }
+        }
+    }
+
+    rc = postcopy_request_pfns(ctx, pfns, nr_pfns);
+    if ( !rc && responded )
+        rc = postcopy_notify(ctx);
+
+    return rc;
+}
+
+/*
+ * Service the paging ring whenever the event channel fires, independently
+ * of what the main thread is doing.
+ */
+static void *postcopy_pager(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    struct pollfd pfd[] =
+    {
+        { .fd = xenevtchn_fd(pc->xce), .events = POLLIN },
+        { .fd = pc->stop_pipe[0],      .events = POLLIN },
+    };
+    int rc;
+
+    for ( ; ; )
+    {
+        rc = poll(pfd, ARRAY_SIZE(pfd), -1);
+        if ( rc < 0 && errno == EINTR )
+            continue;
+        if ( rc < 0 )
+        {
+            PERROR("Failed to poll paging event channel");
+            break;
+        }
+
+        if ( pfd[1].revents )
+            return NULL;
+
+        pthread_mutex_lock(&pc->lock);
+        rc = postcopy_service(ctx);
+        pthread_mutex_unlock(&pc->lock);
+
+        if ( rc )
+            break;
+    }
+
+    pthread_mutex_lock(&pc->lock);
+    pc->pager_failed = true;
+    pthread_mutex_unlock(&pc->lock);
+
+    return NULL;
+}
+
+static int postcopy_start_pager(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    int rc;
+
+    if ( pipe(pc->stop_pipe) )
+    {
+        PERROR("Failed to create post-copy pager pipe");
+        pc->stop_pipe[0] = pc->stop_pipe[1] = -1;
+        return -1;
+    }
+
+    rc = pthread_create(&pc->pager, NULL, postcopy_pager, ctx);
+    if ( rc )
+    {
+        errno = rc;
+        PERROR("Failed to create post-copy pager thread");
+        return -1;
+    }
+    pc->pager_running = true;
+
+    return 0;
+}
+
+static void postcopy_stop_pager(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    char c = 0;
+
+    if ( !pc->pager_running )
+        return;
+
+    if ( write(pc->stop_pipe[1], &c, 1) != 1 )
+    {
+        /* Can't happen with a fresh pipe, but don't leave the thread. */
+        pthread_cancel(pc->pager);
+    }
+
+    pthread_join(pc->pager, NULL);
+    pc->pager_running = false;
+}
+
+/*
+ * Check, between records, that the pager is still working.
+ */
+static int postcopy_check_pager(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    bool failed;
+
+    pthread_mutex_lock(&pc->lock);
+    failed = pc->pager_failed;
+    pthread_mutex_unlock(&pc->lock);
+
+    if ( failed )
+    {
+        ERROR("Post-copy pager failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The device model state has been loaded, and all pages which can't be paged
+ * in on demand have arrived.  Let the toolstack resume the guest.
+ */
+static int postcopy_resume(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    int rc;
+
+    rc = ctx->restore.callbacks->postcopy_resume(ctx->restore.callbacks->data);
+    if ( rc != 1 )
+    {
+        ERROR("Failed to resume domain for post-copy");
+        return -1;
+    }
+
+    pc->resumed = true;
+    IPRINTF("Resumed domain for post-copy");
+
+    return 0;
+}
+
+/*
+ * Process a POSTCOPY_BEGIN record.  Populate the listed pfns, which will be
+ * paged out at POSTCOPY_TRANSITION.
+ */
+static int handle_postcopy_begin(struct xc_sr_context *ctx,
+                                 struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    uint64_t *pfns = rec->data;
+    unsigned int i, count = rec->length / sizeof(*pfns);
+    xen_pfn_t *to_populate = NULL;
+    int rc = -1;
+
+    if ( !ctx->dominfo.hvm )
+    {
+        ERROR("Post-copy is only supported for HVM guests");
+        return -1;
+    }
+
+    if ( ctx->restore.send_back_fd < 0 || !ctx->restore.callbacks ||
+         !ctx->restore.callbacks->restore_results ||
+         !ctx->restore.callbacks->postcopy_transition ||
+         !ctx->restore.callbacks->postcopy_resume )
+    {
+        ERROR("Post-copy needs a back channel, and restore_results,"
+              " postcopy_transition and postcopy_resume callbacks");
+        return -1;
+    }
+
+    if ( postcopy_transitioned(ctx) )
+    {
+        ERROR("POSTCOPY_BEGIN record after POSTCOPY_TRANSITION");
+        return -1;
+    }
+
+    if ( rec->length % sizeof(*pfns) )
+    {
+        ERROR("POSTCOPY_BEGIN record length %u not a multiple of %zu",
+              rec->length, sizeof(*pfns));
+        return -1;
+    }
+
+    if ( !pc )
+    {
+        pc = ctx->restore.postcopy = calloc(1, sizeof(*pc));
+        if ( !pc )
+        {
+            ERROR("Unable to allocate memory for post-copy state");
+            return -1;
+        }
+
+        pthread_mutex_init(&pc->lock, NULL);
+        pc->stop_pipe[0] = pc->stop_pipe[1] = -1;
+    }
+
+    to_populate = malloc(count * sizeof(*to_populate));
+    if ( count && !to_populate )
+    {
+        ERROR("Unable to allocate memory for %u pfns", count);
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfns[i]) )
+        {
+            ERROR("pfn %#"PRIx64" (index %u) outside domain maximum",
+                  pfns[i], i);
+            goto err;
+        }
+
+        if ( postcopy_track_pfn(ctx, pfns[i]) )
+            goto err;
+
+        if ( !test_and_set_bit(pfns[i], pc->outstanding) )
+            pc->nr_outstanding++;
+
+        to_populate[i] = pfns[i];
+    }
+
+    rc = populate_pfns(ctx, count, to_populate, NULL);
+
+ err:
+    free(to_populate);
+
+    return rc;
+}
+
+/*
+ * Process a POSTCOPY_TRANSITION record.  Everything but the outstanding pages
+ * and the device model state has been received.  Page the outstanding pages
+ * out, have the toolstack load the device model state, and resume the guest
+ * unless it has to wait for pages which couldn't be paged out.
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    static const unsigned int magic_params[] =
+    {
+        HVM_PARAM_IOREQ_PFN,
+        HVM_PARAM_BUFIOREQ_PFN,
+        HVM_PARAM_IDENT_PT,
+        HVM_PARAM_PAGING_RING_PFN,
+        HVM_PARAM_MONITOR_RING_PFN,
+        HVM_PARAM_SHARING_RING_PFN,
+    };
+    uint64_t *busy = NULL, value;
+    unsigned long nr_evicted = 0;
+    uint32_t remote_port;
+    xen_pfn_t pfn;
+    unsigned int i;
+    int rc = -1;
+
+    if ( !pc || pc->transitioned )
+    {
+        ERROR("POSTCOPY_TRANSITION record without POSTCOPY_BEGIN");
+        return -1;
+    }
+
+    pc->transitioned = true;
+
+    /*
+     * Pages used by Xen or the toolstack rather than the guest have been
+     * set up from the HVM_PARAMS record, and are not to be paged out.
+     */
+    for ( i = 0; i < ARRAY_SIZE(magic_params); ++i )
+    {
+        if ( xc_hvm_param_get(xch, ctx->domid, magic_params[i], &value) ||
+             !value || !postcopy_is_outstanding(pc, value) )
+            continue;
+
+        clear_bit(value, pc->outstanding);
+        pc->nr_outstanding--;
+    }
+
+    for ( i = 0; i < 2; ++i )
+    {
+        pfn = i ? ctx->restore.console_gfn : ctx->restore.xenstore_gfn;
+
+        if ( pfn && postcopy_is_outstanding(pc, pfn) )
+        {
+            clear_bit(pfn, pc->outstanding);
+            pc->nr_outstanding--;
+        }
+    }
+
+    if ( posix_memalign(&pc->page, PAGE_SIZE, PAGE_SIZE) )
+    {
+        pc->page = NULL;
+        ERROR("Unable to allocate post-copy page buffer");
+        goto err;
+    }
+
+    pc->ring_page = xc_vm_event_enable(xch, ctx->domid,
+                                       HVM_PARAM_PAGING_RING_PFN,
+                                       &remote_port);
+    if ( !pc->ring_page )
+    {
+        PERROR("Failed to enable paging for post-copy");
+        goto err;
+    }
+    pc->paging = true;
+
+    pc->xce = xenevtchn_open(NULL, 0);
+    if ( !pc->xce )
+    {
+        PERROR("Failed to open event channel handle");
+        goto err;
+    }
+
+    pc->port = xenevtchn_bind_interdomain(pc->xce, ctx->domid, remote_port);
+    if ( pc->port < 0 )
+    {
+        PERROR("Failed to bind paging event channel");
+        goto err;
+    }
+
+    SHARED_RING_INIT((vm_event_sring_t *)pc->ring_page);
+    BACK_RING_INIT(&pc->back_ring, (vm_event_sring_t *)pc->ring_page,
+                   PAGE_SIZE);
+
+    busy = malloc(MAX_BATCH_SIZE * sizeof(*busy));
+    if ( !busy )
+    {
+        ERROR("Unable to allocate memory for post-copy requests");
+        goto err;
+    }
+
+    for ( pfn = 0; pfn <= pc->max_pfn; ++pfn )
+    {
+        if ( !test_bit(pfn, pc->outstanding) )
+            continue;
+
+        if ( !xc_mem_paging_nominate(xch, ctx->domid, pfn) &&
+             !xc_mem_paging_evict(xch, ctx->domid, pfn) )
+        {
+            set_bit(pfn, pc->evicted);
+            nr_evicted++;
+            continue;
+        }
+
+        if ( errno != EBUSY )
+        {
+            PERROR("Failed to page out pfn %#"PRIpfn, pfn);
+            goto err;
+        }
+
+        /* In use.  The guest must wait for it. */
+        set_bit(pfn, pc->requested);
+        busy[pc->nr_busy++ % MAX_BATCH_SIZE] = pfn;
+
+        if ( pc->nr_busy % MAX_BATCH_SIZE == 0 &&
+             postcopy_request_pfns(ctx, busy, MAX_BATCH_SIZE) )
+            goto err;
+    }
+
+    if ( postcopy_request_pfns(ctx, busy, pc->nr_busy % MAX_BATCH_SIZE) )
+        goto err;
+
+    DPRINTF("Paged out %lu pages, %lu in use", nr_evicted, pc->nr_busy);
+
+    /* From here on, the back channel belongs to the pager. */
+    if ( postcopy_start_pager(ctx) )
+        goto err;
+
+    if ( ctx->restore.ops.stream_complete(ctx) )
+        goto err;
+
+    ctx->restore.callbacks->restore_results(ctx->restore.xenstore_gfn,
+                                            ctx->restore.console_gfn,
+                                            ctx->restore.callbacks->data);
+
+    if ( ctx->restore.callbacks->postcopy_transition(
+             ctx->restore.callbacks->data) != 1 )
+    {
+        ERROR("Failed to load device model state for post-copy");
+        goto err;
+    }
+
+    rc = pc->nr_busy ? 0 : postcopy_resume(ctx);
+
+ err:
+    free(busy);
+
+    return rc;
+}
+
+/*
+ * Apply PAGE_DATA received after POSTCOPY_TRANSITION.  Pages which are no
+ * longer outstanding (already received, or dropped by the guest) are ignored.
+ * Pages which are not present, or broken, on the sending side are removed,
+ * as they would have been left unpopulated by a PAGE_DATA record before the
+ * transition.
+ */
+static int postcopy_page_data(struct xc_sr_context *ctx, unsigned int count,
+                              xen_pfn_t *pfns, uint32_t *types,
+                              void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    unsigned int i;
+    void *guest_page, *data;
+    xen_pfn_t pfn;
+    int rc = 0;
+
+    pthread_mutex_lock(&pc->lock);
+
+    for ( i = 0; i < count; ++i )
+    {
+        data = NULL;
+        if ( types[i] < XEN_DOMCTL_PFINFO_BROKEN )
+        {
+            data = page_data;
+            page_data += PAGE_SIZE;
+        }
+
+        if ( !postcopy_is_outstanding(pc, pfns[i]) )
+            continue;
+
+        if ( types[i] == XEN_DOMCTL_PFINFO_XTAB ||
+             types[i] == XEN_DOMCTL_PFINFO_BROKEN )
+        {
+            pfn = pfns[i];
+            if ( xc_domain_decrease_reservation_exact(xch, ctx->domid,
+                                                      1, 0, &pfn) )
+            {
+                PERROR("Failed to remove pfn %#"PRIpfn, pfns[i]);
+                rc = -1;
+                goto out;
+            }
+
+            if ( !test_and_clear_bit(pfns[i], pc->evicted) )
+                pc->nr_busy--;
+        }
+        else if ( test_bit(pfns[i], pc->evicted) )
+        {
+            if ( data )
+                memcpy(pc->page, data, PAGE_SIZE);
+            else
+                memset(pc->page, 0, PAGE_SIZE);
+
+            if ( xc_mem_paging_load(xch, ctx->domid, pfns[i], pc->page) )
+            {
+                PERROR("Failed to page in pfn %#"PRIpfn, pfns[i]);
+                rc = -1;
+                goto out;
+            }
+
+            clear_bit(pfns[i], pc->evicted);
+        }
+        else
+        {
+            guest_page = xc_map_foreign_range(xch, ctx->domid, PAGE_SIZE,
+                                              PROT_READ | PROT_WRITE,
+                                              pfns[i]);
+            if ( !guest_page )
+            {
+                PERROR("Failed to map pfn %#"PRIpfn, pfns[i]);
+                rc = -1;
+                goto out;
+            }
+
+            if ( data )
+                memcpy(guest_page, data, PAGE_SIZE);
+            else
+                memset(guest_page, 0, PAGE_SIZE);
+
+            munmap(guest_page, PAGE_SIZE);
+            pc->nr_busy--;
+        }
+
+        clear_bit(pfns[i], pc->outstanding);
+        pc->nr_outstanding--;
+
+        rc = postcopy_wake(ctx, pfns[i]);
+        if ( rc )
+            goto out;
+    }
+
+ out:
+    pthread_mutex_unlock(&pc->lock);
+
+    /* Not under the lock: resuming may fault on pages the pager handles. */
+    if ( !rc && !pc->resumed && pc->nr_busy == 0 )
+        rc = postcopy_resume(ctx);
+
+    return rc;
+}
+
+/*
+ * The END record has been received.  Check that every page has arrived, and
+ * stop paging.
+ */
+static int postcopy_complete(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+
+    postcopy_stop_pager(ctx);
+
+    if ( pc->pager_failed )
+    {
+        ERROR("Post-copy pager failed");
+        return -1;
+    }
+
+    if ( !pc->resumed )
+    {
+        ERROR("Stream ended before post-copy resumed the domain");
+        return -1;
+    }
+
+    if ( pc->nr_outstanding )
+    {
+        ERROR("Stream ended with %lu post-copy pages outstanding",
+              pc->nr_outstanding);
+        return -1;
+    }
+
+    /* Nothing is paged out, so the remaining requests can be answered. */
+    if ( postcopy_service(ctx) )
+        return -1;
+
+    while ( pc->nr_waiters )
+        postcopy_put_response(pc, &pc->waiters[--pc->nr_waiters]);
+
+    if ( postcopy_notify(ctx) )
+        return -1;
+
+    if ( xc_mem_paging_disable(xch, ctx->domid) )
+    {
+        PERROR("Failed to disable paging");
+        return -1;
+    }
+    pc->paging = false;
+
+    return 0;
+}
+
+/*
+ * The restore has failed.  A guest which has already been resumed can't
+ * continue without its outstanding pages, so stop it running.
+ */
+static void postcopy_abort(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+
+    if ( !pc )
+        return;
+
+    postcopy_stop_pager(ctx);
+
+    if ( !pc->resumed )
+        return;
+
+    if ( xc_domain_pause(xch, ctx->domid) )
+        PERROR("Failed to pause domain %u", ctx->domid);
+
+    ERROR("Post-copy failed after resuming domain %u, with %lu pages"
+          " outstanding: it has been paused, and must be destroyed",
+          ctx->domid, pc->nr_outstanding);
+}
+
+static void postcopy_cleanup(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+
+    if ( !pc )
+        return;
+
+    postcopy_stop_pager(ctx);
+
+    if ( pc->paging )
+        xc_mem_paging_disable(ctx->xch, ctx->domid);
+
+    if ( pc->xce )
+    {
+        if ( pc->port >= 0 )
+            xenevtchn_unbind(pc->xce, pc->port);
+        xenevtchn_close(pc->xce);
+    }
+
+    if ( pc->ring_page )
+        munmap(pc->ring_page, PAGE_SIZE);
+
+    if ( pc->stop_pipe[0] >= 0 )
+        close(pc->stop_pipe[0]);
+    if ( pc->stop_pipe[1] >= 0 )
+        close(pc->stop_pipe[1]);
+    pthread_mutex_destroy(&pc->lock);
+
+    free(pc->page);
+    free(pc->waiters);
+    free(pc->requested);
+    free(pc->evicted);
+    free(pc->outstanding);
+    free(pc);
+    ctx->restore.postcopy = NULL;
+}
+
+/*
+ * Validate a PAGE_DATA record from the stream, and pass the results to
+ * process_page_data() to actually perform the legwork.
+ */
+static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned i, pages_of_data = 0;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL, pfn;
+    uint32_t *types = NULL, type;
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        goto err;
+    }
+    else if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        goto err;
+    }
+    else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    {
+        ERROR("PAGE_DATA record (length %u) too short to contain %u"
+              " pfns worth of information", rec->length, pages->count);
+        goto err;
+    }
+
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
+        goto err;
+    }
+
+    for ( i = 0; i < pages->count; ++i )
+    {
+        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
+        if ( !page_data_pfn_is_valid(ctx, pfn) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            goto err;
+        }
+
+        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) >= 5) &&
+             ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) <= 8) )
+        {
+            ERROR("Invalid type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
+            goto err;
+        }
+        else if ( type < XEN_DOMCTL_PFINFO_BROKEN )
+            /* NOTAB and all L1 through L4 tables (including pinned) should
+             * have a page worth of data in the record. */
+            pages_of_data++;
+
+        pfns[i] = pfn;
+        types[i] = type;
+    }
+
+    if ( rec->length != (sizeof(*pages) +
+                         (sizeof(uint64_t) * pages->count) +
+                         (PAGE_SIZE * pages_of_data)) )
+    {
+        ERROR("PAGE_DATA record wrong size: length %u, expected "
+              "%zu + %zu + %lu", rec->length, sizeof(*pages),
+              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        goto err;
+    }
+
+    if ( postcopy_transitioned(ctx) )
     {
-        rc = xc_domain_populate_physmap_exact(
-            xch, ctx->domid, nr_pfns, 0, 0, mfns);
-        if ( rc )
-        {
-            PERROR("Failed to populate physmap");
-            goto err;
-        }
-
-        for ( i = 0; i < nr_pfns; ++i )
-        {
-            if ( mfns[i] == INVALID_MFN )
-            {
-                ERROR("Populate physmap failed for pfn %u", i);
-                rc = -1;
-                goto err;
-            }
-
-            ctx->restore.ops.set_gfn(ctx, pfns[i], mfns[i]);
-        }
+        rc = postcopy_page_data(ctx, pages->count, pfns, types,
+                                &pages->pfn[pages->count]);
+        goto err;
     }
 
-    rc = 0;
+    if ( ctx->restore.pool && !ctx->restore.verify )
+        return queue_page_data(ctx, rec, pages->count, pfns, types,
+                               &pages->pfn[pages->count]);
 
+    rc = drain_page_data(ctx);
+    if ( !rc )
+        rc = process_page_data(ctx, pages->count, pfns, types,
+                               &pages->pfn[pages->count]);
  err:
+    free(types);
     free(pfns);
-    free(mfns);
 
     return rc;
 }
 
 /*
- * Given a list of pfns, their types, and a block of page data from the
- * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * Validate a PAGE_ELIDED record, and zero or copy into place the pages it
+ * describes.  Pages which become populated by this record are already zero.
  */
-static int process_page_data(struct xc_sr_context *ctx, unsigned count,
-                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+static int handle_page_elided(struct xc_sr_context *ctx,
+                              struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
-    int *map_errs = malloc(count * sizeof(*map_errs));
-    int rc;
-    void *mapping = NULL, *guest_page = NULL;
-    unsigned i,    /* i indexes the pfns from the record. */
-        j,         /* j indexes the subset of pfns we decide to map. */
-        nr_pages = 0;
+    struct xc_sr_rec_page_elided_header *hdr = rec->data;
+    xen_pfn_t *pfns = NULL, *dst = NULL, *src = NULL;
+    int *dst_errs = NULL, *src_errs = NULL;
+    void *dst_map = NULL, *src_map = NULL;
+    unsigned i, j, k, nr_dst = 0, nr_src = 0, count;
+    bool *fresh = NULL;
+    int rc = -1;
 
-    if ( !mfns || !map_errs )
+    if ( rec->length < sizeof(*hdr) )
     {
-        rc = -1;
-        ERROR("Failed to allocate %zu bytes to process page data",
-              count * (sizeof(*mfns) + sizeof(*map_errs)));
+        ERROR("PAGE_ELIDED record truncated: length %u, min %zu",
+              rec->length, sizeof(*hdr));
         goto err;
     }
 
-    rc = populate_pfns(ctx, count, pfns, types);
-    if ( rc )
+    count = hdr->count;
+    if ( count < 1 )
     {
-        ERROR("Failed to populate pfns for batch of %u pages", count);
+        ERROR("Expected at least 1 pfn in PAGE_ELIDED record");
+        goto err;
+    }
+    else if ( rec->length != sizeof(*hdr) + count * sizeof(hdr->entry[0]) )
+    {
+        ERROR("PAGE_ELIDED record wrong size: length %u, expected %zu",
+              rec->length, sizeof(*hdr) + count * sizeof(hdr->entry[0]));
+        goto err;
+    }
+
+    pfns = malloc(count * sizeof(*pfns));
+    dst = malloc(count * sizeof(*dst));
+    src = malloc(count * sizeof(*src));
+    dst_errs = malloc(count * sizeof(*dst_errs));
+    src_errs = malloc(count * sizeof(*src_errs));
+    fresh = malloc(count * sizeof(*fresh));
+    if ( !pfns || !dst || !src || !dst_errs || !src_errs || !fresh )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns", count);
         goto err;
     }
 
     for ( i = 0; i < count; ++i )
     {
-        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
+        xen_pfn_t pfn = hdr->entry[i].pfn, src_pfn = hdr->entry[i].src;
 
-        switch ( types[i] )
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
         {
-        case XEN_DOMCTL_PFINFO_NOTAB:
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            goto err;
+        }
 
-        case XEN_DOMCTL_PFINFO_L1TAB:
-        case XEN_DOMCTL_PFINFO_L1TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+        if ( hdr->entry[i].src != PAGE_ELIDED_SRC_ZERO &&
+             !pfn_is_populated(ctx, src_pfn) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) duplicates unsent pfn %#"PRIpfn,
+                  pfn, i, src_pfn);
+            goto err;
+        }
 
-        case XEN_DOMCTL_PFINFO_L2TAB:
-        case XEN_DOMCTL_PFINFO_L2TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+        pfns[i] = pfn;
+        fresh[i] = !pfn_is_populated(ctx, pfn);
+    }
 
-        case XEN_DOMCTL_PFINFO_L3TAB:
-        case XEN_DOMCTL_PFINFO_L3TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+    rc = populate_pfns(ctx, count, pfns, NULL);
+    if ( rc )
+    {
+        ERROR("Failed to populate pfns for %u elided pages", count);
+        goto err;
+    }
+    rc = -1;
 
-        case XEN_DOMCTL_PFINFO_L4TAB:
-        case XEN_DOMCTL_PFINFO_L4TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+    for ( i = 0; i < count; ++i )
+    {
+        ctx->restore.ops.set_page_type(ctx, pfns[i], XEN_DOMCTL_PFINFO_NOTAB);
 
-            mfns[nr_pages++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
-            break;
+        if ( hdr->entry[i].src == PAGE_ELIDED_SRC_ZERO )
+        {
+            /* Freshly populated frames are zeroed by Xen. */
+            if ( fresh[i] && !ctx->restore.verify )
+                continue;
         }
+        else
+            src[nr_src++] = ctx->restore.ops.pfn_to_gfn(ctx,
+                                                        hdr->entry[i].src);
+
+        dst[nr_dst++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
     }
 
-    /* Nothing to do? */
-    if ( nr_pages == 0 )
-        goto done;
+    if ( nr_dst == 0 )
+    {
+        rc = 0;
+        goto err;
+    }
 
-    mapping = guest_page = xenforeignmemory_map(xch->fmem,
-        ctx->domid, PROT_READ | PROT_WRITE,
-        nr_pages, mfns, map_errs);
-    if ( !mapping )
+    dst_map = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                   PROT_READ | PROT_WRITE,
+                                   nr_dst, dst, dst_errs);
+    if ( !dst_map )
     {
-        rc = -1;
-        PERROR("Unable to map %u mfns for %u pages of data",
-               nr_pages, count);
+        PERROR("Unable to map %u mfns for elided pages", nr_dst);
         goto err;
     }
 
-    for ( i = 0, j = 0; i < count; ++i )
+    if ( nr_src )
     {
-        switch ( types[i] )
+        src_map = xenforeignmemory_map(xch->fmem, ctx->domid, PROT_READ,
+                                       nr_src, src, src_errs);
+        if ( !src_map )
         {
-        case XEN_DOMCTL_PFINFO_XTAB:
-        case XEN_DOMCTL_PFINFO_BROKEN:
-        case XEN_DOMCTL_PFINFO_XALLOC:
-            /* No page data to deal with. */
-            continue;
+            PERROR("Unable to map %u mfns for duplicated pages", nr_src);
+            goto err;
         }
+    }
 
-        if ( map_errs[j] )
+    for ( i = 0, j = 0, k = 0; i < count; ++i )
+    {
+        void *dst_page, *src_page = NULL;
+
+        if ( hdr->entry[i].src == PAGE_ELIDED_SRC_ZERO )
         {
-            rc = -1;
-            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn", type %#"PRIx32") failed with %d",
-                  pfns[i], mfns[j], types[i], map_errs[j]);
-            goto err;
+            if ( fresh[i] && !ctx->restore.verify )
+                continue;
+        }
+        else
+        {
+            if ( src_errs[k] )
+            {
+                ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn") failed with %d",
+                      (xen_pfn_t)hdr->entry[i].src, src[k], src_errs[k]);
+                goto err;
+            }
+            src_page = src_map + k++ * PAGE_SIZE;
         }
 
-        /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
-        if ( rc )
+        if ( dst_errs[j] )
         {
-            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
-                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn") failed with %d",
+                  pfns[i], dst[j], dst_errs[j]);
             goto err;
         }
+        dst_page = dst_map + j++ * PAGE_SIZE;
 
         if ( ctx->restore.verify )
         {
-            /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
-                ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
-                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            /* Verify mode - compare what we have to what was elided. */
+            if ( src_page ? memcmp(dst_page, src_page, PAGE_SIZE)
+                          : !page_is_zero(dst_page) )
+                ERROR("verify pfn %#"PRIpfn" failed (elided)", pfns[i]);
         }
+        else if ( src_page )
+            memcpy(dst_page, src_page, PAGE_SIZE);
         else
-        {
-            /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
-        }
-
-        ++j;
-        guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
+            memset(dst_page, 0, PAGE_SIZE);
     }
 
- done:
     rc = 0;
 
  err:
-    if ( mapping )
-        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
-
-    free(map_errs);
-    free(mfns);
+    if ( src_map )
+        xenforeignmemory_unmap(xch->fmem, src_map, nr_src);
+    if ( dst_map )
+        xenforeignmemory_unmap(xch->fmem, dst_map, nr_dst);
+
+    free(fresh);
+    free(src_errs);
+    free(dst_errs);
+    free(src);
+    free(dst);
+    free(pfns);
 
     return rc;
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Validate a PAGE_DELTA record, and apply the encoded changes to the normal
+ * pages it describes.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+static int handle_page_delta(struct xc_sr_context *ctx,
+                             struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
-    struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned i, pages_of_data = 0;
+    struct xc_sr_rec_page_delta_header *hdr = rec->data;
+    xen_pfn_t *pfns = NULL, *mfns = NULL;
+    uint32_t *types = NULL;
+    int *map_errs = NULL;
+    void *mapping = NULL, *page, *verify_page = NULL;
+    char *data;
+    unsigned long data_len, pos = 0;
+    unsigned i, count, nr_pages = 0;
     int rc = -1;
 
-    xen_pfn_t *pfns = NULL, pfn;
-    uint32_t *types = NULL, type;
+    if ( rec->length < sizeof(*hdr) )
+    {
+        ERROR("PAGE_DELTA record truncated: length %u, min %zu",
+              rec->length, sizeof(*hdr));
+        goto err;
+    }
 
-    if ( rec->length < sizeof(*pages) )
+    count = hdr->count;
+    if ( count < 1 )
     {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
+        ERROR("Expected at least 1 pfn in PAGE_DELTA record");
         goto err;
     }
-    else if ( pages->count < 1 )
+    else if ( rec->length < sizeof(*hdr) + count * sizeof(hdr->pfn[0]) )
     {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        ERROR("PAGE_DELTA record (length %u) too short to contain %u"
+              " pfns worth of information", rec->length, count);
         goto err;
     }
-    else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+
+    data = (char *)&hdr->pfn[count];
+    data_len = rec->length - sizeof(*hdr) - count * sizeof(hdr->pfn[0]);
+
+    pfns = malloc(count * sizeof(*pfns));
+    types = malloc(count * sizeof(*types));
+    mfns = malloc(count * sizeof(*mfns));
+    map_errs = malloc(count * sizeof(*map_errs));
+    if ( !pfns || !types || !mfns || !map_errs )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
+        ERROR("Unable to allocate enough memory for %u pfns", count);
         goto err;
     }
 
-    pfns = malloc(pages->count * sizeof(*pfns));
-    types = malloc(pages->count * sizeof(*types));
-    if ( !pfns || !types )
+    for ( i = 0; i < count; ++i )
     {
-        ERROR("Unable to allocate enough memory for %u pfns",
-              pages->count);
+        pfns[i] = hdr->pfn[i];
+        types[i] = XEN_DOMCTL_PFINFO_NOTAB;
+
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfns[i]) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum",
+                  pfns[i], i);
+            goto err;
+        }
+    }
+
+    /* A page sent in full for the first time may not be populated yet. */
+    rc = prepare_page_data(ctx, count, pfns, types, mfns, &nr_pages);
+    if ( rc )
+        goto err;
+    rc = -1;
+
+    mapping = xenforeignmemory_map(xch->fmem, ctx->domid,
+                                   PROT_READ | PROT_WRITE,
+                                   nr_pages, mfns, map_errs);
+    if ( !mapping )
+    {
+        PERROR("Unable to map %u mfns for %u pages of delta data",
+               nr_pages, count);
         goto err;
     }
 
-    for ( i = 0; i < pages->count; ++i )
+    if ( ctx->restore.verify )
     {
-        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
-        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        verify_page = malloc(PAGE_SIZE);
+        if ( !verify_page )
         {
-            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            ERROR("Unable to allocate a page to verify deltas with");
             goto err;
         }
+    }
 
-        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
-        if ( ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) >= 5) &&
-             ((type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT) <= 8) )
+    for ( i = 0; i < count; ++i )
+    {
+        if ( map_errs[i] )
         {
-            ERROR("Invalid type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
-                  type, pfn, i);
+            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn") failed with %d",
+                  pfns[i], mfns[i], map_errs[i]);
             goto err;
         }
-        else if ( type < XEN_DOMCTL_PFINFO_BROKEN )
-            /* NOTAB and all L1 through L4 tables (including pinned) should
-             * have a page worth of data in the record. */
-            pages_of_data++;
 
-        pfns[i] = pfn;
-        types[i] = type;
+        page = mapping + i * PAGE_SIZE;
+
+        if ( ctx->restore.verify )
+            memcpy(verify_page, page, PAGE_SIZE);
+
+        if ( xc_compression_uncompress_page(xch, data, data_len, &pos,
+                                            verify_page ?: page) )
+        {
+            ERROR("Invalid delta for pfn %#"PRIpfn" (index %u)", pfns[i], i);
+            goto err;
+        }
+
+        /* Verify mode - compare what we have to the page after the delta. */
+        if ( verify_page && memcmp(verify_page, page, PAGE_SIZE) )
+            ERROR("verify pfn %#"PRIpfn" failed (delta)", pfns[i]);
     }
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
+    if ( pos != data_len )
     {
-        ERROR("PAGE_DATA record wrong size: length %u, expected "
-              "%zu + %zu + %lu", rec->length, sizeof(*pages),
-              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        ERROR("PAGE_DELTA record has %lu bytes of unused data",
+              data_len - pos);
         goto err;
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+    rc = 0;
+
  err:
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+
+    free(verify_page);
+    free(map_errs);
+    free(mfns);
     free(types);
     free(pfns);
 
@@ -631,6 +2265,24 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     xc_interface *xch = ctx->xch;
     int rc = 0;
 
+    /* Everything other than page data depends on preceding page data. */
+    if ( rec->type != REC_TYPE_PAGE_DATA )
+    {
+        rc = drain_page_data(ctx);
+        if ( rc )
+            goto out;
+    }
+
+    /* Only page data follows POSTCOPY_TRANSITION. */
+    if ( postcopy_transitioned(ctx) &&
+         rec->type != REC_TYPE_PAGE_DATA && rec->type != REC_TYPE_END )
+    {
+        ERROR("Unexpected record %#x (%s) during post-copy",
+              rec->type, rec_type_to_str(rec->type));
+        rc = -1;
+        goto out;
+    }
+
     switch ( rec->type )
     {
     case REC_TYPE_END:
@@ -640,6 +2292,14 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_PAGE_ELIDED:
+        rc = handle_page_elided(ctx, rec);
+        break;
+
+    case REC_TYPE_PAGE_DELTA:
+        rc = handle_page_delta(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -649,11 +2309,20 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_checkpoint(ctx);
         break;
 
+    case REC_TYPE_POSTCOPY_BEGIN:
+        rc = handle_postcopy_begin(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
     }
 
+ out:
     free(rec->data);
     rec->data = NULL;
 
@@ -704,6 +2373,13 @@ static int setup(struct xc_sr_context *ctx)
     }
     ctx->restore.allocated_rec_num = DEFAULT_BUF_RECORDS;
 
+    if ( ctx->restore.nr_workers )
+    {
+        rc = create_restore_pool(ctx);
+        if ( rc )
+            goto err;
+    }
+
  err:
     return rc;
 }
@@ -715,6 +2391,9 @@ static void cleanup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
+    destroy_restore_pool(ctx);
+    postcopy_cleanup(ctx);
+
     for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
         free(ctx->restore.buffered_records[i].data);
 
@@ -744,6 +2423,13 @@ static int restore(struct xc_sr_context *ctx)
 
     do
     {
+        if ( postcopy_transitioned(ctx) )
+        {
+            rc = postcopy_check_pager(ctx);
+            if ( rc )
+                goto err;
+        }
+
         rc = read_record(ctx, ctx->fd, &rec);
         if ( rc )
         {
@@ -787,6 +2473,16 @@ static int restore(struct xc_sr_context *ctx)
 
  remus_failover:
 
+    if ( ctx->restore.postcopy )
+    {
+        /* With post-copy, stream_complete was called at the transition. */
+        rc = postcopy_complete(ctx);
+        if ( rc )
+            goto err;
+        IPRINTF("Post-copy restore successful");
+        goto done;
+    }
+
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
     {
         /* With COLO, we have already called stream_complete */
@@ -799,6 +2495,10 @@ static int restore(struct xc_sr_context *ctx)
      * With Remus, if we reach here, there must be some error on primary,
      * failover from the last checkpoint state.
      */
+    rc = drain_page_data(ctx);
+    if ( rc )
+        goto err;
+
     rc = ctx->restore.ops.stream_complete(ctx);
     if ( rc )
         goto err;
@@ -810,6 +2510,7 @@ static int restore(struct xc_sr_context *ctx)
     saved_errno = errno;
     saved_rc = rc;
     PERROR("Restore failed");
+    postcopy_abort(ctx);
 
  done:
     cleanup(ctx);
@@ -828,7 +2529,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       uint32_t store_domid, unsigned int console_evtchn,
                       unsigned long *console_gfn, uint32_t console_domid,
                       unsigned int hvm, unsigned int pae,
-                      xc_migration_stream_t stream_type,
+                      uint32_t flags, xc_migration_stream_t stream_type,
                       struct restore_callbacks *callbacks, int send_back_fd)
 {
     xen_pfn_t nr_pfns;
@@ -846,6 +2547,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.restore.checkpointed = stream_type;
     ctx.restore.callbacks = callbacks;
     ctx.restore.send_back_fd = send_back_fd;
+    ctx.restore.nr_workers = (flags & XCFLAGS_WORKERS_MASK) >>
+                             XCFLAGS_WORKERS_SHIFT;
 
     /* Sanity checks for callbacks. */
     if ( stream_type )
@@ -860,8 +2563,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                callbacks->restore_results);
     }
 
-    DPRINTF("fd %d, dom %u, hvm %u, pae %u, stream_type %d",
-            io_fd, dom, hvm, pae, stream_type);
+    DPRINTF("fd %d, dom %u, hvm %u, pae %u, flags %u, stream_type %d",
+            io_fd, dom, hvm, pae, flags, stream_type);
 
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
     {
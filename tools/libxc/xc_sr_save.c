@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "xc_sr_common.h"
@@ -46,6 +49,50 @@ static int write_headers(struct xc_sr_context *ctx, uint16_t guest_type)
     return 0;
 }
 
+int write_split_record(struct xc_sr_context *ctx, struct xc_sr_record *rec,
+                       void *buf, size_t sz)
+{
+    static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+
+    xc_interface *xch = ctx->xch;
+    typeof(rec->length) combined_length = rec->length + sz;
+    size_t record_length = ROUNDUP(combined_length, REC_ALIGN_ORDER);
+    struct iovec parts[] =
+    {
+        { &rec->type,       sizeof(rec->type) },
+        { &combined_length, sizeof(combined_length) },
+        { rec->data,        rec->length },
+        { buf,              sz },
+        { (void*)zeroes,    record_length - combined_length },
+    };
+
+    if ( record_length > REC_LENGTH_MAX )
+    {
+        ERROR("Record (0x%08x, %s) length %#zx exceeds max (%#x)", rec->type,
+              rec_type_to_str(rec->type), record_length, REC_LENGTH_MAX);
+        return -1;
+    }
+
+    if ( rec->length )
+        assert(rec->data);
+    if ( sz )
+        assert(buf);
+
+    if ( writev_exact(ctx->fd, parts, ARRAY_SIZE(parts)) )
+        goto err;
+
+    /* Every record in the stream counts towards the iteration's bytes. */
+    ctx->save.iter_stats.bytes_written += sizeof(rec->type) +
+                                          sizeof(combined_length) +
+                                          record_length;
+
+    return 0;
+
+ err:
+    PERROR("Unable to write record to stream");
+    return -1;
+}
+
 /*
  * Writes an END record into the stream.
  */
@@ -66,77 +113,332 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
     return write_record(ctx, &checkpoint);
 }
 
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Pages per second, given a count of pages over an interval in ns. */
+static uint64_t page_rate(uint64_t pages, uint64_t ns)
+{
+    return ns ? pages * 1000000000ULL / ns : 0;
+}
+
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
- *
- * This function:
- * - gets the types for each pfn in the batch.
- * - for each pfn with real data:
- *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * A batch of pfns on its way into the stream as a PAGE_DATA record.  The
+ * arrays are sized for 'max_pfns' entries so a batch can be reused.
  */
-static int write_batch(struct xc_sr_context *ctx)
+struct xc_sr_save_batch
 {
-    xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
-    int *errors = NULL, rc = -1;
-    unsigned i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned nr_pfns = ctx->save.nr_batch_pfns;
-    void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec =
-    {
-        .type = REC_TYPE_PAGE_DATA,
-    };
-
-    assert(nr_pfns != 0);
+    xen_pfn_t *pfns;
+    unsigned int nr_pfns, max_pfns;
 
     /* Mfns of the batch pfns. */
-    mfns = malloc(nr_pfns * sizeof(*mfns));
+    xen_pfn_t *mfns;
     /* Types of the batch pfns. */
-    types = malloc(nr_pfns * sizeof(*types));
+    xen_pfn_t *types;
     /* Errors from attempting to map the gfns. */
-    errors = malloc(nr_pfns * sizeof(*errors));
+    int *errors;
     /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
+    void **guest_data;
     /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
-    /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    void **local_pages;
+    /* Pfns to be retried later.  Folded into deferred_pages by the writer. */
+    xen_pfn_t *deferred;
+    unsigned int nr_deferred;
+
+    void *guest_mapping;
+    unsigned int nr_pages, nr_pages_mapped;
+
+    /*
+     * Pages elided from the PAGE_DATA record: PAGE_ELIDED_ZERO, or the index
+     * in the batch of an identical page which is sent.  Only allocated if
+     * ctx->save.elide_pages.
+     */
+    unsigned int *elided;
+    unsigned int nr_elided;
+    /* Open-addressed table of batch index + 1, keyed on page_sample(). */
+    unsigned int *dup_table;
+    uint32_t *samples;
+
+    /*
+     * Pages sent in a PAGE_DELTA record rather than the PAGE_DATA record.
+     * Only allocated if ctx->save.compress_ctx, and only used by the writer.
+     */
+    bool *delta;
+    unsigned int nr_delta;
+
+    /* Time spent by prepare_batch() mapping, and then copying the pages. */
+    uint64_t map_ns, copy_ns;
+
+    /* Result of prepare_batch(), when run on a worker thread. */
+    int rc, err;
+    bool ready;
+};
+
+/* At least twice the batch size, and a power of two. */
+#define DUP_TABLE_SIZE(nr) (2U << (32 - __builtin_clz((nr) | 1)))
+
+/*
+ * Room for xc_compression_compress_pages() to encode a full batch, at worst a
+ * page plus 9 bytes of run headers per page.
+ */
+#define COMPRESS_BUF_SIZE (MAX_BATCH_SIZE * (PAGE_SIZE + 9))
+
+/* Values of xc_sr_save_batch.elided[] other than a batch index. */
+#define PAGE_ELIDED_NONE (~0U)
+#define PAGE_ELIDED_ZERO (~1U)
+
+/*
+ * Safe to call more than once: a batch whose allocation failed part way is
+ * freed again when the pipeline is torn down.
+ */
+static void free_batch(struct xc_sr_save_batch *batch)
+{
+    free(batch->delta);
+    free(batch->samples);
+    free(batch->dup_table);
+    free(batch->elided);
+    free(batch->deferred);
+    free(batch->local_pages);
+    free(batch->guest_data);
+    free(batch->errors);
+    free(batch->types);
+    free(batch->mfns);
+
+    batch->delta = NULL;
+    batch->samples = NULL;
+    batch->dup_table = NULL;
+    batch->elided = NULL;
+    batch->deferred = NULL;
+    batch->local_pages = NULL;
+    batch->guest_data = NULL;
+    batch->errors = NULL;
+    batch->types = NULL;
+    batch->mfns = NULL;
+    batch->max_pfns = 0;
+}
+
+static int alloc_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch, unsigned int max_pfns)
+{
+    xc_interface *xch = ctx->xch;
+
+    batch->max_pfns = max_pfns;
+    batch->mfns = malloc(max_pfns * sizeof(*batch->mfns));
+    batch->types = malloc(max_pfns * sizeof(*batch->types));
+    batch->errors = malloc(max_pfns * sizeof(*batch->errors));
+    batch->guest_data = calloc(max_pfns, sizeof(*batch->guest_data));
+    batch->local_pages = calloc(max_pfns, sizeof(*batch->local_pages));
+    batch->deferred = malloc(max_pfns * sizeof(*batch->deferred));
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+    if ( !batch->mfns || !batch->types || !batch->errors ||
+         !batch->guest_data || !batch->local_pages || !batch->deferred )
     {
-        ERROR("Unable to allocate arrays for a batch of %u pages",
-              nr_pfns);
-        goto err;
+        ERROR("Unable to allocate arrays for a batch of %u pages", max_pfns);
+        free_batch(batch);
+        return -1;
+    }
+
+    if ( ctx->save.elide_pages )
+    {
+        batch->elided = malloc(max_pfns * sizeof(*batch->elided));
+        batch->dup_table = malloc(DUP_TABLE_SIZE(max_pfns) *
+                                  sizeof(*batch->dup_table));
+        batch->samples = malloc(max_pfns * sizeof(*batch->samples));
+
+        if ( !batch->elided || !batch->dup_table || !batch->samples )
+        {
+            ERROR("Unable to allocate elision arrays for a batch of %u pages",
+                  max_pfns);
+            free_batch(batch);
+            return -1;
+        }
+    }
+
+    if ( ctx->save.compress_ctx )
+    {
+        batch->delta = malloc(max_pfns * sizeof(*batch->delta));
+
+        if ( !batch->delta )
+        {
+            ERROR("Unable to allocate delta array for a batch of %u pages",
+                  max_pfns);
+            free_batch(batch);
+            return -1;
+        }
     }
 
+    return 0;
+}
+
+/*
+ * Unmap and free everything prepare_batch() obtained, leaving the batch
+ * ready to be filled again.
+ */
+static void release_batch(struct xc_sr_context *ctx,
+                          struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    batch->guest_mapping = NULL;
+    batch->nr_pages_mapped = 0;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        free(batch->local_pages[i]);
+        batch->local_pages[i] = NULL;
+        batch->guest_data[i] = NULL;
+    }
+}
+
+/*
+ * Cheap key for spotting candidate duplicate pages.  Only a few words are
+ * sampled; candidates are always confirmed with memcmp().
+ */
+static uint32_t page_sample(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t h = p[0];
+
+    h = (h ^ p[1]) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ p[PAGE_SIZE / sizeof(*p) / 2]) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ p[PAGE_SIZE / sizeof(*p) - 1]) * 0x9e3779b97f4a7c15ULL;
+
+    return h >> 32;
+}
+
+/*
+ * Find normal pages in a prepared batch which are entirely zero, or identical
+ * to another page in the same batch, and drop their data from the batch.
+ *
+ * The restorer obtains identical pages by copying the data it received for
+ * the first page, so that data is first copied into a local page, which both
+ * pages are then compared against.  Either page changing afterwards
+ * dirties it, so it will be resent.
+ */
+static int elide_pages(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i, slot, mask = DUP_TABLE_SIZE(batch->max_pfns) - 1;
+    unsigned int first;
+    void *copy;
+
+    batch->nr_elided = 0;
+    memset(batch->dup_table, 0,
+           DUP_TABLE_SIZE(batch->max_pfns) * sizeof(*batch->dup_table));
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        batch->elided[i] = PAGE_ELIDED_NONE;
+
+        if ( !batch->guest_data[i] ||
+             batch->types[i] != XEN_DOMCTL_PFINFO_NOTAB )
+            continue;
+
+        if ( page_is_zero(batch->guest_data[i]) )
+        {
+            batch->elided[i] = PAGE_ELIDED_ZERO;
+            goto elided;
+        }
+
+        batch->samples[i] = page_sample(batch->guest_data[i]);
+
+        for ( slot = batch->samples[i] & mask;
+              batch->dup_table[slot]; slot = (slot + 1) & mask )
+        {
+            first = batch->dup_table[slot] - 1;
+
+            if ( batch->samples[first] != batch->samples[i] )
+                continue;
+
+            if ( !batch->local_pages[first] )
+            {
+                copy = malloc(PAGE_SIZE);
+                if ( !copy )
+                {
+                    ERROR("Unable to allocate a page to elide duplicates");
+                    return -1;
+                }
+
+                memcpy(copy, batch->guest_data[first], PAGE_SIZE);
+                batch->local_pages[first] = batch->guest_data[first] = copy;
+            }
+
+            if ( !memcmp(batch->guest_data[i], batch->guest_data[first],
+                         PAGE_SIZE) )
+            {
+                batch->elided[i] = first;
+                goto elided;
+            }
+        }
+
+        batch->dup_table[slot] = i + 1;
+        continue;
+
+    elided:
+        batch->guest_data[i] = NULL;
+        batch->nr_elided++;
+        batch->nr_pages--;
+    }
+
+    return 0;
+}
+
+/*
+ * Obtain the data for a batch of pfns.
+ *
+ * This function:
+ * - gets the types for each pfn in the batch.
+ * - for each pfn with real data:
+ *   - maps and attempts to localise the pages.
+ *
+ * It touches no shared save state other than through read-only ops, so may
+ * be run concurrently for different batches.  Pfns which need retrying are
+ * collected in batch->deferred rather than in ctx->save.deferred_pages.
+ */
+static int prepare_batch(struct xc_sr_context *ctx,
+                         struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = batch->mfns, *types = batch->types;
+    int *errors = batch->errors;
+    int rc;
+    unsigned int i, p, nr_pages = 0;
+    unsigned int nr_pfns = batch->nr_pfns;
+    void *page, *orig_page;
+    uint64_t start = monotonic_ns(), mapped;
+
+    assert(nr_pfns != 0 && nr_pfns <= batch->max_pfns);
+
+    batch->nr_deferred = 0;
+    batch->nr_pages = 0;
+    batch->nr_elided = 0;
+
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, batch->pfns[i]);
 
         /* Likely a ballooned page. */
         if ( mfns[i] == INVALID_MFN )
-        {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
-        }
+            batch->deferred[batch->nr_deferred++] = batch->pfns[i];
     }
 
     rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
     if ( rc )
     {
         PERROR("Failed to get types for pfn batch");
-        goto err;
+        return rc;
     }
-    rc = -1;
 
     for ( i = 0; i < nr_pfns; ++i )
     {
@@ -151,16 +453,19 @@ static int write_batch(struct xc_sr_context *ctx)
         mfns[nr_pages++] = mfns[i];
     }
 
+    mapped = monotonic_ns();
+
     if ( nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(xch->fmem,
+        batch->guest_mapping = xenforeignmemory_map(xch->fmem,
             ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !batch->guest_mapping )
         {
             PERROR("Failed to map guest pages");
-            goto err;
+            return -1;
         }
-        nr_pages_mapped = nr_pages;
+        batch->nr_pages_mapped = nr_pages;
+        mapped = monotonic_ns();
 
         for ( i = 0, p = 0; i < nr_pfns; ++i )
         {
@@ -175,53 +480,224 @@ static int write_batch(struct xc_sr_context *ctx)
             if ( errors[p] )
             {
                 ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
-                goto err;
+                      batch->pfns[i], mfns[p], errors[p]);
+                return -1;
             }
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
+            orig_page = page = batch->guest_mapping + (p * PAGE_SIZE);
             rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
 
             if ( orig_page != page )
-                local_pages[i] = page;
+                batch->local_pages[i] = page;
 
             if ( rc )
             {
                 if ( rc == -1 && errno == EAGAIN )
                 {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    batch->deferred[batch->nr_deferred++] = batch->pfns[i];
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
                 else
-                    goto err;
+                    return -1;
             }
             else
-                guest_data[i] = page;
+                batch->guest_data[i] = page;
 
-            rc = -1;
             ++p;
         }
     }
 
+    batch->nr_pages = nr_pages;
+
+    rc = ctx->save.elide_pages ? elide_pages(ctx, batch) : 0;
+
+    batch->map_ns = mapped - start;
+    batch->copy_ns = monotonic_ns() - mapped;
+
+    return rc;
+}
+
+/*
+ * Write a PAGE_ELIDED record for the pages elide_pages() dropped from a
+ * batch.  Must follow the batch's PAGE_DATA record.
+ */
+static int write_elided_record(struct xc_sr_context *ctx,
+                               struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_elided_header *hdr;
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_PAGE_ELIDED,
+    };
+    unsigned int i, j;
+    int rc;
+
+    rec.length = sizeof(*hdr) + batch->nr_elided * sizeof(hdr->entry[0]);
+    hdr = rec.data = malloc(rec.length);
+    if ( !hdr )
+    {
+        ERROR("Unable to allocate %u bytes for elided page list", rec.length);
+        return -1;
+    }
+
+    hdr->count = batch->nr_elided;
+    hdr->_res1 = 0;
+
+    for ( i = 0, j = 0; i < batch->nr_pfns; ++i )
+    {
+        if ( batch->elided[i] == PAGE_ELIDED_NONE )
+            continue;
+
+        hdr->entry[j].pfn = batch->pfns[i];
+        hdr->entry[j].src = batch->elided[i] == PAGE_ELIDED_ZERO
+            ? PAGE_ELIDED_SRC_ZERO : batch->pfns[batch->elided[i]];
+        ++j;
+    }
+
+    rc = write_record(ctx, &rec);
+    free(hdr);
+
+    return rc;
+}
+
+/*
+ * Choose which pages of a prepared batch to send as deltas.  Only normal
+ * pages are eligible, and only once ctx->save.send_deltas is set, so the
+ * cache is not churned by the first pass over all of memory.  Every other
+ * page of the batch is dropped from the cache, as the restorer's copy of it
+ * will no longer match.
+ */
+static int select_delta_pages(struct xc_sr_context *ctx,
+                              struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+
+    batch->nr_delta = 0;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        batch->delta[i] = ctx->save.send_deltas && batch->guest_data[i] &&
+            batch->types[i] == XEN_DOMCTL_PFINFO_NOTAB;
+
+        if ( batch->delta[i] )
+            batch->nr_delta++;
+        else if ( xc_compression_invalidate_page(xch, ctx->save.compress_ctx,
+                                                 batch->pfns[i]) )
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write a PAGE_DELTA record for the pages select_delta_pages() chose.  Must
+ * follow the batch's PAGE_DATA record, and precede any PAGE_ELIDED record,
+ * as elided duplicates may be copied from these pages.
+ */
+static int write_delta_record(struct xc_sr_context *ctx,
+                              struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    comp_ctx *cctx = ctx->save.compress_ctx;
+    struct xc_sr_rec_page_delta_header *hdr;
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_PAGE_DELTA,
+    };
+    unsigned long len = 0;
+    unsigned int i, j;
+    int rc = -1;
+
+    rec.length = sizeof(*hdr) + batch->nr_delta * sizeof(hdr->pfn[0]);
+    hdr = rec.data = malloc(rec.length);
+    if ( !hdr )
+    {
+        ERROR("Unable to allocate %u bytes for delta page list", rec.length);
+        return -1;
+    }
+
+    hdr->count = batch->nr_delta;
+    hdr->_res1 = 0;
+
+    for ( i = 0, j = 0; i < batch->nr_pfns; ++i )
+    {
+        if ( !batch->delta[i] )
+            continue;
+
+        hdr->pfn[j++] = batch->pfns[i];
+
+        if ( xc_compression_add_page(xch, cctx, batch->guest_data[i],
+                                     batch->pfns[i], 0) )
+        {
+            ERROR("Unable to add pfn %#"PRIpfn" to the delta page buffer",
+                  batch->pfns[i]);
+            goto err;
+        }
+    }
+
+    /* compress_buf has room for the worst case of every page changing. */
+    if ( xc_compression_compress_pages(xch, cctx, ctx->save.compress_buf,
+                                       COMPRESS_BUF_SIZE, &len) != 1 )
+    {
+        ERROR("Unable to delta compress %u pages", batch->nr_delta);
+        goto err;
+    }
+
+    rc = write_split_record(ctx, &rec, ctx->save.compress_buf, len);
+
+ err:
+    xc_compression_reset_pagebuf(xch, cctx);
+    free(hdr);
+
+    return rc;
+}
+
+/*
+ * Construct and write a PAGE_DATA record for a prepared batch into the
+ * stream, leaving out elided pages and pages to be sent as deltas.
+ */
+static int write_page_data_record(struct xc_sr_context *ctx,
+                                  struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i, nr_pfns = batch->nr_pfns;
+    unsigned int nr_pages = batch->nr_pages - batch->nr_delta;
+    uint64_t *rec_pfns = NULL;
+    struct iovec *iov = NULL; int iovcnt = 0;
+    struct xc_sr_rec_page_data_header hdr = { 0 };
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_PAGE_DATA,
+    };
+    int rc = -1;
+
+    /* iovec[] for writev(). */
+    iov = malloc((nr_pfns + 4) * sizeof(*iov));
     rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    if ( !iov || !rec_pfns )
     {
         ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
               nr_pfns * sizeof(*rec_pfns));
         goto err;
     }
 
-    hdr.count = nr_pfns;
+    for ( i = 0; i < nr_pfns; ++i )
+    {
+        if ( (batch->nr_elided && batch->elided[i] != PAGE_ELIDED_NONE) ||
+             (batch->nr_delta && batch->delta[i]) )
+            continue;
+
+        rec_pfns[hdr.count++] =
+            ((uint64_t)(batch->types[i]) << 32) | batch->pfns[i];
+    }
 
     rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
+    rec.length += hdr.count * sizeof(*rec_pfns);
     rec.length += nr_pages * PAGE_SIZE;
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
-
     iov[0].iov_base = &rec.type;
     iov[0].iov_len = sizeof(rec.type);
 
@@ -232,7 +708,7 @@ static int write_batch(struct xc_sr_context *ctx)
     iov[2].iov_len = sizeof(hdr);
 
     iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    iov[3].iov_len = hdr.count * sizeof(*rec_pfns);
 
     iovcnt = 4;
 
@@ -240,9 +716,10 @@ static int write_batch(struct xc_sr_context *ctx)
     {
         for ( i = 0; i < nr_pfns; ++i )
         {
-            if ( guest_data[i] )
+            if ( batch->guest_data[i] &&
+                 !(batch->nr_delta && batch->delta[i]) )
             {
-                iov[iovcnt].iov_base = guest_data[i];
+                iov[iovcnt].iov_base = batch->guest_data[i];
                 iov[iovcnt].iov_len = PAGE_SIZE;
                 iovcnt++;
                 --nr_pages;
@@ -255,34 +732,309 @@ static int write_batch(struct xc_sr_context *ctx)
         PERROR("Failed to write page data to stream");
         goto err;
     }
+    ctx->save.iter_stats.bytes_written += sizeof(rec.type) +
+                                          sizeof(rec.length) + rec.length;
 
     /* Sanity check we have sent all the pages we expected to. */
     assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
+
+    rc = 0;
 
  err:
     free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
     free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
 
     return rc;
 }
 
+/*
+ * Write the records for a prepared batch into the stream: PAGE_DATA for the
+ * pages sent in full, then PAGE_DELTA and PAGE_ELIDED for those which are
+ * not.  Must be called in stream order.
+ */
+static int write_batch_record(struct xc_sr_context *ctx,
+                              struct xc_sr_save_batch *batch)
+{
+    struct save_iteration_stats *stats = &ctx->save.iter_stats;
+    uint64_t start = monotonic_ns();
+    unsigned int i;
+    int rc = 0;
+
+    for ( i = 0; i < batch->nr_deferred; ++i )
+        set_bit(batch->deferred[i], ctx->save.deferred_pages);
+    ctx->save.nr_deferred_pages += batch->nr_deferred;
+
+    batch->nr_delta = 0;
+    if ( ctx->save.compress_ctx )
+        rc = select_delta_pages(ctx, batch);
+
+    if ( !rc && batch->nr_elided + batch->nr_delta < batch->nr_pfns )
+        rc = write_page_data_record(ctx, batch);
+
+    if ( !rc && batch->nr_delta )
+        rc = write_delta_record(ctx, batch);
+
+    if ( !rc && batch->nr_elided )
+        rc = write_elided_record(ctx, batch);
+
+    stats->pages_sent += batch->nr_pfns;
+    stats->map_ns += batch->map_ns;
+    stats->copy_ns += batch->copy_ns;
+    stats->write_ns += monotonic_ns() - start;
+
+    return rc;
+}
+
+/*
+ * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
+ * is constructed in ctx->save.batch_pfns.
+ */
+static int write_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch batch = { .pfns = ctx->save.batch_pfns };
+    int rc;
+
+    rc = alloc_batch(ctx, &batch, ctx->save.nr_batch_pfns);
+    if ( rc )
+        return rc;
+
+    batch.nr_pfns = ctx->save.nr_batch_pfns;
+
+    rc = prepare_batch(ctx, &batch);
+    if ( !rc )
+        rc = write_batch_record(ctx, &batch);
+
+    release_batch(ctx, &batch);
+    free_batch(&batch);
+
+    if ( !rc )
+        ctx->save.nr_batch_pfns = 0;
+
+    return rc;
+}
+
+/*
+ * Parallel page sender.
+ *
+ * With ctx->save.nr_workers non-zero, batches of pfns are handed to a pool of
+ * worker threads which run prepare_batch() concurrently, while the saving
+ * thread acts as the single writer, emitting PAGE_DATA records strictly in
+ * the order the batches were queued.  The stream is therefore identical to
+ * that of the serial path.
+ *
+ * Slots form a ring.  'queued' counts batches handed to the workers,
+ * 'dispatched' those picked up by a worker and 'written' those emitted into
+ * the stream, so written <= dispatched <= queued <= written + nr_slots.
+ * Only the saving thread modifies 'queued' and 'written'.
+ */
+struct xc_sr_save_pipeline
+{
+    pthread_mutex_t lock;
+    /* Signalled when a batch is queued, or on shutdown. */
+    pthread_cond_t work_cond;
+    /* Signalled when a worker has finished preparing a batch. */
+    pthread_cond_t done_cond;
+
+    pthread_t *threads;
+    unsigned int nr_threads;
+
+    struct xc_sr_save_batch *slots;
+    unsigned int nr_slots;
+
+    unsigned long queued, dispatched, written;
+    bool stop;
+};
+
+static void *pipeline_worker(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
+
+    pthread_mutex_lock(&pl->lock);
+    for ( ; ; )
+    {
+        while ( !pl->stop && pl->dispatched == pl->queued )
+            pthread_cond_wait(&pl->work_cond, &pl->lock);
+
+        if ( pl->stop )
+            break;
+
+        batch = &pl->slots[pl->dispatched++ % pl->nr_slots];
+        pthread_mutex_unlock(&pl->lock);
+
+        batch->rc = prepare_batch(ctx, batch);
+        batch->err = errno;
+
+        pthread_mutex_lock(&pl->lock);
+        batch->ready = true;
+        pthread_cond_broadcast(&pl->done_cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+static void pipeline_destroy(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    unsigned int i;
+
+    if ( !pl )
+        return;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->stop = true;
+    pthread_cond_broadcast(&pl->work_cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    for ( i = 0; i < pl->nr_threads; ++i )
+        pthread_join(pl->threads[i], NULL);
+
+    for ( i = 0; i < pl->nr_slots; ++i )
+    {
+        release_batch(ctx, &pl->slots[i]);
+        free_batch(&pl->slots[i]);
+        free(pl->slots[i].pfns);
+    }
+
+    pthread_cond_destroy(&pl->done_cond);
+    pthread_cond_destroy(&pl->work_cond);
+    pthread_mutex_destroy(&pl->lock);
+
+    free(pl->slots);
+    free(pl->threads);
+    free(pl);
+    ctx->save.pipeline = NULL;
+}
+
+static int pipeline_create(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pipeline *pl;
+    unsigned int i;
+    int rc;
+
+    pl = calloc(1, sizeof(*pl));
+    if ( !pl )
+        goto enomem;
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->work_cond, NULL);
+    pthread_cond_init(&pl->done_cond, NULL);
+    ctx->save.pipeline = pl;
+
+    /* Two batches per worker keeps the workers busy while the writer runs. */
+    pl->slots = calloc(2 * ctx->save.nr_workers, sizeof(*pl->slots));
+    pl->threads = calloc(ctx->save.nr_workers, sizeof(*pl->threads));
+    if ( !pl->slots || !pl->threads )
+        goto enomem;
+    pl->nr_slots = 2 * ctx->save.nr_workers;
+
+    for ( i = 0; i < pl->nr_slots; ++i )
+    {
+        pl->slots[i].pfns = malloc(MAX_BATCH_SIZE * sizeof(*pl->slots[i].pfns));
+        if ( !pl->slots[i].pfns ||
+             alloc_batch(ctx, &pl->slots[i], MAX_BATCH_SIZE) )
+            goto enomem;
+    }
+
+    for ( i = 0; i < ctx->save.nr_workers; ++i )
+    {
+        rc = pthread_create(&pl->threads[i], NULL, pipeline_worker, ctx);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to create page sender thread %u", i);
+            return -1;
+        }
+        pl->nr_threads++;
+    }
+
+    DPRINTF("Using %u page sender threads", pl->nr_threads);
+
+    return 0;
+
+ enomem:
+    ERROR("Unable to allocate memory for %u page sender threads",
+          ctx->save.nr_workers);
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * Write the oldest outstanding batch into the stream, waiting for a worker
+ * to finish preparing it if necessary.
+ */
+static int pipeline_write_one(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch = &pl->slots[pl->written % pl->nr_slots];
+    int rc;
+
+    assert(pl->written != pl->queued);
+
+    pthread_mutex_lock(&pl->lock);
+    while ( !batch->ready )
+        pthread_cond_wait(&pl->done_cond, &pl->lock);
+    pthread_mutex_unlock(&pl->lock);
+
+    if ( batch->rc )
+    {
+        rc = batch->rc;
+        errno = batch->err;
+    }
+    else
+        rc = write_batch_record(ctx, batch);
+
+    release_batch(ctx, batch);
+    batch->ready = false;
+    batch->nr_pfns = 0;
+    pl->written++;
+
+    return rc;
+}
+
+/*
+ * Hand the batch being filled to the workers.  If every slot is then in
+ * flight, write out the oldest to make room for the next batch.
+ */
+static int pipeline_queue(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+
+    if ( pl->slots[pl->queued % pl->nr_slots].nr_pfns == 0 )
+        return 0;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->queued++;
+    pthread_cond_signal(&pl->work_cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    if ( pl->queued - pl->written == pl->nr_slots )
+        return pipeline_write_one(ctx);
+
+    return 0;
+}
+
 /*
  * Flush a batch of pfns into the stream.
  */
 static int flush_batch(struct xc_sr_context *ctx)
 {
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
     int rc = 0;
 
+    if ( pl )
+    {
+        rc = pipeline_queue(ctx);
+
+        while ( !rc && pl->written != pl->queued )
+            rc = pipeline_write_one(ctx);
+
+        return rc;
+    }
+
     if ( ctx->save.nr_batch_pfns == 0 )
         return rc;
 
@@ -303,8 +1055,21 @@ static int flush_batch(struct xc_sr_context *ctx)
  */
 static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
 {
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
     int rc = 0;
 
+    if ( pl )
+    {
+        batch = &pl->slots[pl->queued % pl->nr_slots];
+        batch->pfns[batch->nr_pfns++] = pfn;
+
+        if ( batch->nr_pfns == MAX_BATCH_SIZE )
+            rc = pipeline_queue(ctx);
+
+        return rc;
+    }
+
     if ( ctx->save.nr_batch_pfns == MAX_BATCH_SIZE )
         rc = flush_batch(ctx);
 
@@ -354,6 +1119,44 @@ static int suspend_domain(struct xc_sr_context *ctx)
     return 0;
 }
 
+/*
+ * Complete the statistics for the iteration just sent, now that the number of
+ * pages dirtied meanwhile is known, and pass them to the toolstack.
+ */
+static void report_iteration_stats(struct xc_sr_context *ctx,
+                                   uint64_t dirty_count, bool suspended)
+{
+    xc_interface *xch = ctx->xch;
+    struct save_iteration_stats *stats = &ctx->save.iter_stats;
+    uint64_t now = monotonic_ns();
+    unsigned int iteration = stats->iteration;
+
+    stats->suspended = suspended;
+    stats->dirty_count = dirty_count;
+    stats->elapsed_ns = now - ctx->save.iter_start;
+    stats->send_rate = page_rate(stats->pages_sent, stats->elapsed_ns);
+    stats->dirty_rate = suspended ? 0 : page_rate(dirty_count,
+                                                  stats->elapsed_ns);
+    stats->downtime_ms = stats->send_rate
+        ? dirty_count * 1000 / stats->send_rate : 0;
+
+    DPRINTF("Iteration %u: %"PRIu64" pages, %"PRIu64" bytes in %"PRIu64
+            "ms (map %"PRIu64"ms, copy %"PRIu64"ms, write %"PRIu64"ms), "
+            "%"PRIu64" dirty, projected downtime %"PRIu64"ms",
+            iteration, stats->pages_sent, stats->bytes_written,
+            stats->elapsed_ns / 1000000, stats->map_ns / 1000000,
+            stats->copy_ns / 1000000, stats->write_ns / 1000000,
+            dirty_count, stats->downtime_ms);
+
+    if ( ctx->save.callbacks->iteration_stats )
+        ctx->save.callbacks->iteration_stats(stats,
+                                             ctx->save.callbacks->data);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->iteration = iteration + 1;
+    ctx->save.iter_start = now;
+}
+
 /*
  * Send a subset of pages in the guests p2m, according to the dirty bitmap.
  * Used for each subsequent iteration of the live migration loop.
@@ -365,31 +1168,73 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
 {
     xc_interface *xch = ctx->xch;
     xen_pfn_t p;
-    unsigned long written;
+    unsigned long i, written = 0;
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
-    for ( p = 0, written = 0; p < ctx->save.p2m_size; ++p )
+    if ( ctx->save.dirty_ring.pending )
     {
-        if ( !test_bit(p, dirty_bitmap) )
-            continue;
+        /*
+         * The bitmap holds nothing but the harvested GFNs: send those and
+         * leave the bitmap clear, without walking it.
+         */
+        for ( i = 0; i < ctx->save.dirty_ring.nr_gfns; ++i )
+        {
+            p = ctx->save.dirty_ring.gfns[i];
+            if ( !test_and_clear_bit(p, dirty_bitmap) )
+                continue;
 
-        rc = add_to_batch(ctx, p);
-        if ( rc )
-            return rc;
+            rc = add_to_batch(ctx, p);
+            if ( rc )
+                return rc;
+
+            if ( (written & ((1U << (22 - 12)) - 1)) == 0 )
+                xc_report_progress_step(xch, written, entries);
+
+            ++written;
+        }
+
+        ctx->save.dirty_ring.pending = false;
+        ctx->save.dirty_ring.nr_gfns = 0;
+    }
+    else
+    {
+        for ( p = 0; p < ctx->save.p2m_size; ++p )
+        {
+            /* Skip whole words of clean pages. */
+            if ( !dirty_bitmap[p / BITS_PER_LONG] )
+            {
+                p |= BITS_PER_LONG - 1;
+                continue;
+            }
+
+            if ( !test_bit(p, dirty_bitmap) )
+                continue;
 
-        /* Update progress every 4MB worth of memory sent. */
-        if ( (written & ((1U << (22 - 12)) - 1)) == 0 )
-            xc_report_progress_step(xch, written, entries);
+            rc = add_to_batch(ctx, p);
+            if ( rc )
+                return rc;
+
+            /* Update progress every 4MB worth of memory sent. */
+            if ( (written & ((1U << (22 - 12)) - 1)) == 0 )
+                xc_report_progress_step(xch, written, entries);
+
+            ++written;
+        }
 
-        ++written;
+        /* Harvests only set the bits of the GFNs they return. */
+        if ( ctx->save.dirty_ring.enabled )
+            bitmap_clear(dirty_bitmap, ctx->save.p2m_size);
     }
 
     rc = flush_batch(ctx);
     if ( rc )
         return rc;
 
+    /* Every page the restorer has from now on is also in the delta cache. */
+    ctx->save.send_deltas = true;
+
     if ( written > entries )
         DPRINTF("Bitmap contained more entries than expected...");
 
@@ -398,30 +1243,163 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
     return ctx->save.ops.check_vm_state(ctx);
 }
 
-/*
- * Send all pages in the guests p2m.  Used as the first iteration of the live
- * migration loop, and for a non-live save.
- */
-static int send_all_pages(struct xc_sr_context *ctx)
-{
-    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
-                                    &ctx->save.dirty_bitmap_hbuf);
+/*
+ * Send all pages in the guests p2m.  Used as the first iteration of the live
+ * migration loop, and for a non-live save.
+ */
+static int send_all_pages(struct xc_sr_context *ctx)
+{
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    bitmap_set(dirty_bitmap, ctx->save.p2m_size);
+
+    return send_dirty_pages(ctx, ctx->save.p2m_size);
+}
+
+/* GFNs to harvest from dirty rings per hypercall. */
+#define DIRTY_RING_BATCH 65536
+
+static int add_dirty_gfn(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *gfns;
+    unsigned long max_gfns;
+
+    if ( ctx->save.dirty_ring.nr_gfns == ctx->save.dirty_ring.max_gfns )
+    {
+        max_gfns = ctx->save.dirty_ring.max_gfns * 2 ?: DIRTY_RING_BATCH;
+        gfns = realloc(ctx->save.dirty_ring.gfns, max_gfns * sizeof(*gfns));
+        if ( !gfns )
+        {
+            ERROR("Unable to allocate memory for %lu dirty GFNs", max_gfns);
+            return -1;
+        }
+        ctx->save.dirty_ring.gfns = gfns;
+        ctx->save.dirty_ring.max_gfns = max_gfns;
+    }
+
+    ctx->save.dirty_ring.gfns[ctx->save.dirty_ring.nr_gfns++] = pfn;
+
+    return 0;
+}
+
+/*
+ * Fetch the pages dirtied since the previous call into the dirty bitmap, and
+ * clean Xen's log for the next round.  In ring mode, only the bits of the
+ * harvested GFNs are set, and the GFNs listed in ctx->save.dirty_ring.
+ */
+static int clean_dirty_bitmap(struct xc_sr_context *ctx, uint32_t mode,
+                              xc_shadow_op_stats_t *stats)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t p;
+    unsigned long i, nr_ring;
+    int nr;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, gfns,
+                                    &ctx->save.dirty_ring.hbuf);
+
+    if ( !ctx->save.dirty_ring.enabled )
+    {
+        if ( xc_shadow_control(
+                 xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+                 &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
+                 NULL, mode, stats) != ctx->save.p2m_size )
+        {
+            PERROR("Failed to retrieve logdirty bitmap");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    ctx->save.dirty_ring.nr_gfns = 0;
+
+    do {
+        nr = xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_HARVEST,
+                               &ctx->save.dirty_ring.hbuf, DIRTY_RING_BATCH,
+                               NULL, mode, stats);
+        if ( nr < 0 )
+        {
+            PERROR("Failed to harvest dirty rings");
+            return -1;
+        }
+
+        for ( i = 0; i < nr; ++i )
+        {
+            p = gfns[i];
+            if ( p >= ctx->save.p2m_size || test_and_set_bit(p, dirty_bitmap) )
+                continue;
+
+            if ( add_dirty_gfn(ctx, p) )
+                return -1;
+        }
+    } while ( nr == DIRTY_RING_BATCH );
+
+    /*
+     * Pages which didn't fit in a ring were logged in the bitmap.  Fetching
+     * it overwrites ours, so list its pages and set the rings' bits again.
+     * Xen then cleans for the next round here, rather than when the last
+     * harvest emptied the rings.
+     */
+    if ( stats->dirty_count )
+    {
+        nr_ring = ctx->save.dirty_ring.nr_gfns;
+
+        if ( xc_shadow_control(
+                 xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+                 &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
+                 NULL, mode, NULL) != ctx->save.p2m_size )
+        {
+            PERROR("Failed to retrieve logdirty bitmap");
+            return -1;
+        }
+
+        for ( p = 0; p < ctx->save.p2m_size; ++p )
+        {
+            if ( !dirty_bitmap[p / BITS_PER_LONG] )
+            {
+                p |= BITS_PER_LONG - 1;
+                continue;
+            }
+
+            if ( test_bit(p, dirty_bitmap) && add_dirty_gfn(ctx, p) )
+                return -1;
+        }
+
+        for ( i = 0; i < nr_ring; ++i )
+            set_bit(ctx->save.dirty_ring.gfns[i], dirty_bitmap);
+    }
 
-    bitmap_set(dirty_bitmap, ctx->save.p2m_size);
+    stats->dirty_count = ctx->save.dirty_ring.nr_gfns;
 
-    return send_dirty_pages(ctx, ctx->save.p2m_size);
+    return 0;
 }
 
 static int enable_logdirty(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
     int on1 = 0, off = 0, on2 = 0;
+    uint32_t mode = XEN_DOMCTL_SHADOW_LOGDIRTY_RING;
     int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, gfns,
+                                    &ctx->save.dirty_ring.hbuf);
 
-    /* This juggling is required if logdirty is enabled for VRAM tracking. */
+    /* Prefer dirty rings, where Xen supports them for this guest. */
     rc = xc_shadow_control(xch, ctx->domid,
                            XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
-                           NULL, 0, NULL, 0, NULL);
+                           NULL, 0, NULL, mode, NULL);
+    if ( rc < 0 && errno == EOPNOTSUPP )
+    {
+        mode = 0;
+        rc = xc_shadow_control(xch, ctx->domid,
+                               XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                               NULL, 0, NULL, mode, NULL);
+    }
+
+    /* This juggling is required if logdirty is enabled for VRAM tracking. */
     if ( rc < 0 )
     {
         on1 = errno;
@@ -432,7 +1410,7 @@ static int enable_logdirty(struct xc_sr_context *ctx)
         else {
             rc = xc_shadow_control(xch, ctx->domid,
                                    XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
-                                   NULL, 0, NULL, 0, NULL);
+                                   NULL, 0, NULL, mode, NULL);
             if ( rc < 0 )
                 on2 = errno;
         }
@@ -443,6 +1421,23 @@ static int enable_logdirty(struct xc_sr_context *ctx)
         }
     }
 
+    /* Older versions of Xen ignore the mode, and can't harvest. */
+    if ( mode &&
+         xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_HARVEST,
+                           NULL, 0, NULL, 0, NULL) == 0 )
+    {
+        gfns = xc_hypercall_buffer_alloc_pages(
+                   xch, gfns, NRPAGES(DIRTY_RING_BATCH * sizeof(*gfns)));
+        if ( !gfns )
+        {
+            ERROR("Unable to allocate memory to harvest dirty rings");
+            return -1;
+        }
+
+        ctx->save.dirty_ring.enabled = true;
+        DPRINTF("Logging dirty pages in rings");
+    }
+
     return 0;
 }
 
@@ -487,6 +1482,183 @@ static int simple_precopy_policy(struct precopy_stats stats, void *user)
         : XGS_POLICY_CONTINUE_PRECOPY;
 }
 
+/*
+ * Auto-converge.
+ *
+ * With XCFLAGS_AUTO_CONVERGE, the precopy phase measures the rate pages are
+ * sent at, and the rate the guest dirties them at.  While the guest dirties
+ * memory faster than it can be sent, its vcpus are progressively capped
+ * through the scheduler.  Unless the caller supplies its own precopy policy,
+ * precopy ends as soon as the remaining dirty pages are projected to be sent
+ * within the downtime target.  The original cap is reinstated by cleanup().
+ */
+#define AC_DEFAULT_MAX_DOWNTIME_MS 300
+#define AC_MAX_ITERATIONS           30
+#define AC_INITIAL_THROTTLE         20
+#define AC_THROTTLE_STEP            10
+#define AC_MAX_THROTTLE             99
+
+static int get_sched_cap(struct xc_sr_context *ctx, uint16_t *cap)
+{
+    xc_interface *xch = ctx->xch;
+    struct xen_domctl_sched_credit credit;
+    struct xen_domctl_sched_credit2 credit2;
+    int rc = -1;
+
+    switch ( ctx->save.converge.sched_id )
+    {
+    case XEN_SCHEDULER_CREDIT:
+        rc = xc_sched_credit_domain_get(xch, ctx->domid, &credit);
+        *cap = credit.cap;
+        break;
+
+    case XEN_SCHEDULER_CREDIT2:
+        rc = xc_sched_credit2_domain_get(xch, ctx->domid, &credit2);
+        *cap = credit2.cap;
+        break;
+    }
+
+    if ( rc )
+        PERROR("Unable to get scheduler cap for domain %u", ctx->domid);
+
+    return rc;
+}
+
+static int set_sched_cap(struct xc_sr_context *ctx, uint16_t cap)
+{
+    xc_interface *xch = ctx->xch;
+    struct xen_domctl_sched_credit credit;
+    struct xen_domctl_sched_credit2 credit2;
+    int rc = -1;
+
+    switch ( ctx->save.converge.sched_id )
+    {
+    case XEN_SCHEDULER_CREDIT:
+        rc = xc_sched_credit_domain_get(xch, ctx->domid, &credit);
+        if ( rc )
+            break;
+        credit.cap = cap;
+        rc = xc_sched_credit_domain_set(xch, ctx->domid, &credit);
+        break;
+
+    case XEN_SCHEDULER_CREDIT2:
+        rc = xc_sched_credit2_domain_get(xch, ctx->domid, &credit2);
+        if ( rc )
+            break;
+        credit2.cap = cap;
+        rc = xc_sched_credit2_domain_set(xch, ctx->domid, &credit2);
+        break;
+    }
+
+    if ( rc )
+        PERROR("Unable to set scheduler cap %u for domain %u",
+               cap, ctx->domid);
+
+    return rc;
+}
+
+/*
+ * Find the domain's scheduler, and its cap to be reinstated.  Throttling is
+ * skipped for schedulers without caps, but the downtime target still
+ * applies.
+ */
+static int auto_converge_setup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xc_cpupoolinfo_t *info;
+
+    info = xc_cpupool_getinfo(xch, ctx->dominfo.cpupool);
+    if ( !info || info->cpupool_id != ctx->dominfo.cpupool )
+    {
+        PERROR("Unable to get info for cpupool %u", ctx->dominfo.cpupool);
+        xc_cpupool_infofree(xch, info);
+        return -1;
+    }
+
+    ctx->save.converge.sched_id = info->sched_id;
+    xc_cpupool_infofree(xch, info);
+
+    switch ( ctx->save.converge.sched_id )
+    {
+    case XEN_SCHEDULER_CREDIT:
+    case XEN_SCHEDULER_CREDIT2:
+        return get_sched_cap(ctx, &ctx->save.converge.orig_cap);
+
+    default:
+        IPRINTF("Scheduler %u has no caps: not throttling domain %u",
+                ctx->save.converge.sched_id, ctx->domid);
+        ctx->save.converge.sched_id = 0;
+        return 0;
+    }
+}
+
+/*
+ * Called with the dirty count of each round of precopy.  Throttle the guest
+ * harder if it dirtied pages faster than the last round sent them.
+ */
+static int auto_converge_throttle(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int throttle = ctx->save.converge.throttle;
+    unsigned long full;
+    uint16_t cap;
+
+    if ( !ctx->save.converge.sched_id ||
+         ctx->save.converge.dirty_rate <= ctx->save.converge.send_rate ||
+         throttle == AC_MAX_THROTTLE )
+        return 0;
+
+    throttle = throttle ? throttle + AC_THROTTLE_STEP : AC_INITIAL_THROTTLE;
+    if ( throttle > AC_MAX_THROTTLE )
+        throttle = AC_MAX_THROTTLE;
+
+    /* Caps are percentages of one pcpu, across all of the domain's vcpus. */
+    full = ctx->save.converge.orig_cap ?:
+        min_t(unsigned long, ctx->dominfo.max_vcpu_id + 1, UINT16_MAX / 100)
+        * 100;
+    cap = max_t(unsigned long, full * (100 - throttle) / 100, 1);
+
+    IPRINTF("Dirty rate %"PRIu64" pages/s exceeds send rate %"PRIu64
+            " pages/s: throttling vcpus by %u%% (cap %u)",
+            ctx->save.converge.dirty_rate, ctx->save.converge.send_rate,
+            throttle, cap);
+
+    if ( set_sched_cap(ctx, cap) )
+        return -1;
+
+    ctx->save.converge.throttle = throttle;
+
+    return 0;
+}
+
+static void auto_converge_cleanup(struct xc_sr_context *ctx)
+{
+    if ( ctx->save.converge.throttle )
+        set_sched_cap(ctx, ctx->save.converge.orig_cap);
+    ctx->save.converge.throttle = 0;
+}
+
+/*
+ * Precopy policy used with auto-converge when the caller has none.  As
+ * simple_precopy_policy(), but stopping as soon as the projected downtime
+ * meets the target, and allowing more iterations for throttling to take
+ * effect.
+ */
+static int auto_converge_policy(struct precopy_stats stats, void *user)
+{
+    struct xc_sr_context *ctx = user;
+    uint64_t send_rate = ctx->save.converge.send_rate;
+
+    if ( stats.dirty_count >= 0 &&
+         (stats.dirty_count < SPP_TARGET_DIRTY_COUNT ||
+          (send_rate && stats.dirty_count * 1000ULL / send_rate <=
+           ctx->save.converge.max_downtime_ms)) )
+        return XGS_POLICY_STOP_AND_COPY;
+
+    return stats.iteration >= AC_MAX_ITERATIONS
+        ? XGS_POLICY_STOP_AND_COPY : XGS_POLICY_CONTINUE_PRECOPY;
+}
+
 /*
  * Send memory while guest is running.
  */
@@ -504,6 +1676,7 @@ static int send_memory_live(struct xc_sr_context *ctx)
 
     precopy_policy_t precopy_policy = ctx->save.callbacks->precopy_policy;
     void *data = ctx->save.callbacks->data;
+    uint64_t start, end, last_clean;
 
     struct precopy_stats *policy_stats;
 
@@ -515,10 +1688,16 @@ static int send_memory_live(struct xc_sr_context *ctx)
         { .dirty_count   = ctx->save.p2m_size };
     policy_stats = &ctx->save.stats;
 
-    if ( precopy_policy == NULL )
+    if ( precopy_policy == NULL && ctx->save.auto_converge )
+    {
+        precopy_policy = auto_converge_policy;
+        data = ctx;
+    }
+    else if ( precopy_policy == NULL )
          precopy_policy = simple_precopy_policy;
 
     bitmap_set(dirty_bitmap, ctx->save.p2m_size);
+    last_clean = monotonic_ns();
 
     for ( ; ; )
     {
@@ -531,9 +1710,14 @@ static int send_memory_live(struct xc_sr_context *ctx)
             if ( rc )
                 goto out;
 
+            start = monotonic_ns();
             rc = send_dirty_pages(ctx, stats.dirty_count);
             if ( rc )
                 goto out;
+            end = monotonic_ns();
+
+            ctx->save.converge.send_rate =
+                page_rate(stats.dirty_count, end - start);
         }
 
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
@@ -548,18 +1732,30 @@ static int send_memory_live(struct xc_sr_context *ctx)
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
            break;
 
-        if ( xc_shadow_control(
-                 xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
-                 &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
-                 NULL, 0, &stats) != ctx->save.p2m_size )
+        if ( clean_dirty_bitmap(ctx, 0, &stats) )
         {
-            PERROR("Failed to retrieve logdirty bitmap");
             rc = -1;
             goto out;
         }
 
+        /* In ring mode, the next round needs not walk the whole bitmap. */
+        ctx->save.dirty_ring.pending = ctx->save.dirty_ring.enabled;
+
         policy_stats->dirty_count = stats.dirty_count;
 
+        end = monotonic_ns();
+        ctx->save.converge.dirty_rate =
+            page_rate(stats.dirty_count, end - last_clean);
+        last_clean = end;
+
+        report_iteration_stats(ctx, stats.dirty_count, false);
+
+        if ( ctx->save.auto_converge )
+        {
+            rc = auto_converge_throttle(ctx);
+            if ( rc )
+                goto out;
+        }
     }
 
  out:
@@ -620,6 +1816,211 @@ static int colo_merge_secondary_dirty_bitmap(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Post-copy.
+ *
+ * With XCFLAGS_POSTCOPY, the pages still dirty once the domain has been
+ * suspended are not sent ahead of the rest of its state.  They are listed in
+ * POSTCOPY_BEGIN records instead, and sent after a POSTCOPY_TRANSITION
+ * record and the device model state, upon which the restorer resumes the
+ * guest.  Pages the guest faults on are requested in POSTCOPY_PFN_REQUEST
+ * records on the back channel, and sent ahead of the remainder, which is
+ * pushed in pfn order.
+ *
+ * Past the transition, the domain must never be resumed here, as it may
+ * already be running on the restoring side.
+ *
+ * The outstanding pages are tracked in the dirty bitmap, which log-dirty has
+ * no further use for once the domain is suspended.
+ */
+#define POSTCOPY_PFNS_PER_RECORD (1U << 20)
+
+static int write_postcopy_begin(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_BEGIN };
+    uint64_t *pfns;
+    unsigned int nr = 0;
+    xen_pfn_t p;
+    int rc = 0;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    pfns = malloc(POSTCOPY_PFNS_PER_RECORD * sizeof(*pfns));
+    if ( !pfns )
+    {
+        ERROR("Unable to allocate memory for post-copy pfn list");
+        return -1;
+    }
+
+    ctx->save.nr_postcopy_pfns = 0;
+    rec.data = pfns;
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( !test_bit(p, dirty_bitmap) )
+            continue;
+
+        pfns[nr++] = p;
+        ctx->save.nr_postcopy_pfns++;
+
+        if ( nr == POSTCOPY_PFNS_PER_RECORD )
+        {
+            rec.length = nr * sizeof(*pfns);
+            rc = write_record(ctx, &rec);
+            if ( rc )
+                goto out;
+            nr = 0;
+        }
+    }
+
+    /* Always send at least one record, so the restorer expects post-copy. */
+    if ( nr || ctx->save.nr_postcopy_pfns == 0 )
+    {
+        rec.length = nr * sizeof(*pfns);
+        rc = write_record(ctx, &rec);
+        if ( rc )
+            goto out;
+    }
+
+    IPRINTF("Deferring %lu pages until after the guest has resumed",
+            ctx->save.nr_postcopy_pfns);
+
+ out:
+    free(pfns);
+    return rc;
+}
+
+/*
+ * Send the outstanding pages asked for on the back channel, without blocking
+ * if there are no requests.
+ */
+static int handle_postcopy_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    struct xc_sr_record rec;
+    uint64_t *pfns;
+    unsigned int i;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    for ( ; ; )
+    {
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 && errno == EINTR )
+            continue;
+        if ( rc < 0 )
+        {
+            PERROR("Failed to poll the back channel");
+            return -1;
+        }
+        if ( rc == 0 )
+            break;
+
+        rc = read_record(ctx, ctx->save.recv_fd, &rec);
+        if ( rc )
+            return rc;
+
+        if ( rec.type != REC_TYPE_POSTCOPY_PFN_REQUEST ||
+             rec.length % sizeof(*pfns) )
+        {
+            ERROR("Unexpected record %#x (%s), length %u, on back channel",
+                  rec.type, rec_type_to_str(rec.type), rec.length);
+            free(rec.data);
+            return -1;
+        }
+
+        pfns = rec.data;
+        for ( i = 0; !rc && i < rec.length / sizeof(*pfns); ++i )
+        {
+            /* Pages may be requested again while already in flight. */
+            if ( pfns[i] >= ctx->save.p2m_size ||
+                 !test_and_clear_bit(pfns[i], dirty_bitmap) )
+                continue;
+
+            ctx->save.nr_postcopy_pfns--;
+            rc = add_to_batch(ctx, pfns[i]);
+        }
+
+        free(rec.data);
+        if ( rc )
+            return rc;
+    }
+
+    return flush_batch(ctx);
+}
+
+/*
+ * Called once all other state has been sent.  Hand the device model state
+ * over, letting the restorer resume the guest, and send the outstanding
+ * pages.
+ */
+static int send_memory_postcopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { REC_TYPE_POSTCOPY_TRANSITION, 0, NULL };
+    unsigned long total = ctx->save.nr_postcopy_pfns;
+    unsigned int n;
+    xen_pfn_t p = 0;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    /* The restorer only accepts PAGE_DATA records from here on. */
+    ctx->save.elide_pages = false;
+    ctx->save.send_deltas = false;
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        return rc;
+
+    ctx->save.postcopy_transitioned = true;
+
+    rc = ctx->save.callbacks->postcopy_transition(ctx->save.callbacks->data);
+    if ( rc != 1 )
+    {
+        ERROR("Failed to send device model state for post-copy");
+        return -1;
+    }
+
+    xc_set_progress_prefix(xch, "Post-copy");
+
+    while ( ctx->save.nr_postcopy_pfns )
+    {
+        rc = handle_postcopy_requests(ctx);
+        if ( rc )
+            goto out;
+
+        for ( n = 0; n < MAX_BATCH_SIZE && p < ctx->save.p2m_size; ++p )
+        {
+            if ( !test_and_clear_bit(p, dirty_bitmap) )
+                continue;
+
+            ctx->save.nr_postcopy_pfns--;
+            ++n;
+
+            rc = add_to_batch(ctx, p);
+            if ( rc )
+                goto out;
+        }
+
+        rc = flush_batch(ctx);
+        if ( rc )
+            goto out;
+
+        xc_report_progress_step(xch, total - ctx->save.nr_postcopy_pfns,
+                                total);
+    }
+
+    report_iteration_stats(ctx, 0, false);
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    return rc;
+}
+
 /*
  * Suspend the domain and send dirty memory.
  * This is the last iteration of the live migration and the
@@ -638,17 +2039,23 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
-    if ( xc_shadow_control(
-             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
-             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
-             NULL, XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) !=
-         ctx->save.p2m_size )
+    if ( clean_dirty_bitmap(ctx, XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) )
     {
-        PERROR("Failed to retrieve logdirty bitmap");
         rc = -1;
         goto out;
     }
 
+    /*
+     * Report the last live iteration, if it hasn't been already.  Otherwise
+     * the guest has been running since the previous checkpoint, rather than
+     * being sent.
+     */
+    if ( ctx->save.iter_stats.pages_sent )
+        report_iteration_stats(ctx, stats.dirty_count +
+                               ctx->save.nr_deferred_pages, false);
+    else
+        ctx->save.iter_start = monotonic_ns();
+
     if ( ctx->save.live )
     {
         rc = update_progress_string(ctx, &progress_str);
@@ -670,13 +2077,20 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
         }
     }
 
-    rc = send_dirty_pages(ctx, stats.dirty_count + ctx->save.nr_deferred_pages);
+    if ( ctx->save.postcopy )
+        rc = write_postcopy_begin(ctx);
+    else
+        rc = send_dirty_pages(ctx,
+                              stats.dirty_count + ctx->save.nr_deferred_pages);
     if ( rc )
         goto out;
 
     bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
     ctx->save.nr_deferred_pages = 0;
 
+    if ( !ctx->save.postcopy )
+        report_iteration_stats(ctx, 0, true);
+
  out:
     xc_set_progress_prefix(xch, NULL);
     free(progress_str);
@@ -775,10 +2189,14 @@ static int send_domain_memory_nonlive(struct xc_sr_context *ctx)
 
     xc_set_progress_prefix(xch, "Frames");
 
+    ctx->save.iter_start = monotonic_ns();
+
     rc = send_all_pages(ctx);
     if ( rc )
         goto err;
 
+    report_iteration_stats(ctx, 0, true);
+
  err:
     return rc;
 }
@@ -794,6 +2212,8 @@ static int setup(struct xc_sr_context *ctx)
     if ( rc )
         goto err;
 
+    ctx->save.iter_start = monotonic_ns();
+
     dirty_bitmap = xc_hypercall_buffer_alloc_pages(
                    xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->save.p2m_size)));
     ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
@@ -809,6 +2229,35 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    if ( ctx->save.auto_converge )
+    {
+        rc = auto_converge_setup(ctx);
+        if ( rc )
+            goto err;
+    }
+
+    if ( ctx->save.compress )
+    {
+        ctx->save.compress_ctx = xc_compression_create_context(
+            xch, ctx->save.p2m_size);
+        ctx->save.compress_buf = malloc(COMPRESS_BUF_SIZE);
+
+        if ( !ctx->save.compress_ctx || !ctx->save.compress_buf )
+        {
+            ERROR("Unable to allocate memory for page delta compression");
+            rc = -1;
+            errno = ENOMEM;
+            goto err;
+        }
+    }
+
+    if ( ctx->save.nr_workers )
+    {
+        rc = pipeline_create(ctx);
+        if ( rc )
+            goto err;
+    }
+
     rc = 0;
 
  err:
@@ -820,7 +2269,12 @@ static void cleanup(struct xc_sr_context *ctx)
     xc_interface *xch = ctx->xch;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_ring_gfns,
+                                    &ctx->save.dirty_ring.hbuf);
+
+    pipeline_destroy(ctx);
 
+    auto_converge_cleanup(ctx);
 
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0, NULL, 0, NULL);
@@ -830,6 +2284,12 @@ static void cleanup(struct xc_sr_context *ctx)
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    xc_hypercall_buffer_free_pages(xch, dirty_ring_gfns,
+                                   NRPAGES(DIRTY_RING_BATCH *
+                                           sizeof(*dirty_ring_gfns)));
+    free(ctx->save.dirty_ring.gfns);
+    xc_compression_free_context(xch, ctx->save.compress_ctx);
+    free(ctx->save.compress_buf);
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
 }
@@ -890,6 +2350,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy )
+        {
+            rc = send_memory_postcopy(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->save.checkpointed != XC_MIG_STREAM_NONE )
         {
             /*
@@ -953,6 +2420,10 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     saved_rc = rc;
     PERROR("Save failed");
 
+    if ( ctx->save.postcopy_transitioned )
+        ERROR("Post-copy failed after the transition: domain %u must be"
+              " destroyed, not resumed", ctx->domid);
+
  done:
     cleanup(ctx);
 
@@ -979,6 +2450,15 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.nr_workers = (flags & XCFLAGS_WORKERS_MASK) >>
+                          XCFLAGS_WORKERS_SHIFT;
+    ctx.save.elide_pages = !!(flags & XCFLAGS_ELIDE_PAGES);
+    ctx.save.compress = !!(flags & XCFLAGS_PAGE_DELTA);
+    ctx.save.auto_converge = !!(flags & XCFLAGS_AUTO_CONVERGE) &&
+                             ctx.save.live;
+    ctx.save.converge.max_downtime_ms = callbacks->max_downtime_ms ?:
+                                        AC_DEFAULT_MAX_DOWNTIME_MS;
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
     ctx.save.checkpointed = stream_type;
     ctx.save.recv_fd = recv_fd;
 
@@ -995,6 +2475,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     if ( ctx.save.checkpointed == XC_MIG_STREAM_COLO )
         assert(callbacks->wait_checkpoint);
 
+    if ( ctx.save.postcopy &&
+         (!hvm || !ctx.save.live || stream_type != XC_MIG_STREAM_NONE ||
+          recv_fd < 0 || !callbacks->postcopy_transition) )
+    {
+        ERROR("Post-copy needs a live, non-checkpointed HVM migration with a"
+              " back channel and a postcopy_transition callback");
+        errno = EINVAL;
+        return -1;
+    }
+
     DPRINTF("fd %d, dom %u, flags %u, hvm %d", io_fd, dom, flags, hvm);
 
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
@@ -76,6 +76,11 @@ struct xc_sr_rhdr
 #define REC_TYPE_VERIFY                     0x0000000dU
 #define REC_TYPE_CHECKPOINT                 0x0000000eU
 #define REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST  0x0000000fU
+#define REC_TYPE_PAGE_ELIDED                0x00000010U
+#define REC_TYPE_PAGE_DELTA                 0x00000011U
+#define REC_TYPE_POSTCOPY_BEGIN             0x00000012U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000013U
+#define REC_TYPE_POSTCOPY_PFN_REQUEST       0x00000014U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +95,31 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/* PAGE_ELIDED */
+struct xc_sr_rec_page_elided_entry
+{
+    uint64_t pfn;
+    uint64_t src;
+};
+
+struct xc_sr_rec_page_elided_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    struct xc_sr_rec_page_elided_entry entry[0];
+};
+
+#define PAGE_ELIDED_SRC_ZERO (~0ULL)
+
+/* PAGE_DELTA */
+struct xc_sr_rec_page_delta_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+    /* Followed by the encoded pages, to the end of the record. */
+};
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
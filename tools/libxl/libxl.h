@@ -1191,6 +1191,21 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_PVCALLS 1
 
+/*
+ * LIBXL_HAVE_DOMAIN_MIGRATION_STATS
+ *
+ * If this is defined, libxl_domain_suspend_stats() exists, and reports
+ * LIBXL_EVENT_TYPE_DOMAIN_MIGRATION_STATS events.
+ */
+#define LIBXL_HAVE_DOMAIN_MIGRATION_STATS 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_PAGE_DELTA
+ *
+ * If this is defined, libxl_domain_suspend() accepts LIBXL_SUSPEND_PAGE_DELTA.
+ */
+#define LIBXL_HAVE_SUSPEND_PAGE_DELTA 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1540,6 +1555,21 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+/*
+ * Send pages which are dirtied again as deltas against the copy already
+ * sent.  Only restorers from this release onwards accept such a stream.
+ */
+#define LIBXL_SUSPEND_PAGE_DELTA 4
+
+/*
+ * As libxl_domain_suspend, additionally reporting progress as one
+ * DOMAIN_MIGRATION_STATS event after each pass over the domain's memory.
+ */
+int libxl_domain_suspend_stats(libxl_ctx *ctx, uint32_t domid, int fd,
+                               int flags, /* LIBXL_SUSPEND_* */
+                               const libxl_asyncop_how *ao_how,
+                               const libxl_asyncprogress_how *aop_stats_how)
+                               LIBXL_EXTERNAL_CALLERS_ONLY;
 
 /*
  * Only suspend domain, do not save its state to file, do not destroy it.
@@ -486,8 +486,9 @@ static void domain_suspend_cb(libxl__egc *egc,
 
 }
 
-int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
-                         const libxl_asyncop_how *ao_how)
+static int do_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
+                             int flags, const libxl_asyncop_how *ao_how,
+                             const libxl_asyncprogress_how *aop_stats_how)
 {
     AO_CREATE(ctx, domid, ao_how);
     int rc;
@@ -509,7 +510,12 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->page_delta = flags & LIBXL_SUSPEND_PAGE_DELTA;
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
+    if (aop_stats_how) {
+        GCNEW(dss->aop_stats_how);
+        libxl__ao_progress_gethow(dss->aop_stats_how, aop_stats_how);
+    }
 
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
                                      ~(O_NONBLOCK|O_NDELAY), 0,
@@ -523,6 +529,19 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     return AO_CREATE_FAIL(rc);
 }
 
+int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+                         const libxl_asyncop_how *ao_how)
+{
+    return do_domain_suspend(ctx, domid, fd, flags, ao_how, NULL);
+}
+
+int libxl_domain_suspend_stats(libxl_ctx *ctx, uint32_t domid, int fd,
+                               int flags, const libxl_asyncop_how *ao_how,
+                               const libxl_asyncprogress_how *aop_stats_how)
+{
+    return do_domain_suspend(ctx, domid, fd, flags, ao_how, aop_stats_how);
+}
+
 static void domain_suspend_empty_cb(libxl__egc *egc,
                               libxl__domain_suspend_state *dss, int rc)
 {
@@ -3435,8 +3435,10 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int page_delta;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
+    libxl_asyncprogress_how *aop_stats_how; /* NULL to discard */
     /* private */
     int rc;
     int hvm;
@@ -61,7 +61,7 @@ void libxl__xc_domain_restore(libxl__egc *egc, libxl__domain_create_state *dcs,
         state->store_port,
         state->store_domid, state->console_port,
         state->console_domid,
-        hvm, pae,
+        hvm, pae, 0 /* flags */,
         cbflags, dcs->restore_params.checkpointed_stream,
     };
 
@@ -418,6 +418,46 @@ void libxl__srm_callout_callback_progress(const char *context,
     xtl_progress(CTX->lg, context, doing_what, done, total);
 }
 
+void libxl__srm_callout_callback_iteration_stats(uint32_t iteration,
+                   uint32_t suspended, uint64_t pages_sent,
+                   uint64_t bytes_written, uint64_t dirty_count,
+                   uint64_t map_ns, uint64_t copy_ns, uint64_t write_ns,
+                   uint64_t elapsed_ns, uint64_t send_rate,
+                   uint64_t dirty_rate, uint64_t downtime_ms, void *user)
+{
+    libxl__save_helper_state *shs = user;
+    libxl__domain_save_state *dss = shs->caller_state;
+    libxl__egc *egc = shs->egc;
+    STATE_AO_GC(shs->ao);
+    libxl_event *ev;
+
+    LOGD(DEBUG, shs->domid, "iteration %"PRIu32"%s: %"PRIu64" pages, "
+         "%"PRIu64" bytes in %"PRIu64"ms, %"PRIu64" dirty, projected "
+         "downtime %"PRIu64"ms", iteration, suspended ? " (suspended)" : "",
+         pages_sent, bytes_written, elapsed_ns / 1000000, dirty_count,
+         downtime_ms);
+
+    if (!dss->aop_stats_how)
+        return;
+
+    ev = NEW_EVENT(egc, DOMAIN_MIGRATION_STATS, shs->domid,
+                   dss->aop_stats_how->for_event);
+    ev->u.domain_migration_stats.iteration = iteration;
+    ev->u.domain_migration_stats.suspended = suspended;
+    ev->u.domain_migration_stats.pages_sent = pages_sent;
+    ev->u.domain_migration_stats.bytes_written = bytes_written;
+    ev->u.domain_migration_stats.dirty_count = dirty_count;
+    ev->u.domain_migration_stats.map_ns = map_ns;
+    ev->u.domain_migration_stats.copy_ns = copy_ns;
+    ev->u.domain_migration_stats.write_ns = write_ns;
+    ev->u.domain_migration_stats.elapsed_ns = elapsed_ns;
+    ev->u.domain_migration_stats.send_rate = send_rate;
+    ev->u.domain_migration_stats.dirty_rate = dirty_rate;
+    ev->u.domain_migration_stats.downtime_ms = downtime_ms;
+
+    libxl__ao_progress_report(egc, ao, dss->aop_stats_how, ev);
+}
+
 int libxl__srm_callout_callback_complete(int retval, int errnoval,
                                          void *user)
 {
@@ -219,6 +219,17 @@ int helper_getreply(void *user)
 
 static struct save_callbacks helper_save_callbacks;
 
+static void save_iteration_stats(const struct save_iteration_stats *stats,
+                                 void *user)
+{
+    helper_stub_iteration_stats(stats->iteration, stats->suspended,
+                                stats->pages_sent, stats->bytes_written,
+                                stats->dirty_count, stats->map_ns,
+                                stats->copy_ns, stats->write_ns,
+                                stats->elapsed_ns, stats->send_rate,
+                                stats->dirty_rate, stats->downtime_ms, user);
+}
+
 static void startup(const char *op) {
     xtl_log(&logger,XTL_DEBUG,0,program,"starting %s",op);
 
@@ -258,6 +269,7 @@ int main(int argc, char **argv)
         assert(!*++argv);
 
         helper_setcallbacks_save(&helper_save_callbacks, cbflags);
+        helper_save_callbacks.iteration_stats = save_iteration_stats;
 
         startup("save");
         setup_signals(save_signal_handler);
@@ -277,6 +289,7 @@ int main(int argc, char **argv)
         domid_t console_domid =             strtoul(NEXTARG,0,10);
         unsigned int hvm =                  strtoul(NEXTARG,0,10);
         unsigned int pae =                  strtoul(NEXTARG,0,10);
+        uint32_t flags =                    strtoul(NEXTARG,0,10);
         unsigned cbflags =                  strtoul(NEXTARG,0,10);
         xc_migration_stream_t stream_type = strtoul(NEXTARG,0,10);
         assert(!*++argv);
@@ -291,7 +304,7 @@ int main(int argc, char **argv)
 
         r = xc_domain_restore(xch, io_fd, dom, store_evtchn, &store_mfn,
                               store_domid, console_evtchn, &console_mfn,
-                              console_domid, hvm, pae,
+                              console_domid, hvm, pae, flags,
                               stream_type,
                               &helper_restore_callbacks, send_back_fd);
         helper_stub_restore_results(store_mfn,console_mfn,0);
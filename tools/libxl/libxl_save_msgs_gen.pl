@@ -33,6 +33,18 @@ our @msgs = (
                                               'xen_pfn_t', 'console_gfn'] ],
     [  9, 'srW',    "complete",              [qw(int retval
                                                  int errnoval)] ],
+    [ 10, 's',      "iteration_stats",       [qw(uint32_t iteration
+                                                 uint32_t suspended
+                                                 uint64_t pages_sent
+                                                 uint64_t bytes_written
+                                                 uint64_t dirty_count
+                                                 uint64_t map_ns
+                                                 uint64_t copy_ns
+                                                 uint64_t write_ns
+                                                 uint64_t elapsed_ns
+                                                 uint64_t send_rate
+                                                 uint64_t dirty_rate
+                                                 uint64_t downtime_ms)] ],
 );
 
 #----------------------------------------
@@ -141,7 +153,8 @@ static void bytes_put(unsigned char *const buf, int *len,
 
 END
 
-foreach my $simpletype (qw(int uint16_t uint32_t unsigned), 'unsigned long', 'xen_pfn_t') {
+foreach my $simpletype (qw(int uint16_t uint32_t uint64_t unsigned),
+                        'unsigned long', 'xen_pfn_t') {
     my $typeid = typeid($simpletype);
     $out_body{'callout'} .= <<END;
 static int ${typeid}_get(const unsigned char **msg,
@@ -65,6 +65,11 @@ REC_TYPE_x86_pv_vcpu_msrs           = 0x0000000c
 REC_TYPE_verify                     = 0x0000000d
 REC_TYPE_checkpoint                 = 0x0000000e
 REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
+REC_TYPE_page_elided                = 0x00000010
+REC_TYPE_page_delta                 = 0x00000011
+REC_TYPE_postcopy_begin             = 0x00000012
+REC_TYPE_postcopy_transition        = 0x00000013
+REC_TYPE_postcopy_pfn_request       = 0x00000014
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -82,7 +87,12 @@ rec_type_to_str = {
     REC_TYPE_x86_pv_vcpu_msrs           : "x86 PV vcpu msrs",
     REC_TYPE_verify                     : "Verify",
     REC_TYPE_checkpoint                 : "Checkpoint",
-    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list"
+    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list",
+    REC_TYPE_page_elided                : "Page elided",
+    REC_TYPE_page_delta                 : "Page delta",
+    REC_TYPE_postcopy_begin             : "Post-copy begin",
+    REC_TYPE_postcopy_transition        : "Post-copy transition",
+    REC_TYPE_postcopy_pfn_request       : "Post-copy pfn request",
 }
 
 # page_data
@@ -105,6 +115,14 @@ PAGE_DATA_TYPE_BROKEN        = (long(0xd) << PAGE_DATA_TYPE_SHIFT) # Broken
 PAGE_DATA_TYPE_XALLOC        = (long(0xe) << PAGE_DATA_TYPE_SHIFT) # Allocate-only
 PAGE_DATA_TYPE_XTAB          = (long(0xf) << PAGE_DATA_TYPE_SHIFT) # Invalid
 
+# page_elided
+PAGE_ELIDED_FORMAT           = "II"
+PAGE_ELIDED_ENTRY_FORMAT     = "QQ"
+PAGE_ELIDED_SRC_ZERO         = (long(1) << 64) - 1
+
+# page_delta
+PAGE_DELTA_FORMAT            = "II"
+
 # x86_pv_info
 X86_PV_INFO_FORMAT        = "BBHI"
 
@@ -285,6 +303,99 @@ class VerifyLibxc(VerifyBase):
                               % (minsz, pfnsz, pagesz, len(content)))
 
 
+    def verify_record_page_elided(self, content):
+        """ Page elided record """
+        minsz = calcsize(PAGE_ELIDED_FORMAT)
+        entrysz = calcsize(PAGE_ELIDED_ENTRY_FORMAT)
+
+        if len(content) < minsz + entrysz:
+            raise RecordError("PAGE_ELIDED record must be at least %d bytes "
+                              "long" % (minsz + entrysz, ))
+
+        count, res1 = unpack(PAGE_ELIDED_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in PAGE_ELIDED record 0x%04x"
+                              % (res1, ))
+
+        if len(content) != minsz + count * entrysz:
+            raise RecordError("Expected %u + %u * %u, got %u"
+                              % (minsz, count, entrysz, len(content)))
+
+        for idx in range(count):
+            pfn, src = unpack(PAGE_ELIDED_ENTRY_FORMAT,
+                              content[minsz + idx * entrysz:
+                                      minsz + (idx + 1) * entrysz])
+
+            if pfn & ~PAGE_DATA_PFN_MASK:
+                raise RecordError("Invalid pfn in entry[%d]: 0x%016x"
+                                  % (idx, pfn))
+
+            if src != PAGE_ELIDED_SRC_ZERO and src & ~PAGE_DATA_PFN_MASK:
+                raise RecordError("Invalid src in entry[%d]: 0x%016x"
+                                  % (idx, src))
+
+
+    def verify_record_page_delta(self, content):
+        """ Page delta record """
+        minsz = calcsize(PAGE_DELTA_FORMAT)
+
+        if len(content) <= minsz:
+            raise RecordError("PAGE_DELTA record must be at least %d bytes "
+                              "long" % (minsz, ))
+
+        count, res1 = unpack(PAGE_DELTA_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in PAGE_DELTA record 0x%04x"
+                              % (res1, ))
+
+        if count == 0:
+            raise RecordError("PAGE_DELTA record with no pfns")
+
+        pfnsz = count * 8
+        if (len(content) - minsz) < pfnsz:
+            raise RecordError("PAGE_DELTA record must contain a pfn record "
+                              "for each count")
+
+        pfns = list(unpack("=%dQ" % (count,), content[minsz:minsz + pfnsz]))
+
+        for idx, pfn in enumerate(pfns):
+            if pfn & ~PAGE_DATA_PFN_MASK:
+                raise RecordError("Invalid pfn in pfn[%d]: 0x%016x"
+                                  % (idx, pfn))
+
+        # Walk the encodings to check they account for the whole record
+        data = bytearray(content[minsz + pfnsz:])
+        pos = 0
+        for idx in range(count):
+
+            if pos >= len(data):
+                raise RecordError("Missing encoding for pfn[%d]" % (idx, ))
+
+            if data[pos] in (0x00, 0x80):
+                pos += 1 if data[pos] == 0x00 else 4097
+                continue
+
+            pagepos = 0
+            while pagepos < 4096:
+                if pos >= len(data) or not data[pos] & 0x7f:
+                    raise RecordError("Bad run at offset %d for pfn[%d]"
+                                      % (pos, idx))
+
+                runsz = (data[pos] & 0x7f) * 4
+                pos += 1 if data[pos] & 0x80 else 1 + runsz
+                pagepos += runsz
+
+            if pagepos != 4096:
+                raise RecordError("Runs for pfn[%d] cover %d bytes"
+                                  % (idx, pagepos))
+
+        if pos != len(data):
+            raise RecordError("Expected %u bytes of encoded pages, got %u"
+                              % (pos, len(data)))
+
+
     def verify_record_x86_pv_info(self, content):
         """ x86 PV Info record """
 
@@ -424,12 +535,44 @@ class VerifyLibxc(VerifyBase):
         """ checkpoint dirty pfn list """
         raise RecordError("Found checkpoint dirty pfn list record in stream")
 
+    def verify_record_postcopy_begin(self, content):
+        """ post-copy begin record """
+
+        if len(content) % 8 != 0:
+            raise RecordError("Length expected to be a multiple of 8, not %d"
+                              % (len(content), ))
+
+        pfns = unpack("=%dQ" % (len(content) // 8, ), content)
+        for idx, pfn in enumerate(pfns):
+            if pfn & ~PAGE_DATA_PFN_MASK:
+                raise RecordError("Invalid pfn in pfn[%d]: 0x%016x"
+                                  % (idx, pfn))
+
+    def verify_record_postcopy_transition(self, content):
+        """ post-copy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Post-copy transition record with non-zero "
+                              "length")
+
+        # Toolstack-defined device model state follows, which can't be parsed
+        raise RecordError("Post-copy stream can't be verified past the "
+                          "transition")
+
+    def verify_record_postcopy_pfn_request(self, content):
+        """ post-copy pfn request """
+        raise RecordError("Found post-copy pfn request record in stream")
+
 
 record_verifiers = {
     REC_TYPE_end:
         VerifyLibxc.verify_record_end,
     REC_TYPE_page_data:
         VerifyLibxc.verify_record_page_data,
+    REC_TYPE_page_elided:
+        VerifyLibxc.verify_record_page_elided,
+    REC_TYPE_page_delta:
+        VerifyLibxc.verify_record_page_delta,
 
     REC_TYPE_x86_pv_info:
         VerifyLibxc.verify_record_x86_pv_info,
@@ -466,4 +609,10 @@ record_verifiers = {
         VerifyLibxc.verify_record_checkpoint,
     REC_TYPE_checkpoint_dirty_pfn_list:
         VerifyLibxc.verify_record_checkpoint_dirty_pfn_list,
+    REC_TYPE_postcopy_begin:
+        VerifyLibxc.verify_record_postcopy_begin,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_pfn_request:
+        VerifyLibxc.verify_record_postcopy_pfn_request,
     }
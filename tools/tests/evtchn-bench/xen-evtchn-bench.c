@@ -0,0 +1,254 @@
+/*
+ * xen-evtchn-bench.c
+ *
+ * Event channel ping-pong: each pair of threads bounces a notification back
+ * and forth over a loopback interdomain event channel, reporting round trip
+ * latency and aggregate throughput.  With several pairs, all the ports are
+ * bound to the same vcpu, so the senders contend on the same event queue.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenevtchn.h>
+#include <xen/xen.h>
+
+struct pair {
+    xenevtchn_handle *ping, *pong;
+    xenevtchn_port_or_error_t ping_port, pong_port;
+    pthread_t ping_thread, pong_thread;
+    uint64_t elapsed;
+    int rc;
+};
+
+static unsigned long nr_iters = 100000;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Wait for a notification on any of xce's ports, and re-enable it. */
+static int wait_port(xenevtchn_handle *xce)
+{
+    xenevtchn_port_or_error_t port = xenevtchn_pending(xce);
+
+    if ( port < 0 || xenevtchn_unmask(xce, port) )
+        return -1;
+
+    return 0;
+}
+
+static void *ping_thread(void *arg)
+{
+    struct pair *p = arg;
+    unsigned long i;
+    uint64_t start;
+
+    pthread_barrier_wait(&start_barrier);
+
+    start = now_ns();
+    for ( i = 0; i < nr_iters; i++ )
+    {
+        if ( xenevtchn_notify(p->ping, p->ping_port) || wait_port(p->ping) )
+        {
+            perror("ping");
+            p->rc = -1;
+            break;
+        }
+    }
+    p->elapsed = now_ns() - start;
+
+    return NULL;
+}
+
+static void *pong_thread(void *arg)
+{
+    struct pair *p = arg;
+    unsigned long i;
+
+    pthread_barrier_wait(&start_barrier);
+
+    for ( i = 0; i < nr_iters; i++ )
+    {
+        if ( wait_port(p->pong) || xenevtchn_notify(p->pong, p->pong_port) )
+        {
+            perror("pong");
+            p->rc = -1;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int setup_pair(struct pair *p)
+{
+    p->ping = xenevtchn_open(NULL, 0);
+    p->pong = xenevtchn_open(NULL, 0);
+    if ( !p->ping || !p->pong )
+    {
+        perror("xenevtchn_open");
+        return -1;
+    }
+
+    p->ping_port = xenevtchn_bind_unbound_port(p->ping, DOMID_SELF);
+    if ( p->ping_port < 0 )
+    {
+        perror("xenevtchn_bind_unbound_port");
+        return -1;
+    }
+
+    p->pong_port = xenevtchn_bind_interdomain(p->pong, DOMID_SELF,
+                                              p->ping_port);
+    if ( p->pong_port < 0 )
+    {
+        perror("xenevtchn_bind_interdomain");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void teardown_pair(struct pair *p)
+{
+    if ( p->pong )
+    {
+        if ( p->pong_port >= 0 )
+            xenevtchn_unbind(p->pong, p->pong_port);
+        xenevtchn_close(p->pong);
+    }
+    if ( p->ping )
+    {
+        if ( p->ping_port >= 0 )
+            xenevtchn_unbind(p->ping, p->ping_port);
+        xenevtchn_close(p->ping);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n <iters>   round trips per pair (default 100000)\n"
+            "  -p <pairs>   ping-pong pairs running concurrently (default 1)\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr_pairs = 1, i;
+    struct pair *pairs;
+    uint64_t max_elapsed = 0, tot_elapsed = 0;
+    int opt, rc = 1;
+
+    while ( (opt = getopt(argc, argv, "n:p:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            nr_iters = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            nr_pairs = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !nr_iters || !nr_pairs )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    pairs = calloc(nr_pairs, sizeof(*pairs));
+    if ( !pairs )
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    for ( i = 0; i < nr_pairs; i++ )
+        pairs[i].ping_port = pairs[i].pong_port = -1;
+
+    for ( i = 0; i < nr_pairs; i++ )
+        if ( setup_pair(&pairs[i]) )
+            goto out;
+
+    pthread_barrier_init(&start_barrier, NULL, 2 * nr_pairs);
+
+    for ( i = 0; i < nr_pairs; i++ )
+    {
+        if ( pthread_create(&pairs[i].pong_thread, NULL, pong_thread,
+                            &pairs[i]) ||
+             pthread_create(&pairs[i].ping_thread, NULL, ping_thread,
+                            &pairs[i]) )
+        {
+            /* Threads already started would wait at the barrier forever. */
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for ( i = 0; i < nr_pairs; i++ )
+    {
+        pthread_join(pairs[i].ping_thread, NULL);
+        pthread_join(pairs[i].pong_thread, NULL);
+
+        if ( pairs[i].rc )
+            goto out;
+
+        tot_elapsed += pairs[i].elapsed;
+        if ( pairs[i].elapsed > max_elapsed )
+            max_elapsed = pairs[i].elapsed;
+    }
+
+    printf("%u pair(s), %lu round trips each: %.0f ns per round trip, "
+           "%.0f notifications/s\n", nr_pairs, nr_iters,
+           (double)tot_elapsed / nr_pairs / nr_iters,
+           2.0 * nr_pairs * nr_iters / (max_elapsed / 1e9));
+
+    rc = 0;
+
+ out:
+    for ( i = 0; i < nr_pairs; i++ )
+        teardown_pair(&pairs[i]);
+    free(pairs);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,495 @@
+/*
+ * xen-migration-bench.c
+ *
+ * Save a synthetic HVM domain and restore it into a second domain on the same
+ * host, through a socketpair, reporting the saver's per-iteration statistics
+ * and the overall throughput.  Nothing but the migration stream itself is
+ * exercised: the domains have no vcpus running and no device model.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <xenctrl.h>
+#include <xenguest.h>
+#include <xenforeignmemory.h>
+#include <xendevicemodel.h>
+
+#define PAGE_SIZE           XC_PAGE_SIZE
+#define CHUNK_PAGES         1024UL
+
+struct bench {
+    xc_interface *xch;
+    xenforeignmemory_handle *fmem;
+    xendevicemodel_handle *dmod;
+
+    uint32_t src, dst;
+    unsigned long nr_pages;
+    uint32_t save_flags, restore_flags;
+    unsigned int dirty_rate;        /* Pages per second dirtied while live. */
+
+    int fds[2];
+    int restore_rc;
+
+    pthread_t dirtier;
+    bool dirtier_running;
+    volatile bool dirtier_stop;
+
+    uint64_t bytes_written;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+/*
+ * A quarter of the pages are zero, a quarter share one pattern, and the rest
+ * are filled with noise seeded from their pfn, so both the elision and the
+ * plain paths of the saver see work.
+ */
+static void fill_page(uint64_t *page, xen_pfn_t pfn)
+{
+    uint64_t state = pfn * 0x9e3779b97f4a7c15ULL + 1;
+    unsigned int i;
+
+    switch ( pfn & 3 )
+    {
+    case 0:
+        memset(page, 0, PAGE_SIZE);
+        break;
+
+    case 1:
+        for ( i = 0; i < PAGE_SIZE / sizeof(*page); ++i )
+            page[i] = 0x5a5a5a5a00000000ULL | i;
+        break;
+
+    default:
+        for ( i = 0; i < PAGE_SIZE / sizeof(*page); ++i )
+            page[i] = xorshift64(&state);
+        break;
+    }
+}
+
+static void *map_chunk(struct bench *b, uint32_t domid, xen_pfn_t start,
+                       unsigned long nr, int prot)
+{
+    xen_pfn_t pfns[CHUNK_PAGES];
+    unsigned long i;
+
+    for ( i = 0; i < nr; ++i )
+        pfns[i] = start + i;
+
+    return xenforeignmemory_map(b->fmem, domid, prot, nr, pfns, NULL);
+}
+
+static int create_domain(struct bench *b, uint32_t *domid, bool populate)
+{
+    struct xen_domctl_createdomain config = {
+        .flags = XEN_DOMCTL_CDF_hvm_guest | XEN_DOMCTL_CDF_hap,
+        .max_vcpus = 1,
+        .max_evtchn_port = -1,
+        .max_grant_frames = 32,
+        .max_maptrack_frames = 1024,
+        .arch = {
+            .emulation_flags = XEN_X86_EMU_LAPIC,
+        },
+    };
+    unsigned long mb = 8 + (b->nr_pages >> 10), i, nr;
+    xen_pfn_t pfns[CHUNK_PAGES];
+
+    *domid = 0;
+    if ( xc_domain_create(b->xch, domid, &config) )
+    {
+        perror("xc_domain_create");
+        return -1;
+    }
+
+    if ( xc_domain_max_vcpus(b->xch, *domid, 1) ||
+         xc_shadow_control(b->xch, *domid,
+                           XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION,
+                           NULL, 0, &mb, 0, NULL) ||
+         xc_domain_setmaxmem(b->xch, *domid,
+                             (b->nr_pages + 256) * (PAGE_SIZE >> 10)) )
+    {
+        perror("Failed to configure domain");
+        return -1;
+    }
+
+    if ( !populate )
+        return 0;
+
+    for ( i = 0; i < b->nr_pages; i += nr )
+    {
+        unsigned long j;
+        uint64_t *mem;
+
+        nr = b->nr_pages - i < CHUNK_PAGES ? b->nr_pages - i : CHUNK_PAGES;
+        for ( j = 0; j < nr; ++j )
+            pfns[j] = i + j;
+
+        if ( xc_domain_populate_physmap_exact(b->xch, *domid, nr, 0, 0, pfns) )
+        {
+            perror("xc_domain_populate_physmap_exact");
+            return -1;
+        }
+
+        mem = map_chunk(b, *domid, i, nr, PROT_WRITE);
+        if ( !mem )
+        {
+            perror("xenforeignmemory_map");
+            return -1;
+        }
+
+        for ( j = 0; j < nr; ++j )
+            fill_page(mem + j * (PAGE_SIZE / sizeof(*mem)), i + j);
+
+        xenforeignmemory_unmap(b->fmem, mem, nr);
+    }
+
+    return 0;
+}
+
+/*
+ * Dirty runs of 64 pages at random through foreign mappings, marking them in
+ * the log-dirty bitmap the way a device model would.
+ */
+static void *dirtier_thread(void *arg)
+{
+    struct bench *b = arg;
+    uint64_t state = now_ns() | 1;
+    const unsigned long run = 64;
+    uint64_t interval = 1000000000ULL * run / b->dirty_rate;
+
+    while ( !b->dirtier_stop )
+    {
+        xen_pfn_t start = xorshift64(&state) % (b->nr_pages - run);
+        uint64_t *mem = map_chunk(b, b->src, start, run, PROT_WRITE);
+        struct timespec ts = {
+            .tv_sec = interval / 1000000000ULL,
+            .tv_nsec = interval % 1000000000ULL,
+        };
+        unsigned long i;
+
+        if ( !mem )
+        {
+            perror("Dirtier failed to map memory");
+            break;
+        }
+
+        for ( i = 0; i < run; ++i )
+            mem[i * (PAGE_SIZE / sizeof(*mem))] = xorshift64(&state);
+
+        xenforeignmemory_unmap(b->fmem, mem, run);
+        xendevicemodel_modified_memory(b->dmod, b->src, start, run);
+
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+static int suspend(void *data)
+{
+    struct bench *b = data;
+
+    /* The guest's memory must be final once the saver is told it is. */
+    if ( b->dirtier_running )
+    {
+        b->dirtier_stop = true;
+        pthread_join(b->dirtier, NULL);
+        b->dirtier_running = false;
+    }
+
+    return !xc_domain_shutdown(b->xch, b->src, SHUTDOWN_suspend);
+}
+
+static int switch_qemu_logdirty(uint32_t domid, unsigned int enable,
+                                void *data)
+{
+    return 0;
+}
+
+static void iteration_stats(const struct save_iteration_stats *s, void *data)
+{
+    struct bench *b = data;
+
+    if ( s->iteration == 0 )
+        printf("%5s %10s %10s %9s %9s %9s %10s %9s %10s %9s\n",
+               "iter", "pages", "MiB", "map ms", "copy ms", "write ms",
+               "elapsed ms", "MiB/s", "dirty/s", "downtime");
+
+    printf("%4u%c %10"PRIu64" %10.1f %9.1f %9.1f %9.1f %10.1f %9.1f "
+           "%10"PRIu64" %9"PRIu64"\n",
+           s->iteration, s->suspended ? '*' : ' ', s->pages_sent,
+           s->bytes_written / 1048576.0, s->map_ns / 1e6, s->copy_ns / 1e6,
+           s->write_ns / 1e6, s->elapsed_ns / 1e6,
+           s->send_rate * (double)PAGE_SIZE / 1048576.0, s->dirty_rate,
+           s->downtime_ms);
+
+    b->bytes_written += s->bytes_written;
+}
+
+static void *restore_thread(void *arg)
+{
+    struct bench *b = arg;
+    struct restore_callbacks callbacks = { 0 };
+    unsigned long store_mfn = 0, console_mfn = 0;
+    xc_interface *xch = xc_interface_open(NULL, NULL, 0);
+
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        b->restore_rc = -1;
+        return NULL;
+    }
+
+    b->restore_rc = xc_domain_restore(xch, b->fds[1], b->dst,
+                                      0, &store_mfn, 0, 0, &console_mfn, 0,
+                                      1, 1, b->restore_flags,
+                                      XC_MIG_STREAM_NONE, &callbacks, -1);
+    xc_interface_close(xch);
+
+    return NULL;
+}
+
+static int verify(struct bench *b)
+{
+    unsigned long i, nr;
+
+    for ( i = 0; i < b->nr_pages; i += nr )
+    {
+        void *src, *dst;
+        int rc;
+
+        nr = b->nr_pages - i < CHUNK_PAGES ? b->nr_pages - i : CHUNK_PAGES;
+        src = map_chunk(b, b->src, i, nr, PROT_READ);
+        dst = map_chunk(b, b->dst, i, nr, PROT_READ);
+
+        rc = (!src || !dst) ? -1 : memcmp(src, dst, nr * PAGE_SIZE);
+
+        if ( src )
+            xenforeignmemory_unmap(b->fmem, src, nr);
+        if ( dst )
+            xenforeignmemory_unmap(b->fmem, dst, nr);
+
+        if ( rc )
+        {
+            fprintf(stderr, "Mismatch in pfns %#lx-%#lx\n", i, i + nr - 1);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -m <MiB>     guest memory size (default 256)\n"
+            "  -l           live migration\n"
+            "  -d <pages>   pages per second to dirty while live\n"
+            "  -w <n>       worker threads for save and restore\n"
+            "  -e           elide zero and duplicate pages\n"
+            "  -c           send re-dirtied pages as deltas\n"
+            "  -v           compare guest memory after restore\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct save_callbacks callbacks = {
+        .suspend = suspend,
+        .switch_qemu_logdirty = switch_qemu_logdirty,
+        .iteration_stats = iteration_stats,
+    };
+    struct bench b = {
+        .nr_pages = 256UL << (20 - XC_PAGE_SHIFT),
+        .fds = { -1, -1 },
+    };
+    pthread_t restorer;
+    bool check = false;
+    uint64_t start, elapsed;
+    int opt, rc = 1, save_rc;
+
+    while ( (opt = getopt(argc, argv, "m:ld:w:ecv")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'm':
+            b.nr_pages = strtoul(optarg, NULL, 0) << (20 - XC_PAGE_SHIFT);
+            break;
+        case 'l':
+            b.save_flags |= XCFLAGS_LIVE;
+            break;
+        case 'd':
+            b.dirty_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            b.save_flags |= XCFLAGS_WORKERS(strtoul(optarg, NULL, 0));
+            b.restore_flags |= XCFLAGS_WORKERS(strtoul(optarg, NULL, 0));
+            break;
+        case 'e':
+            b.save_flags |= XCFLAGS_ELIDE_PAGES;
+            break;
+        case 'c':
+            b.save_flags |= XCFLAGS_PAGE_DELTA;
+            break;
+        case 'v':
+            check = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( b.nr_pages < 128 || (b.dirty_rate && !(b.save_flags & XCFLAGS_LIVE)) )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    callbacks.data = &b;
+
+    b.xch = xc_interface_open(NULL, NULL, 0);
+    b.fmem = xenforeignmemory_open(NULL, 0);
+    b.dmod = xendevicemodel_open(NULL, 0);
+    if ( !b.xch || !b.fmem || !b.dmod )
+    {
+        perror("Failed to open Xen interfaces");
+        goto out;
+    }
+
+    if ( create_domain(&b, &b.src, true) ||
+         create_domain(&b, &b.dst, false) )
+        goto out;
+
+    if ( socketpair(AF_UNIX, SOCK_STREAM, 0, b.fds) )
+    {
+        perror("socketpair");
+        goto out;
+    }
+
+    printf("Migrating %lu MiB from d%u to d%u\n",
+           b.nr_pages >> (20 - XC_PAGE_SHIFT), b.src, b.dst);
+
+    if ( b.dirty_rate )
+    {
+        if ( pthread_create(&b.dirtier, NULL, dirtier_thread, &b) )
+        {
+            perror("pthread_create");
+            goto out;
+        }
+        b.dirtier_running = true;
+    }
+
+    if ( pthread_create(&restorer, NULL, restore_thread, &b) )
+    {
+        perror("pthread_create");
+        goto out;
+    }
+
+    start = now_ns();
+    save_rc = xc_domain_save(b.xch, b.fds[0], b.src, b.save_flags,
+                             &callbacks, 1, XC_MIG_STREAM_NONE, -1);
+
+    /* Unblock the restorer if the saver gave up part way through. */
+    shutdown(b.fds[0], SHUT_WR);
+    pthread_join(restorer, NULL);
+    elapsed = now_ns() - start;
+
+    if ( save_rc || b.restore_rc )
+    {
+        fprintf(stderr, "Migration failed: save %d, restore %d\n",
+                save_rc, b.restore_rc);
+        goto out;
+    }
+
+    printf("Migrated %.1f MiB of stream in %.3f s, %.1f MiB/s of guest "
+           "memory\n", b.bytes_written / 1048576.0, elapsed / 1e9,
+           (b.nr_pages * (double)PAGE_SIZE / 1048576.0) / (elapsed / 1e9));
+
+    if ( check )
+    {
+        if ( verify(&b) )
+            goto out;
+        printf("Guest memory matches\n");
+    }
+
+    rc = 0;
+
+ out:
+    if ( b.dirtier_running )
+    {
+        b.dirtier_stop = true;
+        pthread_join(b.dirtier, NULL);
+    }
+    if ( b.fds[0] >= 0 )
+    {
+        close(b.fds[0]);
+        close(b.fds[1]);
+    }
+    if ( b.xch )
+    {
+        if ( b.src )
+            xc_domain_destroy(b.xch, b.src);
+        if ( b.dst )
+            xc_domain_destroy(b.xch, b.dst);
+        xc_interface_close(b.xch);
+    }
+    if ( b.dmod )
+        xendevicemodel_close(b.dmod);
+    if ( b.fmem )
+        xenforeignmemory_close(b.fmem);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -54,12 +54,15 @@ typedef struct xenstat_collector {
 
 static int  xenstat_collect_vcpus(xenstat_node * node);
 static int  xenstat_collect_xen_version(xenstat_node * node);
+static int  xenstat_collect_sched(xenstat_node * node);
 static void xenstat_free_vcpus(xenstat_node * node);
 static void xenstat_free_networks(xenstat_node * node);
 static void xenstat_free_xen_version(xenstat_node * node);
 static void xenstat_free_vbds(xenstat_node * node);
+static void xenstat_free_sched(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
+static void xenstat_uninit_sched(xenstat_handle * handle);
 static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
 
@@ -71,7 +74,9 @@ static xenstat_collector collectors[] = {
 	{ XENSTAT_XEN_VERSION, xenstat_collect_xen_version,
 	  xenstat_free_xen_version, xenstat_uninit_xen_version },
 	{ XENSTAT_VBD, xenstat_collect_vbds,
-	  xenstat_free_vbds, xenstat_uninit_vbds }
+	  xenstat_free_vbds, xenstat_uninit_vbds },
+	{ XENSTAT_SCHED, xenstat_collect_sched,
+	  xenstat_free_sched, xenstat_uninit_sched }
 };
 
 #define NUM_COLLECTORS (sizeof(collectors)/sizeof(xenstat_collector))
@@ -171,6 +176,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 	node->cpu_hz = ((unsigned long long)physinfo.cpu_khz) * 1000ULL;
         node->num_cpus = physinfo.nr_cpus;
+	node->max_cpu_id = physinfo.max_cpu_id;
 	node->tot_mem = ((unsigned long long)physinfo.total_pages)
 	    * handle->page_size;
 	node->free_mem = ((unsigned long long)physinfo.free_pages)
@@ -346,6 +352,38 @@ unsigned long long xenstat_node_cpu_hz(xenstat_node * node)
 	return node->cpu_hz;
 }
 
+/* Get the number of samples in a scheduling histogram */
+unsigned long long xenstat_node_sched_count(xenstat_node * node,
+					    unsigned int hist)
+{
+	if (hist < XENSTAT_SCHED_NR)
+		return node->sched[hist].count;
+	return 0;
+}
+
+/* Get the sum of the samples in a scheduling histogram */
+unsigned long long xenstat_node_sched_sum(xenstat_node * node,
+					  unsigned int hist)
+{
+	if (hist < XENSTAT_SCHED_NR)
+		return node->sched[hist].sum;
+	return 0;
+}
+
+unsigned int xenstat_node_sched_num_buckets(xenstat_node * node)
+{
+	return XEN_SYSCTL_SCHED_HIST_BUCKETS;
+}
+
+unsigned long long xenstat_node_sched_bucket(xenstat_node * node,
+					     unsigned int hist,
+					     unsigned int bucket)
+{
+	if (hist < XENSTAT_SCHED_NR && bucket < XEN_SYSCTL_SCHED_HIST_BUCKETS)
+		return node->sched[hist].bucket[bucket];
+	return 0;
+}
+
 /* Get the domain ID for this domain */
 unsigned xenstat_domain_id(xenstat_domain * domain)
 {
@@ -370,6 +408,12 @@ unsigned int xenstat_domain_num_vcpus(xenstat_domain * domain)
 	return domain->num_vcpus;
 }
 
+/* Get how long the VCPUs of a domain have been waiting to run */
+unsigned long long xenstat_domain_wait_ns(xenstat_domain * domain)
+{
+	return domain->wait_ns;
+}
+
 xenstat_vcpu *xenstat_domain_vcpu(xenstat_domain * domain, unsigned int vcpu)
 {
 	if (vcpu < domain->num_vcpus)
@@ -500,6 +544,9 @@ static int xenstat_collect_vcpus(xenstat_node * node)
 			else {
 				node->domains[i].vcpus[vcpu].online = info.online;
 				node->domains[i].vcpus[vcpu].ns = info.cpu_time;
+				node->domains[i].vcpus[vcpu].wait_ns =
+				    info.runnable_time;
+				node->domains[i].wait_ns += info.runnable_time;
 			}
 		}
 	}
@@ -531,6 +578,12 @@ unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu)
 	return vcpu->ns;
 }
 
+/* Get VCPU runqueue wait time */
+unsigned long long xenstat_vcpu_wait_ns(xenstat_vcpu * vcpu)
+{
+	return vcpu->wait_ns;
+}
+
 /*
  * Network functions
  */
@@ -637,6 +690,45 @@ static void xenstat_uninit_xen_version(xenstat_handle * handle)
 {
 }
 
+/*
+ * Scheduling statistics functions
+ */
+
+/* Collect the scheduling histograms of all the pCPUs, and sum them up */
+static int xenstat_collect_sched(xenstat_node * node)
+{
+	xc_sched_hist_t hist[XENSTAT_SCHED_NR];
+	unsigned int cpu, i, b, nr;
+
+	for (cpu = 0; cpu <= node->max_cpu_id; cpu++) {
+		nr = XENSTAT_SCHED_NR;
+		/* Offline pCPUs, or a hypervisor without the statistics,
+		 * simply leave the histograms empty. */
+		if (xc_sched_stats(node->handle->xc_handle, cpu, 0,
+				   hist, &nr) != 0)
+			continue;
+
+		for (i = 0; i < nr; i++) {
+			node->sched[i].count += hist[i].count;
+			node->sched[i].sum += hist[i].sum;
+			for (b = 0; b < XEN_SYSCTL_SCHED_HIST_BUCKETS; b++)
+				node->sched[i].bucket[b] += hist[i].bucket[b];
+		}
+	}
+
+	return 1;
+}
+
+/* Free scheduling information in node - nothing to do */
+static void xenstat_free_sched(xenstat_node * node)
+{
+}
+
+/* Free scheduling information in handle - nothing to do */
+static void xenstat_uninit_sched(xenstat_handle * handle)
+{
+}
+
 /*
  * VBD functions
  */
@@ -42,7 +42,15 @@ void xenstat_uninit(xenstat_handle * handle);
 #define XENSTAT_NETWORK 0x2
 #define XENSTAT_XEN_VERSION 0x4
 #define XENSTAT_VBD 0x8
-#define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD)
+#define XENSTAT_SCHED 0x10
+#define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD|XENSTAT_SCHED)
+
+/* Scheduling histograms, summed over all the pCPUs of a node */
+#define XENSTAT_SCHED_WAKE_LATENCY 0	/* Wakeup to running (ns) */
+#define XENSTAT_SCHED_RUNQ_WAIT 1	/* Preemption to running (ns) */
+#define XENSTAT_SCHED_RUNQ_LEN 2	/* Waiting vCPUs, at each decision */
+#define XENSTAT_SCHED_SWITCH_COST 3	/* Decision to end of switch (ns) */
+#define XENSTAT_SCHED_NR 4
 
 /* Get all available information about a node */
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags);
@@ -80,6 +88,19 @@ unsigned int xenstat_node_num_cpus(xenstat_node * node);
 /* Get information about the CPU speed */
 unsigned long long xenstat_node_cpu_hz(xenstat_node * node);
 
+/* Get the number of samples, and their sum, in a scheduling histogram */
+unsigned long long xenstat_node_sched_count(xenstat_node * node,
+					    unsigned int hist);
+unsigned long long xenstat_node_sched_sum(xenstat_node * node,
+					  unsigned int hist);
+
+/* Get the number of buckets of the scheduling histograms, and their
+ * content.  See XEN_SYSCTL_sched_stats for what each bucket covers. */
+unsigned int xenstat_node_sched_num_buckets(xenstat_node * node);
+unsigned long long xenstat_node_sched_bucket(xenstat_node * node,
+					     unsigned int hist,
+					     unsigned int bucket);
+
 /*
  * Domain functions - extract information from a xenstat_domain
  */
@@ -96,6 +117,10 @@ unsigned long long xenstat_domain_cpu_ns(xenstat_domain * domain);
 /* Find the number of VCPUs allocated to a domain */
 unsigned int xenstat_domain_num_vcpus(xenstat_domain * domain);
 
+/* Get how long the domain's VCPUs have been waiting to run, in total.
+ * Only available if VCPU information has been collected. */
+unsigned long long xenstat_domain_wait_ns(xenstat_domain * domain);
+
 /* Get the VCPU handle to obtain VCPU stats */
 xenstat_vcpu *xenstat_domain_vcpu(xenstat_domain * domain,
 				  unsigned int vcpu);
@@ -139,6 +164,9 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 unsigned int xenstat_vcpu_online(xenstat_vcpu * vcpu);
 unsigned long long xenstat_vcpu_ns(xenstat_vcpu * vcpu);
 
+/* Get how long the VCPU has been waiting to run */
+unsigned long long xenstat_vcpu_wait_ns(xenstat_vcpu * vcpu);
+
 
 /*
  * Network functions - extract information from a xenstat_network
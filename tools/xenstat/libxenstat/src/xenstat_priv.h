@@ -45,11 +45,13 @@ struct xenstat_node {
 	unsigned int flags;
 	unsigned long long cpu_hz;
 	unsigned int num_cpus;
+	unsigned int max_cpu_id;
 	unsigned long long tot_mem;
 	unsigned long long free_mem;
 	unsigned int num_domains;
 	xenstat_domain *domains;	/* Array of length num_domains */
 	long freeable_mb;
+	xc_sched_hist_t sched[XENSTAT_SCHED_NR];
 };
 
 struct xenstat_domain {
@@ -57,6 +59,7 @@ struct xenstat_domain {
 	char *name;
 	unsigned int state;
 	unsigned long long cpu_ns;
+	unsigned long long wait_ns;	/* Sum of the vcpus' wait_ns */
 	unsigned int num_vcpus;		/* No. vcpus configured for domain */
 	xenstat_vcpu *vcpus;		/* Array of length num_vcpus */
 	unsigned long long cur_mem;	/* Current memory reservation */
@@ -71,6 +74,7 @@ struct xenstat_domain {
 struct xenstat_vcpu {
 	unsigned int online;
 	unsigned long long ns;
+	unsigned long long wait_ns;
 };
 
 struct xenstat_network {
@@ -96,6 +96,8 @@ static int compare_cpu(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_cpu(xenstat_domain *domain);
 static int compare_cpu_pct(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_cpu_pct(xenstat_domain *domain);
+static int compare_wait_pct(xenstat_domain *domain1, xenstat_domain *domain2);
+static void print_wait_pct(xenstat_domain *domain);
 static int compare_mem(xenstat_domain *domain1, xenstat_domain *domain2);
 static void print_mem(xenstat_domain *domain);
 static void print_mem_pct(xenstat_domain *domain);
@@ -131,6 +133,7 @@ static void adjust_field_widths(xenstat_domain *domain);
 
 /* Section printing functions */
 static void do_summary(void);
+static void do_sched_summary(void);
 static void do_header(void);
 static void do_bottom_line(void);
 static void do_domain(xenstat_domain *);
@@ -146,6 +149,7 @@ typedef enum field_id {
 	FIELD_STATE,
 	FIELD_CPU,
 	FIELD_CPU_PCT,
+	FIELD_WAIT_PCT,
 	FIELD_MEM,
 	FIELD_MEM_PCT,
 	FIELD_MAXMEM,
@@ -176,6 +180,7 @@ field fields[] = {
 	{ FIELD_STATE,     "STATE",      6, compare_state,     print_state   },
 	{ FIELD_CPU,       "CPU(sec)",  10, compare_cpu,       print_cpu     },
 	{ FIELD_CPU_PCT,   "CPU(%)",     6, compare_cpu_pct,   print_cpu_pct },
+	{ FIELD_WAIT_PCT,  "WAIT(%)",    7, compare_wait_pct,  print_wait_pct },
 	{ FIELD_MEM,       "MEM(k)",    10, compare_mem,       print_mem     },
 	{ FIELD_MEM_PCT,   "MEM(%)",     6, compare_mem,       print_mem_pct },
 	{ FIELD_MAXMEM,    "MAXMEM(k)", 10, compare_maxmem,    print_maxmem  },
@@ -532,6 +537,41 @@ static void print_cpu_pct(xenstat_domain *domain)
 	print("%6.1f", get_cpu_pct(domain));
 }
 
+/* Computes the percentage of time the vcpus of a domain spent waiting to
+ * run, i.e., runnable but not running */
+static double get_wait_pct(xenstat_domain *domain)
+{
+	xenstat_domain *old_domain;
+	double us_elapsed;
+
+	/* Can't calculate wait percentage without a previous sample. */
+	if(prev_node == NULL)
+		return 0.0;
+
+	old_domain = xenstat_node_domain(prev_node, xenstat_domain_id(domain));
+	if(old_domain == NULL)
+		return 0.0;
+
+	/* Calculate the time elapsed in microseconds */
+	us_elapsed = ((curtime.tv_sec-oldtime.tv_sec)*1000000.0
+		      +(curtime.tv_usec - oldtime.tv_usec));
+
+	/* See get_cpu_pct() for the conversion */
+	return ((xenstat_domain_wait_ns(domain)
+		 -xenstat_domain_wait_ns(old_domain))/10.0)/us_elapsed;
+}
+
+static int compare_wait_pct(xenstat_domain *domain1, xenstat_domain *domain2)
+{
+	return -compare(get_wait_pct(domain1), get_wait_pct(domain2));
+}
+
+/* Prints wait percentage statistic */
+static void print_wait_pct(xenstat_domain *domain)
+{
+	print("%7.1f", get_wait_pct(domain));
+}
+
 /* Compares current memory of two domains, returning -1,0,1 for <,=,> */
 static int compare_mem(xenstat_domain *domain1, xenstat_domain *domain2)
 {
@@ -986,6 +1026,81 @@ void do_summary(void)
 	      xenstat_node_cpu_hz(cur_node)/1000000);
 }
 
+/* Returns how much a scheduling statistic grew since the previous sample */
+static unsigned long long sched_delta(unsigned long long cur,
+				      unsigned long long prev)
+{
+	/* If a pCPU went offline, just go with the absolute value */
+	return cur >= prev ? cur - prev : cur;
+}
+
+static unsigned long long sched_count(unsigned int hist)
+{
+	return sched_delta(xenstat_node_sched_count(cur_node, hist),
+			   prev_node == NULL ? 0 :
+			   xenstat_node_sched_count(prev_node, hist));
+}
+
+static unsigned long long sched_sum(unsigned int hist)
+{
+	return sched_delta(xenstat_node_sched_sum(cur_node, hist),
+			   prev_node == NULL ? 0 :
+			   xenstat_node_sched_sum(prev_node, hist));
+}
+
+/* Formats the bucket of a scheduling time histogram holding the given
+ * percentile of the samples.  Bucket b holds samples below 2^(b+10)ns,
+ * except for the last one, which holds everything above. */
+static void sched_pct_str(char *str, size_t len, unsigned int hist,
+			  unsigned int pct)
+{
+	unsigned long long count = sched_count(hist), seen = 0;
+	unsigned int b, nr = xenstat_node_sched_num_buckets(cur_node);
+
+	if (count == 0) {
+		snprintf(str, len, "-");
+		return;
+	}
+
+	for (b = 0; b < nr - 1; b++) {
+		seen += sched_delta(xenstat_node_sched_bucket(cur_node, hist, b),
+				    prev_node == NULL ? 0 :
+				    xenstat_node_sched_bucket(prev_node, hist, b));
+		if (seen * 100 >= count * pct)
+			break;
+	}
+
+	if (b < nr - 1)
+		snprintf(str, len, "<%.0fus", ldexp(1.024, b));
+	else
+		snprintf(str, len, ">%.0fus", ldexp(1.024, b - 1));
+}
+
+/* Prints the scheduling latency summary, for the last interval */
+void do_sched_summary(void)
+{
+#define PCT_STR_LEN 16
+	char wake50[PCT_STR_LEN], wake99[PCT_STR_LEN], wait99[PCT_STR_LEN];
+	unsigned long long decisions, switches;
+
+	/* Nothing to show if the hypervisor does not collect them */
+	if (xenstat_node_sched_count(cur_node, XENSTAT_SCHED_RUNQ_LEN) == 0)
+		return;
+
+	sched_pct_str(wake50, PCT_STR_LEN, XENSTAT_SCHED_WAKE_LATENCY, 50);
+	sched_pct_str(wake99, PCT_STR_LEN, XENSTAT_SCHED_WAKE_LATENCY, 99);
+	sched_pct_str(wait99, PCT_STR_LEN, XENSTAT_SCHED_RUNQ_WAIT, 99);
+	decisions = sched_count(XENSTAT_SCHED_RUNQ_LEN);
+	switches = sched_count(XENSTAT_SCHED_SWITCH_COST);
+
+	print("Sched: wake p50 %s p99 %s, wait p99 %s, runq avg %.2f, "
+	      "switch avg %.1fus\n", wake50, wake99, wait99,
+	      decisions ? (double)sched_sum(XENSTAT_SCHED_RUNQ_LEN)
+			  / decisions : 0.0,
+	      switches ? sched_sum(XENSTAT_SCHED_SWITCH_COST)
+			 / 1000.0 / switches : 0.0);
+}
+
 /* Display the top header for the domain table */
 void do_header(void)
 {
@@ -1179,8 +1294,10 @@ static void top(void)
 		fail("Failed to retrieve statistics from libxenstat\n");
 
 	/* dump summary top information */
-	if (!batch)
+	if (!batch) {
 		do_summary();
+		do_sched_summary();
+	}
 
 	/* Count the number of domains for which to report data */
 	num_domains = xenstat_node_num_domains(cur_node);
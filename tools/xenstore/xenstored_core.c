@@ -40,6 +40,9 @@
 #include <signal.h>
 #include <assert.h>
 #include <setjmp.h>
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
 
 #include <xenevtchn.h>
 
@@ -52,7 +55,7 @@
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
 #include "xenstored_control.h"
-#include "tdb.h"
+#include "xenstored_store.h"
 
 #ifndef NO_SOCKETS
 #if defined(HAVE_SYSTEMD)
@@ -79,10 +82,45 @@ static bool recovery = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 char *tracefile = NULL;
-TDB_CONTEXT *tdb_ctx = NULL;
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
 
+#ifndef NO_THREADS
+/*
+ * Optional pool of reader threads.  Requests which can't modify anything
+ * (reads outside of a transaction) are queued for the pool, everything
+ * else is still handled by the main loop, the only writer of the store.
+ * Readers look nodes up in the latest version of the store published (see
+ * xenstored_store.h), which includes everything done before their request
+ * got queued, so they don't hold up the main loop and it doesn't hold them
+ * up.
+ *
+ * A connection is busy from queueing its read until the main loop has
+ * picked the reply up from reader_done: it isn't read from meanwhile,
+ * which keeps its requests in order, and only the main loop touches its
+ * output list.
+ */
+#define MAX_READER_THREADS 64
+static unsigned int nr_reader_threads;
+static pthread_mutex_t reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reader_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reader_idle_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(reader_queue);
+static LIST_HEAD(reader_done);
+static int reader_pipe[2] = { -1, -1 };
+static int reader_pipe0_pollfd_idx = -1;
+static __thread bool in_reader_thread;
+
+/* Only valid in the main loop, see above. */
+static bool conn_busy(struct connection *conn)
+{
+	return conn->reader_busy;
+}
+#else
+#define in_reader_thread false
+#define conn_busy(conn) false
+#endif
+
 #define log(...)							\
 	do {								\
 		char *s = talloc_asprintf(NULL, __VA_ARGS__);		\
@@ -257,6 +295,17 @@ static int destroy_conn(void *_conn)
 {
 	struct connection *conn = _conn;
 
+#ifndef NO_THREADS
+	/* Drop a queued read, or wait for the reader working on it. */
+	if (conn_busy(conn)) {
+		pthread_mutex_lock(&reader_mutex);
+		while (conn->reader_pending && list_empty(&conn->reader_list))
+			pthread_cond_wait(&reader_idle_cond, &reader_mutex);
+		list_del_init(&conn->reader_list);
+		pthread_mutex_unlock(&reader_mutex);
+	}
+#endif
+
 	/* Flush outgoing if possible, but don't block. */
 	if (!conn->domain) {
 		struct pollfd pfd;
@@ -335,18 +384,24 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 		xce_pollfd_idx = set_fd(xenevtchn_fd(xce_handle),
 					POLLIN|POLLPRI);
 
+#ifndef NO_THREADS
+	if (reader_pipe[0] != -1)
+		reader_pipe0_pollfd_idx = set_fd(reader_pipe[0], POLLIN);
+#endif
+
 	wrl_gettime_now(&now);
 	wrl_log_periodic(now);
 
 	list_for_each_entry(conn, &connections, list) {
 		if (conn->domain) {
 			wrl_check_timeout(conn->domain, now, ptimeout);
-			if (domain_can_read(conn) ||
+			if ((!conn_busy(conn) && domain_can_read(conn)) ||
 			    (domain_can_write(conn) &&
 			     !list_empty(&conn->out_list)))
 				*ptimeout = 0;
 		} else {
-			short events = POLLIN|POLLPRI;
+			/* Don't read the next request before replying. */
+			short events = conn_busy(conn) ? 0 : POLLIN|POLLPRI;
 			if (!list_empty(&conn->out_list))
 				events |= POLLOUT;
 			conn->pollfd_idx = set_fd(conn->fd, events);
@@ -354,6 +409,105 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 	}
 }
 
+unsigned int hash_from_key_fn(void *k)
+{
+	char *str = k;
+	unsigned int hash = 5381;
+	char c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + (unsigned int)c;
+
+	return hash;
+}
+
+
+int keys_equal_fn(void *key1, void *key2)
+{
+	return 0 == strcmp((char *)key1, (char *)key2);
+}
+
+
+/*
+ * The node store: records in xs_tdb_record_hdr format, keyed by node name,
+ * or for nodes local to a transaction by the name with the transaction's
+ * generation prepended.
+ *
+ * Records are immutable once stored.  Each store entry holds a talloc link
+ * from nodes_ctx to its record and each struct node read from the store a
+ * talloc reference, so that a record may be shared between the global store,
+ * transactions having read the node and nodes in flight, and lives until the
+ * last of them lets go.  Reading a node therefore copies nothing, and a
+ * transaction's view of a node it has read is the record as it was, not a
+ * copy of it.
+ */
+static void *nodes_ctx;
+
+static size_t db_record_size(const struct xs_tdb_record_hdr *hdr)
+{
+	return sizeof(*hdr) + hdr->num_perms * sizeof(hdr->perms[0])
+		+ hdr->datalen + hdr->childlen;
+}
+
+struct xs_tdb_record_hdr *db_fetch(const char *db_name)
+{
+	return store_fetch(db_name);
+}
+
+static void db_release(struct xs_tdb_record_hdr *hdr)
+{
+	talloc_unlink(nodes_ctx, hdr);
+}
+
+/*
+ * Make hdr, which must hold a link from nodes_ctx the store may consume, the
+ * record for db_name.  On failure the store is unchanged.
+ */
+static int db_insert(const char *db_name, struct xs_tdb_record_hdr *hdr)
+{
+	return store_set(db_name, hdr);
+}
+
+int db_link(const char *db_name, struct xs_tdb_record_hdr *hdr)
+{
+	int ret;
+
+	if (!talloc_reference(nodes_ctx, hdr))
+		return ENOMEM;
+
+	ret = db_insert(db_name, hdr);
+	if (ret)
+		talloc_unlink(nodes_ctx, hdr);
+
+	return ret;
+}
+
+int db_copy(const char *from_name, const char *to_name, uint64_t generation)
+{
+	struct xs_tdb_record_hdr *from, *hdr;
+	int ret;
+
+	from = db_fetch(from_name);
+	if (!from)
+		return ENOENT;
+
+	hdr = talloc_memdup(nodes_ctx, from, db_record_size(from));
+	if (!hdr)
+		return ENOMEM;
+	hdr->generation = generation;
+
+	ret = db_insert(to_name, hdr);
+	if (ret)
+		talloc_free(hdr);
+
+	return ret;
+}
+
+int db_delete(const char *db_name)
+{
+	return store_remove(db_name);
+}
+
 /*
  * If it fails, returns NULL and sets errno.
  * Temporary memory allocations will be done with ctx.
@@ -361,7 +515,7 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 static struct node *read_node(struct connection *conn, const void *ctx,
 			      const char *name)
 {
-	TDB_DATA key, data;
+	const char *db_name;
 	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
 
@@ -377,29 +531,33 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 		return NULL;
 	}
 
-	if (transaction_prepend(conn, name, &key))
+	if (transaction_prepend(conn, name, &db_name))
 		return NULL;
 
-	data = tdb_fetch(tdb_ctx, key);
+	hdr = db_fetch(db_name);
 
-	if (data.dptr == NULL) {
-		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) {
-			node->generation = NO_GENERATION;
-			access_node(conn, node, NODE_ACCESS_READ, NULL);
-			errno = ENOENT;
-		} else {
-			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
-			errno = EIO;
-		}
+	if (hdr == NULL) {
+		node->generation = NO_GENERATION;
+		access_node(conn, node, NODE_ACCESS_READ, NULL);
 		talloc_free(node);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	/*
+	 * Pin the record rather than copying it.  Reader threads mustn't
+	 * touch the shared record, their snapshot keeps it alive for them.
+	 */
+	if (!in_reader_thread && !talloc_reference(node, hdr)) {
+		talloc_free(node);
+		errno = ENOMEM;
 		return NULL;
 	}
 
 	node->parent = NULL;
-	talloc_steal(node, data.dptr);
+	node->hdr = hdr;
 
 	/* Datalen, childlen, number of permissions */
-	hdr = (void *)data.dptr;
 	node->generation = hdr->generation;
 	node->num_perms = hdr->num_perms;
 	node->datalen = hdr->datalen;
@@ -417,24 +575,29 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	return node;
 }
 
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node)
+int write_node_raw(struct connection *conn, const char *db_name,
+		   struct node *node)
 {
-	TDB_DATA data;
+	size_t size;
 	void *p;
 	struct xs_tdb_record_hdr *hdr;
+	int ret;
 
-	data.dsize = sizeof(*hdr)
+	size = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
 	if (domain_is_unprivileged(conn) &&
-	    data.dsize >= quota_max_entry_size) {
+	    size >= quota_max_entry_size) {
 		errno = ENOSPC;
 		return errno;
 	}
 
-	data.dptr = talloc_size(node, data.dsize);
-	hdr = (void *)data.dptr;
+	hdr = talloc_size(nodes_ctx, size);
+	if (!hdr) {
+		errno = ENOMEM;
+		return errno;
+	}
 	hdr->generation = node->generation;
 	hdr->num_perms = node->num_perms;
 	hdr->datalen = node->datalen;
@@ -446,10 +609,10 @@ int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_ctx, *key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key->dptr);
-		errno = EIO;
+	ret = db_insert(db_name, hdr);
+	if (ret) {
+		talloc_free(hdr);
+		errno = ret;
 		return errno;
 	}
 	return 0;
@@ -457,12 +620,12 @@ int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node)
 
 static int write_node(struct connection *conn, struct node *node)
 {
-	TDB_DATA key;
+	const char *db_name;
 
-	if (access_node(conn, node, NODE_ACCESS_WRITE, &key))
+	if (access_node(conn, node, NODE_ACCESS_WRITE, &db_name))
 		return errno;
 
-	return write_node_raw(conn, &key, node);
+	return write_node_raw(conn, db_name, node);
 }
 
 static enum xs_perm_type perm_for_conn(struct connection *conn,
@@ -527,7 +690,9 @@ static int ask_parents(struct connection *conn, const void *ctx,
 
 	/* No permission at root?  We're in trouble. */
 	if (!node) {
-		corrupt(conn, "No permissions file at root");
+		/* Checking the store is up to the main loop. */
+		if (!in_reader_thread)
+			corrupt(conn, "No permissions file at root");
 		*perm = XS_PERM_NONE;
 		return 0;
 	}
@@ -704,8 +869,11 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 	bdata->hdr.msg.len = len;
 	memcpy(bdata->buffer, data, len);
 
-	/* Queue for later transmission. */
-	list_add_tail(&bdata->list, &conn->out_list);
+	/* Queue for later transmission, readers leave that to the main loop. */
+	if (in_reader_thread)
+		conn->reader_reply = bdata;
+	else
+		list_add_tail(&bdata->list, &conn->out_list);
 
 	return;
 }
@@ -886,12 +1054,12 @@ static int do_read(struct connection *conn, struct buffered_data *in)
 
 static void delete_node_single(struct connection *conn, struct node *node)
 {
-	TDB_DATA key;
+	const char *db_name;
 
-	if (access_node(conn, node, NODE_ACCESS_DELETE, &key))
+	if (access_node(conn, node, NODE_ACCESS_DELETE, &db_name))
 		return;
 
-	if (tdb_delete(tdb_ctx, key) != 0) {
+	if (db_delete(db_name) != 0) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -960,6 +1128,7 @@ static struct node *construct_node(struct connection *conn, const void *ctx,
 	node->children = node->data = NULL;
 	node->childlen = node->datalen = 0;
 	node->parent = parent;
+	node->hdr = NULL;
 	domain_entry_inc(conn, node);
 	return node;
 
@@ -971,15 +1140,11 @@ nomem:
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(tdb_ctx, key);
+	db_delete(node->name);
 	return 0;
 }
 
@@ -1102,19 +1267,21 @@ static void delete_node(struct connection *conn, struct node *node)
 }
 
 
-/* Delete memory using memmove. */
-static void memdel(void *mem, unsigned off, unsigned len, unsigned total)
-{
-	memmove(mem + off, mem + off + len, total - off - len);
-}
-
-
 static int remove_child_entry(struct connection *conn, struct node *node,
 			      size_t offset)
 {
-	size_t childlen = strlen(node->children + offset);
-	memdel(node->children, offset, childlen + 1, node->childlen);
-	node->childlen -= childlen + 1;
+	size_t entrylen = strlen(node->children + offset) + 1;
+	char *children;
+
+	/* The children may be shared with the store: don't edit in place. */
+	children = talloc_array(node, char, node->childlen - entrylen);
+	if (!children)
+		return ENOMEM;
+	memcpy(children, node->children, offset);
+	memcpy(children + offset, node->children + offset + entrylen,
+	       node->childlen - offset - entrylen);
+	node->children = children;
+	node->childlen -= entrylen;
 	return write_node(conn, node);
 }
 
@@ -1330,6 +1497,131 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 	conn->transaction = NULL;
 }
 
+#ifndef NO_THREADS
+static void *reader_thread(void *arg)
+{
+	unsigned int id = (unsigned long)arg;
+	struct connection *conn;
+	char c = 0;
+
+	in_reader_thread = true;
+
+	for (;;) {
+		pthread_mutex_lock(&reader_mutex);
+		while (list_empty(&reader_queue))
+			pthread_cond_wait(&reader_cond, &reader_mutex);
+		conn = list_top(&reader_queue, struct connection,
+				reader_list);
+		list_del_init(&conn->reader_list);
+		pthread_mutex_unlock(&reader_mutex);
+
+		store_read_begin(id);
+		process_message(conn, conn->in);
+		store_read_end(id);
+		assert(conn->in == NULL);
+
+		pthread_mutex_lock(&reader_mutex);
+		conn->reader_pending = false;
+		list_add_tail(&conn->reader_list, &reader_done);
+		pthread_cond_broadcast(&reader_idle_cond);
+		pthread_mutex_unlock(&reader_mutex);
+
+		/* Wake the main loop to send the reply; a full pipe is fine. */
+		if (write(reader_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+			barf_perror("reader pipe write failed");
+	}
+
+	return NULL;
+}
+
+/* Hand a request to the reader threads if it can't modify anything. */
+static bool queue_for_reader(struct connection *conn)
+{
+	if (!nr_reader_threads || conn->in->hdr.msg.tx_id)
+		return false;
+
+	switch (conn->in->hdr.msg.type) {
+	case XS_READ:
+	case XS_DIRECTORY:
+	case XS_DIRECTORY_PART:
+	case XS_GET_PERMS:
+		break;
+	default:
+		return false;
+	}
+
+	/* The reader must see everything done before the request. */
+	store_publish();
+
+	conn->reader_busy = true;
+	pthread_mutex_lock(&reader_mutex);
+	conn->reader_pending = true;
+	list_add_tail(&conn->reader_list, &reader_queue);
+	pthread_cond_signal(&reader_cond);
+	pthread_mutex_unlock(&reader_mutex);
+
+	return true;
+}
+
+/* Queue the replies of finished reads for sending. */
+static void collect_reader_replies(void)
+{
+	struct connection *conn;
+
+	pthread_mutex_lock(&reader_mutex);
+	while ((conn = list_top(&reader_done, struct connection,
+				reader_list))) {
+		list_del_init(&conn->reader_list);
+		conn->reader_busy = false;
+		if (conn->reader_reply) {
+			list_add_tail(&conn->reader_reply->list,
+				      &conn->out_list);
+			conn->reader_reply = NULL;
+		}
+	}
+	pthread_mutex_unlock(&reader_mutex);
+}
+
+/*
+ * Wait until a read of conn handed to the reader threads has been done, so
+ * that the main loop may change what they look at.
+ */
+void conn_wait_reader(struct connection *conn)
+{
+	if (!conn_busy(conn))
+		return;
+
+	pthread_mutex_lock(&reader_mutex);
+	while (conn->reader_pending)
+		pthread_cond_wait(&reader_idle_cond, &reader_mutex);
+	pthread_mutex_unlock(&reader_mutex);
+}
+
+static void init_reader_threads(void)
+{
+	pthread_t thread;
+	unsigned long i;
+
+	if (!nr_reader_threads)
+		return;
+
+	if (store_init_readers(nr_reader_threads))
+		barf("Could not initialise store for reader threads");
+
+	if (pipe(reader_pipe) ||
+	    fcntl(reader_pipe[1], F_SETFL, O_NONBLOCK) < 0)
+		barf_perror("Could not create reader pipe");
+
+	for (i = 0; i < nr_reader_threads; i++) {
+		errno = pthread_create(&thread, NULL, reader_thread,
+				       (void *)i);
+		if (errno)
+			barf_perror("Could not create reader thread");
+		pthread_detach(thread);
+	}
+}
+#endif
+
 static void consider_message(struct connection *conn)
 {
 	if (verbose)
@@ -1337,6 +1629,11 @@ static void consider_message(struct connection *conn)
 			sockmsg_string(conn->in->hdr.msg.type),
 			conn->in->hdr.msg.len, conn);
 
+#ifndef NO_THREADS
+	if (queue_for_reader(conn))
+		return;
+#endif
+
 	process_message(conn, conn->in);
 
 	assert(conn->in == NULL);
@@ -1426,6 +1723,8 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 	new->transaction_started = 0;
 	INIT_LIST_HEAD(&new->out_list);
 	INIT_LIST_HEAD(&new->watches);
+	INIT_LIST_HEAD(&new->fired_watches);
+	INIT_LIST_HEAD(&new->reader_list);
 	INIT_LIST_HEAD(&new->transaction_list);
 
 	list_add_tail(&new->list, &connections);
@@ -1495,8 +1794,6 @@ static void accept_connection(int sock, bool canwrite)
 }
 #endif
 
-static int tdb_flags;
-
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
 {
@@ -1519,41 +1816,11 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
-static void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
-{
-	va_list ap;
-	char *s;
-
-	va_start(ap, fmt);
-	s = talloc_vasprintf(NULL, fmt, ap);
-	va_end(ap);
-
-	if (s) {
-		trace("TDB: %s\n", s);
-		syslog(LOG_ERR, "TDB: %s",  s);
-		if (verbose)
-			xprintf("TDB: %s", s);
-		talloc_free(s);
-	} else {
-		trace("talloc failure during logging\n");
-		syslog(LOG_ERR, "talloc failure during logging\n");
-	}
-}
-
 static void setup_structure(void)
 {
-	char *tdbname;
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-	if (!tdbname)
-		barf_perror("Could not create tdbname");
-
-	if (!(tdb_flags & TDB_INTERNAL))
-		unlink(tdbname);
-
-	tdb_ctx = tdb_open_ex(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT|O_EXCL,
-			      0640, &tdb_logger, NULL);
-	if (!tdb_ctx)
-		barf_perror("Could not create tdb file %s", tdbname);
+	nodes_ctx = talloc_named_const(talloc_autofree_context(), 0, "nodes");
+	if (!nodes_ctx || store_init(db_release))
+		barf_perror("Could not create node store");
 
 	manual_node("/", "tool");
 	manual_node("/tool", "xenstored");
@@ -1563,24 +1830,6 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
-{
-	char *str = k;
-	unsigned int hash = 5381;
-	char c;
-
-	while ((c = *str++))
-		hash = ((hash << 5) + hash) + (unsigned int)c;
-
-	return hash;
-}
-
-
-static int keys_equal_fn(void *key1, void *key2)
-{
-	return 0 == strcmp((char *)key1, (char *)key2);
-}
-
 
 static char *child_name(const char *s1, const char *s2)
 {
@@ -1709,12 +1958,11 @@ static int check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(const char *key, void *private)
 {
 	struct hashtable *reachable = private;
 	char *slash;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
+	char * name = talloc_strdup(NULL, key);
 
 	if (!name) {
 		log("clean_store: ENOMEM");
@@ -1729,7 +1977,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			db_delete(key);
 		}
 	}
 
@@ -1745,7 +1993,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	store_iterate(&clean_store_, reachable);
 }
 
 
@@ -1878,7 +2126,10 @@ static void usage(void)
 "  -t, --transaction <nb>  limit the number of transaction allowed per domain,\n"
 "  -R, --no-recovery       to request that no recovery should be attempted when\n"
 "                          the store is corrupted (debug only),\n"
-"  -I, --internal-db       store database in memory, not on disk\n"
+"  -I, --internal-db       ignored, the database is always kept in memory,\n"
+"  -r, --reader-threads <nb> handle reads outside of transactions in <nb>\n"
+"                          threads, at most 64 (0, the default, handles all\n"
+"                          requests in the main loop),\n"
 "  -V, --verbose           to request verbose execution.\n");
 }
 
@@ -1898,6 +2149,7 @@ static struct option options[] = {
 	{ "transaction", 1, NULL, 't' },
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "reader-threads", 1, NULL, 'r' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
@@ -1918,7 +2170,7 @@ int main(int argc, char *argv[])
 	int timeout;
 
 
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RVW:", options,
+	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:Rr:VW:", options,
 				  NULL)) != -1) {
 		switch (opt) {
 		case 'D':
@@ -1952,7 +2204,23 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			/* The node store is always in memory. */
+			break;
+		case 'r':
+#ifndef NO_THREADS
+		{
+			char *end;
+			long nr;
+
+			errno = 0;
+			nr = strtol(optarg, &end, 10);
+			if (errno || end == optarg || *end || nr < 0 ||
+			    nr > MAX_READER_THREADS)
+				barf("Invalid number of reader threads: %s",
+				     optarg);
+			nr_reader_threads = nr;
+		}
+#endif
 			break;
 		case 'V':
 			verbose = true;
@@ -2011,6 +2279,10 @@ int main(int argc, char *argv[])
 	/* Restore existing connections. */
 	restore_existing_connections();
 
+#ifndef NO_THREADS
+	init_reader_threads();
+#endif
+
 	if (outputpid) {
 		printf("%ld\n", (long)getpid());
 		fflush(stdout);
@@ -2039,13 +2311,36 @@ int main(int argc, char *argv[])
 	/* Main loop. */
 	for (;;) {
 		struct connection *conn, *next;
+		int ret;
+
+		/*
+		 * Let new reads see what we've done, and free what readers
+		 * can no longer see.
+		 */
+		store_publish();
+		store_reclaim();
 
-		if (poll(fds, nr_fds, timeout) < 0) {
+		ret = poll(fds, nr_fds, timeout);
+		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
 			barf_perror("Poll failed");
 		}
 
+#ifndef NO_THREADS
+		if (reader_pipe0_pollfd_idx != -1) {
+			if (fds[reader_pipe0_pollfd_idx].revents & POLLIN) {
+				char buf[64];
+				if (read(reader_pipe[0], buf, sizeof(buf)) < 0)
+					barf_perror("reader pipe read failed");
+			}
+			reader_pipe0_pollfd_idx = -1;
+		}
+
+		if (nr_reader_threads)
+			collect_reader_replies();
+#endif
+
 		if (reopen_log_pipe0_pollfd_idx != -1) {
 			if (fds[reopen_log_pipe0_pollfd_idx].revents
 			    & ~POLLIN) {
@@ -2104,7 +2399,7 @@ int main(int argc, char *argv[])
 				talloc_increase_ref_count(next);
 
 			if (conn->domain) {
-				if (domain_can_read(conn))
+				if (!conn_busy(conn) && domain_can_read(conn))
 					handle_input(conn);
 				if (talloc_free(conn) == 0)
 					continue;
@@ -31,7 +31,6 @@
 
 #include "xenstore_lib.h"
 #include "list.h"
-#include "tdb.h"
 #include "hashtable.h"
 
 /* DEFAULT_BUFFER_SIZE should be large enough for each errno string. */
@@ -103,6 +102,16 @@ struct connection
 	/* My watches. */
 	struct list_head watches;
 
+	/* Watches with an event being fired, see fire_watches(). */
+	struct list_head fired_watches;
+	struct list_head fired_list;
+
+	/* A read handed to the reader threads, see xenstored_core.c. */
+	bool reader_busy;		/* Main loop only. */
+	bool reader_pending;		/* Protected by reader_mutex. */
+	struct list_head reader_list;
+	struct buffered_data *reader_reply;
+
 	/* Methods for communicating over this connection: write can be NULL */
 	connwritefn_t *write;
 	connreadfn_t *read;
@@ -130,6 +139,9 @@ struct node {
 	/* Children, each nul-terminated. */
 	unsigned int childlen;
 	char *children;
+
+	/* Store record perms, data and children point into, NULL if none. */
+	struct xs_tdb_record_hdr *hdr;
 };
 
 /* Return the only argument in the input. */
@@ -148,8 +160,17 @@ void send_ack(struct connection *conn, enum xsd_sockmsg_type type);
 /* Canonicalize this path if possible. */
 char *canonicalize(struct connection *conn, const void *ctx, const char *node);
 
-/* Write a node to the tdb data base. */
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node);
+/* Write a node to the data base. */
+int write_node_raw(struct connection *conn, const char *db_name,
+		   struct node *node);
+
+/* Node store access, NULL or ENOENT if db_name isn't present. */
+struct xs_tdb_record_hdr *db_fetch(const char *db_name);
+int db_delete(const char *db_name);
+/* Store hdr, as fetched, under db_name too without copying it. */
+int db_link(const char *db_name, struct xs_tdb_record_hdr *hdr);
+/* Store a copy of a record under another name with a new generation. */
+int db_copy(const char *from_name, const char *to_name, uint64_t generation);
 
 /* Get this node, checking we have permissions. */
 struct node *get_node(struct connection *conn,
@@ -158,6 +179,13 @@ struct node *get_node(struct connection *conn,
 		      enum xs_perm_type perm);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
+#ifndef NO_THREADS
+void conn_wait_reader(struct connection *conn);
+#else
+static inline void conn_wait_reader(struct connection *conn)
+{
+}
+#endif
 void check_store(void);
 void corrupt(struct connection *conn, const char *fmt, ...);
 
@@ -175,7 +203,6 @@ void close_log(void);
 extern char *tracefile;
 extern int tracefd;
 
-extern TDB_CONTEXT *tdb_ctx;
 extern int dom0_domid;
 extern int dom0_event;
 extern int priv_domid;
@@ -208,6 +235,10 @@ xengnttab_handle **xgt_handle;
 
 int remember_string(struct hashtable *hash, const char *str);
 
+/* Hashtable functions for nul terminated string keys. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
+
 #endif /* _XENSTORED_CORE_H */
 
 /*
@@ -464,6 +464,8 @@ int do_set_target(struct connection *conn, struct buffered_data *in)
 	if (IS_ERR(tdomain))
 		return -PTR_ERR(tdomain);
 
+	/* Reader threads check permissions against the target. */
+	conn_wait_reader(domain->conn);
         talloc_reference(domain->conn, tdomain->conn);
         domain->conn->target = tdomain->conn;
 
@@ -0,0 +1,537 @@
+/*
+    Versioned node index for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xenstored_core.h"
+#include "xenstored_store.h"
+
+/*
+ * A version is a table of segments of STORE_SEG_SIZE hash buckets each,
+ * the buckets holding singly linked chains of entries.  Versions, segments
+ * and entries are tagged with the generation they were created in: those of
+ * the working generation haven't been published and are modified in place,
+ * older ones are copied on write.  Changing an entry thus copies the version,
+ * its segment and the entries in front of it in the chain, once per
+ * generation.
+ */
+#define STORE_SEG_SHIFT		8
+#define STORE_SEG_SIZE		(1U << STORE_SEG_SHIFT)
+#define STORE_INIT_SEGS		32
+
+struct store_obj {
+	/* Generation the object was created in. */
+	uint64_t gen;
+	/* Once retired: last published generation it is part of. */
+	uint64_t last_gen;
+	struct store_obj *next_retired;
+	/* Record whose link is dropped with the object. */
+	struct xs_tdb_record_hdr *release;
+};
+
+struct store_entry {
+	struct store_obj obj;
+	struct store_entry *next;
+	/* Generation the link to hdr was handed to the store in. */
+	uint64_t hdr_gen;
+	struct xs_tdb_record_hdr *hdr;
+	unsigned int hash;
+	char name[];
+};
+
+struct store_seg {
+	struct store_obj obj;
+	struct store_entry *bucket[STORE_SEG_SIZE];
+};
+
+struct store_version {
+	struct store_obj obj;
+	unsigned int nr_segs;
+	unsigned int count;
+	struct store_seg *seg[];
+};
+
+static void (*store_release)(struct xs_tdb_record_hdr *hdr);
+
+static struct store_version *working;
+static uint64_t working_gen = 1;
+
+/* Retired objects, oldest first. */
+static struct store_obj *retired;
+static struct store_obj **retired_tail = &retired;
+
+#ifndef NO_THREADS
+static bool working_dirty;
+static struct store_version *published;
+static uint64_t published_gen;
+
+/* Generation each reader started with, 0 if idle. */
+static unsigned int nr_readers;
+static uint64_t *reader_gen;
+static __thread struct store_version *reader_version;
+#endif
+
+static unsigned int store_hash(const char *name)
+{
+	unsigned int h = hash_from_key_fn((void *)name);
+
+	/* The low bits select the bucket, mix in the upper ones. */
+	h += ~(h << 9);
+	h ^= ((h >> 14) | (h << 18));
+	h += (h << 4);
+	h ^= ((h >> 10) | (h << 22));
+
+	return h;
+}
+
+static struct store_entry **store_bucket(struct store_version *v,
+					 unsigned int hash)
+{
+	unsigned int idx = hash & (v->nr_segs * STORE_SEG_SIZE - 1);
+
+	return &v->seg[idx >> STORE_SEG_SHIFT]->bucket[idx % STORE_SEG_SIZE];
+}
+
+static struct store_entry *store_lookup(struct store_version *v,
+					const char *name, unsigned int hash)
+{
+	struct store_entry *e;
+
+	for (e = *store_bucket(v, hash); e; e = e->next)
+		if (e->hash == hash && !strcmp(e->name, name))
+			return e;
+
+	return NULL;
+}
+
+static void store_free(struct store_obj *obj)
+{
+	if (obj->release)
+		store_release(obj->release);
+	free(obj);
+}
+
+/*
+ * obj is no longer part of the working version.  Free it right away unless
+ * it, or the record link it drops, may be seen by a reader.
+ */
+static void store_retire(struct store_obj *obj,
+			 struct xs_tdb_record_hdr *release,
+			 uint64_t release_gen)
+{
+	obj->release = release;
+
+	if (obj->gen == working_gen &&
+	    (!release || release_gen == working_gen)) {
+		store_free(obj);
+		return;
+	}
+
+#ifndef NO_THREADS
+	obj->last_gen = published_gen;
+#endif
+	obj->next_retired = NULL;
+	*retired_tail = obj;
+	retired_tail = &obj->next_retired;
+}
+
+static struct store_version *store_version_alloc(unsigned int nr_segs)
+{
+	struct store_version *v;
+
+	v = malloc(sizeof(*v) + nr_segs * sizeof(v->seg[0]));
+	if (v) {
+		memset(&v->obj, 0, sizeof(v->obj));
+		v->obj.gen = working_gen;
+		v->nr_segs = nr_segs;
+		v->count = 0;
+	}
+
+	return v;
+}
+
+/* Free a version nobody has seen yet, including its segments and entries. */
+static void store_version_free(struct store_version *v)
+{
+	struct store_entry *e, *next;
+	unsigned int s, b;
+
+	for (s = 0; s < v->nr_segs; s++) {
+		if (!v->seg[s])
+			continue;
+		for (b = 0; b < STORE_SEG_SIZE; b++)
+			for (e = v->seg[s]->bucket[b]; e; e = next) {
+				next = e->next;
+				free(e);
+			}
+		free(v->seg[s]);
+	}
+	free(v);
+}
+
+static struct store_seg *store_seg_alloc(void)
+{
+	struct store_seg *seg = calloc(1, sizeof(*seg));
+
+	if (seg)
+		seg->obj.gen = working_gen;
+
+	return seg;
+}
+
+static struct store_entry *store_entry_copy(const struct store_entry *e)
+{
+	size_t size = sizeof(*e) + strlen(e->name) + 1;
+	struct store_entry *copy = malloc(size);
+
+	if (copy) {
+		memcpy(copy, e, size);
+		copy->obj.gen = working_gen;
+	}
+
+	return copy;
+}
+
+/* Make the segment holding hash writable. */
+static struct store_seg *store_seg_cow(unsigned int hash)
+{
+	struct store_version *v = working;
+	struct store_seg *seg;
+	unsigned int s;
+
+	if (v->obj.gen != working_gen) {
+		v = store_version_alloc(working->nr_segs);
+		if (!v)
+			return NULL;
+		v->count = working->count;
+		memcpy(v->seg, working->seg, v->nr_segs * sizeof(v->seg[0]));
+		store_retire(&working->obj, NULL, 0);
+		working = v;
+	}
+
+	s = (hash & (v->nr_segs * STORE_SEG_SIZE - 1)) >> STORE_SEG_SHIFT;
+	seg = v->seg[s];
+	if (seg->obj.gen != working_gen) {
+		seg = malloc(sizeof(*seg));
+		if (!seg)
+			return NULL;
+		memcpy(seg, v->seg[s], sizeof(*seg));
+		seg->obj.gen = working_gen;
+		store_retire(&v->seg[s]->obj, NULL, 0);
+		v->seg[s] = seg;
+	}
+
+	return seg;
+}
+
+/*
+ * Return the link to target in the chain starting at link, copying the
+ * entries in front of it which are shared with a published version.
+ */
+static struct store_entry **store_chain_cow(struct store_entry **link,
+					    struct store_entry *target)
+{
+	struct store_entry *e, *copy;
+
+	while ((e = *link) != target) {
+		if (e->obj.gen != working_gen) {
+			copy = store_entry_copy(e);
+			if (!copy)
+				return NULL;
+			*link = copy;
+			store_retire(&e->obj, NULL, 0);
+			e = copy;
+		}
+		link = &e->next;
+	}
+
+	return link;
+}
+
+/* Double the number of buckets.  Failing only costs longer chains. */
+static void store_grow(void)
+{
+	struct store_version *v;
+	struct store_entry *e, *copy, **bucket;
+	unsigned int s, b;
+
+	v = store_version_alloc(working->nr_segs * 2);
+	if (!v)
+		return;
+	memset(v->seg, 0, v->nr_segs * sizeof(v->seg[0]));
+
+	for (s = 0; s < v->nr_segs; s++) {
+		v->seg[s] = store_seg_alloc();
+		if (!v->seg[s])
+			goto nomem;
+	}
+
+	/* Copy all entries, the chains of the old version stay intact. */
+	for (s = 0; s < working->nr_segs; s++)
+		for (b = 0; b < STORE_SEG_SIZE; b++)
+			for (e = working->seg[s]->bucket[b]; e; e = e->next) {
+				copy = store_entry_copy(e);
+				if (!copy)
+					goto nomem;
+				bucket = store_bucket(v, copy->hash);
+				copy->next = *bucket;
+				*bucket = copy;
+				v->count++;
+			}
+
+	for (s = 0; s < working->nr_segs; s++) {
+		for (b = 0; b < STORE_SEG_SIZE; b++) {
+			struct store_entry *next;
+
+			for (e = working->seg[s]->bucket[b]; e; e = next) {
+				next = e->next;
+				store_retire(&e->obj, NULL, 0);
+			}
+		}
+		store_retire(&working->seg[s]->obj, NULL, 0);
+	}
+	store_retire(&working->obj, NULL, 0);
+	working = v;
+
+	return;
+
+ nomem:
+	store_version_free(v);
+}
+
+int store_init(void (*release)(struct xs_tdb_record_hdr *hdr))
+{
+	unsigned int s;
+
+	store_release = release;
+
+	working = store_version_alloc(STORE_INIT_SEGS);
+	if (!working)
+		return ENOMEM;
+	memset(working->seg, 0, working->nr_segs * sizeof(working->seg[0]));
+
+	for (s = 0; s < working->nr_segs; s++) {
+		working->seg[s] = store_seg_alloc();
+		if (!working->seg[s]) {
+			store_version_free(working);
+			working = NULL;
+			return ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+struct xs_tdb_record_hdr *store_fetch(const char *name)
+{
+	struct store_version *v;
+	struct store_entry *e;
+
+#ifndef NO_THREADS
+	v = reader_version ? : working;
+#else
+	v = working;
+#endif
+
+	e = store_lookup(v, name, store_hash(name));
+
+	return e ? e->hdr : NULL;
+}
+
+int store_set(const char *name, struct xs_tdb_record_hdr *hdr)
+{
+	unsigned int hash = store_hash(name);
+	struct store_entry *e, *new, **link;
+	struct store_seg *seg;
+
+	e = store_lookup(working, name, hash);
+	if (!e && working->count >= working->nr_segs * STORE_SEG_SIZE)
+		store_grow();
+
+#ifndef NO_THREADS
+	working_dirty = true;
+#endif
+
+	seg = store_seg_cow(hash);
+	if (!seg)
+		return ENOMEM;
+	link = &seg->bucket[hash % STORE_SEG_SIZE];
+
+	if (e) {
+		link = store_chain_cow(link, e);
+		if (!link)
+			return ENOMEM;
+
+		/* Nobody but us has seen the entry or its record. */
+		if (e->obj.gen == working_gen && e->hdr_gen == working_gen) {
+			store_release(e->hdr);
+			e->hdr = hdr;
+			return 0;
+		}
+	}
+
+	new = malloc(sizeof(*new) + strlen(name) + 1);
+	if (!new)
+		return ENOMEM;
+	memset(&new->obj, 0, sizeof(new->obj));
+	new->obj.gen = working_gen;
+	new->hdr_gen = working_gen;
+	new->hdr = hdr;
+	new->hash = hash;
+	strcpy(new->name, name);
+
+	if (e) {
+		new->next = e->next;
+		*link = new;
+		store_retire(&e->obj, e->hdr, e->hdr_gen);
+	} else {
+		new->next = *link;
+		*link = new;
+		working->count++;
+	}
+
+	return 0;
+}
+
+int store_remove(const char *name)
+{
+	unsigned int hash = store_hash(name);
+	struct store_entry *e, **link;
+	struct store_seg *seg;
+
+	e = store_lookup(working, name, hash);
+	if (!e)
+		return ENOENT;
+
+#ifndef NO_THREADS
+	working_dirty = true;
+#endif
+
+	seg = store_seg_cow(hash);
+	if (!seg)
+		return ENOMEM;
+	link = store_chain_cow(&seg->bucket[hash % STORE_SEG_SIZE], e);
+	if (!link)
+		return ENOMEM;
+
+	*link = e->next;
+	working->count--;
+	store_retire(&e->obj, e->hdr, e->hdr_gen);
+
+	return 0;
+}
+
+int store_iterate(int (*func)(const char *name, void *arg), void *arg)
+{
+	/*
+	 * Removing an entry may replace the working version and segments,
+	 * but retired objects aren't freed before store_reclaim().
+	 */
+	struct store_version *v = working;
+	struct store_entry *e, *next;
+	unsigned int s, b;
+	int ret;
+
+	for (s = 0; s < v->nr_segs; s++)
+		for (b = 0; b < STORE_SEG_SIZE; b++)
+			/* Fetch next first: func may remove e. */
+			for (e = v->seg[s]->bucket[b]; e; e = next) {
+				next = e->next;
+				ret = func(e->name, arg);
+				if (ret)
+					return ret;
+			}
+
+	return 0;
+}
+
+#ifndef NO_THREADS
+int store_init_readers(unsigned int nr)
+{
+	reader_gen = calloc(nr, sizeof(*reader_gen));
+	if (!reader_gen)
+		return ENOMEM;
+	nr_readers = nr;
+
+	/* Readers may start before anything has been changed. */
+	working_dirty = true;
+	store_publish();
+
+	return 0;
+}
+
+void store_publish(void)
+{
+	if (!nr_readers || !working_dirty)
+		return;
+
+	__atomic_store_n(&published, working, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&published_gen, working_gen, __ATOMIC_SEQ_CST);
+	working_gen++;
+	working_dirty = false;
+}
+
+void store_reclaim(void)
+{
+	uint64_t limit = published_gen, gen;
+	struct store_obj *obj;
+	unsigned int i;
+
+	if (!retired)
+		return;
+
+	/*
+	 * A reader which has started after limit got published can't see
+	 * anything retired before.  Pairs with store_read_begin().
+	 */
+	for (i = 0; i < nr_readers; i++) {
+		gen = __atomic_load_n(&reader_gen[i], __ATOMIC_SEQ_CST);
+		if (gen && gen < limit)
+			limit = gen;
+	}
+
+	while ((obj = retired) && obj->last_gen < limit) {
+		retired = obj->next_retired;
+		store_free(obj);
+	}
+	if (!retired)
+		retired_tail = &retired;
+}
+
+void store_read_begin(unsigned int reader)
+{
+	uint64_t gen = __atomic_load_n(&published_gen, __ATOMIC_SEQ_CST);
+
+	/*
+	 * Announce the generation before picking up the version, which might
+	 * be a newer one already: store_reclaim() either sees gen and keeps
+	 * everything we could find, or we see what it has replaced that with.
+	 */
+	__atomic_store_n(&reader_gen[reader], gen, __ATOMIC_SEQ_CST);
+	reader_version = __atomic_load_n(&published, __ATOMIC_SEQ_CST);
+}
+
+void store_read_end(unsigned int reader)
+{
+	reader_version = NULL;
+	__atomic_store_n(&reader_gen[reader], 0, __ATOMIC_RELEASE);
+}
+#endif
@@ -0,0 +1,71 @@
+/*
+    Versioned node index for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+
+#include "xenstore_lib.h"
+
+/*
+ * Only the main loop modifies the index, the "working" version.  Reader
+ * threads look up nodes in the version published last, which is never
+ * modified: changes copy what they touch, and what they replace is freed
+ * only once no reader can still be looking at it.
+ *
+ * Each entry holds a link to its record, which release is called to drop
+ * once the entry is gone from all versions.
+ */
+int store_init(void (*release)(struct xs_tdb_record_hdr *hdr));
+
+/* Look up name in the working version, or a reader's snapshot. */
+struct xs_tdb_record_hdr *store_fetch(const char *name);
+
+/* Make hdr the record of name, consuming the link on success. */
+int store_set(const char *name, struct xs_tdb_record_hdr *hdr);
+
+int store_remove(const char *name);
+
+/*
+ * Call func for each entry of the working version.  func may remove the
+ * entry it is called for, but no other; a non-zero return value stops the
+ * iteration and is returned.
+ */
+int store_iterate(int (*func)(const char *name, void *arg), void *arg);
+
+#ifndef NO_THREADS
+int store_init_readers(unsigned int nr);
+
+/* Make the working version visible to readers starting from now on. */
+void store_publish(void);
+
+/* Free what is neither in the working version nor seen by any reader. */
+void store_reclaim(void);
+
+/* Bracket a reader's use of the version published last. */
+void store_read_begin(unsigned int reader);
+void store_read_end(unsigned int reader);
+#else
+static inline void store_publish(void)
+{
+}
+
+static inline void store_reclaim(void)
+{
+}
+#endif
+
+#endif /* _XENSTORED_STORE_H */
@@ -40,7 +40,7 @@
  * Some notes regarding detection and handling of transaction conflicts:
  *
  * Basic source of reference is the 'generation' count. Each writing access
- * (either normal write or in a transaction) to the tdb data base will set
+ * (either normal write or in a transaction) to the data base will set
  * the node specific generation count to the global generation count.
  * For being able to identify a transaction the transaction specific generation
  * count is initialized with the global generation count when starting the
@@ -160,12 +160,6 @@ struct transaction
 extern int quota_max_transaction;
 static uint64_t generation;
 
-static void set_tdb_key(const char *name, TDB_DATA *key)
-{
-	key->dptr = (char *)name;
-	key->dsize = strlen(name);
-}
-
 static struct accessed_node *find_accessed_node(struct transaction *trans,
 						const char *name)
 {
@@ -189,22 +183,22 @@ static char *transaction_get_node_name(void *ctx, struct transaction *trans,
  * transaction.
  */
 int transaction_prepend(struct connection *conn, const char *name,
-			TDB_DATA *key)
+			const char **db_name)
 {
-	char *tdb_name;
+	char *trans_name;
 
 	if (!conn || !conn->transaction ||
 	    !find_accessed_node(conn->transaction, name)) {
-		set_tdb_key(name, key);
+		*db_name = name;
 		return 0;
 	}
 
-	tdb_name = transaction_get_node_name(conn->transaction,
-					     conn->transaction, name);
-	if (!tdb_name)
+	trans_name = transaction_get_node_name(conn->transaction,
+					       conn->transaction, name);
+	if (!trans_name)
 		return errno;
 
-	set_tdb_key(tdb_name, key);
+	*db_name = trans_name;
 
 	return 0;
 }
@@ -216,19 +210,18 @@ int transaction_prepend(struct connection *conn, const char *name,
  * node->generation).
  *
  * Accesses in a transaction will be added to the list of accessed nodes
- * if not already done. Read type accesses will copy the node to the
- * transaction specific data base part, write type accesses go there
- * anyway.
+ * if not already done. Read type accesses will make the node's record visible
+ * in the transaction specific data base part as well (sharing, not copying
+ * it), write type accesses go there anyway.
  *
- * If not NULL, key will be supplied with name and length of name of the node
- * to be accessed in the data base.
+ * If not NULL, db_name will be supplied with the name of the node to be
+ * accessed in the data base.
  */
 int access_node(struct connection *conn, struct node *node,
-		enum node_access_type type, TDB_DATA *key)
+		enum node_access_type type, const char **db_name)
 {
 	struct accessed_node *i = NULL;
 	struct transaction *trans;
-	TDB_DATA local_key;
 	const char *trans_name = NULL;
 	int ret;
 	bool introduce = false;
@@ -241,8 +234,8 @@ int access_node(struct connection *conn, struct node *node,
 
 	if (!conn || !conn->transaction) {
 		/* They're changing the global database. */
-		if (key)
-			set_tdb_key(node->name, key);
+		if (db_name)
+			*db_name = node->name;
 		return 0;
 	}
 
@@ -268,15 +261,14 @@ int access_node(struct connection *conn, struct node *node,
 		 * Additional transaction-specific node for read type. We only
 		 * have to verify read nodes if we didn't write them.
 		 *
-		 * The node is created and written to DB here to distinguish
-		 * from the write types.
+		 * The node is linked into the DB here to distinguish from the
+		 * write types.
 		 */
 		if (type == NODE_ACCESS_READ) {
 			i->generation = node->generation;
 			i->check_gen = true;
 			if (node->generation != NO_GENERATION) {
-				set_tdb_key(trans_name, &local_key);
-				ret = write_node_raw(conn, &local_key, node);
+				ret = db_link(trans_name, node->hdr);
 				if (ret)
 					goto err;
 				i->ta_node = true;
@@ -292,8 +284,8 @@ int access_node(struct connection *conn, struct node *node,
 		/* Nothing to delete. */
 		return -1;
 
-	if (key) {
-		set_tdb_key(trans_name, key);
+	if (db_name) {
+		*db_name = trans_name;
 		if (type == NODE_ACCESS_WRITE)
 			i->ta_node = true;
 		if (type == NODE_ACCESS_DELETE)
@@ -315,7 +307,7 @@ err:
 /*
  * Finalize transaction:
  * Walk through accessed nodes and check generation against global data.
- * If all entries match, read the transaction entries and write them without
+ * If all entries match, copy the transaction entries to the entries without
  * transaction prepended. Delete all transaction specific nodes in the data
  * base.
  */
@@ -323,26 +315,16 @@ static int finalize_transaction(struct connection *conn,
 				struct transaction *trans)
 {
 	struct accessed_node *i;
-	TDB_DATA key, ta_key, data;
 	struct xs_tdb_record_hdr *hdr;
 	uint64_t gen;
 	char *trans_name;
-	int ret;
 
 	list_for_each_entry(i, &trans->accessed, list) {
 		if (!i->check_gen)
 			continue;
 
-		set_tdb_key(i->node, &key);
-		data = tdb_fetch(tdb_ctx, key);
-		hdr = (void *)data.dptr;
-		if (!data.dptr) {
-			if (tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)
-				return EIO;
-			gen = NO_GENERATION;
-		} else
-			gen = hdr->generation;
-		talloc_free(data.dptr);
+		hdr = db_fetch(i->node);
+		gen = hdr ? hdr->generation : NO_GENERATION;
 		if (i->generation != gen)
 			return EAGAIN;
 	}
@@ -353,27 +335,16 @@ static int finalize_transaction(struct connection *conn,
 			/* We are doomed: the transaction is only partial. */
 			goto err;
 
-		set_tdb_key(trans_name, &ta_key);
-
 		if (i->modified) {
-			set_tdb_key(i->node, &key);
 			if (i->ta_node) {
-				data = tdb_fetch(tdb_ctx, ta_key);
-				if (!data.dptr)
+				if (db_copy(trans_name, i->node, generation++))
 					goto err;
-				hdr = (void *)data.dptr;
-				hdr->generation = generation++;
-				ret = tdb_store(tdb_ctx, key, data,
-						TDB_REPLACE);
-				talloc_free(data.dptr);
-				if (ret)
-					goto err;
-			} else if (tdb_delete(tdb_ctx, key))
+			} else if (db_delete(i->node))
 					goto err;
 			fire_watches(conn, trans, i->node, false);
 		}
 
-		if (i->ta_node && tdb_delete(tdb_ctx, ta_key))
+		if (i->ta_node && db_delete(trans_name))
 			goto err;
 		list_del(&i->list);
 		talloc_free(i);
@@ -391,7 +362,6 @@ static int destroy_transaction(void *_transaction)
 	struct transaction *trans = _transaction;
 	struct accessed_node *i;
 	char *trans_name;
-	TDB_DATA key;
 
 	wrl_ntransactions--;
 	trace_destroy(trans, "transaction");
@@ -399,10 +369,8 @@ static int destroy_transaction(void *_transaction)
 		if (i->ta_node) {
 			trans_name = transaction_get_node_name(i, trans,
 							       i->node);
-			if (trans_name) {
-				set_tdb_key(trans_name, &key);
-				tdb_delete(tdb_ctx, key);
-			}
+			if (trans_name)
+				db_delete(trans_name);
 		}
 		list_del(&i->list);
 		talloc_free(i);
@@ -38,11 +38,11 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 
 /* This node was accessed. */
 int access_node(struct connection *conn, struct node *node,
-                enum node_access_type type, TDB_DATA *key);
+                enum node_access_type type, const char **db_name);
 
 /* Prepend the transaction to name if appropriate. */
 int transaction_prepend(struct connection *conn, const char *name,
-                        TDB_DATA *key);
+                        const char **db_name);
 
 void conn_delete_all_transactions(struct connection *conn);
 int check_transactions(struct hashtable *hash);
@@ -32,6 +32,32 @@
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * Watches are indexed by path: there is an index entry, found by hashing its
+ * path, for every watched path and every ancestor of one, listing the
+ * watches on exactly that path and the entries one component further down.
+ * Firing watches for a node then means looking up the node and its
+ * ancestors (and for a removal walking the entries below the node) rather
+ * than comparing the node with every watch of every connection.  Special
+ * "@" paths hang off the entry for "/", as watches on "/" see them too.
+ */
+struct watch_index
+{
+	/* The path, also the key in watch_index_table, which owns it. */
+	char *path;
+
+	struct watch_index *parent;
+
+	/* Entries one component further down, linked by sibling. */
+	struct list_head children;
+	struct list_head sibling;
+
+	/* Watches on exactly this path. */
+	struct list_head watches;
+};
+
+static struct hashtable *watch_index_table;
+
 struct watch
 {
 	/* Watches on this connection */
@@ -40,6 +66,16 @@ struct watch
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
+	/* Watches on the same path, and their index entry. */
+	struct list_head index_list;
+	struct watch_index *index;
+
+	/* Watches of the connection with an event being fired. */
+	struct list_head fired_list;
+	const char *fired_name;
+
+	struct connection *conn;
+
 	/* Is this relative to connnection's implicit path? */
 	const char *relative_path;
 
@@ -56,53 +92,118 @@ static bool check_event_node(const char *node)
 	return true;
 }
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
+static void watch_index_put(struct watch_index *index);
+
+/* Find the index entry for path, creating it and its ancestors if needed. */
+static struct watch_index *watch_index_get(const char *path)
 {
-	unsigned int len = strlen(parent);
+	struct watch_index *index, *parent = NULL;
+	const char *slash;
+	char *parent_path;
+
+	if (!watch_index_table) {
+		watch_index_table = create_hashtable(64, hash_from_key_fn,
+						     keys_equal_fn);
+		if (!watch_index_table)
+			return NULL;
+	}
 
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
+	index = hashtable_search(watch_index_table, (void *)path);
+	if (index)
+		return index;
+
+	if (!streq(path, "/")) {
+		slash = strrchr(path, '/');
+		if (!slash || slash == path)
+			parent_path = talloc_strdup(NULL, "/");
+		else
+			parent_path = talloc_strndup(NULL, path, slash - path);
+		if (!parent_path)
+			return NULL;
+		parent = watch_index_get(parent_path);
+		talloc_free(parent_path);
+		if (!parent)
+			return NULL;
+	}
 
-	if (strncmp(child, parent, len) != 0)
-		return false;
+	index = talloc_zero(parent, struct watch_index);
+	if (!index)
+		goto nomem;
+	index->path = strdup(path);
+	if (!index->path ||
+	    !hashtable_insert(watch_index_table, index->path, index)) {
+		free(index->path);
+		talloc_free(index);
+		goto nomem;
+	}
+	index->parent = parent;
+	INIT_LIST_HEAD(&index->children);
+	INIT_LIST_HEAD(&index->watches);
+	if (parent)
+		list_add_tail(&index->sibling, &parent->children);
+
+	return index;
 
-	return child[len] == '/' || child[len] == '\0';
+nomem:
+	watch_index_put(parent);
+	return NULL;
+}
+
+/* Drop index entries which no longer lead to any watch. */
+static void watch_index_put(struct watch_index *index)
+{
+	struct watch_index *parent;
+
+	while (index && list_empty(&index->watches) &&
+	       list_empty(&index->children)) {
+		parent = index->parent;
+		if (parent)
+			list_del(&index->sibling);
+		/* Frees index->path. */
+		hashtable_remove(watch_index_table, index->path);
+		talloc_free(index);
+		index = parent;
+	}
 }
 
 /*
- * Send a watch event.
+ * Can this conn load node, or see that it doesn't exist?
  * Temporary memory allocations are done with ctx.
  */
-static void add_event(struct connection *conn,
-		      void *ctx,
-		      struct watch *watch,
-		      const char *name)
+static bool watch_node_visible(struct connection *conn, void *ctx,
+			       const char *name)
+{
+	struct node *node;
+
+	if (check_event_node(name))
+		return true;
+
+	node = get_node(conn, ctx, name, XS_PERM_READ);
+	/*
+	 * XXX We allow EACCES here because otherwise a non-dom0
+	 * backend driver cannot watch for disappearance of a frontend
+	 * xenstore directory. When the directory disappears, we
+	 * revert to permissions of the parent directory for that path,
+	 * which will typically disallow access for the backend.
+	 * But this breaks device-channel teardown!
+	 * Really we should fix this better...
+	 */
+	return node || errno == ENOENT || errno == EACCES;
+}
+
+/*
+ * Send a watch event, the connection being allowed to see it.
+ * Temporary memory allocations are done with ctx.
+ */
+static void send_event(struct connection *conn,
+		       void *ctx,
+		       struct watch *watch,
+		       const char *name)
 {
 	/* Data to send (node\0token\0). */
 	unsigned int len;
 	char *data;
 
-	if (!check_event_node(name)) {
-		/* Can this conn load node, or see that it doesn't exist? */
-		struct node *node = get_node(conn, ctx, name, XS_PERM_READ);
-		/*
-		 * XXX We allow EACCES here because otherwise a non-dom0
-		 * backend driver cannot watch for disappearance of a frontend
-		 * xenstore directory. When the directory disappears, we
-		 * revert to permissions of the parent directory for that path,
-		 * which will typically disallow access for the backend.
-		 * But this breaks device-channel teardown!
-		 * Really we should fix this better...
-		 */
-		if (!node && errno != ENOENT && errno != EACCES)
-			return;
-	}
-
 	if (watch->relative_path) {
 		name += strlen(watch->relative_path);
 		if (*name == '/') /* Could be "" */
@@ -119,6 +220,69 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+/*
+ * Send a watch event, if the connection may see it.
+ * Temporary memory allocations are done with ctx.
+ */
+static void add_event(struct connection *conn,
+		      void *ctx,
+		      struct watch *watch,
+		      const char *name)
+{
+	if (watch_node_visible(conn, ctx, name))
+		send_event(conn, ctx, watch, name);
+}
+
+/* Queue an event for the watches on index, noting their connections. */
+static void queue_events(struct list_head *fired, struct watch_index *index,
+			 const char *name)
+{
+	struct watch *watch;
+
+	list_for_each_entry(watch, &index->watches, index_list) {
+		if (list_empty(&watch->conn->fired_watches))
+			list_add_tail(&watch->conn->fired_list, fired);
+		watch->fired_name = name ? name : watch->node;
+		list_add_tail(&watch->fired_list, &watch->conn->fired_watches);
+	}
+}
+
+/* Queue an event for all watches below index, each on its own path. */
+static void queue_subtree_events(struct list_head *fired,
+				 struct watch_index *index)
+{
+	struct watch_index *child;
+
+	list_for_each_entry(child, &index->children, sibling) {
+		queue_events(fired, child, NULL);
+		queue_subtree_events(fired, child);
+	}
+}
+
+/*
+ * Send the events queued for a connection.  Events for a node are queued
+ * together, so that whether the connection may see the node is checked once
+ * rather than for every watch.
+ * Temporary memory allocations are done with ctx.
+ */
+static void send_queued_events(struct connection *conn, void *ctx)
+{
+	struct watch *watch;
+	const char *checked = NULL;
+	bool visible = false;
+
+	while ((watch = list_top(&conn->fired_watches, struct watch,
+				 fired_list))) {
+		list_del(&watch->fired_list);
+		if (!checked || !streq(checked, watch->fired_name)) {
+			checked = watch->fired_name;
+			visible = watch_node_visible(conn, ctx, checked);
+		}
+		if (visible)
+			send_event(conn, ctx, watch, watch->fired_name);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -126,26 +290,59 @@ static void add_event(struct connection *conn,
 void fire_watches(struct connection *conn, void *ctx, const char *name,
 		  bool recurse)
 {
+	LIST_HEAD(fired);
 	struct connection *i;
-	struct watch *watch;
+	struct watch_index *index;
+	char *path, *slash;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, ctx, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, ctx, watch, watch->node);
-		}
+	if (!watch_index_table)
+		return;
+
+	path = talloc_strdup(ctx, name);
+	if (!path)
+		return;
+
+	/*
+	 * Watches on the node or an ancestor.  As ancestors of watched paths
+	 * are indexed, the first path missing from the index ends the walk.
+	 */
+	index = hashtable_search(watch_index_table, "/");
+	if (index)
+		queue_events(&fired, index, name);
+	for (slash = path + 1; index && !streq(path, "/"); slash++) {
+		slash = strchr(slash, '/');
+		if (slash)
+			*slash = '\0';
+		index = hashtable_search(watch_index_table, path);
+		if (index)
+			queue_events(&fired, index, name);
+		if (!slash)
+			break;
+		*slash = '/';
+	}
+
+	/* Watches below the node, which is gone with all its children. */
+	if (recurse && index)
+		queue_subtree_events(&fired, index);
+
+	while ((i = list_top(&fired, struct connection, fired_list))) {
+		list_del(&i->fired_list);
+		send_queued_events(i, ctx);
 	}
+
+	talloc_free(path);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	list_del(&watch->index_list);
+	watch_index_put(watch->index);
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -197,10 +394,18 @@ int do_watch(struct connection *conn, struct buffered_data *in)
 	else
 		watch->relative_path = NULL;
 
+	watch->index = watch_index_get(watch->node);
+	if (!watch->index) {
+		talloc_free(watch);
+		return ENOMEM;
+	}
+	watch->conn = conn;
+
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->index_list, &watch->index->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
@@ -1403,14 +1403,15 @@ int create_grant_host_mapping(unsigned long addr, mfn_t frame,
     int rc;
     p2m_type_t t = p2m_grant_map_rw;
 
-    if ( cache_flags  || (flags & ~GNTMAP_readonly) != GNTMAP_host_map )
+    if ( cache_flags ||
+         (flags & ~(GNTMAP_readonly | GNTMAP_order_mask)) != GNTMAP_host_map )
         return GNTST_general_error;
 
     if ( flags & GNTMAP_readonly )
         t = p2m_grant_map_ro;
 
     rc = guest_physmap_add_entry(current->domain, gaddr_to_gfn(addr),
-                                 frame, 0, t);
+                                 frame, MASK_EXTR(flags, GNTMAP_order_mask), t);
 
     if ( rc )
         return GNTST_general_error;
@@ -1423,12 +1424,37 @@ int replace_grant_host_mapping(unsigned long addr, mfn_t mfn,
 {
     gfn_t gfn = gaddr_to_gfn(addr);
     struct domain *d = current->domain;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long i, nr = 1UL << MASK_EXTR(flags, GNTMAP_order_mask);
     int rc;
 
-    if ( new_addr != 0 || (flags & GNTMAP_contains_pte) )
+    if ( new_addr != 0 || (flags & GNTMAP_contains_pte) ||
+         (gfn_x(gfn) & (nr - 1)) )
         return GNTST_general_error;
 
-    rc = guest_physmap_remove_page(d, gfn, mfn, 0);
+    /*
+     * Only remove the range if every entry in it is still the grant
+     * mapping of the matching frame.  Check and removal happen under the
+     * same lock so the range can't change in between.
+     */
+    p2m_write_lock(p2m);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        p2m_type_t t;
+        mfn_t old_mfn = p2m_get_entry(p2m, gfn_add(gfn, i), &t,
+                                      NULL, NULL, NULL);
+
+        if ( !p2m_is_grant(t) || !mfn_eq(old_mfn, mfn_add(mfn, i)) )
+        {
+            p2m_write_unlock(p2m);
+            return GNTST_general_error;
+        }
+    }
+
+    rc = p2m_set_entry(p2m, gfn, nr, INVALID_MFN, p2m_invalid, p2m_access_rwx);
+
+    p2m_write_unlock(p2m);
 
     return rc ? GNTST_general_error : GNTST_okay;
 }
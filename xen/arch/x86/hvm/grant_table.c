@@ -29,10 +29,12 @@ int create_grant_p2m_mapping(uint64_t addr, mfn_t frame,
                              unsigned int flags,
                              unsigned int cache_flags)
 {
+    unsigned int order = MASK_EXTR(flags, GNTMAP_order_mask);
     p2m_type_t p2mt;
     int rc;
 
-    if ( cache_flags || (flags & ~GNTMAP_readonly) != GNTMAP_host_map )
+    if ( cache_flags ||
+         (flags & ~(GNTMAP_readonly | GNTMAP_order_mask)) != GNTMAP_host_map )
         return GNTST_general_error;
 
     if ( flags & GNTMAP_readonly )
@@ -41,7 +43,7 @@ int create_grant_p2m_mapping(uint64_t addr, mfn_t frame,
         p2mt = p2m_grant_map_rw;
     rc = guest_physmap_add_entry(current->domain,
                                  _gfn(addr >> PAGE_SHIFT),
-                                 frame, PAGE_ORDER_4K, p2mt);
+                                 frame, order, p2mt);
     if ( rc )
         return GNTST_general_error;
     else
@@ -52,23 +54,38 @@ int replace_grant_p2m_mapping(uint64_t addr, mfn_t frame,
                               uint64_t new_addr, unsigned int flags)
 {
     unsigned long gfn = (unsigned long)(addr >> PAGE_SHIFT);
+    unsigned int order = MASK_EXTR(flags, GNTMAP_order_mask);
+    unsigned long i;
     p2m_type_t type;
     mfn_t old_mfn;
     struct domain *d = current->domain;
 
-    if ( new_addr != 0 || (flags & GNTMAP_contains_pte) )
+    if ( new_addr != 0 || (flags & GNTMAP_contains_pte) ||
+         (gfn & ((1UL << order) - 1)) )
         return GNTST_general_error;
 
+    /*
+     * The gfn lock is the p2m lock, so holding it for the first gfn keeps
+     * the rest of the range stable until the removal below.  Every entry
+     * must still be the grant mapping of the matching frame: anything else
+     * in the range is not ours to remove.
+     */
     old_mfn = get_gfn_query(d, gfn, &type);
-    if ( !p2m_is_grant(type) || !mfn_eq(old_mfn, frame) )
+    for ( i = 0; ; )
     {
-        put_gfn(d, gfn);
-        gdprintk(XENLOG_WARNING,
-                 "old mapping invalid (type %d, mfn %" PRI_mfn ", frame %"PRI_mfn")\n",
-                 type, mfn_x(old_mfn), mfn_x(frame));
-        return GNTST_general_error;
+        if ( !p2m_is_grant(type) || !mfn_eq(old_mfn, mfn_add(frame, i)) )
+        {
+            put_gfn(d, gfn);
+            gdprintk(XENLOG_WARNING,
+                     "old mapping invalid (gfn %#lx, type %d, mfn %" PRI_mfn ", frame %"PRI_mfn")\n",
+                     gfn + i, type, mfn_x(old_mfn), mfn_x(mfn_add(frame, i)));
+            return GNTST_general_error;
+        }
+        if ( ++i == (1UL << order) )
+            break;
+        old_mfn = get_gfn_query_unlocked(d, gfn + i, &type);
     }
-    if ( guest_physmap_remove_page(d, _gfn(gfn), frame, PAGE_ORDER_4K) )
+    if ( guest_physmap_remove_page(d, _gfn(gfn), frame, order) )
     {
         put_gfn(d, gfn);
         return GNTST_general_error;
@@ -54,6 +54,8 @@
  * Collect the guest_dirty bitmask, a bit mask of the dirty vram pages, by
  * calling paging_log_dirty_range(), which interrogates each vram
  * page's p2m type looking for pages that have been made writable.
+ * With log-dirty in ring mode, dirty_vram->dirty_bitmap also holds the vram
+ * pages logged since then, which cleaning the log made read-only again.
  */
 
 int hap_track_dirty_vram(struct domain *d,
@@ -77,7 +79,8 @@ int hap_track_dirty_vram(struct domain *d,
         }
 
         rc = -ENOMEM;
-        dirty_bitmap = vzalloc(size);
+        /* Whole longs, for paging_log_dirty_range(). */
+        dirty_bitmap = vzalloc(BITS_TO_LONGS(nr) * sizeof(unsigned long));
         if ( !dirty_bitmap )
             goto out;
 
@@ -101,7 +104,16 @@ int hap_track_dirty_vram(struct domain *d,
         {
             unsigned long ostart = dirty_vram->begin_pfn;
             unsigned long oend = dirty_vram->end_pfn;
+            uint8_t *logged = xzalloc_array(uint8_t, size);
 
+            if ( !logged )
+            {
+                paging_unlock(d);
+                goto out;
+            }
+
+            xfree(dirty_vram->dirty_bitmap);
+            dirty_vram->dirty_bitmap = logged;
             dirty_vram->begin_pfn = begin_pfn;
             dirty_vram->end_pfn = begin_pfn + nr;
 
@@ -154,6 +166,7 @@ int hap_track_dirty_vram(struct domain *d,
              */
             begin_pfn = dirty_vram->begin_pfn;
             nr = dirty_vram->end_pfn - dirty_vram->begin_pfn;
+            xfree(dirty_vram->dirty_bitmap);
             xfree(dirty_vram);
             d->arch.hvm.dirty_vram = NULL;
         }
@@ -230,10 +243,13 @@ static int hap_disable_log_dirty(struct domain *d)
 static void hap_clean_dirty_bitmap(struct domain *d)
 {
     /*
-     * Switch to log-dirty mode, either by setting l1e entries of P2M table to
-     * be read-only, or via hardware-assisted log-dirty.
+     * With hardware-assisted log-dirty, resetting the dirty state the
+     * hardware keeps in the P2M suffices, and avoids the whole P2M having
+     * its types re-calculated.  Otherwise switch to log-dirty mode again, by
+     * setting l1e entries of P2M table to be read-only.
      */
-    p2m_change_entry_type_global(d, p2m_ram_rw, p2m_ram_logdirty);
+    if ( !p2m_harvest_hardware_dirty(d, 0, ~0UL, NULL) )
+        p2m_change_entry_type_global(d, p2m_ram_rw, p2m_ram_logdirty);
     flush_tlb_mask(d->dirty_cpumask);
 }
 
@@ -580,6 +596,8 @@ void hap_teardown(struct domain *d, bool *preempted)
 
     d->arch.paging.mode &= ~PG_log_dirty;
 
+    if ( d->arch.hvm.dirty_vram )
+        xfree(d->arch.hvm.dirty_vram->dirty_bitmap);
     XFREE(d->arch.hvm.dirty_vram);
 
 out:
@@ -1212,6 +1212,113 @@ static void ept_flush_pml_buffers(struct p2m_domain *p2m)
     vmx_domain_flush_pml_buffers(p2m->domain);
 }
 
+/*
+ * Harvest the dirty state of the RAM entries mapping [first_gfn, last_gfn]
+ * below the table at mfn, which maps from gfn at the given level, setting
+ * the bits in bitmap (if any) of those which were written to, and reset it
+ * for the next writes to be logged again:
+ * - leaf entries get switched back to p2m_ram_logdirty, which only clears
+ *   the D bit of 4k ones with PML, and write protects superpages for the
+ *   next write to split them (they may have been written without ever
+ *   being logged),
+ * - intermediate entries get their A bit cleared, so that their subtree can
+ *   be skipped next time if the guest hasn't touched it.
+ * Superpages and intermediate entries only partly in the range are left as
+ * they are, as resetting them would lose the state of GFNs outside of it.
+ * Entries with a type re-calculation pending are skipped, as that will
+ * reset them anyway.  Returns whether any entry was changed.
+ */
+static bool ept_harvest_dirty_table(struct p2m_domain *p2m, mfn_t mfn,
+                                    unsigned int level, unsigned long gfn,
+                                    unsigned long first_gfn,
+                                    unsigned long last_gfn,
+                                    unsigned long *bitmap)
+{
+    ept_entry_t *table = map_domain_page(mfn);
+    unsigned long span = 1UL << (level * EPT_TABLE_ORDER);
+    unsigned int i;
+    bool changed = false;
+    int rc;
+
+    for ( i = 0; i < EPT_PAGETABLE_ENTRIES && gfn <= last_gfn;
+          i++, gfn += span )
+    {
+        ept_entry_t e = atomic_read_ept_entry(&table[i]);
+        unsigned long start = max(gfn, first_gfn);
+        unsigned long end = min(gfn + span - 1, last_gfn);
+        bool whole = start == gfn && end == gfn + span - 1;
+
+        if ( gfn + span - 1 < first_gfn || !is_epte_valid(&e) ||
+             !is_epte_present(&e) || e.recalc )
+            continue;
+
+        if ( level && !is_epte_superpage(&e) )
+        {
+            if ( !e.a )
+                continue;
+
+            if ( ept_harvest_dirty_table(p2m, _mfn(e.mfn), level - 1, gfn,
+                                         first_gfn, last_gfn, bitmap) )
+                changed = true;
+
+            if ( whole )
+            {
+                e.a = 0;
+                rc = atomic_write_ept_entry(p2m, &table[i], e, level);
+                ASSERT(rc == 0);
+                changed = true;
+            }
+            continue;
+        }
+
+        /*
+         * Clearing D alone would leave p2m_ram_rw entries, which the next
+         * software update of the entry (e.g. by p2m_set_mem_access(), or
+         * altp2m propagation) sets D in again, so that writes go unlogged.
+         */
+        if ( e.sa_p2mt == p2m_ram_logdirty ? !e.d : e.sa_p2mt != p2m_ram_rw )
+            continue;
+
+        if ( bitmap )
+            for ( ; start <= end; start++ )
+                __set_bit(start - first_gfn, bitmap);
+
+        if ( !whole )
+            continue;
+
+        e.sa_p2mt = p2m_ram_logdirty;
+        ept_p2m_type_to_flags(p2m, &e, e.sa_p2mt, e.access);
+        rc = atomic_write_ept_entry(p2m, &table[i], e, level);
+        ASSERT(rc == 0);
+        changed = true;
+    }
+
+    unmap_domain_page(table);
+
+    return changed;
+}
+
+static bool ept_harvest_hardware_dirty(struct p2m_domain *p2m,
+                                       unsigned long first_gfn,
+                                       unsigned long last_gfn,
+                                       unsigned long *bitmap)
+{
+    /* Domain must have been paused */
+    ASSERT(atomic_read(&p2m->domain->pause_count));
+    ASSERT(p2m_locked_by_me(p2m));
+
+    /* The D bits are only maintained by hardware while PML is enabled. */
+    if ( !p2m->ept.ad )
+        return false;
+
+    if ( p2m->ept.mfn &&
+         ept_harvest_dirty_table(p2m, _mfn(p2m->ept.mfn), p2m->ept.wl, 0,
+                                 first_gfn, last_gfn, bitmap) )
+        ept_sync_domain(p2m);
+
+    return true;
+}
+
 int ept_p2m_init(struct p2m_domain *p2m)
 {
     struct ept_data *ept = &p2m->ept;
@@ -1236,6 +1343,7 @@ int ept_p2m_init(struct p2m_domain *p2m)
         p2m->enable_hardware_log_dirty = ept_enable_hardware_log_dirty;
         p2m->disable_hardware_log_dirty = ept_disable_hardware_log_dirty;
         p2m->flush_hardware_cached_dirty = ept_flush_pml_buffers;
+        p2m->harvest_hardware_dirty = ept_harvest_hardware_dirty;
     }
 
     if ( !zalloc_cpumask_var(&ept->invalidate) )
@@ -452,6 +452,54 @@ void p2m_flush_hardware_cached_dirty(struct domain *d)
     }
 }
 
+/*
+ * Re-arm hardware-assisted log-dirty over [first_gfn, last_gfn], which must
+ * be in log-dirty mode, by resetting only the entries whose dirty state the
+ * hardware has set, rather than by changing the type of every entry.  If
+ * bitmap is non-NULL, bit N gets set if first_gfn + N has been written since
+ * the last reset.  The domain must be paused, with hardware cached dirty GFNs
+ * flushed.
+ *
+ * Returns false, having done nothing, if the p2m has no hardware dirty state
+ * to harvest, in which case log-dirty needs re-arming by type changes.
+ */
+bool p2m_harvest_hardware_dirty(struct domain *d, unsigned long first_gfn,
+                                unsigned long last_gfn, unsigned long *bitmap)
+{
+    struct p2m_domain *hostp2m = p2m_get_hostp2m(d);
+    bool done;
+
+    if ( !hostp2m->harvest_hardware_dirty )
+        return false;
+
+    p2m_lock(hostp2m);
+
+    done = hostp2m->harvest_hardware_dirty(hostp2m, first_gfn, last_gfn,
+                                           bitmap);
+
+#ifdef CONFIG_HVM
+    if ( done && unlikely(altp2m_active(d)) )
+    {
+        unsigned int i;
+
+        for ( i = 0; i < MAX_ALTP2M; i++ )
+            if ( d->arch.altp2m_eptp[i] != mfn_x(INVALID_MFN) )
+            {
+                struct p2m_domain *altp2m = d->arch.altp2m_p2m[i];
+
+                p2m_lock(altp2m);
+                altp2m->harvest_hardware_dirty(altp2m, first_gfn, last_gfn,
+                                               bitmap);
+                p2m_unlock(altp2m);
+            }
+    }
+#endif
+
+    p2m_unlock(hostp2m);
+
+    return done;
+}
+
 /*
  * Force a synchronous P2M TLB flush if a deferred flush is pending.
  *
@@ -21,6 +21,7 @@
 
 #include <xen/init.h>
 #include <xen/guest_access.h>
+#include <xen/vmap.h>
 #include <asm/paging.h>
 #include <asm/shadow.h>
 #include <asm/p2m.h>
@@ -209,6 +210,174 @@ static int paging_free_log_dirty_bitmap(struct domain *d, int rc)
     return rc;
 }
 
+/*
+ * Dirty rings: in ring mode, each vCPU appends the GFNs it dirties to its
+ * own ring, without taking the paging lock, and the toolstack harvests them
+ * with XEN_DOMCTL_SHADOW_OP_HARVEST.  Pages dirtied on behalf of the domain
+ * by anyone else go in a domain-wide ring under the paging lock.  Once a
+ * ring is full, pages are logged in the bitmap instead.
+ */
+#define DIRTY_RING_ENTRIES       4096
+/* Per vCPU: room for GFNs flushed out of hardware (PML) when harvesting. */
+#define DIRTY_RING_FLUSH_ENTRIES 512
+
+struct dirty_ring {
+    unsigned int prod, size;
+    uint64_t gfn[];
+};
+
+static struct dirty_ring *dirty_ring_alloc(unsigned int size)
+{
+    struct dirty_ring *ring = vmalloc(sizeof(*ring) +
+                                      size * sizeof(ring->gfn[0]));
+
+    if ( ring )
+    {
+        ring->prod = 0;
+        ring->size = size;
+    }
+
+    return ring;
+}
+
+static int paging_dirty_ring_enable(struct domain *d)
+{
+    struct dirty_ring *ring;
+    struct vcpu *v;
+    int rc;
+
+    if ( !hap_enabled(d) )
+        return -EOPNOTSUPP;
+
+    /* vCPU rings aren't used until the domain ring is, and are kept. */
+    for_each_vcpu ( d, v )
+        if ( !v->arch.paging.dirty_ring &&
+             !(v->arch.paging.dirty_ring =
+               dirty_ring_alloc(DIRTY_RING_ENTRIES)) )
+            return -ENOMEM;
+
+    ring = dirty_ring_alloc(DIRTY_RING_ENTRIES +
+                            d->max_vcpus * DIRTY_RING_FLUSH_ENTRIES);
+    if ( !ring )
+        return -ENOMEM;
+
+    rc = paging_log_dirty_enable(d, 1);
+    if ( rc )
+    {
+        vfree(ring);
+        return rc;
+    }
+
+    /* Anything dirtied in the meantime is in the bitmap. */
+    paging_lock(d);
+    for_each_vcpu ( d, v )
+        v->arch.paging.dirty_ring->prod = 0;
+    smp_wmb();
+    d->arch.paging.log_dirty.ring = ring;
+    paging_unlock(d);
+
+    return 0;
+}
+
+/* Leave ring mode.  The domain must be paused, or dying. */
+static void paging_dirty_ring_disable(struct domain *d)
+{
+    struct dirty_ring *ring;
+
+    paging_lock(d);
+    ring = d->arch.paging.log_dirty.ring;
+    d->arch.paging.log_dirty.ring = NULL;
+    paging_unlock(d);
+
+    vfree(ring);
+}
+
+/* Append pfn to a dirty ring.  Returns false if it needs logging elsewhere. */
+static bool paging_dirty_ring_log(struct domain *d, pfn_t pfn)
+{
+    struct vcpu *curr = current;
+    struct dirty_ring *ring;
+    bool logged = false;
+
+    if ( likely(!read_atomic(&d->arch.paging.log_dirty.ring)) )
+        return false;
+
+    if ( curr->domain == d )
+    {
+        /*
+         * Only curr appends to its ring, and harvesting or leaving ring mode
+         * pause the domain first.
+         */
+        smp_rmb();
+        ring = curr->arch.paging.dirty_ring;
+        if ( ring->prod < ring->size )
+        {
+            ring->gfn[ring->prod++] = pfn_x(pfn);
+            logged = true;
+        }
+
+        return logged;
+    }
+
+    paging_lock_recursive(d);
+    ring = d->arch.paging.log_dirty.ring;
+    if ( ring && ring->prod < ring->size )
+    {
+        ring->gfn[ring->prod++] = pfn_x(pfn);
+        logged = true;
+    }
+    paging_unlock(d);
+
+    return logged;
+}
+
+/*
+ * hap_track_dirty_vram() finds the VRAM pages written since it last looked
+ * by their p2m types, which each clean resets.  In ring mode, note the VRAM
+ * pages logged, for paging_log_dirty_range() to report them even after a
+ * clean.  Called with the paging lock held.
+ */
+static void dirty_vram_note(struct domain *d, unsigned long gfn)
+{
+    struct sh_dirty_vram *dirty_vram = d->arch.hvm.dirty_vram;
+    unsigned long i;
+
+    ASSERT(paging_locked_by_me(d));
+
+    if ( !dirty_vram || !dirty_vram->dirty_bitmap ||
+         gfn < dirty_vram->begin_pfn || gfn >= dirty_vram->end_pfn )
+        return;
+
+    i = gfn - dirty_vram->begin_pfn;
+    dirty_vram->dirty_bitmap[i >> 3] |= 1 << (i & 7);
+}
+
+/* Copy the oldest GFNs of ring to sc's buffer, as many as still fit. */
+static int dirty_ring_harvest(struct domain *d, struct dirty_ring *ring,
+                              struct xen_domctl_shadow_op *sc,
+                              unsigned long *done)
+{
+    unsigned int i, nr = min_t(unsigned long, ring->prod, sc->pages - *done);
+
+    if ( !nr )
+        return 0;
+
+    if ( copy_to_guest_offset(sc->dirty_bitmap, *done * sizeof(ring->gfn[0]),
+                              (const uint8_t *)ring->gfn,
+                              nr * sizeof(ring->gfn[0])) )
+        return -EFAULT;
+
+    for ( i = 0; i < nr; i++ )
+        dirty_vram_note(d, ring->gfn[i]);
+    d->arch.paging.log_dirty.ring_harvested = true;
+
+    ring->prod -= nr;
+    memmove(ring->gfn, ring->gfn + nr, ring->prod * sizeof(ring->gfn[0]));
+    *done += nr;
+
+    return 0;
+}
+
 int paging_log_dirty_enable(struct domain *d, bool_t log_global)
 {
     int ret;
@@ -245,6 +414,7 @@ static int paging_log_dirty_disable(struct domain *d, bool_t resuming)
             ret = d->arch.paging.log_dirty.ops->disable(d);
             ASSERT(ret <= 0);
         }
+        paging_dirty_ring_disable(d);
     }
 
     ret = paging_free_log_dirty_bitmap(d, ret);
@@ -278,6 +448,9 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
     if ( unlikely(!VALID_M2P(pfn_x(pfn))) )
         return;
 
+    if ( paging_dirty_ring_log(d, pfn) )
+        return;
+
     i1 = L1_LOGDIRTY_IDX(pfn);
     i2 = L2_LOGDIRTY_IDX(pfn);
     i3 = L3_LOGDIRTY_IDX(pfn);
@@ -286,6 +459,10 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
     /* Recursive: this is called from inside the shadow code */
     paging_lock_recursive(d);
 
+    /* A full ring gets here, see dirty_vram_note(). */
+    if ( d->arch.paging.log_dirty.ring )
+        dirty_vram_note(d, pfn_x(pfn));
+
     if ( unlikely(!mfn_valid(d->arch.paging.log_dirty.top)) ) 
     {
          d->arch.paging.log_dirty.top = paging_new_log_dirty_node(d);
@@ -540,6 +717,7 @@ static int paging_log_dirty_op(struct domain *d,
         {
             d->arch.paging.log_dirty.fault_count = 0;
             d->arch.paging.log_dirty.dirty_count = 0;
+            d->arch.paging.log_dirty.ring_harvested = false;
         }
     }
     else
@@ -586,32 +764,123 @@ static int paging_log_dirty_op(struct domain *d,
     return rv;
 }
 
+/*
+ * Return the GFNs in the domain's dirty rings, and clean for the next
+ * round, like paging_log_dirty_op() does for the bitmap.  A round takes as
+ * many calls as it needs to empty the rings, and cleaning costs a sweep of
+ * the whole p2m, so only the call emptying them cleans, if anything was
+ * harvested.  If pages were logged in the bitmap too, the OP_CLEAN fetching
+ * them cleans instead.
+ */
+static int paging_log_dirty_harvest(struct domain *d,
+                                    struct xen_domctl_shadow_op *sc)
+{
+    struct vcpu *v;
+    unsigned long done = 0;
+    bool clean = false;
+    int rc = 0;
+
+    if ( is_hvm_domain(d) && (sc->mode & XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL) )
+        hvm_mapped_guest_frames_mark_dirty(d);
+
+    domain_pause(d);
+
+    /* This logs into the domain ring, from the toolstack's CPU. */
+    p2m_flush_hardware_cached_dirty(d);
+
+    paging_lock(d);
+
+    if ( !d->arch.paging.log_dirty.ring )
+        rc = -EINVAL;
+    else
+    {
+        for_each_vcpu ( d, v )
+            if ( (rc = dirty_ring_harvest(d, v->arch.paging.dirty_ring,
+                                          sc, &done)) != 0 )
+                break;
+        if ( !rc )
+            rc = dirty_ring_harvest(d, d->arch.paging.log_dirty.ring,
+                                    sc, &done);
+
+        clean = !rc && d->arch.paging.log_dirty.ring_harvested &&
+                !d->arch.paging.log_dirty.ring->prod &&
+                !d->arch.paging.log_dirty.dirty_count;
+        for_each_vcpu ( d, v )
+            if ( v->arch.paging.dirty_ring->prod )
+                clean = false;
+
+        if ( clean )
+            d->arch.paging.log_dirty.ring_harvested = false;
+    }
+
+    PAGING_DEBUG(LOGDIRTY, "log-dirty harvest: dom %u gfns=%lu dirty=%u\n",
+                 d->domain_id, done, d->arch.paging.log_dirty.dirty_count);
+
+    sc->pages = done;
+    sc->stats.fault_count = d->arch.paging.log_dirty.fault_count;
+    sc->stats.dirty_count = d->arch.paging.log_dirty.dirty_count;
+
+    paging_unlock(d);
+
+    /* Safe because the domain is paused. */
+    if ( clean )
+        d->arch.paging.log_dirty.ops->clean(d);
+
+    domain_unpause(d);
+
+    return rc;
+}
+
 void paging_log_dirty_range(struct domain *d,
                            unsigned long begin_pfn,
                            unsigned long nr,
                            uint8_t *dirty_bitmap)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    struct sh_dirty_vram *dirty_vram;
     int i;
     unsigned long pfn;
 
+    /* Add the pages noted by dirty_vram_note(), which a clean re-armed. */
+    paging_lock(d);
+    dirty_vram = d->arch.hvm.dirty_vram;
+    if ( dirty_vram && dirty_vram->dirty_bitmap &&
+         dirty_vram->begin_pfn == begin_pfn &&
+         dirty_vram->end_pfn == begin_pfn + nr )
+        for ( i = 0; i < (nr + 7) / 8; i++ )
+        {
+            dirty_bitmap[i] |= dirty_vram->dirty_bitmap[i];
+            dirty_vram->dirty_bitmap[i] = 0;
+        }
+    paging_unlock(d);
+
     /*
-     * Set l1e entries of P2M table to be read-only.
-     *
-     * On first write, it page faults, its entry is changed to read-write,
-     * and on retry the write succeeds.
-     *
-     * We populate dirty_bitmap by looking for entries that have been
-     * switched to read-write.
+     * With hardware-assisted log-dirty, take the written pages from the
+     * dirty state the hardware keeps in the P2M, only visiting the parts
+     * the guest has touched.  The caller sizes dirty_bitmap in whole longs,
+     * and x86 bitmaps are little endian, so it can be used as is.
      */
+    if ( !p2m_harvest_hardware_dirty(d, begin_pfn, begin_pfn + nr - 1,
+                                     (unsigned long *)dirty_bitmap) )
+    {
+        /*
+         * Set l1e entries of P2M table to be read-only.
+         *
+         * On first write, it page faults, its entry is changed to
+         * read-write, and on retry the write succeeds.
+         *
+         * We populate dirty_bitmap by looking for entries that have been
+         * switched to read-write.
+         */
 
-    p2m_lock(p2m);
+        p2m_lock(p2m);
 
-    for ( i = 0, pfn = begin_pfn; pfn < begin_pfn + nr; i++, pfn++ )
-        if ( !p2m_change_type_one(d, pfn, p2m_ram_rw, p2m_ram_logdirty) )
-            dirty_bitmap[i >> 3] |= (1 << (i & 7));
+        for ( i = 0, pfn = begin_pfn; pfn < begin_pfn + nr; i++, pfn++ )
+            if ( !p2m_change_type_one(d, pfn, p2m_ram_rw, p2m_ram_logdirty) )
+                dirty_bitmap[i >> 3] |= (1 << (i & 7));
 
-    p2m_unlock(p2m);
+        p2m_unlock(p2m);
+    }
 
     flush_tlb_mask(d->dirty_cpumask);
 }
@@ -725,8 +994,13 @@ int paging_domctl(struct domain *d, struct xen_domctl_shadow_op *sc,
     case XEN_DOMCTL_SHADOW_OP_ENABLE:
         if ( !(sc->mode & XEN_DOMCTL_SHADOW_ENABLE_LOG_DIRTY) )
             break;
-        /* Else fall through... */
+        return paging_log_dirty_enable(d, 1);
+
     case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
+        if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_RING )
+            return -EINVAL;
+        if ( sc->mode & XEN_DOMCTL_SHADOW_LOGDIRTY_RING )
+            return paging_dirty_ring_enable(d);
         return paging_log_dirty_enable(d, 1);
 
     case XEN_DOMCTL_SHADOW_OP_OFF:
@@ -739,6 +1013,11 @@ int paging_domctl(struct domain *d, struct xen_domctl_shadow_op *sc,
         if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL )
             return -EINVAL;
         return paging_log_dirty_op(d, sc, resuming);
+
+    case XEN_DOMCTL_SHADOW_OP_HARVEST:
+        if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL )
+            return -EINVAL;
+        return paging_log_dirty_harvest(d, sc);
     }
 
     /* Here, dispatch domctl to the appropriate paging code */
@@ -794,6 +1073,7 @@ int paging_teardown(struct domain *d)
 {
     int rc;
     bool preempted = false;
+    struct vcpu *v;
 
     if ( hap_enabled(d) )
         hap_teardown(d, &preempted);
@@ -808,6 +1088,13 @@ int paging_teardown(struct domain *d)
     if ( rc == -ERESTART )
         return rc;
 
+    paging_dirty_ring_disable(d);
+    for_each_vcpu ( d, v )
+    {
+        vfree(v->arch.paging.dirty_ring);
+        v->arch.paging.dirty_ring = NULL;
+    }
+
     /* Move populate-on-demand cache back to domain_list for destruction */
     rc = p2m_pod_empty_cache(d);
 
@@ -54,6 +54,10 @@ int create_grant_pv_mapping(uint64_t addr, mfn_t frame,
     mfn_t gl1mfn;
     int rc = GNTST_general_error;
 
+    /* Multi-page grants need superpage mappings, which PV guests lack. */
+    if ( flags & GNTMAP_order_mask )
+        return GNTST_general_error;
+
     nl1e = l1e_from_mfn(frame, grant_to_pte_flags(flags, cache_flags));
     nl1e = adjust_guest_l1e(nl1e, currd);
 
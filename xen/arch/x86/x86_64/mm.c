@@ -1435,21 +1435,16 @@ int memory_add(unsigned long spfn, unsigned long epfn, unsigned int pxm)
          !iommu_use_hap_pt(hardware_domain) &&
          !need_iommu_pt_sync(hardware_domain) )
     {
-        for ( i = spfn; i < epfn; i++ )
-            if ( iommu_legacy_map(hardware_domain, _dfn(i), _mfn(i),
-                                  PAGE_ORDER_4K,
-                                  IOMMUF_readable | IOMMUF_writable) )
-                break;
-        if ( i != epfn )
-        {
-            while (i-- > old_max)
-                /* If statement to satisfy __must_check. */
-                if ( iommu_legacy_unmap(hardware_domain, _dfn(i),
-                                        PAGE_ORDER_4K) )
-                    continue;
-
+        unsigned int flush_flags = 0;
+
+        /* A failed iommu_map_range() has undone its mappings already. */
+        ret = iommu_map_range(hardware_domain, _dfn(spfn), _mfn(spfn),
+                              epfn - spfn, IOMMUF_readable | IOMMUF_writable,
+                              &flush_flags);
+        if ( !ret )
+            ret = iommu_iotlb_flush_all(hardware_domain, flush_flags);
+        if ( ret )
             goto destroy_m2p;
-        }
     }
 
     /* We can't revert any more */
@@ -841,6 +841,7 @@ long do_domctl(XEN_GUEST_HANDLE_PARAM(xen_domctl_t) u_domctl)
         op->u.getvcpuinfo.running  = v->is_running;
         op->u.getvcpuinfo.cpu_time = runstate.time[RUNSTATE_running];
         op->u.getvcpuinfo.cpu      = v->processor;
+        op->u.getvcpuinfo.runnable_time = runstate.time[RUNSTATE_runnable];
         ret = 0;
         copyback = 1;
         break;
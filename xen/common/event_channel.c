@@ -132,6 +132,7 @@ static struct evtchn *alloc_evtchn_bucket(struct domain *d, unsigned int port)
         }
         chn[i].port = port + i;
         spin_lock_init(&chn[i].lock);
+        spin_lock_init(&chn[i].fifo_lock);
     }
     return chn;
 }
@@ -213,6 +214,7 @@ void evtchn_free(struct domain *d, struct evtchn *chn)
     chn->state          = ECS_FREE;
     chn->notify_vcpu_id = 0;
     chn->xen_consumer   = 0;
+    chn->coalesce_window = 0;
 
     xsm_evtchn_close_post(chn);
 }
@@ -647,6 +649,8 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
 
         chn2->state = ECS_UNBOUND;
         chn2->u.unbound.remote_domid = d1->domain_id;
+        /* Any window set applied to the binding just torn down. */
+        chn2->coalesce_window = 0;
 
         double_evtchn_unlock(chn1, chn2);
 
@@ -673,7 +677,99 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
     return rc;
 }
 
-int evtchn_send(struct domain *ld, unsigned int lport)
+/*
+ * Event coalescing.
+ *
+ * An event sent to a port with a coalescing window, within that window of
+ * the port's previous delivery, is deferred to the end of the window.  The
+ * port is pushed onto a lock-free list of its vCPU, which the vCPU's
+ * coalescing timer pops and delivers.  Whoever sets the port's
+ * coalesce_deferred bit pushes it, and the bit is only cleared once the
+ * port has been popped again, so a port is on at most one list at a time.
+ *
+ * Ports are never popped from a list without their domain's vCPUs being
+ * destroyed first, so the timer may find them closed (or even bound again),
+ * in which case it delivers a spurious event at worst.
+ */
+#define COALESCE_STAMP_SHIFT 10
+
+static void evtchn_deliver(struct domain *d, struct evtchn *chn)
+{
+    if ( chn->coalesce_window )
+        write_atomic(&chn->coalesce_stamp, NOW() >> COALESCE_STAMP_SHIFT);
+
+    evtchn_port_set_pending(d, chn->notify_vcpu_id, chn);
+}
+
+static bool evtchn_coalesce(struct domain *d, struct evtchn *chn)
+{
+    struct vcpu *v = d->vcpu[chn->notify_vcpu_id];
+    s_time_t now = NOW(), elapsed, expires;
+    unsigned int head;
+
+    /* Unacknowledged events would only cause redundant upcalls. */
+    if ( evtchn_port_is_pending(d, chn->port) )
+        return true;
+
+    elapsed = (uint32_t)((now >> COALESCE_STAMP_SHIFT) -
+                         read_atomic(&chn->coalesce_stamp));
+    elapsed <<= COALESCE_STAMP_SHIFT;
+    if ( elapsed >= MICROSECS(chn->coalesce_window) )
+        return false;
+
+    if ( test_and_set_bit(0, &chn->coalesce_deferred) )
+        return true;
+
+    do {
+        head = read_atomic(&v->evtchn_coalesce_head);
+        chn->coalesce_next = head;
+    } while ( cmpxchg(&v->evtchn_coalesce_head, head, chn->port) != head );
+
+    expires = now - elapsed + MICROSECS(chn->coalesce_window);
+    if ( !timer_expires_before(&v->evtchn_coalesce_timer, expires + 1) )
+        set_timer(&v->evtchn_coalesce_timer, expires);
+
+    return true;
+}
+
+void evtchn_coalesce_timer_fn(void *data)
+{
+    struct vcpu *v = data;
+    struct domain *d = v->domain;
+    unsigned int port = xchg(&v->evtchn_coalesce_head, 0);
+
+    while ( port )
+    {
+        struct evtchn *chn = evtchn_from_port(d, port);
+
+        port = chn->coalesce_next;
+        /*
+         * Let further events be deferred again before delivering this one,
+         * so that none of them can be merged into an already handled one.
+         */
+        smp_mb();
+        clear_bit(0, &chn->coalesce_deferred);
+
+        spin_lock(&chn->lock);
+        if ( chn->state == ECS_INTERDOMAIN || chn->state == ECS_IPI )
+            evtchn_deliver(d, chn);
+        spin_unlock(&chn->lock);
+    }
+}
+
+static void evtchn_notify(struct domain *d, struct evtchn *chn, bool coalesce)
+{
+    if ( coalesce && chn->coalesce_window && evtchn_coalesce(d, chn) )
+        return;
+
+    evtchn_deliver(d, chn);
+}
+
+/*
+ * Only sends on behalf of the guest (EVTCHNOP_send and EVTCHNOP_send_batch)
+ * are subject to coalescing.  Xen's own sends are delivered immediately.
+ */
+static int send_port(struct domain *ld, unsigned int lport, bool coalesce)
 {
     struct evtchn *lchn, *rchn;
     struct domain *rd;
@@ -706,10 +802,10 @@ int evtchn_send(struct domain *ld, unsigned int lport)
         if ( consumer_is_xen(rchn) )
             xen_notification_fn(rchn)(rd->vcpu[rchn->notify_vcpu_id], rport);
         else
-            evtchn_port_set_pending(rd, rchn->notify_vcpu_id, rchn);
+            evtchn_notify(rd, rchn, coalesce);
         break;
     case ECS_IPI:
-        evtchn_port_set_pending(ld, lchn->notify_vcpu_id, lchn);
+        evtchn_notify(ld, lchn, coalesce);
         break;
     case ECS_UNBOUND:
         /* silently drop the notification */
@@ -724,6 +820,11 @@ out:
     return ret;
 }
 
+int evtchn_send(struct domain *ld, unsigned int lport)
+{
+    return send_port(ld, lport, false);
+}
+
 int guest_enabled_event(struct vcpu *v, uint32_t virq)
 {
     return ((v != NULL) && (v->virq_to_evtchn[virq] != 0));
@@ -1051,6 +1152,60 @@ static long evtchn_set_priority(const struct evtchn_set_priority *set_priority)
     return ret;
 }
 
+static long evtchn_send_batch(struct evtchn_send_batch *batch)
+{
+    struct domain *d = current->domain;
+    long rc = 0;
+
+    batch->nr_sent = 0;
+    if ( batch->nr_ports > ARRAY_SIZE(batch->ports) )
+        return -EINVAL;
+
+    for ( ; batch->nr_sent < batch->nr_ports; batch->nr_sent++ )
+    {
+        rc = send_port(d, batch->ports[batch->nr_sent], true);
+        if ( rc )
+            break;
+    }
+
+    return rc;
+}
+
+static long evtchn_set_coalescing(const struct evtchn_set_coalescing *set)
+{
+    struct domain *d = current->domain;
+    unsigned int port = set->port;
+    struct evtchn *chn;
+
+    if ( set->window_us > EVTCHN_COALESCE_MAX_US )
+        return -EINVAL;
+
+    spin_lock(&d->event_lock);
+
+    if ( !port_is_valid(d, port) )
+    {
+        spin_unlock(&d->event_lock);
+        return -EINVAL;
+    }
+
+    /*
+     * Only bound interdomain and IPI channels coalesce; the window is reset
+     * whenever they get unbound, so it can't leak into the next binding.
+     */
+    chn = evtchn_from_port(d, port);
+    if ( chn->state != ECS_INTERDOMAIN && chn->state != ECS_IPI )
+    {
+        spin_unlock(&d->event_lock);
+        return -EINVAL;
+    }
+
+    write_atomic(&chn->coalesce_window, set->window_us);
+
+    spin_unlock(&d->event_lock);
+
+    return 0;
+}
+
 long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
 {
     long rc;
@@ -1119,7 +1274,7 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         struct evtchn_send send;
         if ( copy_from_guest(&send, arg, 1) != 0 )
             return -EFAULT;
-        rc = evtchn_send(current->domain, send.port);
+        rc = send_port(current->domain, send.port, true);
         break;
     }
 
@@ -1194,6 +1349,24 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_send_batch: {
+        struct evtchn_send_batch send_batch;
+        if ( copy_from_guest(&send_batch, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_send_batch(&send_batch);
+        if ( __copy_to_guest(arg, &send_batch, 1) )
+            rc = -EFAULT;
+        break;
+    }
+
+    case EVTCHNOP_set_coalescing: {
+        struct evtchn_set_coalescing set_coalescing;
+        if ( copy_from_guest(&set_coalescing, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_set_coalescing(&set_coalescing);
+        break;
+    }
+
     default:
         rc = -ENOSYS;
         break;
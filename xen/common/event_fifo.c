@@ -56,35 +56,19 @@ static void evtchn_fifo_init(struct domain *d, struct evtchn *evtchn)
                  d->domain_id, evtchn->port);
 }
 
-static struct evtchn_fifo_queue *lock_old_queue(const struct domain *d,
-                                                struct evtchn *evtchn,
-                                                unsigned long *flags)
-{
-    struct vcpu *v;
-    struct evtchn_fifo_queue *q, *old_q;
-    unsigned int try;
-
-    for ( try = 0; try < 3; try++ )
-    {
-        v = d->vcpu[evtchn->last_vcpu_id];
-        old_q = &v->evtchn_fifo->queue[evtchn->last_priority];
-
-        spin_lock_irqsave(&old_q->lock, *flags);
-
-        v = d->vcpu[evtchn->last_vcpu_id];
-        q = &v->evtchn_fifo->queue[evtchn->last_priority];
-
-        if ( old_q == q )
-            return old_q;
-
-        spin_unlock_irqrestore(&old_q->lock, *flags);
-    }
-
-    gprintk(XENLOG_WARNING,
-            "dom%d port %d lost event (too many queue changes)\n",
-            d->domain_id, evtchn->port);
-    return NULL;
-}          
+/*
+ * Queues are lock-free: producers swap themselves in as the tail of a queue
+ * with xchg(), and then link the previous tail to themselves.  The previous
+ * tail may however have been consumed by the guest in the meantime, and
+ * even linked again (on this queue or another one), in which case linking
+ * to it would corrupt the queues.  To spot that, tails are tagged with the
+ * event's link sequence number, which is bumped, under the event's
+ * fifo_lock, every time the event is linked.
+ */
+#define TAIL_SEQ_MASK       ((1u << (32 - EVTCHN_FIFO_LINK_BITS)) - 1)
+#define TAIL(port, seq)     ((port) | ((uint32_t)(seq) << EVTCHN_FIFO_LINK_BITS))
+#define TAIL_PORT(tail)     ((tail) & EVTCHN_FIFO_LINK_MASK)
+#define TAIL_SEQ(tail)      ((tail) >> EVTCHN_FIFO_LINK_BITS)
 
 static int try_set_link(event_word_t *word, event_word_t *w, uint32_t link)
 {
@@ -103,7 +87,8 @@ static int try_set_link(event_word_t *word, event_word_t *w, uint32_t link)
 }
 
 /*
- * Atomically set the LINK field iff it is still LINKED.
+ * Atomically set the LINK field of the (former) tail iff it is still
+ * LINKED, and still the same instance of the event which became the tail.
  *
  * The guest is only permitted to make the following changes to a
  * LINKED event.
@@ -116,18 +101,27 @@ static int try_set_link(event_word_t *word, event_word_t *w, uint32_t link)
  * We block unmasking by the guest by marking the tail word as BUSY,
  * therefore, the cmpxchg() may fail at most 4 times.
  */
-static bool_t evtchn_fifo_set_link(const struct domain *d, event_word_t *word,
+static bool_t evtchn_fifo_set_link(struct domain *d, uint32_t tail,
                                    uint32_t link)
 {
+    struct evtchn *evtchn = evtchn_from_port(d, TAIL_PORT(tail));
+    event_word_t *word = evtchn_fifo_word_from_port(d, TAIL_PORT(tail));
     event_word_t w;
+    unsigned long flags;
     unsigned int try;
-    int ret;
+    int ret = 0;
+
+    spin_lock_irqsave(&evtchn->fifo_lock, flags);
+
+    /* Consumed and linked again since it became the tail? */
+    if ( evtchn->fifo_seq != TAIL_SEQ(tail) )
+        goto out;
 
     w = read_atomic(word);
 
     ret = try_set_link(word, &w, link);
     if ( ret >= 0 )
-        return ret;
+        goto out;
 
     /* Lock the word to prevent guest unmasking. */
     set_bit(EVTCHN_FIFO_BUSY, word);
@@ -141,13 +135,38 @@ static bool_t evtchn_fifo_set_link(const struct domain *d, event_word_t *word,
         {
             if ( ret == 0 )
                 clear_bit(EVTCHN_FIFO_BUSY, word);
-            return ret;
+            goto out;
         }
     }
     gdprintk(XENLOG_WARNING, "domain %d, port %d not linked\n",
              d->domain_id, link);
     clear_bit(EVTCHN_FIFO_BUSY, word);
-    return 1;
+    ret = 1;
+
+ out:
+    spin_unlock_irqrestore(&evtchn->fifo_lock, flags);
+
+    return ret;
+}
+
+/*
+ * Slow path, for an event moving to a different queue (because it was
+ * rebound to another vCPU, or its priority changed).
+ *
+ * If this event was the tail of its old queue, that queue is now empty,
+ * and the tail must be invalidated.  A stale tail would be spotted by its
+ * sequence number anyway, but this saves the next event on the old queue
+ * a trip through this event's lock.
+ */
+static void evtchn_fifo_migrate(const struct vcpu *v, struct evtchn *evtchn,
+                                struct evtchn_fifo_queue *old_q,
+                                const struct evtchn_fifo_queue *q,
+                                uint32_t old_tail)
+{
+    (void)cmpxchg(&old_q->tail, old_tail, 0);
+
+    evtchn->last_vcpu_id = v->vcpu_id;
+    evtchn->last_priority = q->priority;
 }
 
 static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
@@ -180,7 +199,7 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
          && !test_bit(EVTCHN_FIFO_LINKED, word) )
     {
         struct evtchn_fifo_queue *q, *old_q;
-        event_word_t *tail_word;
+        uint32_t tail, prev_tail;
         bool_t linked = 0;
 
         /*
@@ -202,54 +221,45 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
          */
         q = &v->evtchn_fifo->queue[evtchn->priority];
 
-        old_q = lock_old_queue(d, evtchn, &flags);
-        if ( !old_q )
-            goto done;
+        /*
+         * Only whoever sets LINKED gets to link the event, so all the
+         * below is serialized for each event.
+         */
+        spin_lock_irqsave(&evtchn->fifo_lock, flags);
 
         if ( test_and_set_bit(EVTCHN_FIFO_LINKED, word) )
         {
-            spin_unlock_irqrestore(&old_q->lock, flags);
+            spin_unlock_irqrestore(&evtchn->fifo_lock, flags);
             goto done;
         }
 
-        /*
-         * If this event was a tail, the old queue is now empty and
-         * its tail must be invalidated to prevent adding an event to
-         * the old queue from corrupting the new queue.
-         */
-        if ( old_q->tail == port )
-            old_q->tail = 0;
+        prev_tail = TAIL(port, evtchn->fifo_seq);
+        evtchn->fifo_seq = (evtchn->fifo_seq + 1) & TAIL_SEQ_MASK;
+        tail = TAIL(port, evtchn->fifo_seq);
 
         /* Moved to a different queue? */
-        if ( old_q != q )
-        {
-            evtchn->last_vcpu_id = evtchn->notify_vcpu_id;
-            evtchn->last_priority = evtchn->priority;
+        old_q = &d->vcpu[evtchn->last_vcpu_id]->evtchn_fifo->queue[
+            evtchn->last_priority];
+        if ( unlikely(old_q != q) )
+            evtchn_fifo_migrate(v, evtchn, old_q, q, prev_tail);
 
-            spin_unlock_irqrestore(&old_q->lock, flags);
-            spin_lock_irqsave(&q->lock, flags);
-        }
+        spin_unlock_irqrestore(&evtchn->fifo_lock, flags);
 
         /*
-         * Atomically link the tail to port iff the tail is linked.
-         * If the tail is unlinked the queue is empty.
+         * Atomically link the previous tail to port iff it is still
+         * linked.  If it is not, the queue is empty (which includes
+         * there having been no previous tail at all), and head must be
+         * updated.
          *
-         * If port is the same as tail, the queue is empty but q->tail
-         * will appear linked as we just set LINKED above.
-         *
-         * If the queue is empty (i.e., we haven't linked to the new
-         * event), head must be updated.
+         * Later events may be linked to us before we are done, but none
+         * can be consumed (nor, therefore, make the queue empty again)
+         * before we are, as they are not reachable from head until then.
          */
-        if ( q->tail )
-        {
-            tail_word = evtchn_fifo_word_from_port(d, q->tail);
-            linked = evtchn_fifo_set_link(d, tail_word, port);
-        }
+        prev_tail = xchg(&q->tail, tail);
+        if ( TAIL_PORT(prev_tail) )
+            linked = evtchn_fifo_set_link(d, prev_tail, port);
         if ( !linked )
             write_atomic(q->head, port);
-        q->tail = port;
-
-        spin_unlock_irqrestore(&q->lock, flags);
 
         if ( !linked
              && !test_and_set_bit(q->priority,
@@ -399,7 +409,6 @@ static void unmap_guest_page(void *virt)
 static void init_queue(struct vcpu *v, struct evtchn_fifo_queue *q,
                        unsigned int i)
 {
-    spin_lock_init(&q->lock);
     q->priority = i;
 }
 
@@ -48,7 +48,7 @@ struct grant_table {
      * entry list, etc.)
      */
     percpu_rwlock_t       lock;
-    /* Lock protecting the maptrack limit */
+    /* Lock protecting the maptrack limit and depot */
     spinlock_t            maptrack_lock;
     /*
      * Defaults to v1.  May be changed with GNTTABOP_set_version.  All other
@@ -76,6 +76,8 @@ struct grant_table {
     struct active_grant_entry **active;
     /* Mapping tracking table per vcpu. */
     struct grant_mapping **maptrack;
+    /* Full magazines of free maptrack entries (see get_maptrack_handle()). */
+    unsigned int          maptrack_depot;
 
     /* Domain to which this struct grant_table belongs. */
     const struct domain *domain;
@@ -168,8 +170,37 @@ struct gnttab_unmap_common {
     grant_ref_t ref;
 };
 
-/* Number of unmap operations that are done between each tlb flush */
-#define GNTTAB_UNMAP_BATCH_SIZE 32
+/* State of an unmap operation left to complete after the TLB flush. */
+struct gnttab_unmap_done {
+    uint16_t done;
+    grant_ref_t ref;
+    mfn_t mfn;
+    struct domain *rd;
+};
+
+/*
+ * Maximum number of unmap operations that are done between each tlb flush.
+ * Fewer are if the hypercall gets preempted, or completes, before.
+ */
+#define GNTTAB_UNMAP_BATCH_SIZE 128
+
+struct gnttab_unmap_batch {
+    unsigned int nr;
+    struct gnttab_unmap_done ops[GNTTAB_UNMAP_BATCH_SIZE];
+};
+
+/*
+ * Map and unmap requests mostly come in batches for grants of a single
+ * remote domain (e.g. a backend's frontend).  Rather than looking up and
+ * RCU locking the remote domain for each operation, consecutive operations
+ * on the same domain are grouped: the domain is kept RCU locked until an
+ * operation on another domain or the end of the batch.  Its grant table is
+ * still only read locked for the part of each operation dealing with grant
+ * entries, not across guest copies, p2m updates or log-dirty marking.
+ */
+struct gnttab_group {
+    struct domain *rd;      /* RCU locked remote domain, or NULL */
+};
 
 
 #define PIN_FAIL(_lbl, _rc, _f, _a...)          \
@@ -184,10 +215,10 @@ struct gnttab_unmap_common {
  * table of these, indexes into which are returned as a 'mapping handle'.
  */
 struct grant_mapping {
-    grant_ref_t ref;        /* grant ref */
-    uint16_t flags;         /* 0-4: GNTMAP_* ; 5-15: unused */
+    grant_ref_t ref;        /* grant ref, or next free entry */
+    uint16_t flags;         /* 0-5, 8-11: GNTMAP_* ; others: unused */
     domid_t  domid;         /* granting domain */
-    uint32_t vcpu;          /* vcpu which created the grant mapping */
+    uint32_t next_mag;      /* free: next magazine, for a magazine's head */
     uint32_t pad;           /* round size to a power of 2 */
 };
 
@@ -273,6 +304,8 @@ struct active_grant_entry {
     bool          is_sub_page:1; /* True if this is a sub-page grant. */
     unsigned int  length:16; /* For sub-page grants, the length of the
                                 grant.                                */
+    uint8_t       order;  /* For multi-page grants, the order of the
+                             range of frames from mfn.                */
     grant_ref_t   trans_gref;
     struct domain *trans_domain;
     mfn_t         mfn;    /* Machine frame being granted.             */
@@ -317,6 +350,27 @@ static inline void grant_write_unlock(struct grant_table *gt)
     percpu_write_unlock(grant_rwlock, &gt->lock);
 }
 
+static void gnttab_group_put(struct gnttab_group *grp)
+{
+    if ( grp->rd )
+    {
+        rcu_unlock_domain(grp->rd);
+        grp->rd = NULL;
+    }
+}
+
+static struct domain *gnttab_group_get(struct gnttab_group *grp,
+                                       domid_t domid)
+{
+    if ( !grp->rd || grp->rd->domain_id != domid )
+    {
+        gnttab_group_put(grp);
+        grp->rd = rcu_lock_domain_by_id(domid);
+    }
+
+    return grp->rd;
+}
+
 static inline void gnttab_flush_tlb(const struct domain *d)
 {
     if ( !paging_mode_external(d) )
@@ -422,6 +476,92 @@ static int get_paged_frame(unsigned long gfn, mfn_t *mfn,
     return GNTST_okay;
 }
 
+/*
+ * Check that the 2^order frames of a multi-page grant from gfn are present
+ * and contiguous in machine memory, and return the first one.  Contrary to
+ * get_paged_frame(), no page reference is retained.
+ */
+static int get_multi_page_frames(unsigned long gfn, unsigned int order,
+                                 mfn_t *mfn, bool readonly,
+                                 struct domain *rd)
+{
+    unsigned long i;
+
+    if ( gfn & ((1UL << order) - 1) )
+        return GNTST_bad_page;
+
+    for ( i = 0; i < (1UL << order); i++ )
+    {
+        struct page_info *page;
+        mfn_t frame;
+        int rc = get_paged_frame(gfn + i, &frame, &page, readonly, rd);
+
+        if ( rc != GNTST_okay )
+            return rc;
+        put_page(page);
+
+        if ( !i )
+            *mfn = frame;
+        else if ( !mfn_eq(frame, mfn_add(*mfn, i)) )
+            return GNTST_bad_page;
+    }
+
+    return GNTST_okay;
+}
+
+/* Drop the references held by a host mapping of nr frames from mfn. */
+static void put_grant_pages(mfn_t mfn, unsigned long nr, bool put_type)
+{
+    while ( nr-- )
+    {
+        struct page_info *pg = mfn_to_page(mfn_add(mfn, nr));
+
+        if ( put_type )
+            put_page_type(pg);
+        put_page(pg);
+    }
+}
+
+/*
+ * Host map a multi-page grant of the order given in flags, taking the page
+ * references the mapping holds.
+ */
+static int map_grant_pages(uint64_t addr, mfn_t mfn, unsigned int flags,
+                           const struct domain *ld, struct domain *rd)
+{
+    unsigned long i, nr = 1UL << MASK_EXTR(flags, GNTMAP_order_mask);
+    bool typed = gnttab_host_mapping_get_page_type(flags & GNTMAP_readonly,
+                                                   ld, rd);
+    int rc = GNTST_general_error;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct page_info *pg = mfn_to_page(mfn_add(mfn, i));
+
+        if ( !get_page(pg, rd) )
+            break;
+        if ( typed && !get_page_type(pg, PGT_writable_page) )
+        {
+            put_page(pg);
+            break;
+        }
+    }
+
+    if ( i == nr )
+    {
+        rc = create_grant_host_mapping(addr, mfn, flags, 0);
+        if ( rc == GNTST_okay )
+            return rc;
+    }
+    else if ( !rd->is_dying )
+        gdprintk(XENLOG_WARNING, "Could not pin grant frame %#"PRI_mfn"\n",
+                 mfn_x(mfn_add(mfn, i)));
+
+    put_grant_pages(mfn, i, typed);
+
+    return rc;
+}
+
 static inline void
 double_gt_lock(struct grant_table *lgt, struct grant_table *rgt)
 {
@@ -452,72 +592,95 @@ double_gt_unlock(struct grant_table *lgt, struct grant_table *rgt)
 
 #define INVALID_MAPTRACK_HANDLE UINT_MAX
 
-static inline grant_handle_t
-_get_maptrack_handle(struct grant_table *t, struct vcpu *v)
+/*
+ * Maptrack handles are allocated from magazines, as in a slab allocator.
+ *
+ * A magazine is a list of MAPTRACK_MAG_SIZE (or, for the loaded magazine
+ * of a vCPU, at most as many) free entries, linked through their ref
+ * field.  Each vCPU has a loaded magazine, which it allocates from and
+ * frees to, and a previous one, which is either full or empty.  Full
+ * magazines are exchanged with a per-domain depot, where they are linked
+ * through the next_mag field of their head entry.  So allocating or
+ * freeing a handle costs at most a depot access, whichever vCPU created
+ * the mapping, and the maptrack frames only grow when the depot runs dry.
+ *
+ * The magazines of a vCPU are only used by the vCPU itself, under its
+ * maptrack_freelist_lock, except when another vCPU of the domain runs out
+ * of handles with no room left to grow: it then reclaims a magazine from
+ * other vCPUs, rather than failing while some of them hold free handles.
+ */
+#define MAPTRACK_MAG_SIZE 32
+
+static unsigned int maptrack_depot_get(struct grant_table *t)
 {
-    unsigned int head, next, prev_head;
+    unsigned int mag;
 
-    spin_lock(&v->maptrack_freelist_lock);
+    spin_lock(&t->maptrack_lock);
+    mag = t->maptrack_depot;
+    if ( mag != MAPTRACK_TAIL )
+        t->maptrack_depot = maptrack_entry(t, mag).next_mag;
+    spin_unlock(&t->maptrack_lock);
 
-    do {
-        /* No maptrack pages allocated for this VCPU yet? */
-        head = read_atomic(&v->maptrack_head);
-        if ( unlikely(head == MAPTRACK_TAIL) )
-        {
-            spin_unlock(&v->maptrack_freelist_lock);
-            return INVALID_MAPTRACK_HANDLE;
-        }
+    return mag;
+}
 
-        /*
-         * Always keep one entry in the free list to make it easier to
-         * add free entries to the tail.
-         */
-        next = read_atomic(&maptrack_entry(t, head).ref);
-        if ( unlikely(next == MAPTRACK_TAIL) )
-        {
-            spin_unlock(&v->maptrack_freelist_lock);
-            return INVALID_MAPTRACK_HANDLE;
-        }
+static void maptrack_depot_put(struct grant_table *t, unsigned int mag)
+{
+    spin_lock(&t->maptrack_lock);
+    maptrack_entry(t, mag).next_mag = t->maptrack_depot;
+    t->maptrack_depot = mag;
+    spin_unlock(&t->maptrack_lock);
+}
 
-        prev_head = head;
-        head = cmpxchg(&v->maptrack_head, prev_head, next);
-    } while ( head != prev_head );
+/* Pop a handle from the loaded magazine.  Called with it not empty. */
+static grant_handle_t maptrack_pop(struct grant_table *t, struct vcpu *v)
+{
+    grant_handle_t handle = v->maptrack_head;
 
-    spin_unlock(&v->maptrack_freelist_lock);
+    ASSERT(v->maptrack_count);
+    v->maptrack_head = maptrack_entry(t, handle).ref;
+    v->maptrack_count--;
 
-    return head;
+    return handle;
 }
 
 /*
- * Try to "steal" a free maptrack entry from another VCPU.
- *
- * A stolen entry is transferred to the thief, so the number of
- * entries for each VCPU should tend to the usage pattern.
- *
- * To avoid having to atomically count the number of free entries on
- * each VCPU and to avoid two VCPU repeatedly stealing entries from
- * each other, the initial victim VCPU is selected randomly.
+ * Take a magazine from another vCPU: its previous (full) magazine if it has
+ * one, else its loaded one.  The initial victim is selected randomly, to
+ * avoid reclaiming from the same vCPUs over and over.
  */
-static grant_handle_t steal_maptrack_handle(struct grant_table *t,
-                                            const struct vcpu *curr)
+static unsigned int reclaim_maptrack_magazine(struct grant_table *t,
+                                              const struct vcpu *curr,
+                                              unsigned int *count)
 {
     const struct domain *currd = curr->domain;
-    unsigned int first, i;
+    unsigned int first, i, mag = MAPTRACK_TAIL;
 
-    /* Find an initial victim. */
     first = i = get_random() % currd->max_vcpus;
 
     do {
-        if ( currd->vcpu[i] )
-        {
-            grant_handle_t handle;
+        struct vcpu *v = currd->vcpu[i];
 
-            handle = _get_maptrack_handle(t, currd->vcpu[i]);
-            if ( handle != INVALID_MAPTRACK_HANDLE )
+        if ( v && v != curr )
+        {
+            spin_lock(&v->maptrack_freelist_lock);
+            if ( v->maptrack_prev != MAPTRACK_TAIL )
+            {
+                mag = v->maptrack_prev;
+                *count = MAPTRACK_MAG_SIZE;
+                v->maptrack_prev = MAPTRACK_TAIL;
+            }
+            else if ( v->maptrack_count )
             {
-                maptrack_entry(t, handle).vcpu = curr->vcpu_id;
-                return handle;
+                mag = v->maptrack_head;
+                *count = v->maptrack_count;
+                v->maptrack_head = MAPTRACK_TAIL;
+                v->maptrack_count = 0;
             }
+            spin_unlock(&v->maptrack_freelist_lock);
+
+            if ( mag != MAPTRACK_TAIL )
+                break;
         }
 
         i++;
@@ -525,36 +688,32 @@ static grant_handle_t steal_maptrack_handle(struct grant_table *t,
             i = 0;
     } while ( i != first );
 
-    /* No free handles on any VCPU. */
-    return INVALID_MAPTRACK_HANDLE;
+    return mag;
 }
 
 static inline void
 put_maptrack_handle(
     struct grant_table *t, grant_handle_t handle)
 {
-    struct domain *currd = current->domain;
-    struct vcpu *v;
-    unsigned int prev_tail, cur_tail;
-
-    /* 1. Set entry to be a tail. */
-    maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
-
-    /* 2. Add entry to the tail of the list on the original VCPU. */
-    v = currd->vcpu[maptrack_entry(t, handle).vcpu];
+    struct vcpu *curr = current;
 
-    spin_lock(&v->maptrack_freelist_lock);
+    spin_lock(&curr->maptrack_freelist_lock);
 
-    cur_tail = read_atomic(&v->maptrack_tail);
-    do {
-        prev_tail = cur_tail;
-        cur_tail = cmpxchg(&v->maptrack_tail, prev_tail, handle);
-    } while ( cur_tail != prev_tail );
+    /* Loaded magazine full?  Make it the previous one. */
+    if ( curr->maptrack_count == MAPTRACK_MAG_SIZE )
+    {
+        if ( curr->maptrack_prev != MAPTRACK_TAIL )
+            maptrack_depot_put(t, curr->maptrack_prev);
+        curr->maptrack_prev = curr->maptrack_head;
+        curr->maptrack_head = MAPTRACK_TAIL;
+        curr->maptrack_count = 0;
+    }
 
-    /* 3. Update the old tail entry to point to the new entry. */
-    write_atomic(&maptrack_entry(t, prev_tail).ref, handle);
+    maptrack_entry(t, handle).ref = curr->maptrack_head;
+    curr->maptrack_head = handle;
+    curr->maptrack_count++;
 
-    spin_unlock(&v->maptrack_freelist_lock);
+    spin_unlock(&curr->maptrack_freelist_lock);
 }
 
 static inline grant_handle_t
@@ -562,78 +721,103 @@ get_maptrack_handle(
     struct grant_table *lgt)
 {
     struct vcpu          *curr = current;
-    unsigned int          i, head;
+    unsigned int          i, mag, count = MAPTRACK_MAG_SIZE;
     grant_handle_t        handle;
-    struct grant_mapping *new_mt = NULL;
+    struct grant_mapping *new_mt;
+
+    spin_lock(&curr->maptrack_freelist_lock);
 
-    handle = _get_maptrack_handle(lgt, curr);
-    if ( likely(handle != INVALID_MAPTRACK_HANDLE) )
-        return handle;
+    if ( likely(curr->maptrack_count) )
+        goto out;
+
+    /* Previous magazine full?  Load it. */
+    if ( curr->maptrack_prev != MAPTRACK_TAIL )
+    {
+        curr->maptrack_head = curr->maptrack_prev;
+        curr->maptrack_count = MAPTRACK_MAG_SIZE;
+        curr->maptrack_prev = MAPTRACK_TAIL;
+        goto out;
+    }
+
+    mag = maptrack_depot_get(lgt);
+    if ( likely(mag != MAPTRACK_TAIL) )
+        goto load;
+
+    spin_unlock(&curr->maptrack_freelist_lock);
 
     spin_lock(&lgt->maptrack_lock);
 
+    /* Another VCPU may have refilled the depot meanwhile. */
+    mag = lgt->maptrack_depot;
+    if ( mag != MAPTRACK_TAIL )
+    {
+        lgt->maptrack_depot = maptrack_entry(lgt, mag).next_mag;
+        spin_unlock(&lgt->maptrack_lock);
+        spin_lock(&curr->maptrack_freelist_lock);
+        goto load;
+    }
+
     /*
-     * If we've run out of handles and still have frame headroom, try
+     * No full magazine anywhere: if we still have frame headroom, try
      * allocating a new maptrack frame.  If there is no headroom, or we're
-     * out of memory, try stealing an entry from another VCPU (in case the
-     * guest isn't mapping across its VCPUs evenly).
+     * out of memory, try reclaiming a magazine from another VCPU (in case
+     * the guest isn't mapping across its VCPUs evenly).
      */
-    if ( nr_maptrack_frames(lgt) < lgt->max_maptrack_frames )
-        new_mt = alloc_xenheap_page();
-
-    if ( !new_mt )
+    if ( nr_maptrack_frames(lgt) >= lgt->max_maptrack_frames ||
+         !(new_mt = alloc_xenheap_page()) )
     {
         spin_unlock(&lgt->maptrack_lock);
 
-        /*
-         * Uninitialized free list? Steal an extra entry for the tail
-         * sentinel.
-         */
-        if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        {
-            handle = steal_maptrack_handle(lgt, curr);
-            if ( handle == INVALID_MAPTRACK_HANDLE )
-                return handle;
-            spin_lock(&curr->maptrack_freelist_lock);
-            maptrack_entry(lgt, handle).ref = MAPTRACK_TAIL;
-            curr->maptrack_tail = handle;
-            if ( curr->maptrack_head == MAPTRACK_TAIL )
-                write_atomic(&curr->maptrack_head, handle);
-            spin_unlock(&curr->maptrack_freelist_lock);
-        }
-        return steal_maptrack_handle(lgt, curr);
+        mag = reclaim_maptrack_magazine(lgt, curr, &count);
+        if ( mag == MAPTRACK_TAIL )
+            return INVALID_MAPTRACK_HANDLE;
+
+        spin_lock(&curr->maptrack_freelist_lock);
+        goto load;
     }
 
     clear_page(new_mt);
 
     /*
-     * Use the first new entry and add the remaining entries to the
-     * head of the free list.
+     * Split the new entries into magazines, handing the first one to the
+     * current VCPU and the remaining ones to the depot.
      */
     handle = lgt->maptrack_limit;
 
+    BUILD_BUG_ON(MAPTRACK_PER_PAGE % MAPTRACK_MAG_SIZE);
     for ( i = 0; i < MAPTRACK_PER_PAGE; i++ )
     {
         BUILD_BUG_ON(sizeof(new_mt->ref) < sizeof(handle));
-        new_mt[i].ref = handle + i + 1;
-        new_mt[i].vcpu = curr->vcpu_id;
+        new_mt[i].ref = (i + 1) % MAPTRACK_MAG_SIZE ? handle + i + 1
+                                                    : MAPTRACK_TAIL;
+    }
+    for ( i = MAPTRACK_MAG_SIZE; i < MAPTRACK_PER_PAGE;
+          i += MAPTRACK_MAG_SIZE )
+    {
+        new_mt[i].next_mag = lgt->maptrack_depot;
+        lgt->maptrack_depot = handle + i;
     }
-
-    /* Set tail directly if this is the first page for this VCPU. */
-    if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        curr->maptrack_tail = handle + MAPTRACK_PER_PAGE - 1;
 
     lgt->maptrack[nr_maptrack_frames(lgt)] = new_mt;
     smp_wmb();
     lgt->maptrack_limit += MAPTRACK_PER_PAGE;
 
     spin_unlock(&lgt->maptrack_lock);
+
+    mag = handle;
     spin_lock(&curr->maptrack_freelist_lock);
 
-    do {
-        new_mt[i - 1].ref = read_atomic(&curr->maptrack_head);
-        head = cmpxchg(&curr->maptrack_head, new_mt[i - 1].ref, handle + 1);
-    } while ( head != new_mt[i - 1].ref );
+ load:
+    /*
+     * Other vCPUs may have reclaimed from us while the lock was dropped, but
+     * only we ever add entries, so our loaded magazine is still empty.
+     */
+    ASSERT(!curr->maptrack_count);
+    curr->maptrack_head = mag;
+    curr->maptrack_count = count;
+
+ out:
+    handle = maptrack_pop(lgt, curr);
 
     spin_unlock(&curr->maptrack_freelist_lock);
 
@@ -917,7 +1101,7 @@ static unsigned int mapkind(
 
 static void
 map_grant_ref(
-    struct gnttab_map_grant_ref *op)
+    struct gnttab_map_grant_ref *op, struct gnttab_group *grp)
 {
     struct domain *ld, *rd, *owner = NULL;
     struct grant_table *lgt, *rgt;
@@ -935,6 +1119,7 @@ map_grant_ref(
     grant_entry_header_t *shah;
     uint16_t *status;
     bool_t need_iommu;
+    unsigned int   order = MASK_EXTR(op->flags, GNTMAP_order_mask);
 
     led = current;
     ld = led->domain;
@@ -955,7 +1140,19 @@ map_grant_ref(
         return;
     }
 
-    if ( unlikely((rd = rcu_lock_domain_by_id(op->dom)) == NULL) )
+    if ( unlikely(order &&
+                  (order > GNTTAB_MAX_MULTI_PAGE_ORDER ||
+                   (op->flags & (GNTMAP_device_map|GNTMAP_contains_pte)) ||
+                   (op->host_addr & ((PAGE_SIZE << order) - 1)) ||
+                   gnttab_need_iommu_mapping(ld))) )
+    {
+        gdprintk(XENLOG_INFO, "Bad multi-page grant map op: %x at %#"PRIx64"\n",
+                 op->flags, op->host_addr);
+        op->status = GNTST_general_error;
+        return;
+    }
+
+    if ( unlikely((rd = gnttab_group_get(grp, op->dom)) == NULL) )
     {
         gdprintk(XENLOG_INFO, "Could not find domain %d\n", op->dom);
         op->status = GNTST_bad_domain;
@@ -965,7 +1162,6 @@ map_grant_ref(
     rc = xsm_grant_mapref(XSM_HOOK, ld, rd, op->flags);
     if ( rc )
     {
-        rcu_unlock_domain(rd);
         op->status = GNTST_permission_denied;
         return;
     }
@@ -974,7 +1170,6 @@ map_grant_ref(
     handle = get_maptrack_handle(lgt);
     if ( unlikely(handle == INVALID_MAPTRACK_HANDLE) )
     {
-        rcu_unlock_domain(rd);
         gdprintk(XENLOG_INFO, "Failed to obtain maptrack handle\n");
         op->status = GNTST_no_device_space;
         return;
@@ -996,10 +1191,12 @@ map_grant_ref(
     if ( act->pin &&
          ((act->domid != ld->domain_id) ||
           (act->pin & 0x80808080U) != 0 ||
-          (act->is_sub_page)) )
+          (act->is_sub_page) ||
+          (act->order != order)) )
         PIN_FAIL(act_release_out, GNTST_general_error,
-                 "Bad domain (%d != %d), or risk of counter overflow %08x, or subpage %d\n",
-                 act->domid, ld->domain_id, act->pin, act->is_sub_page);
+                 "Bad domain (%d != %d), or risk of counter overflow %08x, or subpage %d, or order %u != %u\n",
+                 act->domid, ld->domain_id, act->pin, act->is_sub_page,
+                 act->order, order);
 
     if ( !act->pin ||
          (!(op->flags & GNTMAP_readonly) &&
@@ -1015,9 +1212,22 @@ map_grant_ref(
             unsigned long gfn = rgt->gt_version == 1 ?
                                 shared_entry_v1(rgt, op->ref).frame :
                                 shared_entry_v2(rgt, op->ref).full_page.frame;
-
-            rc = get_paged_frame(gfn, &mfn, &pg,
-                                 op->flags & GNTMAP_readonly, rd);
+            bool multi = rgt->gt_version != 1 &&
+                         (shah->flags & GTF_multi_page);
+
+            if ( multi != !!order ||
+                 (multi &&
+                  shared_entry_v2(rgt, op->ref).multi_page.order != order) )
+                PIN_FAIL(unlock_out_clear, GNTST_general_error,
+                         "Grant %#x of d%d isn't of order %u\n",
+                         op->ref, rd->domain_id, order);
+
+            if ( order )
+                rc = get_multi_page_frames(gfn, order, &mfn,
+                                           op->flags & GNTMAP_readonly, rd);
+            else
+                rc = get_paged_frame(gfn, &mfn, &pg,
+                                     op->flags & GNTMAP_readonly, rd);
             if ( rc != GNTST_okay )
                 goto unlock_out_clear;
             act_set_gfn(act, _gfn(gfn));
@@ -1026,6 +1236,7 @@ map_grant_ref(
             act->start = 0;
             act->length = PAGE_SIZE;
             act->is_sub_page = false;
+            act->order = order;
             act->trans_domain = rd;
             act->trans_gref = op->ref;
         }
@@ -1047,6 +1258,15 @@ map_grant_ref(
     active_entry_release(act);
     grant_read_unlock(rgt);
 
+    if ( order )
+    {
+        /* Multi-page grants only get host mapped, as checked above. */
+        rc = map_grant_pages(op->host_addr, mfn, op->flags, ld, rd);
+        if ( rc != GNTST_okay )
+            goto undo_out;
+        goto mapped;
+    }
+
     /* pg may be set, with a refcount included, from get_paged_frame(). */
     if ( !pg )
     {
@@ -1144,6 +1364,7 @@ map_grant_ref(
         goto undo_out;
     }
 
+ mapped:
     need_iommu = gnttab_need_iommu_mapping(ld);
     if ( need_iommu )
     {
@@ -1199,7 +1420,6 @@ map_grant_ref(
     op->handle       = handle;
     op->status       = GNTST_okay;
 
-    rcu_unlock_domain(rd);
     return;
 
  undo_out:
@@ -1241,7 +1461,6 @@ map_grant_ref(
     grant_read_unlock(rgt);
     op->status = rc;
     put_maptrack_handle(lgt, handle);
-    rcu_unlock_domain(rd);
 }
 
 static long
@@ -1250,27 +1469,40 @@ gnttab_map_grant_ref(
 {
     int i;
     struct gnttab_map_grant_ref op;
+    struct gnttab_group grp = { NULL };
+    long rc = 0;
 
     for ( i = 0; i < count; i++ )
     {
         if ( i && hypercall_preempt_check() )
-            return i;
+        {
+            rc = i;
+            break;
+        }
 
         if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
 
-        map_grant_ref(&op);
+        map_grant_ref(&op, &grp);
 
         if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
     }
 
-    return 0;
+    gnttab_group_put(&grp);
+
+    return rc;
 }
 
 static void
 unmap_common(
-    struct gnttab_unmap_common *op)
+    struct gnttab_unmap_common *op, struct gnttab_group *grp)
 {
     domid_t          dom;
     struct domain   *ld, *rd;
@@ -1304,7 +1536,7 @@ unmap_common(
     }
 
     dom = map->domid;
-    if ( unlikely((rd = rcu_lock_domain_by_id(dom)) == NULL) )
+    if ( unlikely((rd = gnttab_group_get(grp, dom)) == NULL) )
     {
         /* This can happen when a grant is implicitly unmapped. */
         gdprintk(XENLOG_INFO, "Could not find domain %d\n", dom);
@@ -1315,7 +1547,6 @@ unmap_common(
     rc = xsm_grant_unmapref(XSM_HOOK, ld, rd);
     if ( rc )
     {
-        rcu_unlock_domain(rd);
         op->status = GNTST_permission_denied;
         return;
     }
@@ -1376,13 +1607,20 @@ unmap_common(
 
     if ( op->host_addr && (flags & GNTMAP_host_map) )
     {
+        if ( op->host_addr &
+             ((PAGE_SIZE << MASK_EXTR(flags, GNTMAP_order_mask)) - 1) )
+            PIN_FAIL(act_release_out, GNTST_general_error,
+                     "Host address %#"PRIx64" not aligned to mapping order %u\n",
+                     op->host_addr, MASK_EXTR(flags, GNTMAP_order_mask));
+
         if ( (rc = replace_grant_host_mapping(op->host_addr,
                                               op->mfn, op->new_addr,
                                               flags)) < 0 )
             goto act_release_out;
 
         map->flags &= ~GNTMAP_host_map;
-        op->done |= GNTMAP_host_map | (flags & GNTMAP_readonly);
+        op->done |= GNTMAP_host_map |
+                    (flags & (GNTMAP_readonly | GNTMAP_order_mask));
     }
 
     if ( op->dev_bus_addr && (flags & GNTMAP_device_map) )
@@ -1427,35 +1665,27 @@ unmap_common(
 
     /* If just unmapped a writable mapping, mark as dirtied */
     if ( rc == GNTST_okay && !(flags & GNTMAP_readonly) )
-         gnttab_mark_dirty(rd, op->mfn);
+    {
+        unsigned long i;
+
+        for ( i = 0; i < (1UL << MASK_EXTR(flags, GNTMAP_order_mask)); i++ )
+            gnttab_mark_dirty(rd, mfn_add(op->mfn, i));
+    }
 
     op->status = rc;
-    rcu_unlock_domain(rd);
 }
 
+/* Called with op->rd RCU locked, and its grant table read locked. */
 static void
-unmap_common_complete(struct gnttab_unmap_common *op)
+unmap_common_complete(const struct gnttab_unmap_done *op)
 {
-    struct domain *ld, *rd = op->rd;
-    struct grant_table *rgt;
+    struct domain *ld = current->domain, *rd = op->rd;
+    struct grant_table *rgt = rd->grant_table;
     struct active_grant_entry *act;
     grant_entry_header_t *sha;
     struct page_info *pg;
     uint16_t *status;
 
-    if ( !op->done )
-    {
-        /* unmap_common() didn't do anything - nothing to complete. */
-        return;
-    }
-
-    ld = current->domain;
-
-    rcu_lock_domain(rd);
-    rgt = rd->grant_table;
-
-    grant_read_lock(rgt);
-
     act = active_entry_acquire(rgt, op->ref);
     sha = shared_entry_header(rgt, op->ref);
 
@@ -1486,12 +1716,10 @@ unmap_common_complete(struct gnttab_unmap_common *op)
     if ( op->done & GNTMAP_host_map )
     {
         if ( !is_iomem_page(op->mfn) )
-        {
-            if ( gnttab_host_mapping_get_page_type(op->done & GNTMAP_readonly,
-                                                   ld, rd) )
-                put_page_type(pg);
-            put_page(pg);
-        }
+            put_grant_pages(op->mfn,
+                            1UL << MASK_EXTR(op->done, GNTMAP_order_mask),
+                            gnttab_host_mapping_get_page_type(
+                                op->done & GNTMAP_readonly, ld, rd));
 
         ASSERT(act->pin & (GNTPIN_hstw_mask | GNTPIN_hstr_mask));
         if ( op->done & GNTMAP_readonly )
@@ -1508,15 +1736,68 @@ unmap_common_complete(struct gnttab_unmap_common *op)
         gnttab_clear_flag(_GTF_reading, status);
 
     active_entry_release(act);
-    grant_read_unlock(rgt);
+}
+
+static void
+unmap_batch_add(struct gnttab_unmap_batch *batch,
+                const struct gnttab_unmap_common *common)
+{
+    struct gnttab_unmap_done *op;
+
+    /* unmap_common() didn't do anything - nothing to complete. */
+    if ( !common->done )
+        return;
 
-    rcu_unlock_domain(rd);
+    ASSERT(batch->nr < ARRAY_SIZE(batch->ops));
+    op = &batch->ops[batch->nr++];
+    op->done = common->done;
+    op->ref = common->ref;
+    op->mfn = common->mfn;
+    op->rd = common->rd;
+}
+
+/*
+ * Flush the TLBs once for all the operations of the batch, and complete
+ * them, grouped by remote domain.
+ */
+static void
+unmap_batch_complete(struct gnttab_unmap_batch *batch)
+{
+    struct domain *rd = NULL;
+    unsigned int i;
+
+    gnttab_flush_tlb(current->domain);
+
+    for ( i = 0; i < batch->nr; i++ )
+    {
+        if ( batch->ops[i].rd != rd )
+        {
+            if ( rd )
+            {
+                grant_read_unlock(rd->grant_table);
+                rcu_unlock_domain(rd);
+            }
+            rd = batch->ops[i].rd;
+            rcu_lock_domain(rd);
+            grant_read_lock(rd->grant_table);
+        }
+
+        unmap_common_complete(&batch->ops[i]);
+    }
+
+    if ( rd )
+    {
+        grant_read_unlock(rd->grant_table);
+        rcu_unlock_domain(rd);
+    }
+
+    batch->nr = 0;
 }
 
 static void
 unmap_grant_ref(
     struct gnttab_unmap_grant_ref *op,
-    struct gnttab_unmap_common *common)
+    struct gnttab_unmap_common *common, struct gnttab_group *grp)
 {
     common->host_addr = op->host_addr;
     common->dev_bus_addr = op->dev_bus_addr;
@@ -1528,7 +1809,7 @@ unmap_grant_ref(
     common->rd = NULL;
     common->mfn = INVALID_MFN;
 
-    unmap_common(common);
+    unmap_common(common, grp);
     op->status = common->status;
 }
 
@@ -1537,52 +1818,49 @@ static long
 gnttab_unmap_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_grant_ref_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    unsigned int i;
     struct gnttab_unmap_grant_ref op;
-    struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    struct gnttab_unmap_common common;
+    struct gnttab_unmap_batch batch = { 0 };
+    struct gnttab_group grp = { NULL };
+    long rc = 0;
 
-    while ( count != 0 )
+    for ( i = 0; i < count; i++ )
     {
-        c = min(count, (unsigned int)GNTTAB_UNMAP_BATCH_SIZE);
-        partial_done = 0;
-
-        for ( i = 0; i < c; i++ )
+        if ( i && hypercall_preempt_check() )
         {
-            if ( unlikely(__copy_from_guest(&op, uop, 1)) )
-                goto fault;
-            unmap_grant_ref(&op, &common[i]);
-            ++partial_done;
-            if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
-                goto fault;
-            guest_handle_add_offset(uop, 1);
+            rc = i;
+            break;
         }
 
-        gnttab_flush_tlb(current->domain);
-
-        for ( i = 0; i < partial_done; i++ )
-            unmap_common_complete(&common[i]);
+        if ( batch.nr == ARRAY_SIZE(batch.ops) )
+            unmap_batch_complete(&batch);
 
-        count -= c;
-        done += c;
-
-        if ( count && hypercall_preempt_check() )
-            return done;
+        if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+        unmap_grant_ref(&op, &common, &grp);
+        unmap_batch_add(&batch, &common);
+        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+        guest_handle_add_offset(uop, 1);
     }
 
-    return 0;
+    gnttab_group_put(&grp);
+    unmap_batch_complete(&batch);
 
-fault:
-    gnttab_flush_tlb(current->domain);
-
-    for ( i = 0; i < partial_done; i++ )
-        unmap_common_complete(&common[i]);
-    return -EFAULT;
+    return rc;
 }
 
 static void
 unmap_and_replace(
     struct gnttab_unmap_and_replace *op,
-    struct gnttab_unmap_common *common)
+    struct gnttab_unmap_common *common, struct gnttab_group *grp)
 {
     common->host_addr = op->host_addr;
     common->new_addr = op->new_addr;
@@ -1594,7 +1872,7 @@ unmap_and_replace(
     common->rd = NULL;
     common->mfn = INVALID_MFN;
 
-    unmap_common(common);
+    unmap_common(common, grp);
     op->status = common->status;
 }
 
@@ -1602,46 +1880,43 @@ static long
 gnttab_unmap_and_replace(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_and_replace_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    unsigned int i;
     struct gnttab_unmap_and_replace op;
-    struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    struct gnttab_unmap_common common;
+    struct gnttab_unmap_batch batch = { 0 };
+    struct gnttab_group grp = { NULL };
+    long rc = 0;
 
-    while ( count != 0 )
+    for ( i = 0; i < count; i++ )
     {
-        c = min(count, (unsigned int)GNTTAB_UNMAP_BATCH_SIZE);
-        partial_done = 0;
-
-        for ( i = 0; i < c; i++ )
+        if ( i && hypercall_preempt_check() )
         {
-            if ( unlikely(__copy_from_guest(&op, uop, 1)) )
-                goto fault;
-            unmap_and_replace(&op, &common[i]);
-            ++partial_done;
-            if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
-                goto fault;
-            guest_handle_add_offset(uop, 1);
+            rc = i;
+            break;
         }
 
-        gnttab_flush_tlb(current->domain);
-
-        for ( i = 0; i < partial_done; i++ )
-            unmap_common_complete(&common[i]);
+        if ( batch.nr == ARRAY_SIZE(batch.ops) )
+            unmap_batch_complete(&batch);
 
-        count -= c;
-        done += c;
-
-        if ( count && hypercall_preempt_check() )
-            return done;
+        if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+        unmap_and_replace(&op, &common, &grp);
+        unmap_batch_add(&batch, &common);
+        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+        guest_handle_add_offset(uop, 1);
     }
 
-    return 0;
+    gnttab_group_put(&grp);
+    unmap_batch_complete(&batch);
 
-fault:
-    gnttab_flush_tlb(current->domain);
-
-    for ( i = 0; i < partial_done; i++ )
-        unmap_common_complete(&common[i]);
-    return -EFAULT;
+    return rc;
 }
 
 static int
@@ -1840,6 +2115,7 @@ int grant_table_init(struct domain *d, unsigned int max_grant_frames,
     /* Simple stuff. */
     percpu_rwlock_resource_init(&gt->lock, grant_rwlock);
     spin_lock_init(&gt->maptrack_lock);
+    gt->maptrack_depot = MAPTRACK_TAIL;
 
     gt->gt_version = 1;
     gt->max_grant_frames = max_grant_frames;
@@ -2449,9 +2725,10 @@ acquire_grant_for_copy(
     }
 
     /* If already pinned, check the active domid and avoid refcnt overflow. */
-    if ( act->pin && ((act->domid != ldom) || (act->pin & 0x80808080U) != 0) )
+    if ( act->pin && ((act->domid != ldom) || (act->pin & 0x80808080U) != 0 ||
+                      act->order) )
         PIN_FAIL(unlock_out, GNTST_general_error,
-                 "Bad domain (%d != %d), or risk of counter overflow %08x\n",
+                 "Bad domain (%d != %d), or risk of counter overflow %08x, or multi-page\n",
                  act->domid, ldom, act->pin);
 
     old_pin = act->pin;
@@ -2548,6 +2825,7 @@ acquire_grant_for_copy(
             act->trans_domain = td;
             act->trans_gref = trans_gref;
             act->mfn = grant_mfn;
+            act->order = 0;
             act_set_gfn(act, INVALID_GFN);
             /*
              * The actual remote remote grant may or may not be a sub-page,
@@ -2579,6 +2857,9 @@ acquire_grant_for_copy(
             trans_page_off = 0;
             trans_length = PAGE_SIZE;
         }
+        else if ( sha2->hdr.flags & GTF_multi_page )
+            PIN_FAIL(unlock_out_clear, GNTST_general_error,
+                     "Multi-page grants can't be copied\n");
         else if ( !(sha2->hdr.flags & GTF_sub_page) )
         {
             rc = get_paged_frame(sha2->full_page.frame, &grant_mfn, page,
@@ -2606,6 +2887,7 @@ acquire_grant_for_copy(
         {
             act->domid = ldom;
             act->is_sub_page = is_sub_page;
+            act->order = 0;
             act->start = trans_page_off;
             act->length = trans_length;
             act->trans_domain = td;
@@ -2676,6 +2958,37 @@ struct gnttab_copy_buf {
     bool_t read_only;
     bool_t have_grant;
     bool_t have_type;
+
+    /* Last use, for gnttab_copy_cache. */
+    unsigned int last_use;
+};
+
+/*
+ * Number of source, and of destination, buffers kept claimed (and mapped)
+ * by a GNTTABOP_copy hypercall, for reuse by further operations of the
+ * batch.  Kept small, as each of them uses a domain page mapping.
+ *
+ * The cache deliberately lives on the hypercall's stack and is emptied
+ * before returning to the guest, including on preemption, rather than
+ * being kept per vCPU across batches.  A cached buffer holds an RCU lock
+ * on its domain, which mustn't be held across a return to the guest, and
+ * a pin on the grant (or a page reference and writable type on the frame).
+ * Keeping those would stop the granting domain from revoking the grant,
+ * and the caller from retyping its frame, until some later batch happened
+ * to evict the buffer.  Dropping the claims but keeping what they resolved
+ * to wouldn't be safe either: nothing would stop the grant from being
+ * revoked or its table from changing version meanwhile.
+ */
+#define GNTTAB_COPY_CACHE_SIZE 4
+
+struct gnttab_copy_cache {
+    struct gnttab_copy_buf src[GNTTAB_COPY_CACHE_SIZE];
+    struct gnttab_copy_buf dest[GNTTAB_COPY_CACHE_SIZE];
+    unsigned int clock;
+
+    /* Last source and destination domains which passed the XSM check. */
+    bool xsm_valid;
+    domid_t xsm_src, xsm_dest;
 };
 
 static int gnttab_copy_lock_domain(domid_t domid, bool is_gref,
@@ -2695,49 +3008,15 @@ static int gnttab_copy_lock_domain(domid_t domid, bool is_gref,
     return GNTST_okay;
 }
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
+static void gnttab_copy_unlock_domain(struct gnttab_copy_buf *buf)
 {
-    if ( src->domain )
-    {
-        rcu_unlock_domain(src->domain);
-        src->domain = NULL;
-    }
-    if ( dest->domain )
+    if ( buf->domain )
     {
-        rcu_unlock_domain(dest->domain);
-        dest->domain = NULL;
+        rcu_unlock_domain(buf->domain);
+        buf->domain = NULL;
     }
 }
 
-static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
-{
-    int rc;
-
-    rc = gnttab_copy_lock_domain(op->source.domid,
-                                 op->flags & GNTCOPY_source_gref, src);
-    if ( rc < 0 )
-        goto error;
-    rc = gnttab_copy_lock_domain(op->dest.domid,
-                                 op->flags & GNTCOPY_dest_gref, dest);
-    if ( rc < 0 )
-        goto error;
-
-    rc = xsm_grant_copy(XSM_HOOK, src->domain, dest->domain);
-    if ( rc < 0 )
-    {
-        rc = GNTST_permission_denied;
-        goto error;
-    }
-    return 0;
-
- error:
-    gnttab_copy_unlock_domains(src, dest);
-    return rc;
-}
-
 static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
 {
     if ( buf->virt )
@@ -2826,7 +3105,57 @@ static bool_t gnttab_copy_buf_valid(const struct gnttab_copy_ptr *p,
         return 0;
     if ( has_gref )
         return b->have_grant && p->u.ref == b->ptr.u.ref;
-    return p->u.gmfn == b->ptr.u.gmfn;
+    return !b->have_grant && p->u.gmfn == b->ptr.u.gmfn;
+}
+
+/*
+ * Find the cached buffer for p, or evict the least recently used one (which
+ * the caller then needs to lock the domain of, and claim).  Cached buffers
+ * have their domain locked and are claimed, and all others are empty.
+ */
+static struct gnttab_copy_buf *gnttab_copy_cache_get(
+    struct gnttab_copy_cache *cache, struct gnttab_copy_buf *bufs,
+    const struct gnttab_copy_ptr *p, bool_t has_gref)
+{
+    struct gnttab_copy_buf *lru = &bufs[0];
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_CACHE_SIZE; i++ )
+    {
+        struct gnttab_copy_buf *b = &bufs[i];
+
+        if ( b->domain && b->ptr.domid == p->domid &&
+             gnttab_copy_buf_valid(p, b, has_gref) )
+        {
+            lru = b;
+            break;
+        }
+        if ( b->last_use < lru->last_use )
+            lru = b;
+    }
+
+    if ( i == GNTTAB_COPY_CACHE_SIZE )
+    {
+        gnttab_copy_release_buf(lru);
+        gnttab_copy_unlock_domain(lru);
+    }
+
+    lru->last_use = ++cache->clock;
+
+    return lru;
+}
+
+static void gnttab_copy_cache_release(struct gnttab_copy_cache *cache)
+{
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_CACHE_SIZE; i++ )
+    {
+        gnttab_copy_release_buf(&cache->src[i]);
+        gnttab_copy_unlock_domain(&cache->src[i]);
+        gnttab_copy_release_buf(&cache->dest[i]);
+        gnttab_copy_unlock_domain(&cache->dest[i]);
+    }
 }
 
 static int gnttab_copy_buf(const struct gnttab_copy *op,
@@ -2862,38 +3191,59 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
 }
 
 static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+                           struct gnttab_copy_cache *cache)
 {
+    struct gnttab_copy_buf *src, *dest;
     int rc;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
+    src = gnttab_copy_cache_get(cache, cache->src, &op->source,
+                                op->flags & GNTCOPY_source_gref);
+    dest = gnttab_copy_cache_get(cache, cache->dest, &op->dest,
+                                 op->flags & GNTCOPY_dest_gref);
+
+    if ( !src->domain )
     {
-        gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
-        gnttab_copy_unlock_domains(src, dest);
+        rc = gnttab_copy_lock_domain(op->source.domid,
+                                     op->flags & GNTCOPY_source_gref, src);
+        if ( rc < 0 )
+            goto out;
+    }
 
-        rc = gnttab_copy_lock_domains(op, src, dest);
+    if ( !dest->domain )
+    {
+        rc = gnttab_copy_lock_domain(op->dest.domid,
+                                     op->flags & GNTCOPY_dest_gref, dest);
         if ( rc < 0 )
             goto out;
     }
 
-    /* Different source? */
-    if ( !gnttab_copy_buf_valid(&op->source, src,
-                                op->flags & GNTCOPY_source_gref) )
+    /* Different domains than the last checked ones? */
+    if ( !cache->xsm_valid || op->source.domid != cache->xsm_src ||
+         op->dest.domid != cache->xsm_dest )
+    {
+        cache->xsm_valid = false;
+        rc = xsm_grant_copy(XSM_HOOK, src->domain, dest->domain);
+        if ( rc < 0 )
+        {
+            rc = GNTST_permission_denied;
+            goto out;
+        }
+        cache->xsm_valid = true;
+        cache->xsm_src = op->source.domid;
+        cache->xsm_dest = op->dest.domid;
+    }
+
+    /* Source not cached? */
+    if ( !src->virt )
     {
-        gnttab_copy_release_buf(src);
         rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
         if ( rc )
             goto out;
     }
 
-    /* Different dest? */
-    if ( !gnttab_copy_buf_valid(&op->dest, dest,
-                                op->flags & GNTCOPY_dest_gref) )
+    /* Dest not cached? */
+    if ( !dest->virt )
     {
-        gnttab_copy_release_buf(dest);
         rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
         if ( rc )
             goto out;
@@ -2901,6 +3251,15 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
 
     rc = gnttab_copy_buf(op, dest, src);
  out:
+    /* Only cache successfully claimed buffers. */
+    if ( rc != GNTST_okay )
+    {
+        gnttab_copy_release_buf(src);
+        gnttab_copy_unlock_domain(src);
+        gnttab_copy_release_buf(dest);
+        gnttab_copy_unlock_domain(dest);
+    }
+
     return rc;
 }
 
@@ -2917,8 +3276,7 @@ static long gnttab_copy(
 {
     unsigned int i;
     struct gnttab_copy op;
-    struct gnttab_copy_buf src = {};
-    struct gnttab_copy_buf dest = {};
+    struct gnttab_copy_cache cache = {};
     long rc = 0;
 
     for ( i = 0; i < count; i++ )
@@ -2935,17 +3293,12 @@ static long gnttab_copy(
             break;
         }
 
-        rc = gnttab_copy_one(&op, &dest, &src);
+        rc = gnttab_copy_one(&op, &cache);
         if ( rc > 0 )
         {
             rc = count - i;
             break;
         }
-        if ( rc != GNTST_okay )
-        {
-            gnttab_copy_release_buf(&src);
-            gnttab_copy_release_buf(&dest);
-        }
 
         op.status = rc;
         rc = 0;
@@ -2957,9 +3310,7 @@ static long gnttab_copy(
         guest_handle_add_offset(uop, 1);
     }
 
-    gnttab_copy_release_buf(&src);
-    gnttab_copy_release_buf(&dest);
-    gnttab_copy_unlock_domains(&src, &dest);
+    gnttab_copy_cache_release(&cache);
 
     return rc;
 }
@@ -3658,7 +4009,7 @@ gnttab_release_mappings(
                 act->pin -= GNTPIN_hstr_inc;
                 if ( gnttab_release_host_mappings(d) &&
                      !is_iomem_page(act->mfn) )
-                    put_page(pg);
+                    put_grant_pages(act->mfn, 1UL << act->order, false);
             }
         }
         else
@@ -3677,13 +4028,10 @@ gnttab_release_mappings(
                 act->pin -= GNTPIN_hstw_inc;
                 if ( gnttab_release_host_mappings(d) &&
                      !is_iomem_page(act->mfn) )
-                {
-                    if ( gnttab_host_mapping_get_page_type((map->flags &
-                                                            GNTMAP_readonly),
-                                                           d, rd) )
-                        put_page_type(pg);
-                    put_page(pg);
-                }
+                    put_grant_pages(act->mfn, 1UL << act->order,
+                                    gnttab_host_mapping_get_page_type(
+                                        (map->flags & GNTMAP_readonly),
+                                        d, rd));
             }
 
             if ( (act->pin & (GNTPIN_devw_mask|GNTPIN_hstw_mask)) == 0 )
@@ -3782,7 +4130,8 @@ void grant_table_init_vcpu(struct vcpu *v)
 {
     spin_lock_init(&v->maptrack_freelist_lock);
     v->maptrack_head = MAPTRACK_TAIL;
-    v->maptrack_tail = MAPTRACK_TAIL;
+    v->maptrack_count = 0;
+    v->maptrack_prev = MAPTRACK_TAIL;
 }
 
 #ifdef CONFIG_HAS_MEM_SHARING
@@ -120,6 +120,7 @@
  *   regions within it.
  */
 
+#include <xen/cpu.h>
 #include <xen/init.h>
 #include <xen/types.h>
 #include <xen/lib.h>
@@ -128,6 +129,8 @@
 #include <xen/mm.h>
 #include <xen/irq.h>
 #include <xen/softirq.h>
+#include <xen/tasklet.h>
+#include <xen/timer.h>
 #include <xen/domain_page.h>
 #include <xen/keyhandler.h>
 #include <xen/perfc.h>
@@ -216,6 +219,20 @@ size_param("bootscrub_chunk", opt_bootscrub_chunk);
 static bool __read_mostly opt_scrub_domheap;
 boolean_param("scrub-domheap", opt_scrub_domheap);
 
+/*
+ * scrub-workers -> Maximum number of idle CPUs scrubbing the free pages of
+ * a NUMA node at the same time.
+ */
+static unsigned int __read_mostly opt_scrub_workers = 4;
+integer_param("scrub-workers", opt_scrub_workers);
+
+/*
+ * scrub-rate -> Amount of bytes per second of each node's dirty free pages
+ * to scrub even when its CPUs are busy.  Zero only scrubs from idle CPUs.
+ */
+static unsigned long __initdata opt_scrub_rate;
+size_param("scrub-rate", opt_scrub_rate);
+
 #ifdef CONFIG_SCRUB_DEBUG
 static bool __read_mostly scrub_debug;
 #else
@@ -450,12 +467,30 @@ static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 
 static unsigned long node_need_scrub[MAX_NUMNODES];
 
+/* Background scrubbing state of each node. */
+static struct node_scrub {
+    atomic_t scrubbers;         /* CPUs scrubbing the node's heap. */
+    spinlock_t job_lock;
+    struct scrub_job *job;      /* Allocation asking idle CPUs for help. */
+
+    /* Rate target, see scrub-rate.  Protected by heap_lock. */
+    bool armed;                 /* timer is pending. */
+    unsigned long scrubbed;     /* Pages scrubbed in the current period. */
+    unsigned long budget;       /* Pages left for tasklet to scrub. */
+    struct timer timer;
+    struct tasklet tasklet;
+} node_scrub[MAX_NUMNODES] = {
+    [0 ... MAX_NUMNODES - 1] = { .job_lock = SPIN_LOCK_UNLOCKED },
+};
+
 static unsigned long *avail[MAX_NUMNODES];
 static long total_avail_pages;
 
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+static bool page_cache_drain_all(void);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -535,6 +570,21 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
      * then the claim must take tot_pages into account
      */
     claim = pages - d->tot_pages;
+
+    /*
+     * Pages in the per-CPU caches are accounted as allocated: return them
+     * to the heap before failing the claim.  Holding d->page_alloc_lock
+     * keeps the domain's side of the sums stable meanwhile.
+     */
+    if ( claim > avail_pages )
+    {
+        spin_unlock(&heap_lock);
+        page_cache_drain_all();
+        spin_lock(&heap_lock);
+
+        avail_pages = total_avail_pages - outstanding_claims;
+    }
+
     if ( claim > avail_pages )
         goto out;
 
@@ -897,42 +947,23 @@ static struct page_info *get_free_buddy(unsigned int zone_lo,
     }
 }
 
-/* Allocate 2^@order contiguous pages. */
-static struct page_info *alloc_heap_pages(
+/*
+ * Take a 2^@order chunk off the free lists, halving a larger buddy as needed,
+ * and account for it as allocated.  Called with the heap_lock held.  The
+ * pages keep their PGC_need_scrub and TLB flush state, for the caller to
+ * deal with, and *first_dirty is set to the chunk's first dirty page.
+ */
+static struct page_info *take_heap_chunk(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
-    struct domain *d)
+    struct domain *d, unsigned int *first_dirty)
 {
     nodeid_t node;
-    unsigned int i, buddy_order, zone, first_dirty;
+    unsigned int i, buddy_order, zone;
     unsigned long request = 1UL << order;
     struct page_info *pg;
-    bool need_tlbflush = false;
-    uint32_t tlbflush_timestamp = 0;
-    unsigned int dirty_cnt = 0;
 
-    /* Make sure there are enough bits in memflags for nodeID. */
-    BUILD_BUG_ON((_MEMF_bits - _MEMF_node) < (8 * sizeof(nodeid_t)));
-
-    ASSERT(zone_lo <= zone_hi);
-    ASSERT(zone_hi < NR_ZONES);
-
-    if ( unlikely(order > MAX_ORDER) )
-        return NULL;
-
-    spin_lock(&heap_lock);
-
-    /*
-     * Claimed memory is considered unavailable unless the request
-     * is made by a domain with sufficient unclaimed pages.
-     */
-    if ( (outstanding_claims + request > total_avail_pages) &&
-          ((memflags & MEMF_no_refcount) ||
-           !d || d->outstanding_pages < request) )
-    {
-        spin_unlock(&heap_lock);
-        return NULL;
-    }
+    ASSERT(spin_is_locked(&heap_lock));
 
     pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d);
     /* Try getting a dirty buddy if we couldn't get a clean one. */
@@ -940,34 +971,30 @@ static struct page_info *alloc_heap_pages(
         pg = get_free_buddy(zone_lo, zone_hi, order,
                             memflags | MEMF_no_scrub, d);
     if ( !pg )
-    {
-        /* No suitable memory blocks. Fail the request. */
-        spin_unlock(&heap_lock);
         return NULL;
-    }
 
     node = phys_to_nid(page_to_maddr(pg));
     zone = page_to_zone(pg);
     buddy_order = PFN_ORDER(pg);
 
-    first_dirty = pg->u.free.first_dirty;
+    *first_dirty = pg->u.free.first_dirty;
 
     /* We may have to halve the chunk a number of times. */
     while ( buddy_order != order )
     {
         buddy_order--;
         page_list_add_scrub(pg, node, zone, buddy_order,
-                            (1U << buddy_order) > first_dirty ?
-                            first_dirty : INVALID_DIRTY_IDX);
+                            (1U << buddy_order) > *first_dirty ?
+                            *first_dirty : INVALID_DIRTY_IDX);
         pg += 1U << buddy_order;
 
-        if ( first_dirty != INVALID_DIRTY_IDX )
+        if ( *first_dirty != INVALID_DIRTY_IDX )
         {
             /* Adjust first_dirty */
-            if ( first_dirty >= 1U << buddy_order )
-                first_dirty -= 1U << buddy_order;
+            if ( *first_dirty >= 1U << buddy_order )
+                *first_dirty -= 1U << buddy_order;
             else
-                first_dirty = 0; /* We've moved past original first_dirty */
+                *first_dirty = 0; /* We've moved past original first_dirty */
         }
     }
 
@@ -995,11 +1022,558 @@ static struct page_info *alloc_heap_pages(
         }
 
         /* PGC_need_scrub can only be set if first_dirty is valid */
-        ASSERT(first_dirty != INVALID_DIRTY_IDX || !(pg[i].count_info & PGC_need_scrub));
+        ASSERT(*first_dirty != INVALID_DIRTY_IDX || !(pg[i].count_info & PGC_need_scrub));
 
         /* Preserve PGC_need_scrub so we can check it after lock is dropped. */
         pg[i].count_info = PGC_state_inuse | (pg[i].count_info & PGC_need_scrub);
+    }
+
+    return pg;
+}
+
+static void free_heap_chunk(struct page_info *pg, unsigned int order,
+                            bool need_scrub);
+
+/*
+ * Per-CPU page caches.
+ *
+ * Each CPU keeps a few free chunks of each small order, from its own node,
+ * to serve most allocations and frees without taking the heap_lock.  The
+ * caches get refilled from, and drained to, the heap in batches.
+ *
+ * Cached pages are accounted as allocated by the heap: they are neither in
+ * avail[] nor total_avail_pages, and are in PGC_state_inuse, so that the
+ * buddy merging in free_heap_pages() leaves them alone, and offlining one
+ * just marks it as pending, for the heap to reserve it once the chunk gets
+ * there.  While cached, a page has no owner, keeps its TLB flush state in
+ * u.free, and PGC_need_scrub if it is to be scrubbed before use.  All of
+ * the caches get drained before an allocation or a claim fails.
+ */
+#define PCP_NR_ORDERS 4   /* Orders 0 to 3 are cached. */
+#define PCP_BATCH     16  /* Pages moved by a refill or drain. */
+#define PCP_HIGH      64  /* Pages cached per order, at most. */
+
+#define pcp_batch(order) max(PCP_BATCH >> (order), 1)
+#define pcp_high(order)  (PCP_HIGH >> (order))
+
+struct page_cache {
+    spinlock_t lock;
+    bool enabled;
+    nodeid_t node;
+    struct page_list_head list[PCP_NR_ORDERS];
+    unsigned int count[PCP_NR_ORDERS];  /* Chunks in list[]. */
+
+    /* Statistics, see pagealloc_info(). */
+    unsigned long hits, misses, refills, drains;
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+
+/*
+ * Return a list of chunks from a cache to the heap.  As their owner is gone,
+ * free_heap_pages() wouldn't know which of them need a TLB flush, so flush
+ * ahead of it where needed.
+ */
+static void page_cache_release(struct page_list_head *list, unsigned int order)
+{
+    struct page_info *pg;
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+    unsigned int i;
+
+    page_list_for_each ( pg, list )
+        for ( i = 0; i < (1U << order); i++ )
+            accumulate_tlbflush(&need_tlbflush, &pg[i], &tlbflush_timestamp);
+
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
+
+    spin_lock(&heap_lock);
+
+    while ( (pg = page_list_remove_head(list)) )
+    {
+        bool need_scrub = false;
+
+        for ( i = 0; i < (1U << order); i++ )
+            need_scrub |= test_bit(_PGC_need_scrub, &pg[i].count_info);
+
+        free_heap_chunk(pg, order, need_scrub);
+    }
+
+    spin_unlock(&heap_lock);
+}
+
+/* Refill an empty cache from the heap.  Called with the cache lock held. */
+static unsigned int page_cache_refill(struct page_cache *pc,
+                                      unsigned int zone_lo,
+                                      unsigned int zone_hi,
+                                      unsigned int order)
+{
+    unsigned int i, j, first_dirty, dirty_cnt = 0;
+    struct page_info *pg;
+
+    ASSERT(!pc->count[order]);
+
+    spin_lock(&heap_lock);
+
+    for ( i = 0; i < pcp_batch(order); i++ )
+    {
+        /* Claimed memory is left for the allocations of the claimants. */
+        if ( outstanding_claims + (1UL << order) > total_avail_pages )
+            break;
+
+        pg = take_heap_chunk(zone_lo, zone_hi, order,
+                             MEMF_node(pc->node) | MEMF_exact_node, NULL,
+                             &first_dirty);
+        if ( !pg )
+            break;
+
+        if ( first_dirty != INVALID_DIRTY_IDX )
+            for ( j = first_dirty; j < (1U << order); j++ )
+                if ( test_bit(_PGC_need_scrub, &pg[j].count_info) )
+                    dirty_cnt++;
+
+        page_list_add_tail(pg, &pc->list[order]);
+    }
+
+    /* Pages in the caches are scrubbed on allocation, if needed. */
+    node_need_scrub[pc->node] -= dirty_cnt;
+
+    spin_unlock(&heap_lock);
 
+    pc->count[order] = i;
+    if ( i )
+        pc->refills++;
+
+    return i;
+}
+
+/*
+ * Allocate a 2^@order chunk from the local CPU's cache.  Returns NULL when
+ * the cache can't serve the request, for the caller to use the heap.
+ */
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags, const struct domain *d)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    nodeid_t node = MEMF_get_node(memflags);
+    struct page_info *pg;
+    unsigned int i, zone;
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+    PAGE_LIST_HEAD(list);
+
+    if ( order >= PCP_NR_ORDERS || !pc->enabled ||
+         (node != NUMA_NO_NODE && node != pc->node) ||
+         (d && !node_isset(pc->node, d->node_affinity)) )
+        return NULL;
+
+    spin_lock(&pc->lock);
+
+ again:
+    if ( !pc->count[order] &&
+         !page_cache_refill(pc, zone_lo, zone_hi, order) )
+        goto miss;
+
+    pg = page_list_first(&pc->list[order]);
+    zone = page_to_zone(pg);
+    if ( zone < zone_lo || zone > zone_hi )
+        goto miss;
+
+    page_list_del(pg, &pc->list[order]);
+    pc->count[order]--;
+
+    /*
+     * offline_page() only marks a cached page as offlining: send the chunk
+     * back to the heap, which reserves the page, rather than handing it out.
+     */
+    for ( i = 0; i < (1U << order); i++ )
+        if ( !page_state_is(&pg[i], inuse) )
+        {
+            spin_unlock(&pc->lock);
+
+            page_list_add(pg, &list);
+            page_cache_release(&list, order);
+
+            spin_lock(&pc->lock);
+            goto again;
+        }
+
+    pc->hits++;
+
+    spin_unlock(&pc->lock);
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        if ( !(memflags & MEMF_no_tlbflush) )
+            accumulate_tlbflush(&need_tlbflush, &pg[i],
+                                &tlbflush_timestamp);
+
+        /* Initialise fields which have other uses for free pages. */
+        pg[i].u.inuse.type_info = 0;
+
+        flush_page_to_ram(mfn_x(page_to_mfn(&pg[i])),
+                          !(memflags & MEMF_no_icache_flush));
+
+        if ( test_and_clear_bit(_PGC_need_scrub, &pg[i].count_info) )
+        {
+            if ( !(memflags & MEMF_no_scrub) )
+                scrub_one_page(&pg[i]);
+        }
+        else if ( !(memflags & MEMF_no_scrub) )
+            check_one_page(&pg[i]);
+    }
+
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
+
+    return pg;
+
+ miss:
+    pc->misses++;
+    spin_unlock(&pc->lock);
+
+    return NULL;
+}
+
+/*
+ * Free a 2^@order chunk to the local CPU's cache, draining a batch of the
+ * oldest chunks to the heap if it gets full.  Returns false when the chunk
+ * isn't cacheable, for the caller to free it to the heap.
+ */
+static bool page_cache_free(struct page_info *pg, unsigned int order,
+                            bool need_scrub)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    mfn_t mfn = page_to_mfn(pg);
+    unsigned int i, zone = page_to_zone(pg);
+    bool tainted = false;
+    PAGE_LIST_HEAD(list);
+
+    if ( order >= PCP_NR_ORDERS || !pc->enabled ||
+         phys_to_nid(page_to_maddr(pg)) != pc->node ||
+         zone == MEMZONE_XEN ||
+         (dma_bitsize && zone <= bits_to_zone(dma_bitsize)) )
+        return false;
+
+    /* Pages being offlined go back to the heap, which reserves them. */
+    for ( i = 0; i < (1U << order); i++ )
+        if ( !page_state_is(&pg[i], inuse) )
+            return false;
+
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        unsigned long x, y = pg[i].count_info;
+
+        /* If a page has no owner it will need no safety TLB flush. */
+        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
+        if ( pg[i].u.free.need_tlbflush )
+            page_set_tlbflush_timestamp(&pg[i]);
+
+        /* This page is not a guest frame any more. */
+        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
+        set_gpfn_from_mfn(mfn_x(mfn) + i, INVALID_M2P_ENTRY);
+
+        if ( need_scrub )
+            poison_one_page(&pg[i]);
+
+        /* Don't lose an offline_page() racing with us. */
+        do {
+            x = y;
+            if ( (x & PGC_state) != PGC_state_inuse )
+            {
+                tainted = true;
+                break;
+            }
+            y = cmpxchg(&pg[i].count_info, x,
+                        PGC_state_inuse | (need_scrub ? PGC_need_scrub : 0));
+        } while ( y != x );
+    }
+
+    if ( unlikely(tainted) )
+    {
+        page_list_add(pg, &list);
+        page_cache_release(&list, order);
+        return true;
+    }
+
+    spin_lock(&pc->lock);
+
+    page_list_add(pg, &pc->list[order]);
+    if ( ++pc->count[order] > pcp_high(order) )
+    {
+        for ( i = 0; i < pcp_batch(order); i++ )
+        {
+            pg = page_list_last(&pc->list[order]);
+            page_list_del(pg, &pc->list[order]);
+            page_list_add(pg, &list);
+        }
+        pc->count[order] -= i;
+        pc->drains++;
+    }
+
+    spin_unlock(&pc->lock);
+
+    if ( !page_list_empty(&list) )
+        page_cache_release(&list, order);
+
+    return true;
+}
+
+/* Return all the pages of a CPU's cache to the heap. */
+static bool page_cache_drain(unsigned int cpu)
+{
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    unsigned int order;
+    bool drained = false;
+
+    for ( order = 0; order < PCP_NR_ORDERS; order++ )
+    {
+        PAGE_LIST_HEAD(list);
+
+        spin_lock(&pc->lock);
+        if ( pc->count[order] )
+        {
+            page_list_move(&list, &pc->list[order]);
+            pc->count[order] = 0;
+            pc->drains++;
+        }
+        spin_unlock(&pc->lock);
+
+        if ( !page_list_empty(&list) )
+        {
+            page_cache_release(&list, order);
+            drained = true;
+        }
+    }
+
+    return drained;
+}
+
+/* Drain all the caches, for an allocation to find all free memory. */
+static bool page_cache_drain_all(void)
+{
+    unsigned int cpu;
+    bool drained = false;
+
+    for_each_online_cpu ( cpu )
+        drained |= page_cache_drain(cpu);
+
+    return drained;
+}
+
+static int cpu_page_cache_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    unsigned int order;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        /* Only initialise pc once. */
+        if ( !pc->enabled )
+        {
+            spin_lock_init(&pc->lock);
+            for ( order = 0; order < PCP_NR_ORDERS; order++ )
+                INIT_PAGE_LIST_HEAD(&pc->list[order]);
+            pc->node = cpu_to_node(cpu);
+            pc->enabled = pc->node < MAX_NUMNODES && avail[pc->node];
+        }
+        break;
+
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        page_cache_drain(cpu);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_page_cache_nfb = {
+    .notifier_call = cpu_page_cache_callback
+};
+
+static int __init page_cache_init(void)
+{
+    unsigned int cpu;
+
+    for_each_online_cpu ( cpu )
+        cpu_page_cache_callback(&cpu_page_cache_nfb, CPU_UP_PREPARE,
+                                (void *)(unsigned long)cpu);
+    register_cpu_notifier(&cpu_page_cache_nfb);
+
+    return 0;
+}
+__initcall(page_cache_init);
+
+/*
+ * Dirty pages of large allocations are scrubbed in chunks by the allocating
+ * CPU together with the idle CPUs of the node, which pick the job up from
+ * scrub_free_pages().
+ */
+struct scrub_job {
+    struct page_info *pg;
+    unsigned int nr;
+    atomic_t next;              /* First page no CPU has claimed yet. */
+    atomic_t helpers;           /* Idle CPUs working on the job. */
+};
+
+#define SCRUB_JOB_MIN_PAGES (1U << 9)
+#define SCRUB_JOB_CHUNK     64U
+
+/*
+ * Scrub chunks of @job until none are left.  A @helper stops early when it
+ * has softirqs to handle: whatever it leaves unclaimed gets scrubbed by the
+ * allocating CPU, which keeps going until the end.
+ */
+static void scrub_job_run(struct scrub_job *job, bool helper)
+{
+    unsigned int i, end, cpu = smp_processor_id();
+
+    while ( !(helper && softirq_pending(cpu)) &&
+            (i = atomic_add_return(SCRUB_JOB_CHUNK, &job->next) -
+                 SCRUB_JOB_CHUNK) < job->nr )
+    {
+        for ( end = min(i + SCRUB_JOB_CHUNK, job->nr); i < end; i++ )
+            if ( test_bit(_PGC_need_scrub, &job->pg[i].count_info) )
+                scrub_one_page(&job->pg[i]);
+    }
+}
+
+/* Help an allocation on this CPU's node to scrub its pages, if any. */
+static bool scrub_job_help(void)
+{
+    nodeid_t node = cpu_to_node(smp_processor_id());
+    struct node_scrub *ns;
+    struct scrub_job *job;
+
+    if ( node == NUMA_NO_NODE )
+        return false;
+
+    ns = &node_scrub[node];
+    if ( !read_atomic(&ns->job) )
+        return false;
+
+    spin_lock(&ns->job_lock);
+    job = ns->job;
+    if ( job )
+        atomic_inc(&job->helpers);
+    spin_unlock(&ns->job_lock);
+
+    if ( !job )
+        return false;
+
+    scrub_job_run(job, true);
+    atomic_dec(&job->helpers);
+
+    return true;
+}
+
+/*
+ * Scrub the @nr pages at @pg, which are being allocated from @node, with
+ * the help of the node's idle CPUs.  Returns false if nobody can help, in
+ * which case the caller scrubs the pages itself.
+ */
+static bool scrub_job_parallel(struct page_info *pg, unsigned int nr,
+                               nodeid_t node)
+{
+    struct node_scrub *ns = &node_scrub[node];
+    struct scrub_job job = { .pg = pg, .nr = nr };
+
+    if ( nr < SCRUB_JOB_MIN_PAGES ||
+         cpumask_weight(&node_to_cpumask(node)) < 2 )
+        return false;
+
+    spin_lock(&ns->job_lock);
+    if ( ns->job )
+    {
+        spin_unlock(&ns->job_lock);
+        return false;
+    }
+    ns->job = &job;
+    spin_unlock(&ns->job_lock);
+
+    /* Idle CPUs look for the job when woken; busy ones ignore it. */
+    smp_send_event_check_mask(&node_to_cpumask(node));
+
+    scrub_job_run(&job, false);
+
+    /* job lives on our stack: wait for the helpers to let go of it. */
+    spin_lock(&ns->job_lock);
+    ns->job = NULL;
+    spin_unlock(&ns->job_lock);
+
+    while ( atomic_read(&job.helpers) )
+        cpu_relax();
+
+    return true;
+}
+
+/* Allocate 2^@order contiguous pages. */
+static struct page_info *alloc_heap_pages(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    nodeid_t node;
+    unsigned int i, first_dirty;
+    unsigned long request = 1UL << order;
+    struct page_info *pg;
+    bool need_tlbflush = false, drained = false;
+    uint32_t tlbflush_timestamp = 0;
+    unsigned int dirty_cnt = 0;
+
+    /* Make sure there are enough bits in memflags for nodeID. */
+    BUILD_BUG_ON((_MEMF_bits - _MEMF_node) < (8 * sizeof(nodeid_t)));
+
+    ASSERT(zone_lo <= zone_hi);
+    ASSERT(zone_hi < NR_ZONES);
+
+    if ( unlikely(order > MAX_ORDER) )
+        return NULL;
+
+    pg = page_cache_alloc(zone_lo, zone_hi, order, memflags, d);
+    if ( pg )
+        return pg;
+
+ retry:
+    spin_lock(&heap_lock);
+
+    /*
+     * Claimed memory is considered unavailable unless the request
+     * is made by a domain with sufficient unclaimed pages.
+     */
+    if ( (outstanding_claims + request > total_avail_pages) &&
+          ((memflags & MEMF_no_refcount) ||
+           !d || d->outstanding_pages < request) )
+        pg = NULL;
+    else
+        pg = take_heap_chunk(zone_lo, zone_hi, order, memflags, d,
+                             &first_dirty);
+    if ( !pg )
+    {
+        /* No suitable memory blocks. Fail the request. */
+        spin_unlock(&heap_lock);
+        /* Unless the per-CPU caches had some. */
+        if ( !drained && page_cache_drain_all() )
+        {
+            drained = true;
+            goto retry;
+        }
+        return NULL;
+    }
+
+    node = phys_to_nid(page_to_maddr(pg));
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
         if ( !(memflags & MEMF_no_tlbflush) )
             accumulate_tlbflush(&need_tlbflush, &pg[i],
                                 &tlbflush_timestamp);
@@ -1020,11 +1594,16 @@ static struct page_info *alloc_heap_pages(
     if ( first_dirty != INVALID_DIRTY_IDX ||
          (scrub_debug && !(memflags & MEMF_no_scrub)) )
     {
+        bool scrubbed = (memflags & MEMF_no_scrub) ||
+            (first_dirty != INVALID_DIRTY_IDX &&
+             scrub_job_parallel(pg + first_dirty,
+                                (1U << order) - first_dirty, node));
+
         for ( i = 0; i < (1U << order); i++ )
         {
             if ( test_bit(_PGC_need_scrub, &pg[i].count_info) )
             {
-                if ( !(memflags & MEMF_no_scrub) )
+                if ( !scrubbed )
                     scrub_one_page(&pg[i]);
 
                 dirty_cnt++;
@@ -1148,13 +1727,26 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-static nodemask_t node_scrubbing;
+/* Become one of node's scrubbers, unless it has enough of them already. */
+static bool node_get_scrubber(nodeid_t node)
+{
+    if ( atomic_inc_return(&node_scrub[node].scrubbers) <= opt_scrub_workers )
+        return true;
+
+    atomic_dec(&node_scrub[node].scrubbers);
+    return false;
+}
+
+static void node_put_scrubber(nodeid_t node)
+{
+    atomic_dec(&node_scrub[node].scrubbers);
+}
 
 /*
  * If get_node is true this will return closest node that needs to be scrubbed,
- * with appropriate bit in node_scrubbing set.
+ * with this CPU counted as one of its scrubbers.
  * If get_node is not set, this will return *a* node that needs to be scrubbed.
- * node_scrubbing bitmask will no be updated.
+ * No scrubber will be counted.
  * If no node needs scrubbing then NUMA_NO_NODE is returned.
  */
 static unsigned int node_to_scrub(bool get_node)
@@ -1166,8 +1758,7 @@ static unsigned int node_to_scrub(bool get_node)
     if ( node == NUMA_NO_NODE )
         node = 0;
 
-    if ( node_need_scrub[node] &&
-         (!get_node || !node_test_and_set(node, node_scrubbing)) )
+    if ( node_need_scrub[node] && (!get_node || node_get_scrubber(node)) )
         return node;
 
     /*
@@ -1201,10 +1792,10 @@ static unsigned int node_to_scrub(bool get_node)
              * then we'd need to take this lock every time we come in here.
              */
             if ( (dist < shortest || closest == NUMA_NO_NODE) &&
-                 !node_test_and_set(node, node_scrubbing) )
+                 node_get_scrubber(node) )
             {
                 if ( closest != NUMA_NO_NODE )
-                    node_clear(closest, node_scrubbing);
+                    node_put_scrubber(closest);
                 shortest = dist;
                 closest = node;
             }
@@ -1237,19 +1828,37 @@ static void scrub_continue(void *data)
     }
 }
 
-bool scrub_free_pages(void)
+/*
+ * Find the last dirty buddy of the list which no other CPU is scrubbing.
+ * Unscrubbed pages are always at the end of the list.
+ */
+static struct page_info *dirty_buddy(const struct page_list_head *list)
+{
+    struct page_info *pg;
+
+    for ( pg = page_list_last(list); pg; pg = page_list_prev(pg, list) )
+    {
+        if ( pg->u.free.first_dirty == INVALID_DIRTY_IDX )
+            return NULL;
+        if ( pg->u.free.scrub_state == BUDDY_NOT_SCRUBBING )
+            return pg;
+    }
+
+    return NULL;
+}
+
+/*
+ * Scrub node's free pages until it is clean, softirqs are pending, or
+ * *budget (if given) pages are scrubbed.  Returns whether it was preempted.
+ */
+static bool scrub_node(nodeid_t node, unsigned long *budget)
 {
     struct page_info *pg;
     unsigned int zone;
     unsigned int cpu = smp_processor_id();
     bool preempt = false;
-    nodeid_t node;
     unsigned int cnt = 0;
 
-    node = node_to_scrub(true);
-    if ( node == NUMA_NO_NODE )
-        return false;
-
     spin_lock(&heap_lock);
 
     for ( zone = 0; zone < NR_ZONES; zone++ )
@@ -1257,17 +1866,15 @@ bool scrub_free_pages(void)
         unsigned int order = MAX_ORDER;
 
         do {
-            while ( !page_list_empty(&heap(node, zone, order)) )
+            while ( (pg = dirty_buddy(&heap(node, zone, order))) != NULL )
             {
                 unsigned int i, dirty_cnt;
+                unsigned long limit = budget ? *budget : ~0UL;
                 struct scrub_wait_state st;
 
-                /* Unscrubbed pages are always at the end of the list. */
-                pg = page_list_last(&heap(node, zone, order));
-                if ( pg->u.free.first_dirty == INVALID_DIRTY_IDX )
-                    break;
+                if ( !limit )
+                    goto out;
 
-                ASSERT(pg->u.free.scrub_state == BUDDY_NOT_SCRUBBING);
                 pg->u.free.scrub_state = BUDDY_SCRUBBING;
 
                 spin_unlock(&heap_lock);
@@ -1302,8 +1909,11 @@ bool scrub_free_pages(void)
 
                         spin_lock(&heap_lock);
                         node_need_scrub[node] -= dirty_cnt;
+                        node_scrub[node].scrubbed += dirty_cnt;
+                        if ( budget )
+                            *budget -= min_t(unsigned long, *budget, dirty_cnt);
                         spin_unlock(&heap_lock);
-                        goto out_nolock;
+                        return false;
                     }
 
                     /*
@@ -1317,6 +1927,9 @@ bool scrub_free_pages(void)
                         preempt = true;
                         break;
                     }
+
+                    if ( dirty_cnt >= limit )
+                        break;
                 }
 
                 st.pg = pg;
@@ -1332,6 +1945,9 @@ bool scrub_free_pages(void)
                 spin_lock_cb(&heap_lock, scrub_continue, &st);
 
                 node_need_scrub[node] -= dirty_cnt;
+                node_scrub[node].scrubbed += dirty_cnt;
+                if ( budget )
+                    *budget -= min_t(unsigned long, *budget, dirty_cnt);
 
                 if ( st.drop )
                     goto out;
@@ -1355,13 +1971,125 @@ bool scrub_free_pages(void)
  out:
     spin_unlock(&heap_lock);
 
- out_nolock:
-    node_clear(node, node_scrubbing);
+    return preempt;
+}
+
+bool scrub_free_pages(void)
+{
+    nodeid_t node;
+
+    if ( scrub_job_help() )
+        return true;
+
+    node = node_to_scrub(true);
+    if ( node == NUMA_NO_NODE )
+        return false;
+
+    scrub_node(node, NULL);
+
+    node_put_scrubber(node);
     return node_to_scrub(false) != NUMA_NO_NODE;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
+/*
+ * With scrub-rate set, each node with dirty free pages checks every period
+ * how much idle CPUs scrubbed, and has a tasklet, which preempts whatever
+ * runs on the CPU, make up for the rest.
+ */
+#define SCRUB_RATE_PERIOD MILLISECS(10)
+
+static unsigned long __read_mostly scrub_rate_pages;
+
+/* Called with the heap_lock held. */
+static void node_scrub_arm(nodeid_t node)
+{
+    struct node_scrub *ns = &node_scrub[node];
+
+    if ( scrub_rate_pages && !ns->armed )
+    {
+        ns->armed = true;
+        set_timer(&ns->timer, NOW() + SCRUB_RATE_PERIOD);
+    }
+}
+
+/* Prefer one of the node's own CPUs for its timer and tasklet. */
+static unsigned int node_scrub_cpu(nodeid_t node)
+{
+    unsigned int cpu;
+
+    for_each_cpu ( cpu, &node_to_cpumask(node) )
+        if ( cpu_online(cpu) )
+            return cpu;
+
+    return smp_processor_id();
+}
+
+static void node_scrub_timer_fn(void *data)
+{
+    nodeid_t node = (unsigned long)data;
+    struct node_scrub *ns = &node_scrub[node];
+    bool armed;
+    unsigned long budget;
+
+    spin_lock(&heap_lock);
+
+    budget = ns->scrubbed < scrub_rate_pages ?
+             scrub_rate_pages - ns->scrubbed : 0;
+    ns->budget = budget;
+    ns->scrubbed = 0;
+    ns->armed = armed = node_need_scrub[node];
+    if ( armed )
+        set_timer(&ns->timer, NOW() + SCRUB_RATE_PERIOD);
+
+    spin_unlock(&heap_lock);
+
+    if ( armed && budget )
+        tasklet_schedule_on_cpu(&ns->tasklet, node_scrub_cpu(node));
+}
+
+static void node_scrub_tasklet_fn(unsigned long data)
+{
+    nodeid_t node = data;
+    struct node_scrub *ns = &node_scrub[node];
+
+    atomic_inc(&ns->scrubbers);
+    if ( scrub_node(node, &ns->budget) )
+        tasklet_schedule(&ns->tasklet);
+    node_put_scrubber(node);
+}
+
+static int __init scrub_rate_init(void)
+{
+    nodeid_t node;
+
+    if ( !opt_scrub_rate )
+        return 0;
+
+    for ( node = 0; node < MAX_NUMNODES; node++ )
+    {
+        struct node_scrub *ns = &node_scrub[node];
+
+        init_timer(&ns->timer, node_scrub_timer_fn, (void *)(unsigned long)node,
+                   node_scrub_cpu(node));
+        tasklet_init(&ns->tasklet, node_scrub_tasklet_fn, node);
+    }
+
+    spin_lock(&heap_lock);
+
+    scrub_rate_pages = max(1UL, (opt_scrub_rate >> PAGE_SHIFT) *
+                                SCRUB_RATE_PERIOD / SECONDS(1));
+    for ( node = 0; node < MAX_NUMNODES; node++ )
+        if ( node_need_scrub[node] )
+            node_scrub_arm(node);
+
+    spin_unlock(&heap_lock);
+
+    return 0;
+}
+__initcall(scrub_rate_init);
+
+/* Free 2^@order set of pages to the heap.  Called with the heap_lock held. */
+static void free_heap_chunk(
     struct page_info *pg, unsigned int order, bool need_scrub)
 {
     unsigned long mask;
@@ -1371,8 +2099,7 @@ static void free_heap_pages(
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -1430,6 +2157,7 @@ static void free_heap_pages(
     if ( need_scrub )
     {
         node_need_scrub[node] += 1 << order;
+        node_scrub_arm(node);
         pg->u.free.first_dirty = 0;
     }
     else
@@ -1492,7 +2220,17 @@ static void free_heap_pages(
 
     if ( tainted )
         reserve_offlined_page(pg);
+}
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    if ( page_cache_free(pg, order, need_scrub) )
+        return;
 
+    spin_lock(&heap_lock);
+    free_heap_chunk(pg, order, need_scrub);
     spin_unlock(&heap_lock);
 }
 
@@ -1619,6 +2357,18 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
 
     spin_unlock(&heap_lock);
 
+    /*
+     * Pages in the per-CPU page caches are in use without an owner.  Drain
+     * the caches: freeing the page from there gets it offlined.
+     */
+    if ( !page_get_owner(pg) && !(old_info & PGC_xen_heap) &&
+         page_cache_drain_all() && page_state_is(pg, offlined) )
+    {
+        *status = broken ? PG_OFFLINE_OFFLINED | PG_OFFLINE_BROKEN
+                         : PG_OFFLINE_OFFLINED;
+        return 0;
+    }
+
     if ( (owner = page_get_owner_and_reference(pg)) )
     {
         if ( p2m_pod_offline_or_broken_hit(pg) )
@@ -2423,8 +3173,9 @@ unsigned long avail_node_heap_pages(unsigned int nodeid)
 
 static void pagealloc_info(unsigned char key)
 {
-    unsigned int zone = MEMZONE_XEN;
+    unsigned int zone = MEMZONE_XEN, cpu;
     unsigned long n, total = 0;
+    unsigned long cached = 0, hits = 0, misses = 0, refills = 0, drains = 0;
 
     printk("Physical memory information:\n");
     printk("    Xen heap: %lukB free\n",
@@ -2446,6 +3197,23 @@ static void pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+
+    for_each_online_cpu ( cpu )
+    {
+        const struct page_cache *pc = &per_cpu(page_cache, cpu);
+        unsigned int order;
+
+        for ( order = 0; order < PCP_NR_ORDERS; order++ )
+            cached += (unsigned long)pc->count[order] << order;
+        hits += pc->hits;
+        misses += pc->misses;
+        refills += pc->refills;
+        drains += pc->drains;
+    }
+
+    printk("    Per-CPU caches: %lukB cached, %lu hits, %lu misses, "
+           "%lu refills, %lu drains\n", cached << (PAGE_SHIFT-10),
+           hits, misses, refills, drains);
 }
 
 static __init int pagealloc_keyhandler_init(void)
@@ -1651,6 +1651,10 @@ csched_runq_steal(int peer_cpu, int cpu, int pri, int balance_step)
                                 !has_soft_affinity(vc)) )
             continue;
 
+        /* Nor can we steal something our siblings won't let us run. */
+        if ( !sched_gran_allowed(cpu, vc->domain) )
+            continue;
+
         affinity_balance_cpumask(vc, balance_step, cpumask_scratch);
         if ( __csched_vcpu_is_migrateable(prv, vc, cpu, cpumask_scratch) )
         {
@@ -1945,6 +1949,13 @@ csched_schedule(
     snext = __runq_elem(runq->next);
     ret.migrated = 0;
 
+    /*
+     * Skip whatever can't run here because of the scheduling granularity.
+     * The idle vcpu is always in the runq, and can always run.
+     */
+    while ( !sched_gran_allowed(cpu, snext->vcpu->domain) )
+        snext = __runq_elem(snext->runq_elem.next);
+
     /* Tasklet work (which runs in idle VCPU context) overrides all else. */
     if ( tasklet_work_scheduled )
     {
@@ -18,6 +18,7 @@
 #include <xen/event.h>
 #include <xen/time.h>
 #include <xen/perfc.h>
+#include <xen/rbtree.h>
 #include <xen/sched-if.h>
 #include <xen/softirq.h>
 #include <asm/div64.h>
@@ -388,6 +389,15 @@ static int __read_mostly opt_underload_balance_tolerance = 0;
 integer_param("credit2_balance_under", opt_underload_balance_tolerance);
 static int __read_mostly opt_overload_balance_tolerance = -3;
 integer_param("credit2_balance_over", opt_overload_balance_tolerance);
+
+/*
+ * Work stealing: rather than waiting for the next credit reset to balance
+ * the load, a pcpu with nothing to run pulls a waiting vcpu from the most
+ * loaded runqueue close to it, and wakeups which find no pcpu to run on in
+ * their own runqueue poke an idle pcpu of another one to come and steal.
+ */
+static bool __read_mostly opt_work_stealing;
+boolean_param("credit2_work_stealing", opt_work_stealing);
 /*
  * Domains subject to a cap receive a replenishment of their runtime budget
  * once every opt_cap_period interval. Default is 10 ms. The amount of budget
@@ -465,8 +475,9 @@ custom_param("credit2_runqueue", parse_credit2_runqueue);
 struct csched2_runqueue_data {
     spinlock_t lock;           /* Lock for this runqueue                     */
 
-    struct list_head runq;     /* Ordered list of runnable vms               */
+    struct rb_root runq;       /* Credit-ordered tree of runnable vms        */
     int id;                    /* ID of this runqueue (-1 if invalid)        */
+    int64_t credit_bonus;      /* Credit handed out by resets so far         */
 
     int load;                  /* Instantaneous load (num of non-idle vcpus) */
     s_time_t load_last_update; /* Last time average was updated              */
@@ -530,7 +541,8 @@ struct csched2_vcpu {
     s_time_t load_last_update;         /* Last time average was updated       */
     s_time_t avgload;                  /* Decaying queue load                 */
 
-    struct list_head runq_elem;        /* On the runqueue (rqd->runq)         */
+    struct rb_node runq_elem;          /* On the runqueue (rqd->runq)         */
+    int64_t credit_bonus;              /* rqd->credit_bonus already applied   */
     struct list_head parked_elem;      /* On the parked_vcpus list            */
     struct list_head rqd_elem;         /* On csched2_runqueue_data's svc list */
     struct csched2_runqueue_data *migrate_rqd; /* Pre-determined migr. target */
@@ -786,18 +798,71 @@ static s_time_t c2t(struct csched2_runqueue_data *rqd, s_time_t credit, struct c
     return credit * svc->weight / rqd->max_weight;
 }
 
+/*
+ * Credit resets are applied lazily: reset_credit() only accounts the credit
+ * it hands out in rqd->credit_bonus, and each vcpu catches up with that the
+ * next time its credit is looked at. Adding the same amount to everyone and
+ * clipping does not change the order of the vcpus, so the runqueue stays
+ * sorted in the meantime.
+ */
+static void credit_sync(struct csched2_vcpu *svc)
+{
+    struct csched2_runqueue_data *rqd = svc->rqd;
+    int64_t credit;
+    int start_credit = svc->credit;
+
+    if ( is_idle_vcpu(svc->vcpu) || rqd == NULL ||
+         svc->credit_bonus == rqd->credit_bonus )
+        return;
+
+    credit = svc->credit + (rqd->credit_bonus - svc->credit_bonus);
+
+    /* "Clip" credits to max carryover */
+    svc->credit = min_t(int64_t, credit,
+                        CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX);
+
+    if ( unlikely(tb_init_done) )
+    {
+        struct {
+            unsigned vcpu:16, dom:16;
+            int credit_start, credit_end;
+            unsigned multiplier;
+        } d;
+        d.dom = svc->vcpu->domain->domain_id;
+        d.vcpu = svc->vcpu->vcpu_id;
+        d.credit_start = start_credit;
+        d.credit_end = svc->credit;
+        d.multiplier = (rqd->credit_bonus - svc->credit_bonus) /
+                       CSCHED2_CREDIT_INIT;
+        __trace_var(TRC_CSCHED2_CREDIT_RESET, 1,
+                    sizeof(d),
+                    (unsigned char *)&d);
+    }
+
+    svc->credit_bonus = rqd->credit_bonus;
+}
+
 /*
  * Runqueue related code.
  */
 
 static inline int vcpu_on_runq(struct csched2_vcpu *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
+}
+
+static inline struct csched2_vcpu * runq_elem(struct rb_node *elem)
+{
+    return rb_entry(elem, struct csched2_vcpu, runq_elem);
 }
 
-static inline struct csched2_vcpu * runq_elem(struct list_head *elem)
+/* The vcpu with the most credit in the runqueue, NULL if it is empty. */
+static inline struct csched2_vcpu *
+runq_first(struct csched2_runqueue_data *rqd)
 {
-    return list_entry(elem, struct csched2_vcpu, runq_elem);
+    struct rb_node *node = rb_first(&rqd->runq);
+
+    return node ? runq_elem(node) : NULL;
 }
 
 static void activate_runqueue(struct csched2_private *prv, int rqi)
@@ -811,7 +876,7 @@ static void activate_runqueue(struct csched2_private *prv, int rqi)
     rqd->max_weight = 1;
     rqd->id = rqi;
     INIT_LIST_HEAD(&rqd->svc);
-    INIT_LIST_HEAD(&rqd->runq);
+    rqd->runq = RB_ROOT;
     spin_lock_init(&rqd->lock);
 
     __cpumask_set_cpu(rqi, &prv->active_queues);
@@ -945,6 +1010,8 @@ _runq_assign(struct csched2_vcpu *svc, struct csched2_runqueue_data *rqd)
 
     svc->rqd = rqd;
     list_add_tail(&svc->rqd_elem, &svc->rqd->svc);
+    /* Resets which happened before we got here are none of our business. */
+    svc->credit_bonus = rqd->credit_bonus;
 
     update_max_weight(svc->rqd, svc->weight, 0);
 
@@ -985,6 +1052,9 @@ _runq_deassign(struct csched2_vcpu *svc)
     ASSERT(!vcpu_on_runq(svc));
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
+    /* Take the resets of the runqueue we're leaving with us. */
+    credit_sync(svc);
+
     list_del_init(&svc->rqd_elem);
     update_max_weight(rqd, 0, svc->weight);
 
@@ -1271,10 +1341,9 @@ update_load(const struct scheduler *ops,
 static void
 runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
 {
-    struct list_head *iter;
     unsigned int cpu = svc->vcpu->processor;
-    struct list_head * runq = &c2rqd(ops, cpu)->runq;
-    int pos = 0;
+    struct rb_root *runq = &c2rqd(ops, cpu)->runq;
+    struct rb_node **link = &runq->rb_node, *parent = NULL;
 
     ASSERT(spin_is_locked(per_cpu(schedule_data, cpu).schedule_lock));
 
@@ -1286,16 +1355,26 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
     ASSERT(!svc->vcpu->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    credit_sync(svc);
+
+    /*
+     * Leftmost is the vcpu with the most credit. Going right on ties keeps
+     * vcpus with the same credit in FIFO order.
+     */
+    while ( *link )
     {
-        struct csched2_vcpu * iter_svc = runq_elem(iter);
+        struct csched2_vcpu * iter_svc = runq_elem(*link);
 
-        if ( svc->credit > iter_svc->credit )
-            break;
+        parent = *link;
+        credit_sync(iter_svc);
 
-        pos++;
+        if ( svc->credit > iter_svc->credit )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
     }
-    list_add_tail(&svc->runq_elem, iter);
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, runq);
 
     if ( unlikely(tb_init_done) )
     {
@@ -1303,9 +1382,14 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
             unsigned vcpu:16, dom:16;
             unsigned pos;
         } d;
+        struct rb_node *iter = &svc->runq_elem;
+
+        /* The position is only worth a walk if someone is looking. */
+        d.pos = 0;
+        while ( (iter = rb_prev(iter)) != NULL )
+            d.pos++;
         d.dom = svc->vcpu->domain->domain_id;
         d.vcpu = svc->vcpu->vcpu_id;
-        d.pos = pos;
         __trace_var(TRC_CSCHED2_RUNQ_POS, 1,
                     sizeof(d),
                     (unsigned char *)&d);
@@ -1315,7 +1399,8 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
 static inline void runq_remove(struct csched2_vcpu *svc)
 {
     ASSERT(vcpu_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+    rb_erase(&svc->runq_elem, &svc->rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
 }
 
 void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_vcpu *, s_time_t);
@@ -1345,6 +1430,22 @@ static inline bool is_preemptable(const struct csched2_vcpu *svc,
            ratelimit - CSCHED2_RATELIMIT_TICKLE_TOLERANCE;
 }
 
+/*
+ * Drop from mask the idle cpus on which new can't run, because of what
+ * their siblings are running (see sched_gran_allowed()).
+ */
+static void gran_filter(cpumask_t *mask, const struct csched2_vcpu *new)
+{
+    unsigned int i;
+
+    if ( opt_sched_granularity == SCHED_GRAN_cpu )
+        return;
+
+    for_each_cpu ( i, mask )
+        if ( !sched_gran_allowed(i, new->vcpu->domain) )
+            __cpumask_clear_cpu(i, mask);
+}
+
 /*
  * Score to preempt the target cpu.  Return a negative number if the
  * credit isn't high enough; if it is, favor a preemption on cpu in
@@ -1376,6 +1477,10 @@ static s_time_t tickle_score(const struct scheduler *ops, s_time_t now,
          !is_preemptable(cur, now, MICROSECS(prv->ratelimit_us))) )
         return -1;
 
+    /* Preempting cur is pointless if cpu's siblings won't let new run. */
+    if ( !sched_gran_allowed(cpu, new->vcpu->domain) )
+        return -1;
+
     burn_credits(rqd, cur, now);
 
     score = new->credit - cur->credit;
@@ -1415,6 +1520,72 @@ static s_time_t tickle_score(const struct scheduler *ops, s_time_t now,
     return score;
 }
 
+/*
+ * Topology levels looked at when stealing work, closest first: the runqueues
+ * with pcpus in the same core, the same socket, the same node, anywhere.
+ */
+#define STEAL_LEVELS 4
+
+static const cpumask_t *steal_level_mask(unsigned int cpu, unsigned int level)
+{
+    switch ( level )
+    {
+    case 0:
+        return per_cpu(cpu_sibling_mask, cpu);
+    case 1:
+        return per_cpu(cpu_core_mask, cpu);
+    case 2:
+        return &node_to_cpumask(cpu_to_node(cpu));
+    default:
+        return &cpu_online_map;
+    }
+}
+
+/*
+ * Nobody in new's runqueue can run it right away: poke an idle pcpu in the
+ * closest other runqueue, so it comes and steals new (see steal_work()).
+ * This looks at other runqueues without their locks, so it is just a hint;
+ * at worst, the poked pcpu goes back to idle.
+ */
+static void steal_tickle(const struct scheduler *ops,
+                         const struct csched2_vcpu *new)
+{
+    struct csched2_private *prv = csched2_priv(ops);
+    unsigned int cpu = new->vcpu->processor, level, i, ipid;
+
+    if ( !read_trylock(&prv->lock) )
+        return;
+
+    for ( level = 0; level < STEAL_LEVELS; level++ )
+    {
+        const cpumask_t *mask = steal_level_mask(cpu, level);
+
+        for_each_cpu ( i, &prv->active_queues )
+        {
+            struct csched2_runqueue_data *rqd = prv->rqd + i;
+
+            if ( rqd == new->rqd )
+                continue;
+
+            for_each_cpu ( ipid, &rqd->idle )
+            {
+                if ( !cpumask_test_cpu(ipid, mask) ||
+                     cpumask_test_cpu(ipid, &rqd->tickled) ||
+                     !cpumask_test_cpu(ipid, new->vcpu->cpu_hard_affinity) ||
+                     !sched_gran_allowed(ipid, new->vcpu->domain) )
+                    continue;
+
+                SCHED_STAT_CRANK(tickled_steal_cpu);
+                cpu_raise_softirq(ipid, SCHEDULE_SOFTIRQ);
+                goto out;
+            }
+        }
+    }
+
+ out:
+    read_unlock(&prv->lock);
+}
+
 /*
  * Check what processor it is best to 'wake', for picking up a vcpu that has
  * just been put (back) in the runqueue. Logic is as follows:
@@ -1443,6 +1614,8 @@ runq_tickle(const struct scheduler *ops, struct csched2_vcpu *new, s_time_t now)
 
     ASSERT(new->rqd == rqd);
 
+    credit_sync(new);
+
     if ( unlikely(tb_init_done) )
     {
         struct {
@@ -1503,6 +1676,7 @@ runq_tickle(const struct scheduler *ops, struct csched2_vcpu *new, s_time_t now)
         else
             cpumask_and(&mask, &rqd->smt_idle, online);
         cpumask_and(&mask, &mask, cpumask_scratch_cpu(cpu));
+        gran_filter(&mask, new);
         i = cpumask_test_or_cycle(cpu, &mask);
         if ( i < nr_cpu_ids )
         {
@@ -1519,6 +1693,7 @@ runq_tickle(const struct scheduler *ops, struct csched2_vcpu *new, s_time_t now)
         cpumask_andnot(&mask, &rqd->idle, &rqd->tickled);
         cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu), online);
         cpumask_and(&mask, &mask, cpumask_scratch_cpu(cpu));
+        gran_filter(&mask, new);
         i = cpumask_test_or_cycle(cpu, &mask);
         if ( i < nr_cpu_ids )
         {
@@ -1584,6 +1759,8 @@ runq_tickle(const struct scheduler *ops, struct csched2_vcpu *new, s_time_t now)
     if ( ipid == -1 )
     {
         SCHED_STAT_CRANK(tickled_no_cpu);
+        if ( opt_work_stealing )
+            steal_tickle(ops, new);
         return;
     }
 
@@ -1617,7 +1794,7 @@ static void reset_credit(const struct scheduler *ops, int cpu, s_time_t now,
                          struct csched2_vcpu *snext)
 {
     struct csched2_runqueue_data *rqd = c2rqd(ops, cpu);
-    struct list_head *iter;
+    unsigned int i;
     int m;
 
     /*
@@ -1641,67 +1818,38 @@ static void reset_credit(const struct scheduler *ops, int cpu, s_time_t now,
     if ( snext->credit < -CSCHED2_CREDIT_INIT )
         m += (-snext->credit) / CSCHED2_CREDIT_INIT;
 
-    list_for_each( iter, &rqd->svc )
+    /*
+     * If a vcpu is running, it is our responsibility to make sure, here,
+     * that the credit it has spent so far get accounted. Everyone else
+     * picks the reset up later, in credit_sync(), so the cost of a reset
+     * is bounded by the number of pcpus of the runqueue, rather than by
+     * the number of vcpus assigned to it.
+     */
+    for_each_cpu ( i, &rqd->active )
     {
-        unsigned int svc_cpu;
-        struct csched2_vcpu * svc;
-        int start_credit;
-
-        svc = list_entry(iter, struct csched2_vcpu, rqd_elem);
-        svc_cpu = svc->vcpu->processor;
-
-        ASSERT(!is_idle_vcpu(svc->vcpu));
-        ASSERT(svc->rqd == rqd);
+        struct csched2_vcpu *svc = csched2_vcpu(curr_on_cpu(i));
 
-        /*
-         * If svc is running, it is our responsibility to make sure, here,
-         * that the credit it has spent so far get accounted.
-         */
-        if ( svc->vcpu == curr_on_cpu(svc_cpu) )
-        {
-            burn_credits(rqd, svc, now);
-            /*
-             * And, similarly, in case it has run out of budget, as a
-             * consequence of this round of accounting, we also must inform
-             * its pCPU that it's time to park it, and pick up someone else.
-             */
-            if ( unlikely(svc->budget <= 0) )
-                tickle_cpu(svc_cpu, rqd);
-        }
-
-        start_credit = svc->credit;
+        if ( is_idle_vcpu(svc->vcpu) || svc->rqd != rqd )
+            continue;
 
+        burn_credits(rqd, svc, now);
         /*
-         * Add INIT * m, avoiding integer multiplication in the common case.
+         * And, similarly, in case it has run out of budget, as a
+         * consequence of this round of accounting, we also must inform
+         * its pCPU that it's time to park it, and pick up someone else.
          */
-        if ( likely(m==1) )
-            svc->credit += CSCHED2_CREDIT_INIT;
-        else
-            svc->credit += m * CSCHED2_CREDIT_INIT;
+        if ( unlikely(svc->budget <= 0) )
+            tickle_cpu(i, rqd);
+    }
 
-        /* "Clip" credits to max carryover */
-        if ( svc->credit > CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX )
-            svc->credit = CSCHED2_CREDIT_INIT + CSCHED2_CARRYOVER_MAX;
+    /* Add INIT * m, avoiding integer multiplication in the common case. */
+    if ( likely(m == 1) )
+        rqd->credit_bonus += CSCHED2_CREDIT_INIT;
+    else
+        rqd->credit_bonus += (int64_t)m * CSCHED2_CREDIT_INIT;
 
-        svc->start_time = now;
-
-        if ( unlikely(tb_init_done) )
-        {
-            struct {
-                unsigned vcpu:16, dom:16;
-                int credit_start, credit_end;
-                unsigned multiplier;
-            } d;
-            d.dom = svc->vcpu->domain->domain_id;
-            d.vcpu = svc->vcpu->vcpu_id;
-            d.credit_start = start_credit;
-            d.credit_end = svc->credit;
-            d.multiplier = m;
-            __trace_var(TRC_CSCHED2_CREDIT_RESET, 1,
-                        sizeof(d),
-                        (unsigned char *)&d);
-        }
-    }
+    /* snext is about to run, and csched2_schedule() wants its new credit. */
+    credit_sync(snext);
 
     SCHED_STAT_CRANK(credit_reset);
 
@@ -1721,6 +1869,8 @@ void burn_credits(struct csched2_runqueue_data *rqd,
         return;
     }
 
+    credit_sync(svc);
+
     delta = now - svc->start_time;
 
     if ( unlikely(delta <= 0) )
@@ -2036,7 +2186,7 @@ csched2_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
 
     svc->sdom = dd;
     svc->vcpu = vc;
@@ -2546,6 +2696,110 @@ static bool vcpu_is_migrateable(struct csched2_vcpu *svc,
            cpumask_intersects(cpumask_scratch_cpu(cpu), &rqd->active);
 }
 
+/*
+ * cpu has nothing to run: pull a vcpu which is waiting in the runqueue with
+ * the highest load average among the closest ones. Returns whether a vcpu
+ * has been moved to cpu's runqueue.
+ */
+static bool steal_work(const struct scheduler *ops, unsigned int cpu,
+                       s_time_t now)
+{
+    struct csched2_private *prv = csched2_priv(ops);
+    struct csched2_runqueue_data *lrqd = c2rqd(ops, cpu), *orqd = NULL;
+    struct rb_node *iter;
+    unsigned int level, i;
+    bool stolen = false;
+
+    ASSERT(spin_is_locked(per_cpu(schedule_data, cpu).schedule_lock));
+
+    if ( !read_trylock(&prv->lock) )
+        return false;
+
+    /*
+     * The loads and the runqueues are looked at without the locks, which is
+     * fine for picking a victim. The one we pick is then checked properly.
+     */
+    for ( level = 0; level < STEAL_LEVELS && orqd == NULL; level++ )
+    {
+        const cpumask_t *mask = steal_level_mask(cpu, level);
+
+        for_each_cpu ( i, &prv->active_queues )
+        {
+            struct csched2_runqueue_data *rqd = prv->rqd + i;
+
+            if ( rqd == lrqd || RB_EMPTY_ROOT(&rqd->runq) ||
+                 !cpumask_intersects(&rqd->active, mask) )
+                continue;
+
+            if ( orqd == NULL || rqd->b_avgload > orqd->b_avgload )
+                orqd = rqd;
+        }
+    }
+
+    /* As in balance_load(), we can't wait for the lock, or we may deadlock. */
+    if ( orqd == NULL || !spin_trylock(&orqd->lock) )
+        goto out;
+
+    /* Make sure the runqueue hasn't been deactivated in the meantime. */
+    if ( unlikely(orqd->id < 0) )
+        goto out_unlock;
+
+    for ( iter = rb_first(&orqd->runq); iter != NULL; iter = rb_next(iter) )
+    {
+        struct csched2_vcpu *svc = runq_elem(iter);
+
+        if ( !cpumask_test_cpu(cpu, svc->vcpu->cpu_hard_affinity) ||
+             !vcpu_is_migrateable(svc, lrqd) ||
+             !sched_gran_allowed(cpu, svc->vcpu->domain) )
+            continue;
+
+        /* Someone in its runqueue has been told to pick it, let them. */
+        if ( svc->tickled_cpu != -1 &&
+             cpumask_test_cpu(svc->tickled_cpu, &orqd->tickled) )
+            continue;
+
+        /*
+         * Like migrate(), but svc goes straight to cpu and there is no
+         * need to tickle anyone: we are about to pick it ourselves.
+         */
+        if ( unlikely(tb_init_done) )
+        {
+            struct {
+                unsigned vcpu:16, dom:16;
+                unsigned rqi:16, trqi:16;
+            } d;
+            d.dom = svc->vcpu->domain->domain_id;
+            d.vcpu = svc->vcpu->vcpu_id;
+            d.rqi = orqd->id;
+            d.trqi = lrqd->id;
+            __trace_var(TRC_CSCHED2_MIGRATE, 1,
+                        sizeof(d),
+                        (unsigned char *)&d);
+        }
+
+        runq_remove(svc);
+        update_load(ops, orqd, NULL, -1, now);
+        _runq_deassign(svc);
+
+        svc->vcpu->processor = cpu;
+
+        _runq_assign(svc, lrqd);
+        update_load(ops, lrqd, NULL, 1, now);
+        runq_insert(ops, svc);
+
+        SCHED_STAT_CRANK(migrate_stolen);
+        stolen = true;
+        break;
+    }
+
+ out_unlock:
+    spin_unlock(&orqd->lock);
+ out:
+    read_unlock(&prv->lock);
+
+    return stolen;
+}
+
 static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 {
     struct csched2_private *prv = csched2_priv(ops);
@@ -3103,7 +3357,7 @@ csched2_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!vcpu_on_runq(svc));
 
     /* csched2_cpu_pick() expects the pcpu lock to be held */
     lock = vcpu_schedule_lock_irq(vc);
@@ -3141,7 +3395,7 @@ csched2_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!vcpu_on_runq(svc));
 
     SCHED_STAT_CRANK(vcpu_remove);
 
@@ -3163,7 +3417,7 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = c2rqd(ops, cpu);
-    struct list_head *runq = &rqd->runq;
+    struct csched2_vcpu *swait = runq_first(rqd);
     struct csched2_private *prv = csched2_priv(ops);
 
     /*
@@ -3195,15 +3449,16 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     }
 
     /* 1) Run until snext's credit will be 0. */
+    credit_sync(snext);
     rt_credit = snext->credit;
 
     /*
      * 2) If there's someone waiting whose credit is positive,
      *    run until your credit ~= his.
      */
-    if ( ! list_empty(runq) )
+    if ( swait != NULL )
     {
-        struct csched2_vcpu *swait = runq_elem(runq->next);
+        credit_sync(swait);
 
         if ( ! is_idle_vcpu(swait->vcpu)
              && swait->credit > 0 )
@@ -3260,7 +3515,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                int cpu, s_time_t now,
                unsigned int *skipped)
 {
-    struct list_head *iter, *temp;
+    struct rb_node *iter;
     struct csched2_vcpu *snext = NULL;
     struct csched2_private *prv = csched2_priv(per_cpu(scheduler, cpu));
     bool yield = false, soft_aff_preempt = false;
@@ -3345,9 +3600,11 @@ runq_candidate(struct csched2_runqueue_data *rqd,
         snext = csched2_vcpu(idle_vcpu[cpu]);
 
  check_runq:
-    list_for_each_safe( iter, temp, &rqd->runq )
+    for ( iter = rb_first(&rqd->runq); iter != NULL; iter = rb_next(iter) )
     {
-        struct csched2_vcpu * svc = list_entry(iter, struct csched2_vcpu, runq_elem);
+        struct csched2_vcpu * svc = runq_elem(iter);
+
+        credit_sync(svc);
 
         if ( unlikely(tb_init_done) )
         {
@@ -3368,6 +3625,14 @@ runq_candidate(struct csched2_runqueue_data *rqd,
             continue;
         }
 
+        /* Nor vcpus which our siblings won't let us run right now. */
+        if ( !sched_gran_allowed(cpu, svc->vcpu->domain) )
+        {
+            (*skipped)++;
+            SCHED_STAT_CRANK(deferred_to_gran);
+            continue;
+        }
+
         /*
          * If a vcpu is meant to be picked up by another processor, and such
          * processor has not scheduled yet, leave it in the runqueue for him.
@@ -3526,8 +3791,15 @@ csched2_schedule(
         snext = csched2_vcpu(idle_vcpu[cpu]);
     }
     else
+    {
         snext = runq_candidate(rqd, scurr, cpu, now, &skipped_vcpus);
 
+        /* Nothing to do here: see if someone close has too much. */
+        if ( opt_work_stealing && is_idle_vcpu(snext->vcpu) &&
+             steal_work(ops, cpu, now) )
+            snext = runq_candidate(rqd, scurr, cpu, now, &skipped_vcpus);
+    }
+
     /* If switching from a non-idle runnable vcpu, put it
      * back on the runqueue. */
     if ( snext != scurr
@@ -3633,6 +3905,7 @@ csched2_dump_vcpu(struct csched2_private *prv, struct csched2_vcpu *svc)
             svc->flags,
             svc->vcpu->processor);
 
+    credit_sync(svc);
     printk(" credit=%" PRIi32" [w=%u]", svc->credit, svc->weight);
 
     if ( has_cap(svc) )
@@ -3745,7 +4018,7 @@ csched2_dump(const struct scheduler *ops)
     for_each_cpu(i, &prv->active_queues)
     {
         struct csched2_runqueue_data *rqd = prv->rqd + i;
-        struct list_head *iter, *runq = &rqd->runq;
+        struct rb_node *iter;
         int loop = 0;
 
         /* We need the lock to scan the runqueue. */
@@ -3757,7 +4030,7 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( iter = rb_first(&rqd->runq); iter != NULL; iter = rb_next(iter) )
         {
             struct csched2_vcpu *svc = runq_elem(iter);
 
@@ -54,6 +54,29 @@ boolean_param("sched_smt_power_savings", sched_smt_power_savings);
  * */
 int sched_ratelimit_us = SCHED_DEFAULT_RATELIMIT_US;
 integer_param("sched_ratelimit_us", sched_ratelimit_us);
+
+/*
+ * Scheduling granularity: with "core" (or "socket"), all the threads of a
+ * core (or of a socket) only ever run vcpus of one domain at a time, or are
+ * idle.
+ */
+enum sched_gran __read_mostly opt_sched_granularity = SCHED_GRAN_cpu;
+
+static int __init sched_select_granularity(const char *str)
+{
+    if ( strcmp("cpu", str) == 0 )
+        opt_sched_granularity = SCHED_GRAN_cpu;
+    else if ( strcmp("core", str) == 0 )
+        opt_sched_granularity = SCHED_GRAN_core;
+    else if ( strcmp("socket", str) == 0 )
+        opt_sched_granularity = SCHED_GRAN_socket;
+    else
+        return -EINVAL;
+
+    return 0;
+}
+custom_param("sched-gran", sched_select_granularity);
+
 /* Various timer handlers. */
 static void s_timer_fn(void *unused);
 static void vcpu_periodic_timer_fn(void *data);
@@ -170,6 +193,108 @@ static inline void vcpu_urgent_count_update(struct vcpu *v)
     }
 }
 
+/*
+ * Scheduling statistics (see XEN_SYSCTL_sched_stats).
+ *
+ * They are always on, and collected here for all the schedulers. Histograms
+ * are only updated by the pCPU they belong to, so they need no atomics.
+ * Runqueue lengths, on the other hand, are updated from wherever a vCPU is
+ * woken up, and can refer to pCPUs that went offline while a vCPU was still
+ * accounted to them, so they can't live in the per-CPU areas.
+ */
+struct sched_stats {
+    xen_sysctl_sched_hist_t hist[XEN_SYSCTL_SCHED_HIST_NR];
+    s_time_t switch_start;
+};
+static DEFINE_PER_CPU(struct sched_stats, sched_stats);
+static atomic_t sched_runq_len[NR_CPUS];
+
+static inline void sched_hist_add(unsigned int which, uint64_t val,
+                                  unsigned int bucket)
+{
+    xen_sysctl_sched_hist_t *h = &this_cpu(sched_stats).hist[which];
+
+    h->count++;
+    h->sum += val;
+    h->bucket[min(bucket, XEN_SYSCTL_SCHED_HIST_BUCKETS - 1U)]++;
+}
+
+static inline void sched_hist_add_time(unsigned int which, s_time_t delta)
+{
+    if ( delta < 0 )
+        delta = 0;
+
+    sched_hist_add(which, delta, fls64(delta >> 10));
+}
+
+static inline void sched_stats_runstate_change(
+    struct vcpu *v, int new_state, s_time_t new_entry_time)
+{
+    if ( is_idle_vcpu(v) )
+        return;
+
+    if ( new_state == RUNSTATE_runnable )
+    {
+        v->runq_stats_cpu = v->processor;
+        v->runq_stats_woken = v->runstate.state != RUNSTATE_running;
+        atomic_inc(&sched_runq_len[v->runq_stats_cpu]);
+    }
+    else if ( v->runstate.state == RUNSTATE_runnable )
+    {
+        atomic_dec(&sched_runq_len[v->runq_stats_cpu]);
+
+        /* Becoming running only happens in schedule(), on v->processor. */
+        if ( new_state == RUNSTATE_running )
+            sched_hist_add_time(v->runq_stats_woken ?
+                                XEN_SYSCTL_SCHED_HIST_wake_latency :
+                                XEN_SYSCTL_SCHED_HIST_runq_wait,
+                                new_entry_time - v->runstate.state_entry_time);
+    }
+}
+
+int sched_get_stats(struct xen_sysctl_sched_stats *op)
+{
+    unsigned int cpu = op->cpu;
+    int rc = 0;
+
+    if ( op->pad || (op->flags & ~XEN_SYSCTL_SCHED_STATS_reset) )
+        return -EINVAL;
+
+    if ( cpu >= nr_cpu_ids )
+        return -EINVAL;
+
+    if ( guest_handle_is_null(op->hist) )
+    {
+        op->nr_hists = XEN_SYSCTL_SCHED_HIST_NR;
+        return 0;
+    }
+
+    /* Keep the pCPU (and hence its per-CPU area) from going away. */
+    if ( !get_cpu_maps() )
+        return -EBUSY;
+
+    if ( !cpu_online(cpu) )
+        rc = -ENODEV;
+    else
+    {
+        struct sched_stats *stats = &per_cpu(sched_stats, cpu);
+
+        op->nr_hists = min(op->nr_hists, XEN_SYSCTL_SCHED_HIST_NR + 0U);
+        if ( copy_to_guest(op->hist, stats->hist, op->nr_hists) )
+            rc = -EFAULT;
+        /*
+         * This races with the pCPU updating its own statistics, so a few
+         * samples may survive the reset. That is fine for our purposes.
+         */
+        else if ( op->flags & XEN_SYSCTL_SCHED_STATS_reset )
+            memset(stats->hist, 0, sizeof(stats->hist));
+    }
+
+    put_cpu_maps();
+
+    return rc;
+}
+
 static inline void vcpu_runstate_change(
     struct vcpu *v, int new_state, s_time_t new_entry_time)
 {
@@ -180,6 +305,8 @@ static inline void vcpu_runstate_change(
 
     vcpu_urgent_count_update(v);
 
+    sched_stats_runstate_change(v, new_state, new_entry_time);
+
     trace_runstate_change(v, new_state);
 
     delta = new_entry_time - v->runstate.state_entry_time;
@@ -262,6 +389,8 @@ int sched_init_vcpu(struct vcpu *v, unsigned int processor)
                v, v->processor);
     init_timer(&v->poll_timer, poll_timer_fn,
                v, v->processor);
+    init_timer(&v->evtchn_coalesce_timer, evtchn_coalesce_timer_fn,
+               v, v->processor);
 
     v->sched_priv = sched_alloc_vdata(dom_scheduler(d), v, d->sched_priv);
     if ( v->sched_priv == NULL )
@@ -359,6 +488,7 @@ int sched_move_domain(struct domain *d, struct cpupool *c)
         migrate_timer(&v->periodic_timer, new_p);
         migrate_timer(&v->singleshot_timer, new_p);
         migrate_timer(&v->poll_timer, new_p);
+        migrate_timer(&v->evtchn_coalesce_timer, new_p);
 
         lock = vcpu_schedule_lock_irq(v);
 
@@ -399,6 +529,7 @@ void sched_destroy_vcpu(struct vcpu *v)
     kill_timer(&v->periodic_timer);
     kill_timer(&v->singleshot_timer);
     kill_timer(&v->poll_timer);
+    kill_timer(&v->evtchn_coalesce_timer);
     if ( test_and_clear_bool(v->is_urgent) )
         atomic_dec(&per_cpu(schedule_data, v->processor).urgent_count);
     sched_remove_vcpu(vcpu_scheduler(v), v);
@@ -1397,6 +1528,96 @@ static void vcpu_periodic_timer_work(struct vcpu *v)
     set_timer(&v->periodic_timer, periodic_next_event);
 }
 
+/* The cpus which must run vcpus of the same domain as cpu. */
+static const cpumask_t *sched_gran_mask(unsigned int cpu)
+{
+    switch ( opt_sched_granularity )
+    {
+    case SCHED_GRAN_core:
+        return per_cpu(cpu_sibling_mask, cpu);
+    case SCHED_GRAN_socket:
+        return per_cpu(cpu_core_mask, cpu);
+    default:
+        return cpumask_of(cpu);
+    }
+}
+
+/* NULL if the granularity is cpu, and hence there is nothing to serialise. */
+static spinlock_t *sched_gran_lock(unsigned int cpu)
+{
+    unsigned int first;
+
+    if ( opt_sched_granularity == SCHED_GRAN_cpu )
+        return NULL;
+
+    /* The sibling masks may be empty while cpu is being brought up. */
+    first = cpumask_first(sched_gran_mask(cpu));
+    if ( first >= nr_cpu_ids )
+        first = cpu;
+
+    return &per_cpu(schedule_data, first).gran_lock;
+}
+
+/*
+ * Can a vcpu of d run on cpu, without any other cpu in the same core (or
+ * socket) running, or still switching away from, a vcpu of another domain?
+ *
+ * Schedulers must check this when picking the next vcpu to run. In
+ * schedule(), that happens with the granularity lock held, so the answer
+ * can't change before the pick is published in gran_dom. Anywhere else, it
+ * is just a hint.
+ */
+bool sched_gran_allowed(unsigned int cpu, const struct domain *d)
+{
+    unsigned int sibling;
+
+    if ( opt_sched_granularity == SCHED_GRAN_cpu || is_idle_domain(d) )
+        return true;
+
+    for_each_cpu ( sibling, sched_gran_mask(cpu) )
+    {
+        const struct schedule_data *sd = &per_cpu(schedule_data, sibling);
+
+        if ( sibling == cpu )
+            continue;
+
+        if ( (sd->gran_dom && sd->gran_dom != d) ||
+             (sd->gran_prev_dom && sd->gran_prev_dom != d) )
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * prev is now fully off cpu: the siblings which have been kept idle because
+ * of it may be able to run something.
+ */
+static void sched_gran_saved(unsigned int cpu, const struct vcpu *prev)
+{
+    struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+    spinlock_t *lock = sched_gran_lock(cpu);
+    unsigned int sibling;
+    unsigned long flags;
+    bool kick;
+
+    if ( !lock )
+        return;
+
+    spin_lock_irqsave(lock, flags);
+    kick = sd->gran_prev_dom == prev->domain;
+    if ( kick )
+        sd->gran_prev_dom = NULL;
+    spin_unlock_irqrestore(lock, flags);
+
+    if ( !kick )
+        return;
+
+    for_each_cpu ( sibling, sched_gran_mask(cpu) )
+        if ( sibling != cpu && is_idle_vcpu(curr_on_cpu(sibling)) )
+            cpu_raise_softirq(sibling, SCHEDULE_SOFTIRQ);
+}
+
 /*
  * The main function
  * - deschedule the current domain (scheduler independent).
@@ -1410,8 +1631,9 @@ static void schedule(void)
     unsigned long        *tasklet_work = &this_cpu(tasklet_work_to_do);
     bool_t                tasklet_work_scheduled = 0;
     struct schedule_data *sd;
-    spinlock_t           *lock;
+    spinlock_t           *lock, *gran_lock;
     struct task_slice     next_slice;
+    unsigned int          runq_len;
     int cpu = smp_processor_id();
 
     ASSERT_NOT_IN_ATOMIC();
@@ -1444,6 +1666,17 @@ static void schedule(void)
 
     stop_timer(&sd->s_timer);
 
+    runq_len = atomic_read(&sched_runq_len[cpu]);
+    sched_hist_add(XEN_SYSCTL_SCHED_HIST_runq_len, runq_len, runq_len);
+
+    /*
+     * The granularity lock makes the scheduler's sched_gran_allowed() checks
+     * and the update of gran_dom atomic with respect to the siblings.
+     */
+    gran_lock = sched_gran_lock(cpu);
+    if ( gran_lock )
+        spin_lock(gran_lock);
+
     /* get policy-specific decision on scheduling... */
     sched = this_cpu(scheduler);
     next_slice = sched->do_schedule(sched, now, tasklet_work_scheduled);
@@ -1452,6 +1685,15 @@ static void schedule(void)
 
     sd->curr = next;
 
+    if ( gran_lock )
+    {
+        sd->gran_dom = is_idle_vcpu(next) ? NULL : next->domain;
+        /* prev's state is on this cpu until context_saved(). */
+        if ( !is_idle_vcpu(prev) && prev->domain != next->domain )
+            sd->gran_prev_dom = prev->domain;
+        spin_unlock(gran_lock);
+    }
+
     if ( next_slice.time >= 0 ) /* -ve means no limit */
         set_timer(&sd->s_timer, now + next_slice.time);
 
@@ -1498,6 +1740,8 @@ static void schedule(void)
     ASSERT(!next->is_running);
     next->is_running = 1;
 
+    this_cpu(sched_stats).switch_start = now;
+
     pcpu_schedule_unlock_irq(lock, cpu);
 
     SCHED_STAT_CRANK(sched_ctx);
@@ -1524,6 +1768,15 @@ void context_saved(struct vcpu *prev)
 
     sched_context_saved(vcpu_scheduler(prev), prev);
 
+    sched_gran_saved(smp_processor_id(), prev);
+
+    if ( this_cpu(sched_stats).switch_start )
+    {
+        sched_hist_add_time(XEN_SYSCTL_SCHED_HIST_switch_cost,
+                            NOW() - this_cpu(sched_stats).switch_start);
+        this_cpu(sched_stats).switch_start = 0;
+    }
+
     vcpu_migrate_finish(prev);
 }
 
@@ -1568,6 +1821,9 @@ static int cpu_schedule_up(unsigned int cpu)
     sd->curr = idle_vcpu[cpu];
     init_timer(&sd->s_timer, s_timer_fn, NULL, cpu);
     atomic_set(&sd->urgent_count, 0);
+    spin_lock_init(&sd->gran_lock);
+    sd->gran_dom = NULL;
+    sd->gran_prev_dom = NULL;
 
     /* Boot CPU is dealt with later in schedule_init(). */
     if ( cpu == 0 )
@@ -1767,6 +2023,11 @@ void __init scheduler_init(void)
     register_cpu_notifier(&cpu_schedule_nfb);
 
     printk("Using scheduler: %s (%s)\n", ops.name, ops.opt_name);
+    if ( opt_sched_granularity != SCHED_GRAN_cpu &&
+         ops.sched_id != XEN_SCHEDULER_CREDIT &&
+         ops.sched_id != XEN_SCHEDULER_CREDIT2 )
+        printk(XENLOG_WARNING
+               "sched-gran is only honoured by credit and credit2\n");
     if ( sched_init(&ops) )
         panic("scheduler returned error on init\n");
 
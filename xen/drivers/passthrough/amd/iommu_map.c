@@ -35,15 +35,18 @@ static unsigned int pfn_to_pde_idx(unsigned long pfn, unsigned int level)
     return idx;
 }
 
-static unsigned int clear_iommu_pte_present(unsigned long l1_mfn,
-                                            unsigned long dfn)
+static unsigned int clear_iommu_pte_present(unsigned long pt_mfn,
+                                            unsigned long dfn,
+                                            unsigned int level,
+                                            struct amd_iommu_pte *old)
 {
     struct amd_iommu_pte *table, *pte;
     unsigned int flush_flags;
 
-    table = map_domain_page(_mfn(l1_mfn));
-    pte = &table[pfn_to_pde_idx(dfn, 1)];
+    table = map_domain_page(_mfn(pt_mfn));
+    pte = &table[pfn_to_pde_idx(dfn, level)];
 
+    *old = *pte;
     flush_flags = pte->pr ? IOMMU_FLUSHF_modified : 0;
     memset(pte, 0, sizeof(*pte));
 
@@ -85,7 +88,8 @@ static unsigned int set_iommu_pte_present(unsigned long pt_mfn,
                                           unsigned long dfn,
                                           unsigned long next_mfn,
                                           int pde_level,
-                                          bool iw, bool ir)
+                                          bool iw, bool ir,
+                                          struct amd_iommu_pte *old)
 {
     struct amd_iommu_pte *table, *pde;
     unsigned int flush_flags;
@@ -93,6 +97,8 @@ static unsigned int set_iommu_pte_present(unsigned long pt_mfn,
     table = map_domain_page(_mfn(pt_mfn));
     pde = &table[pfn_to_pde_idx(dfn, pde_level)];
 
+    if ( old )
+        *old = *pde;
     flush_flags = set_iommu_pde_present(pde, next_mfn, 0, iw, ir);
     unmap_domain_page(table);
 
@@ -159,12 +165,12 @@ void iommu_dte_set_guest_cr3(struct amd_iommu_dte *dte, uint16_t dom_id,
 #undef GCR3_MASK
 }
 
-/* Walk io page tables and build level page tables if necessary
- * {Re, un}mapping super page frames causes re-allocation of io
- * page tables.
+/* Walk io page tables down to the given level and build level page tables
+ * if necessary. {Re, un}mapping part of a super page frame causes it to be
+ * split, through re-allocation of io page tables.
  */
 static int iommu_pde_from_dfn(struct domain *d, unsigned long dfn,
-                              unsigned long pt_mfn[])
+                              unsigned int target, unsigned long pt_mfn[])
 {
     struct amd_iommu_pte *pde, *next_table_vaddr;
     unsigned long  next_table_mfn;
@@ -175,17 +181,17 @@ static int iommu_pde_from_dfn(struct domain *d, unsigned long dfn,
     table = hd->arch.root_table;
     level = hd->arch.paging_mode;
 
-    BUG_ON( table == NULL || level < 1 || level > 6 );
+    BUG_ON( table == NULL || level < target || level > 6 );
 
     next_table_mfn = mfn_x(page_to_mfn(table));
 
-    if ( level == 1 )
+    if ( level == target )
     {
         pt_mfn[level] = next_table_mfn;
         return 0;
     }
 
-    while ( level > 1 )
+    while ( level > target )
     {
         unsigned int next_level = level - 1;
         pt_mfn[level] = next_table_mfn;
@@ -197,11 +203,12 @@ static int iommu_pde_from_dfn(struct domain *d, unsigned long dfn,
         next_table_mfn = pde->mfn;
 
         /* Split super page frame into smaller pieces.*/
-        if ( pde->pr && !pde->next_level && next_table_mfn )
+        if ( pde->pr && !pde->next_level )
         {
             int i;
             unsigned long mfn, pfn;
             unsigned int page_sz;
+            bool iw = pde->iw, ir = pde->ir;
 
             page_sz = 1 << (PTE_PER_TABLE_SHIFT * (next_level - 1));
             pfn =  dfn & ~((1 << (PTE_PER_TABLE_SHIFT * next_level)) - 1);
@@ -217,17 +224,19 @@ static int iommu_pde_from_dfn(struct domain *d, unsigned long dfn,
             }
 
             next_table_mfn = mfn_x(page_to_mfn(table));
-            set_iommu_pde_present(pde, next_table_mfn, next_level, true,
-                                  true);
 
             for ( i = 0; i < PTE_PER_TABLE_SIZE; i++ )
             {
                 set_iommu_pte_present(next_table_mfn, pfn, mfn, next_level,
-                                      true, true);
+                                      iw, ir, NULL);
                 mfn += page_sz;
                 pfn += page_sz;
              }
 
+            /* Only hook up the table once it maps the same as the pde. */
+            set_iommu_pde_present(pde, next_table_mfn, next_level, true,
+                                  true);
+
             amd_iommu_flush_all_pages(d);
         }
 
@@ -258,7 +267,7 @@ static int iommu_pde_from_dfn(struct domain *d, unsigned long dfn,
         level--;
     }
 
-    /* mfn of level 1 page table */
+    /* mfn of the target level page table */
     pt_mfn[level] = next_table_mfn;
     return 0;
 }
@@ -357,13 +366,27 @@ static int update_paging_mode(struct domain *d, unsigned long dfn)
     return 0;
 }
 
+/*
+ * The last dfn the root table needs to cover for a mapping of the given order
+ * at dfn: a superpage at level N needs the root to be at level N at least.
+ */
+static unsigned long last_root_dfn(dfn_t dfn, unsigned int page_order)
+{
+    return dfn_x(dfn) | ((1ul << (page_order + PTE_PER_TABLE_SHIFT)) - 1);
+}
+
 int amd_iommu_map_page(struct domain *d, dfn_t dfn, mfn_t mfn,
-                       unsigned int flags, unsigned int *flush_flags)
+                       unsigned int page_order, unsigned int flags,
+                       unsigned int *flush_flags)
 {
     struct domain_iommu *hd = dom_iommu(d);
+    unsigned int level = page_order / PTE_PER_TABLE_SHIFT + 1;
+    struct amd_iommu_pte old;
     int rc;
     unsigned long pt_mfn[7];
 
+    ASSERT(!(page_order % PTE_PER_TABLE_SHIFT));
+
     if ( iommu_use_hap_pt(d) )
         return 0;
 
@@ -385,7 +408,7 @@ int amd_iommu_map_page(struct domain *d, dfn_t dfn, mfn_t mfn,
      * we might need a deeper page table for wider dfn now */
     if ( is_hvm_domain(d) )
     {
-        if ( update_paging_mode(d, dfn_x(dfn)) )
+        if ( update_paging_mode(d, last_root_dfn(dfn, page_order)) )
         {
             spin_unlock(&hd->arch.mapping_lock);
             AMD_IOMMU_DEBUG("Update page mode failed dfn = %"PRI_dfn"\n",
@@ -395,7 +418,8 @@ int amd_iommu_map_page(struct domain *d, dfn_t dfn, mfn_t mfn,
         }
     }
 
-    if ( iommu_pde_from_dfn(d, dfn_x(dfn), pt_mfn) || (pt_mfn[1] == 0) )
+    if ( iommu_pde_from_dfn(d, dfn_x(dfn), level, pt_mfn) ||
+         (pt_mfn[level] == 0) )
     {
         spin_unlock(&hd->arch.mapping_lock);
         AMD_IOMMU_DEBUG("Invalid IO pagetable entry dfn = %"PRI_dfn"\n",
@@ -404,21 +428,37 @@ int amd_iommu_map_page(struct domain *d, dfn_t dfn, mfn_t mfn,
         return -EFAULT;
     }
 
-    /* Install 4k mapping */
-    *flush_flags |= set_iommu_pte_present(pt_mfn[1], dfn_x(dfn), mfn_x(mfn),
-                                          1, (flags & IOMMUF_writable),
-                                          (flags & IOMMUF_readable));
+    /* Install 4k or super page mapping */
+    *flush_flags |= set_iommu_pte_present(pt_mfn[level], dfn_x(dfn),
+                                          mfn_x(mfn), level,
+                                          (flags & IOMMUF_writable),
+                                          (flags & IOMMUF_readable), &old);
 
     spin_unlock(&hd->arch.mapping_lock);
 
+    /*
+     * The super page took the place of a page table, which may only be
+     * freed once the IOMMU can't use it anymore.
+     */
+    if ( old.pr && old.next_level )
+    {
+        amd_iommu_flush_all_pages(d);
+        iommu_queue_free_pgtable(mfn_to_page(_mfn(old.mfn)), old.next_level);
+    }
+
     return 0;
 }
 
 int amd_iommu_unmap_page(struct domain *d, dfn_t dfn,
+                         unsigned int page_order,
                          unsigned int *flush_flags)
 {
     unsigned long pt_mfn[7];
     struct domain_iommu *hd = dom_iommu(d);
+    unsigned int level = page_order / PTE_PER_TABLE_SHIFT + 1;
+    struct amd_iommu_pte old;
+
+    ASSERT(!(page_order % PTE_PER_TABLE_SHIFT));
 
     if ( iommu_use_hap_pt(d) )
         return 0;
@@ -437,7 +477,7 @@ int amd_iommu_unmap_page(struct domain *d, dfn_t dfn,
      * we might need a deeper page table for lager dfn now */
     if ( is_hvm_domain(d) )
     {
-        int rc = update_paging_mode(d, dfn_x(dfn));
+        int rc = update_paging_mode(d, last_root_dfn(dfn, page_order));
 
         if ( rc )
         {
@@ -450,7 +490,8 @@ int amd_iommu_unmap_page(struct domain *d, dfn_t dfn,
         }
     }
 
-    if ( iommu_pde_from_dfn(d, dfn_x(dfn), pt_mfn) || (pt_mfn[1] == 0) )
+    if ( iommu_pde_from_dfn(d, dfn_x(dfn), level, pt_mfn) ||
+         (pt_mfn[level] == 0) )
     {
         spin_unlock(&hd->arch.mapping_lock);
         AMD_IOMMU_DEBUG("Invalid IO pagetable entry dfn = %"PRI_dfn"\n",
@@ -460,10 +501,18 @@ int amd_iommu_unmap_page(struct domain *d, dfn_t dfn,
     }
 
     /* mark PTE as 'page not present' */
-    *flush_flags |= clear_iommu_pte_present(pt_mfn[1], dfn_x(dfn));
+    *flush_flags |= clear_iommu_pte_present(pt_mfn[level], dfn_x(dfn), level,
+                                            &old);
 
     spin_unlock(&hd->arch.mapping_lock);
 
+    /* A page table unhooked may only be freed once the IOMMU can't use it. */
+    if ( old.pr && old.next_level )
+    {
+        amd_iommu_flush_all_pages(d);
+        iommu_queue_free_pgtable(mfn_to_page(_mfn(old.mfn)), old.next_level);
+    }
+
     return 0;
 }
 
@@ -543,7 +592,7 @@ int amd_iommu_reserve_domain_unity_map(struct domain *domain,
     {
         unsigned long frame = gfn + i;
 
-        rt = amd_iommu_map_page(domain, _dfn(frame), _mfn(frame), flags,
+        rt = amd_iommu_map_page(domain, _dfn(frame), _mfn(frame), 0, flags,
                                 &flush_flags);
         if ( rt != 0 )
             break;
@@ -2735,7 +2735,8 @@ static void arm_smmu_iommu_domain_teardown(struct domain *d)
 }
 
 static int __must_check arm_smmu_map_page(struct domain *d, dfn_t dfn,
-					  mfn_t mfn, unsigned int flags,
+					  mfn_t mfn, unsigned int page_order,
+					  unsigned int flags,
 					  unsigned int *flush_flags)
 {
 	p2m_type_t t;
@@ -2762,10 +2763,11 @@ static int __must_check arm_smmu_map_page(struct domain *d, dfn_t dfn,
 	 * if there is already one...
 	 */
 	return guest_physmap_add_entry(d, _gfn(dfn_x(dfn)), _mfn(dfn_x(dfn)),
-				       0, t);
+				       page_order, t);
 }
 
 static int __must_check arm_smmu_unmap_page(struct domain *d, dfn_t dfn,
+                                            unsigned int page_order,
                                             unsigned int *flush_flags)
 {
 	/*
@@ -2775,7 +2777,8 @@ static int __must_check arm_smmu_unmap_page(struct domain *d, dfn_t dfn,
 	if ( !is_domain_direct_mapped(d) )
 		return -EINVAL;
 
-	return guest_physmap_remove_page(d, _gfn(dfn_x(dfn)), _mfn(dfn_x(dfn)), 0);
+	return guest_physmap_remove_page(d, _gfn(dfn_x(dfn)), _mfn(dfn_x(dfn)),
+					 page_order);
 }
 
 static const struct iommu_ops arm_smmu_iommu_ops = {
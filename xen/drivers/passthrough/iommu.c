@@ -288,24 +288,47 @@ void iommu_domain_destroy(struct domain *d)
     arch_iommu_domain_destroy(d);
 }
 
-int iommu_map(struct domain *d, dfn_t dfn, mfn_t mfn,
-              unsigned int page_order, unsigned int flags,
-              unsigned int *flush_flags)
+/*
+ * Return the largest order the IOMMU can (un)map dfn (and mfn, if any) with,
+ * without going beyond the nr pages left.
+ */
+static unsigned int iommu_chunk_order(const struct domain_iommu *hd,
+                                      unsigned long dfn, unsigned long mfn,
+                                      unsigned long nr)
+{
+    unsigned int orders = hd->platform_ops->page_orders, order = 0;
+
+    while ( orders )
+    {
+        unsigned int next = find_first_set_bit(orders);
+
+        if ( ((dfn | mfn) & ((1ul << next) - 1)) || nr < (1ul << next) )
+            break;
+
+        order = next;
+        orders &= orders - 1;
+    }
+
+    return order;
+}
+
+int iommu_map_range(struct domain *d, dfn_t dfn, mfn_t mfn, unsigned long nr,
+                    unsigned int flags, unsigned int *flush_flags)
 {
     const struct domain_iommu *hd = dom_iommu(d);
     unsigned long i;
+    unsigned int order;
     int rc = 0;
 
     if ( !iommu_enabled || !hd->platform_ops )
         return 0;
 
-    ASSERT(IS_ALIGNED(dfn_x(dfn), (1ul << page_order)));
-    ASSERT(IS_ALIGNED(mfn_x(mfn), (1ul << page_order)));
-
-    for ( i = 0; i < (1ul << page_order); i++ )
+    for ( i = 0; i < nr; i += 1ul << order )
     {
+        order = iommu_chunk_order(hd, dfn_x(dfn) + i, mfn_x(mfn) + i, nr - i);
+
         rc = iommu_call(hd->platform_ops, map_page, d, dfn_add(dfn, i),
-                        mfn_add(mfn, i), flags, flush_flags);
+                        mfn_add(mfn, i), order, flags, flush_flags);
 
         if ( likely(!rc) )
             continue;
@@ -316,11 +339,9 @@ int iommu_map(struct domain *d, dfn_t dfn, mfn_t mfn,
                    d->domain_id, dfn_x(dfn_add(dfn, i)),
                    mfn_x(mfn_add(mfn, i)), rc);
 
-        while ( i-- )
-            /* if statement to satisfy __must_check */
-            if ( iommu_call(hd->platform_ops, unmap_page, d, dfn_add(dfn, i),
-                            flush_flags) )
-                continue;
+        /* Use while-break to avoid compiler warning */
+        while ( i && iommu_unmap_range(d, dfn, i, flush_flags) )
+            break;
 
         if ( !is_hardware_domain(d) )
             domain_crash(d);
@@ -331,6 +352,17 @@ int iommu_map(struct domain *d, dfn_t dfn, mfn_t mfn,
     return rc;
 }
 
+int iommu_map(struct domain *d, dfn_t dfn, mfn_t mfn,
+              unsigned int page_order, unsigned int flags,
+              unsigned int *flush_flags)
+{
+    ASSERT(IS_ALIGNED(dfn_x(dfn), (1ul << page_order)));
+    ASSERT(IS_ALIGNED(mfn_x(mfn), (1ul << page_order)));
+
+    return iommu_map_range(d, dfn, mfn, 1ul << page_order, flags,
+                           flush_flags);
+}
+
 int iommu_legacy_map(struct domain *d, dfn_t dfn, mfn_t mfn,
                      unsigned int page_order, unsigned int flags)
 {
@@ -349,22 +381,25 @@ int iommu_legacy_map(struct domain *d, dfn_t dfn, mfn_t mfn,
     return rc;
 }
 
-int iommu_unmap(struct domain *d, dfn_t dfn, unsigned int page_order,
-                unsigned int *flush_flags)
+int iommu_unmap_range(struct domain *d, dfn_t dfn, unsigned long nr,
+                      unsigned int *flush_flags)
 {
     const struct domain_iommu *hd = dom_iommu(d);
     unsigned long i;
+    unsigned int order;
     int rc = 0;
 
     if ( !iommu_enabled || !hd->platform_ops )
         return 0;
 
-    ASSERT(IS_ALIGNED(dfn_x(dfn), (1ul << page_order)));
-
-    for ( i = 0; i < (1ul << page_order); i++ )
+    for ( i = 0; i < nr; i += 1ul << order )
     {
-        int err = iommu_call(hd->platform_ops, unmap_page, d, dfn_add(dfn, i),
-                             flush_flags);
+        int err;
+
+        order = iommu_chunk_order(hd, dfn_x(dfn) + i, 0, nr - i);
+
+        err = iommu_call(hd->platform_ops, unmap_page, d, dfn_add(dfn, i),
+                         order, flush_flags);
 
         if ( likely(!err) )
             continue;
@@ -387,6 +422,14 @@ int iommu_unmap(struct domain *d, dfn_t dfn, unsigned int page_order,
     return rc;
 }
 
+int iommu_unmap(struct domain *d, dfn_t dfn, unsigned int page_order,
+                unsigned int *flush_flags)
+{
+    ASSERT(IS_ALIGNED(dfn_x(dfn), (1ul << page_order)));
+
+    return iommu_unmap_range(d, dfn, 1ul << page_order, flush_flags);
+}
+
 int iommu_legacy_unmap(struct domain *d, dfn_t dfn, unsigned int page_order)
 {
     unsigned int flush_flags = 0;
@@ -415,6 +458,22 @@ int iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
     return iommu_call(hd->platform_ops, lookup_page, d, dfn, mfn, flags);
 }
 
+/*
+ * Free a page table which was unhooked from a live domain's IOMMU page tables,
+ * with the IOTLB flushed since.  The free_page_table hook gets the table's
+ * level through PFN_ORDER(), for it to also free the tables below.
+ */
+void iommu_queue_free_pgtable(struct page_info *pg, unsigned int level)
+{
+    PFN_ORDER(pg) = level;
+
+    spin_lock(&iommu_pt_cleanup_lock);
+    page_list_add_tail(pg, &iommu_pt_cleanup_list);
+    spin_unlock(&iommu_pt_cleanup_lock);
+
+    tasklet_schedule(&iommu_pt_cleanup_tasklet);
+}
+
 static void iommu_free_pagetables(unsigned long unused)
 {
     do {
@@ -249,19 +249,63 @@ static u64 bus_to_context_maddr(struct iommu *iommu, u8 bus)
     return maddr;
 }
 
-static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
+/*
+ * Replace the superpage mapping at *pte, a level @level entry, by a table
+ * holding the equivalent next level mappings.  Returns the table's maddr,
+ * or 0 if it couldn't be allocated.
+ */
+static u64 dma_pte_split(struct acpi_drhd_unit *drhd, struct dma_pte *pte,
+                         unsigned int level)
+{
+    u64 maddr = alloc_pgtable_maddr(drhd, 1);
+    u64 inc = 1ULL << level_to_offset_bits(level - 1);
+    struct dma_pte *table;
+    unsigned int i;
+
+    if ( !maddr )
+        return 0;
+
+    table = map_vtd_domain_page(maddr);
+    for ( i = 0; i < PTE_NUM; i++ )
+    {
+        table[i].val = (pte->val & ~(PADDR_MASK & PAGE_MASK_4K)) |
+                       (dma_pte_addr(*pte) + i * inc);
+        if ( level == 2 )
+            table[i].val &= ~DMA_PTE_SP;
+    }
+    iommu_flush_cache_page(table, 1);
+    unmap_vtd_domain_page(table);
+
+    dma_clear_pte(*pte);
+    dma_set_pte_addr(*pte, maddr);
+    dma_set_pte_readable(*pte);
+    dma_set_pte_writable(*pte);
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+
+    return maddr;
+}
+
+/*
+ * Return the maddr of the level *target page table covering addr.  With
+ * alloc, missing tables get allocated, and superpages above *target get
+ * split.  Without, the walk stops at whatever maps addr: 0 is returned if
+ * nothing does, and *target gets raised if a superpage does.
+ */
+static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr,
+                                  unsigned int *target, int alloc)
 {
     struct acpi_drhd_unit *drhd;
     struct pci_dev *pdev;
     struct domain_iommu *hd = dom_iommu(domain);
     int addr_width = agaw_to_width(hd->arch.agaw);
     struct dma_pte *parent, *pte = NULL;
-    int level = agaw_to_level(hd->arch.agaw);
+    unsigned int level = agaw_to_level(hd->arch.agaw);
     int offset;
-    u64 pte_maddr = 0;
+    u64 table_maddr, pte_maddr = 0;
 
     addr &= (((u64)1) << addr_width) - 1;
     ASSERT(spin_is_locked(&hd->arch.mapping_lock));
+    ASSERT(*target >= 1 && *target <= level);
     if ( hd->arch.pgd_maddr == 0 )
     {
         /*
@@ -271,49 +315,64 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
         pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
         drhd = acpi_find_matched_drhd_unit(pdev);
         if ( !alloc || ((hd->arch.pgd_maddr = alloc_pgtable_maddr(drhd, 1)) == 0) )
-            goto out;
+            return 0;
     }
 
-    parent = (struct dma_pte *)map_vtd_domain_page(hd->arch.pgd_maddr);
-    while ( level > 1 )
+    table_maddr = hd->arch.pgd_maddr;
+    parent = (struct dma_pte *)map_vtd_domain_page(table_maddr);
+    while ( level > *target )
     {
         offset = address_level_offset(addr, level);
         pte = &parent[offset];
 
         pte_maddr = dma_pte_addr(*pte);
-        if ( !pte_maddr )
+        if ( dma_pte_superpage(*pte) )
         {
             if ( !alloc )
+            {
+                *target = level;
                 break;
+            }
 
             pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
             drhd = acpi_find_matched_drhd_unit(pdev);
-            pte_maddr = alloc_pgtable_maddr(drhd, 1);
-            if ( !pte_maddr )
+            pte_maddr = dma_pte_split(drhd, pte, level);
+        }
+        else if ( !pte_maddr )
+        {
+            if ( !alloc )
+            {
+                table_maddr = 0;
                 break;
+            }
 
-            dma_set_pte_addr(*pte, pte_maddr);
+            pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
+            drhd = acpi_find_matched_drhd_unit(pdev);
+            pte_maddr = alloc_pgtable_maddr(drhd, 1);
+            if ( pte_maddr )
+            {
+                dma_set_pte_addr(*pte, pte_maddr);
 
-            /*
-             * high level table always sets r/w, last level
-             * page table control read/write
-             */
-            dma_set_pte_readable(*pte);
-            dma_set_pte_writable(*pte);
-            iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+                /*
+                 * high level table always sets r/w, last level
+                 * page table control read/write
+                 */
+                dma_set_pte_readable(*pte);
+                dma_set_pte_writable(*pte);
+                iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+            }
         }
 
-        if ( level == 2 )
+        table_maddr = pte_maddr;
+        if ( !table_maddr || --level == *target )
             break;
 
         unmap_vtd_domain_page(parent);
-        parent = map_vtd_domain_page(pte_maddr);
-        level--;
+        parent = map_vtd_domain_page(table_maddr);
     }
 
     unmap_vtd_domain_page(parent);
- out:
-    return pte_maddr;
+    return table_maddr;
 }
 
 static void iommu_flush_write_buffer(struct iommu *iommu)
@@ -648,18 +707,31 @@ static int __must_check iommu_flush_iotlb_all(struct domain *d)
     return iommu_flush_iotlb(d, INVALID_DFN, 0, 0);
 }
 
-/* clear one page's page table */
+/* clear the page table entry mapping 2^order pages at addr */
 static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr,
+                                          unsigned int order,
                                           unsigned int *flush_flags)
 {
     struct domain_iommu *hd = dom_iommu(domain);
-    struct dma_pte *page = NULL, *pte = NULL;
+    struct dma_pte *page = NULL, *pte = NULL, old;
+    unsigned int level = order / LEVEL_STRIDE + 1, found = level;
     u64 pg_maddr;
     int rc = 0;
 
     spin_lock(&hd->arch.mapping_lock);
-    /* get last level pte */
-    pg_maddr = addr_to_dma_page_maddr(domain, addr, 0);
+    pg_maddr = addr_to_dma_page_maddr(domain, addr, &found, 0);
+
+    /* Only part of a superpage is going away: split it. */
+    if ( pg_maddr && found > level )
+    {
+        pg_maddr = addr_to_dma_page_maddr(domain, addr, &level, 1);
+        if ( !pg_maddr )
+        {
+            spin_unlock(&hd->arch.mapping_lock);
+            return -ENOMEM;
+        }
+    }
+
     if ( pg_maddr == 0 )
     {
         spin_unlock(&hd->arch.mapping_lock);
@@ -667,7 +739,7 @@ static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr,
     }
 
     page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + address_level_offset(addr, 1);
+    pte = page + address_level_offset(addr, level);
 
     if ( !dma_pte_present(*pte) )
     {
@@ -676,6 +748,7 @@ static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr,
         return 0;
     }
 
+    old = *pte;
     dma_clear_pte(*pte);
     *flush_flags |= IOMMU_FLUSHF_modified;
 
@@ -684,6 +757,15 @@ static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr,
 
     unmap_vtd_domain_page(page);
 
+    /* A page table unhooked may only be freed once the IOMMU can't use it. */
+    if ( level > 1 && !dma_pte_superpage(old) )
+    {
+        rc = iommu_flush_iotlb_all(domain);
+        if ( !rc )
+            iommu_queue_free_pgtable(maddr_to_page(dma_pte_addr(old)),
+                                     level - 1);
+    }
+
     return rc;
 }
 
@@ -715,7 +797,7 @@ static void iommu_free_page_table(struct page_info *pg)
         if ( !dma_pte_present(*pte) )
             continue;
 
-        if ( next_level >= 1 )
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             iommu_free_pagetable(dma_pte_addr(*pte), next_level);
 
         dma_clear_pte(*pte);
@@ -1403,7 +1485,9 @@ int domain_context_mapping_one(
         /* Ensure we have pagetables allocated down to leaf PTE. */
         if ( hd->arch.pgd_maddr == 0 )
         {
-            addr_to_dma_page_maddr(domain, 0, 1);
+            unsigned int level = 1;
+
+            addr_to_dma_page_maddr(domain, 0, &level, 1);
             if ( hd->arch.pgd_maddr == 0 )
             {
             nomem:
@@ -1777,14 +1861,19 @@ static void iommu_domain_teardown(struct domain *d)
 }
 
 static int __must_check intel_iommu_map_page(struct domain *d, dfn_t dfn,
-                                             mfn_t mfn, unsigned int flags,
+                                             mfn_t mfn,
+                                             unsigned int page_order,
+                                             unsigned int flags,
                                              unsigned int *flush_flags)
 {
     struct domain_iommu *hd = dom_iommu(d);
     struct dma_pte *page, *pte, old, new = {};
+    unsigned int level = page_order / LEVEL_STRIDE + 1;
     u64 pg_maddr;
     int rc = 0;
 
+    ASSERT(!(page_order % LEVEL_STRIDE));
+
     /* Do nothing if VT-d shares EPT page table */
     if ( iommu_use_hap_pt(d) )
         return 0;
@@ -1795,7 +1884,7 @@ static int __must_check intel_iommu_map_page(struct domain *d, dfn_t dfn,
 
     spin_lock(&hd->arch.mapping_lock);
 
-    pg_maddr = addr_to_dma_page_maddr(d, dfn_to_daddr(dfn), 1);
+    pg_maddr = addr_to_dma_page_maddr(d, dfn_to_daddr(dfn), &level, 1);
     if ( !pg_maddr )
     {
         spin_unlock(&hd->arch.mapping_lock);
@@ -1803,13 +1892,15 @@ static int __must_check intel_iommu_map_page(struct domain *d, dfn_t dfn,
     }
 
     page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = &page[dfn_x(dfn) & LEVEL_MASK];
+    pte = &page[address_level_offset(dfn_to_daddr(dfn), level)];
     old = *pte;
 
     dma_set_pte_addr(new, mfn_to_maddr(mfn));
     dma_set_pte_prot(new,
                      ((flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
                      ((flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+    if ( level > 1 )
+        dma_set_pte_superpage(new);
 
     /* Set the SNP on leaf page table if Snoop Control available */
     if ( iommu_snoop )
@@ -1830,12 +1921,27 @@ static int __must_check intel_iommu_map_page(struct domain *d, dfn_t dfn,
 
     *flush_flags |= IOMMU_FLUSHF_added;
     if ( dma_pte_present(old) )
+    {
         *flush_flags |= IOMMU_FLUSHF_modified;
 
+        /*
+         * The superpage took the place of a page table, which may only be
+         * freed once the IOMMU can't use it anymore.
+         */
+        if ( level > 1 && !dma_pte_superpage(old) )
+        {
+            rc = iommu_flush_iotlb_all(d);
+            if ( !rc )
+                iommu_queue_free_pgtable(maddr_to_page(dma_pte_addr(old)),
+                                         level - 1);
+        }
+    }
+
     return rc;
 }
 
 static int __must_check intel_iommu_unmap_page(struct domain *d, dfn_t dfn,
+                                               unsigned int page_order,
                                                unsigned int *flush_flags)
 {
     /* Do nothing if VT-d shares EPT page table */
@@ -1846,7 +1952,7 @@ static int __must_check intel_iommu_unmap_page(struct domain *d, dfn_t dfn,
     if ( iommu_hwdom_passthrough && is_hardware_domain(d) )
         return 0;
 
-    return dma_pte_clear_one(d, dfn_to_daddr(dfn), flush_flags);
+    return dma_pte_clear_one(d, dfn_to_daddr(dfn), page_order, flush_flags);
 }
 
 static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
@@ -1854,6 +1960,7 @@ static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
 {
     struct domain_iommu *hd = dom_iommu(d);
     struct dma_pte *page, val;
+    unsigned int level = 1;
     u64 pg_maddr;
 
     /*
@@ -1866,7 +1973,7 @@ static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
 
     spin_lock(&hd->arch.mapping_lock);
 
-    pg_maddr = addr_to_dma_page_maddr(d, dfn_to_daddr(dfn), 0);
+    pg_maddr = addr_to_dma_page_maddr(d, dfn_to_daddr(dfn), &level, 0);
     if ( !pg_maddr )
     {
         spin_unlock(&hd->arch.mapping_lock);
@@ -1874,7 +1981,7 @@ static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
     }
 
     page = map_vtd_domain_page(pg_maddr);
-    val = page[dfn_x(dfn) & LEVEL_MASK];
+    val = page[address_level_offset(dfn_to_daddr(dfn), level)];
 
     unmap_vtd_domain_page(page);
     spin_unlock(&hd->arch.mapping_lock);
@@ -1882,7 +1989,8 @@ static int intel_iommu_lookup_page(struct domain *d, dfn_t dfn, mfn_t *mfn,
     if ( !dma_pte_present(val) )
         return -ENOENT;
 
-    *mfn = maddr_to_mfn(dma_pte_addr(val));
+    *mfn = mfn_add(maddr_to_mfn(dma_pte_addr(val)),
+                   dfn_x(dfn) & ((1ul << ((level - 1) * LEVEL_STRIDE)) - 1));
     *flags = dma_pte_read(val) ? IOMMUF_readable : 0;
     *flags |= dma_pte_write(val) ? IOMMUF_writable : 0;
 
@@ -2323,6 +2431,11 @@ static int __init vtd_setup(void)
 
         printk(".\n");
 
+        if ( !cap_sps_2mb(iommu->cap) )
+            iommu_ops.page_orders &= ~(1U << PAGE_ORDER_2M);
+        if ( !cap_sps_1gb(iommu->cap) )
+            iommu_ops.page_orders &= ~(1U << PAGE_ORDER_1G);
+
         if ( iommu_snoop && !ecap_snp_ctl(iommu->ecap) )
             iommu_snoop = 0;
 
@@ -2679,9 +2792,15 @@ static void vtd_dump_p2m_table_level(paddr_t pt_maddr, int level, paddr_t gpa,
             continue;
 
         address = gpa + offset_level_address(i, level);
-        if ( next_level >= 1 ) 
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             vtd_dump_p2m_table_level(dma_pte_addr(*pte), next_level, 
                                      address, indent + 1);
+        else if ( next_level >= 1 )
+            printk("%*sdfn: %08lx mfn: %08lx order: %u\n",
+                   indent, "",
+                   (unsigned long)(address >> PAGE_SHIFT_4K),
+                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K),
+                   next_level * LEVEL_STRIDE);
         else
             printk("%*sdfn: %08lx mfn: %08lx\n",
                    indent, "",
@@ -2712,6 +2831,7 @@ const struct iommu_ops __initconstrel intel_iommu_ops = {
     .remove_device = intel_iommu_remove_device,
     .assign_device  = intel_iommu_assign_device,
     .teardown = iommu_domain_teardown,
+    .page_orders = (1U << PAGE_ORDER_2M) | (1U << PAGE_ORDER_1G),
     .map_page = intel_iommu_map_page,
     .unmap_page = intel_iommu_unmap_page,
     .lookup_page = intel_iommu_lookup_page,
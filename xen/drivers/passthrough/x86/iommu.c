@@ -256,7 +256,7 @@ static bool __hwdom_init hwdom_iommu_map(const struct domain *d,
 
 void __hwdom_init arch_iommu_hwdom_init(struct domain *d)
 {
-    unsigned long i, top, max_pfn;
+    unsigned long i, top, max_pfn, start = 0, nr = 0;
     unsigned int flush_flags = 0;
 
     BUG_ON(!is_hardware_domain(d));
@@ -284,19 +284,34 @@ void __hwdom_init arch_iommu_hwdom_init(struct domain *d)
     max_pfn = (GB(4) >> PAGE_SHIFT) - 1;
     top = max(max_pdx, pfn_to_pdx(max_pfn) + 1);
 
-    for ( i = 0; i < top; i++ )
+    for ( i = 0; i <= top; i++ )
     {
         unsigned long pfn = pdx_to_pfn(i);
-        int rc;
-
-        if ( !hwdom_iommu_map(d, pfn, max_pfn) )
-            continue;
+        bool map = i < top && hwdom_iommu_map(d, pfn, max_pfn);
+        int rc = 0;
 
         if ( paging_mode_translate(d) )
-            rc = set_identity_p2m_entry(d, pfn, p2m_access_rw, 0);
+        {
+            if ( map )
+                rc = set_identity_p2m_entry(d, pfn, p2m_access_rw, 0);
+        }
+        /*
+         * Batch up runs of contiguous frames, for the IOMMU to be able to
+         * use superpages.  Cut them at 1G boundaries, to bound the time
+         * spent without processing softirqs.
+         */
+        else if ( map && nr && pfn == start + nr &&
+                  (pfn & ((1ul << PAGE_ORDER_1G) - 1)) )
+            nr++;
         else
-            rc = iommu_map(d, _dfn(pfn), _mfn(pfn), PAGE_ORDER_4K,
-                           IOMMUF_readable | IOMMUF_writable, &flush_flags);
+        {
+            if ( nr )
+                rc = iommu_map_range(d, _dfn(start), _mfn(start), nr,
+                                     IOMMUF_readable | IOMMUF_writable,
+                                     &flush_flags);
+            start = pfn;
+            nr = map;
+        }
 
         if ( rc )
             printk(XENLOG_WARNING " d%d: IOMMU mapping failed: %d\n",
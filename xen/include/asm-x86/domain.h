@@ -168,12 +168,22 @@ struct hap_domain {
 /************************************************/
 /*       common paging data structure           */
 /************************************************/
+struct dirty_ring;
+
 struct log_dirty_domain {
     /* log-dirty radix tree to record dirty pages */
     mfn_t          top;
     unsigned int   allocs;
     unsigned int   failed_allocs;
 
+    /*
+     * In ring mode, dirty pages not logged by one of the domain's vCPUs
+     * (which have a ring each).  Protected by the paging lock.
+     */
+    struct dirty_ring *ring;
+    /* GFNs were harvested from the rings since the last clean. */
+    bool           ring_harvested;
+
     /* log-dirty mode stats */
     unsigned int   fault_count;
     unsigned int   dirty_count;
@@ -233,6 +243,9 @@ struct paging_vcpu {
     struct shadow_vtlb *vtlb;
     spinlock_t          vtlb_lock;
 
+    /* Log-dirty ring mode: pages dirtied by this vCPU. */
+    struct dirty_ring  *dirty_ring;
+
     /* paging support extension */
     struct shadow_vcpu shadow;
 };
@@ -256,6 +256,10 @@ struct p2m_domain {
     void               (*enable_hardware_log_dirty)(struct p2m_domain *p2m);
     void               (*disable_hardware_log_dirty)(struct p2m_domain *p2m);
     void               (*flush_hardware_cached_dirty)(struct p2m_domain *p2m);
+    bool               (*harvest_hardware_dirty)(struct p2m_domain *p2m,
+                                                 unsigned long first_gfn,
+                                                 unsigned long last_gfn,
+                                                 unsigned long *bitmap);
     void               (*change_entry_type_global)(struct p2m_domain *p2m,
                                                    p2m_type_t ot,
                                                    p2m_type_t nt);
@@ -617,6 +621,10 @@ void p2m_disable_hardware_log_dirty(struct domain *d);
 /* Flush hardware cached dirty GFNs */
 void p2m_flush_hardware_cached_dirty(struct domain *d);
 
+/* Harvest and reset hardware dirty state over a GFN range */
+bool p2m_harvest_hardware_dirty(struct domain *d, unsigned long first_gfn,
+                                unsigned long last_gfn, unsigned long *bitmap);
+
 /* Change types across all p2m entries in a domain */
 void p2m_change_entry_type_global(struct domain *d, 
                                   p2m_type_t ot, p2m_type_t nt);
@@ -38,7 +38,7 @@
 #include "hvm/save.h"
 #include "memory.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x00000011
+#define XEN_DOMCTL_INTERFACE_VERSION 0x00000012
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -172,6 +172,16 @@ struct xen_domctl_getpageframeinfo3 {
 #define XEN_DOMCTL_SHADOW_OP_CLEAN       11
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
+ /*
+  * Return up to pages of the GFNs logged in dirty rings, as an array of
+  * uint64 in dirty_bitmap.  pages is updated with the number returned, and
+  * stats.dirty_count with the number of pages which were logged in the
+  * bitmap instead (for OP_CLEAN to return), as a ring was full.  GFNs which
+  * did not fit are returned by the next HARVEST.  The call which empties the
+  * rings cleans for next round, unless stats.dirty_count is non-zero: the
+  * OP_CLEAN returning those pages then does.
+  */
+#define XEN_DOMCTL_SHADOW_OP_HARVEST     13
 
 /* Memory allocation accessors. */
 #define XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION   30
@@ -209,13 +219,22 @@ struct xen_domctl_getpageframeinfo3 {
   */
 #define XEN_DOMCTL_SHADOW_ENABLE_EXTERNAL  (1 << 4)
 
-/* Mode flags for XEN_DOMCTL_SHADOW_OP_{CLEAN,PEEK}. */
+/* Mode flags for XEN_DOMCTL_SHADOW_OP_{CLEAN,PEEK,HARVEST}. */
  /*
   * This is the final iteration: Requesting to include pages mapped
   * writably by the hypervisor in the dirty bitmap.
   */
 #define XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL   (1 << 0)
 
+/* Mode flags for XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY. */
+ /*
+  * Log dirtied pages in rings, one per vCPU, rather than the bitmap, for
+  * OP_HARVEST to return.  The cost of logging and harvesting then scales
+  * with the number of pages dirtied, not with the size of the guest.
+  * HAP guests only.
+  */
+#define XEN_DOMCTL_SHADOW_LOGDIRTY_RING    (1 << 1)
+
 struct xen_domctl_shadow_op_stats {
     uint32_t fault_count;
     uint32_t dirty_count;
@@ -226,13 +245,14 @@ struct xen_domctl_shadow_op {
     uint32_t       op;       /* XEN_DOMCTL_SHADOW_OP_* */
 
     /* OP_ENABLE: XEN_DOMCTL_SHADOW_ENABLE_* */
-    /* OP_PEAK / OP_CLEAN: XEN_DOMCTL_SHADOW_LOGDIRTY_* */
+    /* OP_PEAK / OP_CLEAN / OP_HARVEST / OP_ENABLE_LOGDIRTY: */
+    /*   XEN_DOMCTL_SHADOW_LOGDIRTY_* */
     uint32_t       mode;
 
     /* OP_GET_ALLOCATION / OP_SET_ALLOCATION */
     uint32_t       mb;       /* Shadow memory allocation in MB */
 
-    /* OP_PEEK / OP_CLEAN */
+    /* OP_PEEK / OP_CLEAN / OP_HARVEST */
     XEN_GUEST_HANDLE_64(uint8) dirty_bitmap;
     uint64_aligned_t pages; /* Size of buffer. Updated with actual size. */
     struct xen_domctl_shadow_op_stats stats;
@@ -264,6 +284,7 @@ struct xen_domctl_getvcpuinfo {
     uint8_t  running;                 /* currently scheduled on its CPU? */
     uint64_aligned_t cpu_time;        /* total cpu time consumed (ns) */
     uint32_t cpu;                     /* current mapping   */
+    uint64_aligned_t runnable_time;   /* total time waiting to run (ns) */
 };
 
 
@@ -74,6 +74,8 @@
 #define EVTCHNOP_init_control    11
 #define EVTCHNOP_expand_array    12
 #define EVTCHNOP_set_priority    13
+#define EVTCHNOP_send_batch      14
+#define EVTCHNOP_set_coalescing  15
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -312,6 +314,48 @@ struct evtchn_set_priority {
 };
 typedef struct evtchn_set_priority evtchn_set_priority_t;
 
+/*
+ * EVTCHNOP_send_batch: Send an event to the remote end of each of the
+ * channels whose local endpoints are listed in <ports>, as EVTCHNOP_send
+ * would do for each of them.
+ * NOTES:
+ *  1. Ports are processed in order, stopping at the first failing one, whose
+ *     error is returned.  <nr_sent> is the number of ports processed before.
+ *  2. Hypervisors not supporting this operation fail it with -ENOSYS or
+ *     -EOPNOTSUPP, in which case EVTCHNOP_send should be used instead.
+ */
+#define EVTCHN_SEND_BATCH_MAX 64
+struct evtchn_send_batch {
+    /* IN parameters. */
+    uint32_t nr_ports;
+    /* OUT parameters. */
+    uint32_t nr_sent;
+    /* IN parameters. */
+    evtchn_port_t ports[EVTCHN_SEND_BATCH_MAX];
+};
+typedef struct evtchn_send_batch evtchn_send_batch_t;
+
+/*
+ * EVTCHNOP_set_coalescing: set the coalescing window for an event channel.
+ * Events sent to <port> while its previous event is still pending are merged
+ * into that event, and events sent within <window_us> microseconds of its
+ * previous delivery are deferred to the end of that window, so that a burst
+ * of notifications results in a single upcall.
+ * NOTES:
+ *  1. Only events sent by EVTCHNOP_send or EVTCHNOP_send_batch, to an
+ *     interdomain or IPI channel, are coalesced.  Setting a window on a
+ *     port which isn't bound to either fails with -EINVAL.
+ *  2. <window_us> is at most EVTCHN_COALESCE_MAX_US.  A window of 0, which is
+ *     the default whenever the channel gets bound, disables coalescing.
+ */
+#define EVTCHN_COALESCE_MAX_US 65535
+struct evtchn_set_coalescing {
+    /* IN parameters. */
+    evtchn_port_t port;
+    uint32_t window_us;
+};
+typedef struct evtchn_set_coalescing evtchn_set_coalescing_t;
+
 /*
  * ` enum neg_errnoval
  * ` HYPERVISOR_event_channel_op_compat(struct evtchn_op *op)
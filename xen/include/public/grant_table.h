@@ -174,6 +174,10 @@ typedef struct grant_entry_v1 grant_entry_v1_t;
  *  GTF_sub_page: Grant access to only a subrange of the page.  @domid
  *                will only be allowed to copy from the grant, and not
  *                map it. [GST]
+ *  GTF_multi_page: (Version 2 only.) Grant access to a naturally aligned
+ *                  range of contiguous frames.  @domid will only be allowed
+ *                  to map the grant as a whole (see GNTMAP_order()), and
+ *                  not to copy from it. [GST]
  */
 #define _GTF_readonly       (2)
 #define GTF_readonly        (1U<<_GTF_readonly)
@@ -189,6 +193,8 @@ typedef struct grant_entry_v1 grant_entry_v1_t;
 #define GTF_PAT             (1U<<_GTF_PAT)
 #define _GTF_sub_page       (8)
 #define GTF_sub_page        (1U<<_GTF_sub_page)
+#define _GTF_multi_page     (9)
+#define GTF_multi_page      (1U<<_GTF_multi_page)
 
 /*
  * Subflags for GTF_accept_transfer:
@@ -259,6 +265,19 @@ union grant_entry_v2 {
         uint64_t frame;
     } sub_page;
 
+    /*
+     * If the grant type is GTF_permit_access and GTF_multi_page is set,
+     * @domid is allowed to access the 2^@order frames starting at @frame,
+     * which must be aligned accordingly, and backed by contiguous machine
+     * frames.  @order must not exceed GNTTAB_MAX_MULTI_PAGE_ORDER.
+     */
+    struct {
+        grant_entry_header_t hdr;
+        uint8_t order;
+        uint8_t pad0[3];
+        uint64_t frame;
+    } multi_page;
+
     /*
      * If the grant is GTF_transitive, @domid is allowed to use the
      * grant @gref in domain @trans_domid, as if it was the local
@@ -279,6 +298,8 @@ union grant_entry_v2 {
 };
 typedef union grant_entry_v2 grant_entry_v2_t;
 
+#define GNTTAB_MAX_MULTI_PAGE_ORDER 9
+
 typedef uint16_t grant_status_t;
 
 #endif /* __XEN_INTERFACE_VERSION__ */
@@ -629,6 +650,17 @@ DEFINE_XEN_GUEST_HANDLE(gnttab_cache_flush_t);
 #define _GNTMAP_can_fail        (5)
 #define GNTMAP_can_fail         (1<<_GNTMAP_can_fail)
 
+ /*
+  * Order of the GTF_multi_page grant to map, which must match the one in
+  * the grant entry, 0 for a single page grant.  A multi-page grant is
+  * mapped as a whole at <host_addr>, which must be aligned to its size.
+  * This is only supported for host mappings by domains with translated
+  * (p2m) address spaces, which may use a superpage mapping for it.
+  */
+#define _GNTMAP_order           (8)
+#define GNTMAP_order_mask       (0xf<<_GNTMAP_order)
+#define GNTMAP_order(o)         ((o)<<_GNTMAP_order)
+
 /*
  * Bits to be placed in guest kernel available PTE bits (architecture
  * dependent; only supported when XENFEAT_gnttab_map_avail_bits is set).
@@ -35,7 +35,7 @@
 #include "domctl.h"
 #include "physdev.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x00000012
+#define XEN_SYSCTL_INTERFACE_VERSION 0x00000013
 
 /*
  * Read console content from Xen buffer ring.
@@ -1014,6 +1014,52 @@ typedef struct xen_sysctl_cpu_policy xen_sysctl_cpu_policy_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_cpu_policy_t);
 #endif
 
+/*
+ * XEN_SYSCTL_sched_stats
+ *
+ * Retrieve the scheduling statistics of a pCPU. They are collected by the
+ * generic scheduling code, independently of the scheduler in use, and are
+ * cumulative since boot (or since the last reset).
+ *
+ * Each statistic is a histogram. For the time based ones, bucket 0 counts
+ * the samples below 2^10ns, bucket i the ones in [2^(i+9), 2^(i+10))ns, and
+ * the last bucket everything above. For runqueue lengths, bucket i counts
+ * the times the runqueue was found with i vCPUs waiting in it, with the last
+ * bucket, again, catching everything above.
+ */
+#define XEN_SYSCTL_SCHED_HIST_BUCKETS 20
+struct xen_sysctl_sched_hist {
+    uint64_aligned_t count;       /* Number of samples. */
+    uint64_aligned_t sum;         /* Sum of the samples (ns or vCPUs). */
+    uint64_aligned_t bucket[XEN_SYSCTL_SCHED_HIST_BUCKETS];
+};
+typedef struct xen_sysctl_sched_hist xen_sysctl_sched_hist_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_sched_hist_t);
+
+struct xen_sysctl_sched_stats {
+    uint32_t cpu;                 /* IN: pCPU to query. */
+#define XEN_SYSCTL_SCHED_STATS_reset (1u << 0)
+    uint32_t flags;               /* IN: XEN_SYSCTL_SCHED_STATS_* */
+    /*
+     * IN/OUT: Number of entries in/written to 'hist', or the number of
+     * available histograms if the guest handle is NULL.
+     */
+    uint32_t nr_hists;
+    uint32_t pad;                 /* IN: Must be zero. */
+/* Time from a vCPU waking up to it running. */
+#define XEN_SYSCTL_SCHED_HIST_wake_latency 0
+/* Time from a vCPU being preempted (or yielding) to it running again. */
+#define XEN_SYSCTL_SCHED_HIST_runq_wait    1
+/* vCPUs waiting in the runqueue, sampled at each scheduling decision. */
+#define XEN_SYSCTL_SCHED_HIST_runq_len     2
+/* Time from the scheduling decision to the end of the context switch. */
+#define XEN_SYSCTL_SCHED_HIST_switch_cost  3
+#define XEN_SYSCTL_SCHED_HIST_NR           4
+    XEN_GUEST_HANDLE_64(xen_sysctl_sched_hist_t) hist; /* OUT */
+};
+typedef struct xen_sysctl_sched_stats xen_sysctl_sched_stats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_sched_stats_t);
+
 struct xen_sysctl {
     uint32_t cmd;
 #define XEN_SYSCTL_readconsole                    1
@@ -1044,6 +1090,7 @@ struct xen_sysctl {
 #define XEN_SYSCTL_livepatch_op                  27
 #define XEN_SYSCTL_set_parameter                 28
 #define XEN_SYSCTL_get_cpu_policy                29
+#define XEN_SYSCTL_sched_stats                   30
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -1072,6 +1119,7 @@ struct xen_sysctl {
         struct xen_sysctl_cpu_featureset    cpu_featureset;
         struct xen_sysctl_livepatch_op      livepatch;
         struct xen_sysctl_set_parameter     set_parameter;
+        struct xen_sysctl_sched_stats       sched_stats;
 #if defined(__i386__) || defined(__x86_64__)
         struct xen_sysctl_cpu_policy        cpu_policy;
 #endif
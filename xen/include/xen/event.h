@@ -53,6 +53,9 @@ void send_guest_pirq(struct domain *, const struct pirq *);
 /* Send a notification from a given domain's event-channel port. */
 int evtchn_send(struct domain *d, unsigned int lport);
 
+/* Deliver the events deferred on a VCPU by their coalescing window. */
+void evtchn_coalesce_timer_fn(void *data);
+
 /* Bind a local event-channel port to the specified VCPU. */
 long evtchn_bind_vcpu(unsigned int port, unsigned int vcpu_id);
 
@@ -11,9 +11,8 @@
 
 struct evtchn_fifo_queue {
     uint32_t *head; /* points into control block */
-    uint32_t tail;
+    uint32_t tail;  /* port and link sequence number, see event_fifo.c */
     uint8_t priority;
-    spinlock_t lock;
 };
 
 struct evtchn_fifo_vcpu {
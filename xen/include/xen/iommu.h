@@ -116,6 +116,12 @@ int __must_check iommu_map(struct domain *d, dfn_t dfn, mfn_t mfn,
 int __must_check iommu_unmap(struct domain *d, dfn_t dfn,
                              unsigned int page_order,
                              unsigned int *flush_flags);
+int __must_check iommu_map_range(struct domain *d, dfn_t dfn, mfn_t mfn,
+                                 unsigned long nr, unsigned int flags,
+                                 unsigned int *flush_flags);
+int __must_check iommu_unmap_range(struct domain *d, dfn_t dfn,
+                                   unsigned long nr,
+                                   unsigned int *flush_flags);
 
 int __must_check iommu_legacy_map(struct domain *d, dfn_t dfn, mfn_t mfn,
                                   unsigned int page_order,
@@ -204,14 +210,22 @@ struct iommu_ops {
 
     void (*teardown)(struct domain *d);
 
+    /*
+     * Mask of the non-zero page orders map_page and unmap_page accept, i.e.
+     * the superpage sizes the IOMMU page tables can hold.  Mappings of other
+     * orders get split or merged by the driver as needed.
+     */
+    unsigned int page_orders;
+
     /*
      * This block of operations must be appropriately locked against each
      * other by the caller in order to have meaningful results.
      */
     int __must_check (*map_page)(struct domain *d, dfn_t dfn, mfn_t mfn,
-                                 unsigned int flags,
+                                 unsigned int page_order, unsigned int flags,
                                  unsigned int *flush_flags);
     int __must_check (*unmap_page)(struct domain *d, dfn_t dfn,
+                                   unsigned int page_order,
                                    unsigned int *flush_flags);
     int __must_check (*lookup_page)(struct domain *d, dfn_t dfn, mfn_t *mfn,
                                     unsigned int *flags);
@@ -317,6 +331,8 @@ DECLARE_PER_CPU(bool_t, iommu_dont_flush_iotlb);
 extern struct spinlock iommu_pt_cleanup_lock;
 extern struct page_list_head iommu_pt_cleanup_list;
 
+void iommu_queue_free_pgtable(struct page_info *pg, unsigned int level);
+
 #endif /* _IOMMU_H_ */
 
 /*
@@ -40,10 +40,23 @@ struct schedule_data {
     void               *sched_priv;
     struct timer        s_timer;        /* scheduling timer                */
     atomic_t            urgent_count;   /* how many urgent vcpus           */
+    spinlock_t          gran_lock;      /* see sched_gran_allowed()        */
+    struct domain      *gran_dom;       /* domain of curr (NULL if idle)   */
+    struct domain      *gran_prev_dom;  /* domain being switched away from */
 };
 
 #define curr_on_cpu(c)    (per_cpu(schedule_data, c).curr)
 
+/* Scheduling granularity, i.e. which cpus must run the same domain. */
+enum sched_gran {
+    SCHED_GRAN_cpu,
+    SCHED_GRAN_core,
+    SCHED_GRAN_socket,
+};
+extern enum sched_gran opt_sched_granularity;
+
+bool sched_gran_allowed(unsigned int cpu, const struct domain *d);
+
 DECLARE_PER_CPU(struct schedule_data, schedule_data);
 DECLARE_PER_CPU(struct scheduler *, scheduler);
 DECLARE_PER_CPU(struct cpupool *, cpupool);
@@ -114,6 +114,12 @@ struct evtchn
     u8 priority;
     u8 last_priority;
     u16 last_vcpu_id;
+    u16 fifo_seq;          /* FIFO ABI: link sequence number */
+    u16 coalesce_window;   /* Coalescing window (us), 0 if disabled */
+    u32 coalesce_stamp;    /* Time of last delivery, in 1024ns units */
+    unsigned int coalesce_deferred; /* Bit 0: on a vCPU's deferred list */
+    evtchn_port_t coalesce_next;    /* Next port on the deferred list */
+    spinlock_t fifo_lock;  /* FIFO ABI: serializes linking to/of the event */
 #ifdef CONFIG_XSM
     union {
 #ifdef XSM_NEED_GENERIC_EVTCHN_SSID
@@ -160,6 +166,10 @@ struct vcpu
 
     struct timer     poll_timer;    /* timeout for SCHEDOP_poll */
 
+    /* Events deferred by their coalescing window, see event_channel.c. */
+    unsigned int     evtchn_coalesce_head;
+    struct timer     evtchn_coalesce_timer;
+
     void            *sched_priv;    /* scheduler-specific data */
 
     struct vcpu_runstate_info runstate;
@@ -173,6 +183,10 @@ struct vcpu
         XEN_GUEST_HANDLE(vcpu_runstate_info_compat_t) compat;
     } runstate_guest; /* guest address */
 #endif
+    /* pCPU whose runqueue length statistics account for us while runnable. */
+    unsigned int     runq_stats_cpu;
+    /* Did we become runnable by waking up (rather than being preempted)? */
+    bool             runq_stats_woken;
 
     /* Has the FPU been initialised? */
     bool             fpu_initialised;
@@ -234,10 +248,11 @@ struct vcpu
     /* VCPU paused by system controller. */
     int              controller_pause_count;
 
-    /* Grant table map tracking. */
+    /* Grant table map tracking: loaded and previous free magazines. */
     spinlock_t       maptrack_freelist_lock;
     unsigned int     maptrack_head;
-    unsigned int     maptrack_tail;
+    unsigned int     maptrack_count;
+    unsigned int     maptrack_prev;
 
     /* IRQ-safe virq_lock protects against delivering VIRQ to stale evtchn. */
     evtchn_port_t    virq_to_evtchn[NR_VIRQS];
@@ -645,6 +660,7 @@ void sched_destroy_domain(struct domain *d);
 int sched_move_domain(struct domain *d, struct cpupool *c);
 long sched_adjust(struct domain *, struct xen_domctl_scheduler_op *);
 long sched_adjust_global(struct xen_sysctl_scheduler_op *);
+int  sched_get_stats(struct xen_sysctl_sched_stats *);
 int  sched_id(void);
 void sched_tick_suspend(void);
 void sched_tick_resume(void);
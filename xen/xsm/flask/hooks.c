@@ -779,6 +779,7 @@ static int flask_sysctl(int cmd)
         return domain_has_xen(current->domain, XEN__DEBUG);
 
     case XEN_SYSCTL_getcpuinfo:
+    case XEN_SYSCTL_sched_stats:
         return domain_has_xen(current->domain, XEN__GETCPUINFO);
 
     case XEN_SYSCTL_availheap:
@@ -1491,6 +1492,7 @@ static int flask_shadow_control(struct domain *d, uint32_t op)
     case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
+    case XEN_DOMCTL_SHADOW_OP_HARVEST:
         perm = SHADOW__LOGDIRTY;
         break;
     default: